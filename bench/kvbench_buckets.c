@@ -0,0 +1,138 @@
+//
+//  kvbench_buckets.c
+//  kvdb
+//
+//  Copyright (c) 2013 etpan. All rights reserved.
+//
+
+// compares the cost of finding the bucket of a key in tables with a prime number of buckets (files created
+// before) and in tables with a power of 2 number of buckets, and how evenly the keys are spread.
+// usage: kvbench-buckets [lookup count]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "kvtable.h"
+#include "kvmurmurhash.h"
+
+#define LOOKUP_ROUNDS 8
+
+static double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.;
+}
+
+static uint32_t key_hash_value(unsigned int idx)
+{
+    char key[32];
+    size_t key_size = (size_t) snprintf(key, sizeof(key), "key-%u", idx);
+    return kv_murmur_hash(key, key_size, 0);
+}
+
+static void table_init(struct kvdb_table * table, uint64_t * maxcount, int bucket_selection, uint64_t count)
+{
+    memset(table, 0, sizeof(* table));
+    * maxcount = hton64(count);
+    table->kv_maxcount = maxcount;
+    table->kv_bucket_selection = bucket_selection;
+    table->kv_items = malloc(count * sizeof(* table->kv_items));
+    for(uint64_t i = 0 ; i < count ; i ++) {
+        table->kv_items[i].kv_offset = i;
+    }
+}
+
+// returns the time of a lookup in nanoseconds.
+static double bench_lookups(struct kvdb_table * table, const uint32_t * hash_values, unsigned int lookup_count,
+                            uint64_t * p_sum)
+{
+    uint64_t sum = 0;
+    double start = now();
+    for(unsigned int round = 0 ; round < LOOKUP_ROUNDS ; round ++) {
+        for(unsigned int i = 0 ; i < lookup_count ; i ++) {
+            sum += kv_table_bucket(table, hash_values[i])->kv_offset;
+        }
+    }
+    double elapsed = now() - start;
+    * p_sum += sum;
+    return elapsed * 1000000000. / ((double) lookup_count * LOOKUP_ROUNDS);
+}
+
+// fills a full table: KV_MAX_MEAN_COLLISION keys for each bucket.
+static void bench_spread(struct kvdb_table * table, uint64_t * p_empty, unsigned int * p_longest)
+{
+    uint64_t count = ntoh64(* table->kv_maxcount);
+    unsigned char * loads = calloc(count, 1);
+    unsigned int longest = 0;
+    for(uint64_t i = 0 ; i < count * KV_MAX_MEAN_COLLISION ; i ++) {
+        struct kvdb_item * item = kv_table_bucket(table, key_hash_value((unsigned int) i));
+        unsigned char * load = &loads[item - table->kv_items];
+        if (* load < 255) {
+            (* load) ++;
+        }
+        if (* load > longest) {
+            longest = * load;
+        }
+    }
+    uint64_t empty = 0;
+    for(uint64_t i = 0 ; i < count ; i ++) {
+        if (loads[i] == 0) {
+            empty ++;
+        }
+    }
+    free(loads);
+    * p_empty = empty;
+    * p_longest = longest;
+}
+
+int main(int argc, char ** argv)
+{
+    unsigned int lookup_count = argc > 1 ? (unsigned int) atoi(argv[1]) : 1000000;
+    uint64_t sizes[] = {1 << 12, KV_FIRST_TABLE_MAX_COUNT, 1 << 20, 1 << 24};
+    
+    uint32_t * hash_values = malloc(lookup_count * sizeof(* hash_values));
+    for(unsigned int i = 0 ; i < lookup_count ; i ++) {
+        hash_values[i] = key_hash_value(i);
+    }
+    
+    printf("%u lookups per run\n", lookup_count);
+    printf("%10s %10s %12s %10s %12s\n", "layout", "buckets", "ns/lookup", "empty", "longest");
+    uint64_t sum = 0;
+    for(unsigned int i = 0 ; i < sizeof(sizes) / sizeof(sizes[0]) ; i ++) {
+        struct kvdb_table modulo_table;
+        uint64_t modulo_maxcount;
+        struct kvdb_table mask_table;
+        uint64_t mask_maxcount;
+        table_init(&modulo_table, &modulo_maxcount, KV_BUCKET_SELECTION_MODULO, kv_getnextprime(sizes[i]));
+        table_init(&mask_table, &mask_maxcount, KV_BUCKET_SELECTION_MASK, sizes[i]);
+        
+        // warm up the tables.
+        bench_lookups(&modulo_table, hash_values, lookup_count, &sum);
+        bench_lookups(&mask_table, hash_values, lookup_count, &sum);
+        
+        struct kvdb_table * tables[] = {&modulo_table, &mask_table};
+        const char * names[] = {"prime", "pow2"};
+        for(unsigned int k = 0 ; k < 2 ; k ++) {
+            double ns = bench_lookups(tables[k], hash_values, lookup_count, &sum);
+            uint64_t empty;
+            unsigned int longest;
+            bench_spread(tables[k], &empty, &longest);
+            uint64_t count = ntoh64(* tables[k]->kv_maxcount);
+            printf("%10s %10llu %12.2f %9.2f%% %12u\n", names[k], (unsigned long long) count, ns,
+                   empty * 100. / count, longest);
+        }
+        
+        free(modulo_table.kv_items);
+        free(mask_table.kv_items);
+    }
+    // keeps the lookups from being optimized away.
+    if (sum == 0) {
+        printf("\n");
+    }
+    free(hash_values);
+    
+    return EXIT_SUCCESS;
+}
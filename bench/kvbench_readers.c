@@ -0,0 +1,159 @@
+//
+//  kvbench_readers.c
+//  kvdb
+//
+//  Copyright (c) 2013 etpan. All rights reserved.
+//
+
+// measures how the lookups scale with the number of reader threads while a writer changes the database.
+// usage: kvbench-readers [filename] [key count] [seconds per run]
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "kvdb.h"
+
+#define VALUE_SIZE 100
+#define MAX_THREAD_COUNT 256
+
+struct bench_state {
+    kvdb * db;
+    unsigned int key_count;
+    volatile int stop;
+    uint64_t writes;
+};
+
+struct reader_state {
+    struct bench_state * bench;
+    unsigned int seed;
+    uint64_t reads;
+    uint64_t misses;
+};
+
+static double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.;
+}
+
+static size_t make_key(char * key, size_t size, unsigned int idx)
+{
+    return (size_t) snprintf(key, size, "key-%u", idx);
+}
+
+static void * reader_main(void * data)
+{
+    struct reader_state * state = data;
+    struct bench_state * bench = state->bench;
+    char key[32];
+    char value[VALUE_SIZE * 2];
+    
+    while (!bench->stop) {
+        size_t key_size = make_key(key, sizeof(key), rand_r(&state->seed) % bench->key_count);
+        size_t value_size;
+        int r = kvdb_get_into(bench->db, key, key_size, value, sizeof(value), &value_size);
+        if (r < 0) {
+            state->misses ++;
+        }
+        state->reads ++;
+    }
+    return NULL;
+}
+
+static void * writer_main(void * data)
+{
+    struct bench_state * bench = data;
+    unsigned int seed = 1;
+    char key[32];
+    char value[VALUE_SIZE];
+    
+    memset(value, 'v', sizeof(value));
+    while (!bench->stop) {
+        size_t key_size = make_key(key, sizeof(key), rand_r(&seed) % bench->key_count);
+        value[0] = (char) bench->writes;
+        kvdb_set(bench->db, key, key_size, value, sizeof(value));
+        bench->writes ++;
+    }
+    return NULL;
+}
+
+int main(int argc, char ** argv)
+{
+    const char * filename = argc > 1 ? argv[1] : "kvbench-readers.kvdb";
+    unsigned int key_count = argc > 2 ? (unsigned int) atoi(argv[2]) : 100000;
+    double duration = argc > 3 ? atof(argv[3]) : 2.;
+    long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpu_count > MAX_THREAD_COUNT) {
+        cpu_count = MAX_THREAD_COUNT;
+    }
+    
+    unlink(filename);
+    struct bench_state bench;
+    bench.db = kvdb_new(filename);
+    bench.key_count = key_count;
+    kvdb_set_concurrent_readers(bench.db, 1);
+    if (kvdb_open(bench.db) < 0) {
+        fprintf(stderr, "could not open %s\n", filename);
+        return EXIT_FAILURE;
+    }
+    
+    char key[32];
+    char value[VALUE_SIZE];
+    memset(value, 'v', sizeof(value));
+    for(unsigned int i = 0 ; i < key_count ; i ++) {
+        size_t key_size = make_key(key, sizeof(key), i);
+        kvdb_set(bench.db, key, key_size, value, sizeof(value));
+    }
+    
+    printf("%u keys, %ld cpus, %.1f s per run\n", key_count, cpu_count, duration);
+    printf("%8s %14s %14s %10s %12s\n", "readers", "reads/s", "reads/s/thread", "scaling", "writes/s");
+    double single_thread_rate = 0;
+    for(long thread_count = 1 ; thread_count <= cpu_count ; thread_count *= 2) {
+        pthread_t threads[MAX_THREAD_COUNT];
+        struct reader_state readers[MAX_THREAD_COUNT];
+        pthread_t writer;
+        
+        bench.stop = 0;
+        bench.writes = 0;
+        double start = now();
+        pthread_create(&writer, NULL, writer_main, &bench);
+        for(long i = 0 ; i < thread_count ; i ++) {
+            readers[i].bench = &bench;
+            readers[i].seed = (unsigned int) i + 1;
+            readers[i].reads = 0;
+            readers[i].misses = 0;
+            pthread_create(&threads[i], NULL, reader_main, &readers[i]);
+        }
+        usleep((useconds_t) (duration * 1000000));
+        bench.stop = 1;
+        uint64_t reads = 0;
+        uint64_t misses = 0;
+        for(long i = 0 ; i < thread_count ; i ++) {
+            pthread_join(threads[i], NULL);
+            reads += readers[i].reads;
+            misses += readers[i].misses;
+        }
+        pthread_join(writer, NULL);
+        double elapsed = now() - start;
+        
+        double rate = reads / elapsed;
+        if (thread_count == 1) {
+            single_thread_rate = rate;
+        }
+        printf("%8ld %14.0f %14.0f %9.2fx %12.0f\n", thread_count, rate, rate / thread_count,
+               rate / single_thread_rate, bench.writes / elapsed);
+        if (misses > 0) {
+            fprintf(stderr, "%llu lookups failed\n", (unsigned long long) misses);
+        }
+    }
+    
+    kvdb_close(bench.db);
+    kvdb_free(bench.db);
+    unlink(filename);
+    return EXIT_SUCCESS;
+}
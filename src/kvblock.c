@@ -6,10 +6,17 @@
 //  Copyright (c) 2013 etpan. All rights reserved.
 //
 
+#ifdef __linux__
+// for fallocate().
+#define _GNU_SOURCE
+#endif
+
 #include "kvblock.h"
 
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
@@ -18,100 +25,1186 @@
 #include "kvtypes.h"
 #include "kvendian.h"
 #include "kvpaddingutils.h"
+#include "kvcache.h"
+#include "kvuring.h"
+#include "kvlock.h"
+
+// size of the space reserved at the end of the file by an arena.
+#define KV_BLOCK_ARENA_CHUNK_SIZE (1024 * 1024)
+// smallest free region given back to the file system by kv_block_coalesce().
+#define KV_HOLE_PUNCH_MIN_SIZE (256 * 1024)
+// number of recycled blocks an arena keeps before adding them to the lists of the file.
+#define KV_BLOCK_ARENA_FREE_MAX_COUNT 256
+
+// first blocks of the list of the file for a size class, kept in memory so that taking one doesn't need to
+// read the file. the last one is the head of the list of the file.
+struct kv_free_list {
+    // host order.
+    uint64_t * kv_offsets;
+    size_t kv_count;
+    size_t kv_capacity;
+    // block of the list of the file after the first one in memory, host order.
+    uint64_t kv_next_offset;
+};
+
+struct kv_block_arena {
+    pthread_mutex_t kv_lock;
+    // space reserved at the end of the file.
+    uint64_t kv_offset;
+    uint64_t kv_end;
+    // blocks recycled by the threads of the arena, chained in the file from the last one to the first one.
+    // they're added to the lists of the file by arena_free_lists_splice().
+    struct kv_free_list kv_free_lists[KV_BLOCK_SIZE_CLASS_COUNT];
+    size_t kv_free_count;
+};
+
+// Returns -1 if the memory can't be allocated.
+static int free_list_push(struct kv_free_list * list, uint64_t offset)
+{
+    if (list->kv_count == list->kv_capacity) {
+        size_t capacity = list->kv_capacity == 0 ? 16 : list->kv_capacity * 2;
+        uint64_t * offsets = realloc(list->kv_offsets, capacity * sizeof(* offsets));
+        if (offsets == NULL) {
+            return -1;
+        }
+        list->kv_offsets = offsets;
+        list->kv_capacity = capacity;
+    }
+    list->kv_offsets[list->kv_count] = offset;
+    __atomic_store_n(&list->kv_count, list->kv_count + 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Returns 0 if the list is empty.
+static uint64_t free_list_pop(struct kv_free_list * list)
+{
+    if (list->kv_count == 0) {
+        return 0;
+    }
+    __atomic_store_n(&list->kv_count, list->kv_count - 1, __ATOMIC_RELAXED);
+    return list->kv_offsets[list->kv_count];
+}
+
+// returns the head of the list of the file for the given size class, network order.
+static uint64_t * free_blocks_head(kvdb * db, uint8_t size_class)
+{
+    if (size_class < KV_BLOCK_POW2_CLASS_COUNT) {
+        return &db->kv_free_blocks[size_class];
+    }
+    return &db->kv_class_free_blocks[size_class - KV_BLOCK_POW2_CLASS_COUNT];
+}
+
+// returns the size class of the given power of 2 or of one of the sizes after it.
+static uint8_t size_class_make(unsigned int log2_size, unsigned int step)
+{
+    if (step == 0) {
+        return log2_size;
+    }
+    return KV_BLOCK_POW2_CLASS_COUNT + (log2_size - KV_BLOCK_INTERMEDIATE_CLASS_MIN_LOG2) * 3 + step - 1;
+}
+
+void kv_block_free_lists_setup(kvdb * db)
+{
+    db->kv_free_lists = calloc(KV_BLOCK_SIZE_CLASS_COUNT, sizeof(* db->kv_free_lists));
+}
+
+void kv_block_free_lists_unsetup(kvdb * db)
+{
+    if (db->kv_free_lists == NULL) {
+        return;
+    }
+    for(unsigned int size_class = 0 ; size_class < KV_BLOCK_SIZE_CLASS_COUNT ; size_class ++) {
+        free(db->kv_free_lists[size_class].kv_offsets);
+    }
+    free(db->kv_free_lists);
+    db->kv_free_lists = NULL;
+}
+
+void kv_block_free_lists_reset(kvdb * db)
+{
+    if (db->kv_free_lists == NULL) {
+        return;
+    }
+    for(unsigned int size_class = 0 ; size_class < KV_BLOCK_SIZE_CLASS_COUNT ; size_class ++) {
+        db->kv_free_lists[size_class].kv_count = 0;
+    }
+}
+
+// writes the header of a recycled block, next_offset is in network order.
+// Returns -1 if there's an I/O error.
+static int free_block_write(kvdb * db, uint8_t size_class, uint64_t offset, uint64_t next_offset)
+{
+    char data[8 + 4 + 1];
+    memcpy(data, &next_offset, 8);
+    h32_to_bytes(data + 8, 0);
+    h8_to_bytes(data + 8 + 4, size_class);
+    ssize_t count = pwrite(db->kv_fd, data, sizeof(data), (off_t) offset);
+    if (count < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// makes a block whose header links it to the list of the file the head of that list.
+static void free_blocks_set_head(kvdb * db, uint8_t size_class, uint64_t offset)
+{
+    uint64_t * head = free_blocks_head(db, size_class);
+    struct kv_free_list * list = &db->kv_free_lists[size_class];
+    if ((list->kv_count > 0) && (list->kv_offsets[list->kv_count - 1] != ntoh64(* head))) {
+        // The blocks in memory are no longer the first ones of the list of the file.
+        list->kv_count = 0;
+    }
+    if (list->kv_count == 0) {
+        list->kv_next_offset = ntoh64(* head);
+    }
+    if (free_list_push(list, offset) < 0) {
+        // The blocks are taken from the file when the memory can't be allocated.
+        list->kv_count = 0;
+    }
+    * head = hton64(offset);
+}
+
+// adds a block at the head of the list of the file for its size class.
+// Returns -1 if there's an I/O error, the block is then lost.
+static int free_blocks_push(kvdb * db, uint8_t size_class, uint64_t offset)
+{
+    // keep it in network order.
+    int r = free_block_write(db, size_class, offset, * free_blocks_head(db, size_class));
+    if (r < 0) {
+        return -1;
+    }
+    free_blocks_set_head(db, size_class, offset);
+    return 0;
+}
+
+void kv_block_arenas_setup(kvdb * db)
+{
+    db->kv_block_arenas = calloc(KV_THREAD_SLOT_COUNT, sizeof(* db->kv_block_arenas));
+    for(unsigned int i = 0 ; i < KV_THREAD_SLOT_COUNT ; i ++) {
+        pthread_mutex_init(&db->kv_block_arenas[i].kv_lock, NULL);
+    }
+}
+
+// adds a recycled block to the arena, the block is linked to the previous one recycled by the arena.
+// the lock of the arena should be held.
+// Returns -1 if there's an I/O error, the block is then lost.
+static int arena_free_lists_push(kvdb * db, struct kv_block_arena * arena, uint8_t size_class, uint64_t offset)
+{
+    int r;
+    if (db->kv_multi_process) {
+        // The writers of the processes are serialized by the lock of the file: the block goes to the list of
+        // the file right away so that the other processes can use it.
+        kv_alloc_lock(db);
+        r = free_blocks_push(db, size_class, offset);
+        kv_alloc_unlock(db);
+        return r;
+    }
+    
+    struct kv_free_list * list = &arena->kv_free_lists[size_class];
+    uint64_t next_offset = list->kv_count > 0 ? list->kv_offsets[list->kv_count - 1] : 0;
+    r = free_block_write(db, size_class, offset, hton64(next_offset));
+    if (r < 0) {
+        return -1;
+    }
+    if (free_list_push(list, offset) < 0) {
+        // It's added to the list of the file on its own.
+        kv_alloc_lock(db);
+        r = free_blocks_push(db, size_class, offset);
+        kv_alloc_unlock(db);
+        return r;
+    }
+    arena->kv_free_count ++;
+    return 0;
+}
+
+// adds the blocks recycled by the arena to the lists of the file.
+// the lock of the arena should be held.
+// Returns -1 if there's an I/O error, the blocks stay in the arena.
+static int arena_free_lists_splice(kvdb * db, struct kv_block_arena * arena)
+{
+    for(unsigned int size_class = 0 ; size_class < KV_BLOCK_SIZE_CLASS_COUNT ; size_class ++) {
+        struct kv_free_list * list = &arena->kv_free_lists[size_class];
+        if (list->kv_count == 0) {
+            continue;
+        }
+        uint64_t * head = free_blocks_head(db, size_class);
+        while (1) {
+            // The first block of the arena is linked to the list of the file without holding the lock of the
+            // database, then the list is changed only if its head is still the same.
+            // keep it in network order.
+            uint64_t next_offset = __atomic_load_n(head, __ATOMIC_RELAXED);
+            ssize_t count = pwrite(db->kv_fd, &next_offset, sizeof(next_offset),
+                                   (off_t) (list->kv_offsets[0] + KV_BLOCK_NEXT_OFFSET_OFFSET));
+            if (count < 0) {
+                return -1;
+            }
+            kv_alloc_lock(db);
+            if (* head == next_offset) {
+                for(size_t i = 0 ; i < list->kv_count ; i ++) {
+                    free_blocks_set_head(db, size_class, list->kv_offsets[i]);
+                }
+                kv_alloc_unlock(db);
+                break;
+            }
+            kv_alloc_unlock(db);
+        }
+        arena->kv_free_count -= list->kv_count;
+        list->kv_count = 0;
+    }
+    return 0;
+}
+
+// gives the recycled blocks and the unused space of the arena back to the database.
+static void arena_release(kvdb * db, struct kv_block_arena * arena)
+{
+    // The blocks are lost if there's an I/O error.
+    arena_free_lists_splice(db, arena);
+    // The space is lost if there's an I/O error.
+    kv_alloc_lock(db);
+    kv_block_recycle_region(db, arena->kv_offset, arena->kv_end - arena->kv_offset);
+    kv_alloc_unlock(db);
+    arena->kv_offset = 0;
+    arena->kv_end = 0;
+}
+
+void kv_block_arenas_unsetup(kvdb * db)
+{
+    for(unsigned int i = 0 ; i < KV_THREAD_SLOT_COUNT ; i ++) {
+        struct kv_block_arena * arena = &db->kv_block_arenas[i];
+        arena_release(db, arena);
+        for(unsigned int size_class = 0 ; size_class < KV_BLOCK_SIZE_CLASS_COUNT ; size_class ++) {
+            free(arena->kv_free_lists[size_class].kv_offsets);
+        }
+        pthread_mutex_destroy(&arena->kv_lock);
+    }
+    free(db->kv_block_arenas);
+    db->kv_block_arenas = NULL;
+}
+
+// returns the arena of the current thread, NULL if the database is not shared between threads.
+static struct kv_block_arena * current_arena(kvdb * db)
+{
+    if (db->kv_block_arenas == NULL) {
+        return NULL;
+    }
+    return &db->kv_block_arenas[kv_thread_slot()];
+}
 
 int kv_block_recycle(kvdb * db, uint64_t offset)
 {
-    uint8_t log2_size;
+    uint8_t size_class;
     ssize_t count;
+    int r;
     
-    count = pread(db->kv_fd, &log2_size, 1, offset + 8 + 4);
+    count = pread(db->kv_fd, &size_class, 1, offset + KV_BLOCK_SIZE_CLASS_OFFSET);
     if (count < 0)
         return -1;
-    uint64_t next_free_offset = db->kv_free_blocks[log2_size];
-    // keep it in network order.
-    count = pwrite(db->kv_fd, &next_free_offset, sizeof(next_free_offset), offset);
-    if (count < 0)
+    if (kv_block_capacity(size_class) == 0)
         return -1;
-    db->kv_free_blocks[log2_size] = hton64(offset);
+    
+    kv_block_cache_remove(db->kv_block_cache, offset);
+    struct kv_block_arena * arena = current_arena(db);
+    if (arena != NULL) {
+        // Writers don't wait for each other to recycle a block. The blocks of the arena are lost if the
+        // process stops before they're added to the lists of the file.
+        pthread_mutex_lock(&arena->kv_lock);
+        r = arena_free_lists_push(db, arena, size_class, offset);
+        if ((r == 0) && (arena->kv_free_count >= KV_BLOCK_ARENA_FREE_MAX_COUNT)) {
+            r = arena_free_lists_splice(db, arena);
+        }
+        pthread_mutex_unlock(&arena->kv_lock);
+        return r;
+    }
+    
+    // The block is in the list of the file right away so that it's not lost if the process stops.
+    return free_blocks_push(db, size_class, offset);
+}
+
+// smallest block, see block_size_round_up().
+#define KV_RECYCLED_REGION_MIN_LOG2_SIZE 4
+
+// returns the largest step of the sizes after the given power of 2.
+static unsigned int size_class_max_step(kvdb * db, unsigned int log2_size)
+{
+    if ((db->kv_block_size_classes == 0) || (log2_size < KV_BLOCK_INTERMEDIATE_CLASS_MIN_LOG2) ||
+        (log2_size > KV_BLOCK_INTERMEDIATE_CLASS_MAX_LOG2)) {
+        return 0;
+    }
+    return 3;
+}
+
+// returns the largest size class of the blocks that fit in the given size, -1 if there's none.
+static int largest_size_class(kvdb * db, uint64_t size)
+{
+    unsigned int log2_size = KV_RECYCLED_REGION_MIN_LOG2_SIZE;
+    while ((log2_size + 1 < KV_BLOCK_POW2_CLASS_COUNT) && ((((uint64_t) 1) << (log2_size + 1)) <= size)) {
+        log2_size ++;
+    }
+    unsigned int step = size_class_max_step(db, log2_size);
+    while (log2_size >= KV_RECYCLED_REGION_MIN_LOG2_SIZE) {
+        uint8_t size_class = size_class_make(log2_size, step);
+        if (kv_block_disk_size(size_class) <= size) {
+            return size_class;
+        }
+        if (step > 0) {
+            step --;
+        }
+        else {
+            log2_size --;
+            step = size_class_max_step(db, log2_size);
+        }
+    }
+    return -1;
+}
+
+// the end of a region is split in at most KV_RECYCLED_REGION_TAIL_MAX_COUNT blocks.
+#define KV_RECYCLED_REGION_TAIL_SIZE 1024
+#define KV_RECYCLED_REGION_TAIL_MAX_COUNT 48
+
+// splits size bytes in count blocks, the largest first.
+// Returns 0 if the blocks can't fill them exactly.
+static int region_split(kvdb * db, uint64_t size, unsigned int count, uint8_t * size_classes)
+{
+    uint64_t min_block_size = kv_block_disk_size(KV_RECYCLED_REGION_MIN_LOG2_SIZE);
+    for(unsigned int i = 0 ; i < count ; i ++) {
+        // Leave enough space for the next blocks.
+        uint64_t max_size = size - (count - i - 1) * min_block_size;
+        int size_class = largest_size_class(db, max_size);
+        if (size_class < 0) {
+            return 0;
+        }
+        size_classes[i] = (uint8_t) size_class;
+        size -= kv_block_disk_size((uint8_t) size_class);
+    }
+    return size == 0;
+}
+
+// splits the end of a region in blocks.
+// Returns the number of blocks.
+static unsigned int region_tail_split(kvdb * db, uint64_t size, uint8_t * size_classes)
+{
+    // The size of every block is 1 modulo 4: the count of blocks that fill the region exactly is
+    // the size of the region modulo 4.
+    uint64_t min_block_size = kv_block_disk_size(KV_RECYCLED_REGION_MIN_LOG2_SIZE);
+    unsigned int count = (unsigned int) (size % 4);
+    if (count == 0) {
+        count = 4;
+    }
+    while ((count <= KV_RECYCLED_REGION_TAIL_MAX_COUNT) && (count * min_block_size <= size)) {
+        if (region_split(db, size, count, size_classes)) {
+            return count;
+        }
+        count += 4;
+    }
+    
+    // The few bytes left are lost.
+    count = 0;
+    int size_class;
+    while ((count < KV_RECYCLED_REGION_TAIL_MAX_COUNT) && ((size_class = largest_size_class(db, size)) >= 0)) {
+        size_classes[count] = (uint8_t) size_class;
+        size -= kv_block_disk_size((uint8_t) size_class);
+        count ++;
+    }
+    return count;
+}
+
+// region taken by kv_block_free_regions_take() that is given back.
+struct free_regions_position {
+    struct kv_free_region * regions;
+    size_t count;
+    size_t index;
+};
+
+// adds a block at the beginning of the region that ends at end to the lists of the file, or to the lists of
+// the arena when it's not NULL. when the region is chained, the block is removed from the chain first:
+// it's lost rather than given twice if the process stops.
+// Returns -1 if there's an I/O error.
+static int region_block_recycle(kvdb * db, struct kv_block_arena * arena, struct free_regions_position * chained,
+                                uint8_t size_class, uint64_t offset, uint64_t end)
+{
+    if (chained != NULL) {
+        struct kv_free_region * region = &chained->regions[chained->index];
+        region->offset = offset + kv_block_disk_size(size_class);
+        region->size = end - region->offset;
+        if (kv_block_free_regions_update(db, chained->regions, chained->count, chained->index) < 0) {
+            return -1;
+        }
+    }
+    return arena != NULL ? arena_free_lists_push(db, arena, size_class, offset) :
+        free_blocks_push(db, size_class, offset);
+}
+
+// splits a region in blocks that are added to the lists of the file, or to the lists of the arena when
+// it's not NULL. chained is the position of the region in the chain of the file, NULL if it's not chained.
+// Returns -1 if there's an I/O error.
+static int region_recycle(kvdb * db, struct kv_block_arena * arena, uint64_t offset, uint64_t size,
+                          struct free_regions_position * chained)
+{
+    uint64_t end = offset + size;
+    // The region is split into the largest blocks first, kv_block_reuse() splits them again when needed.
+    while (size >= 2 * KV_RECYCLED_REGION_TAIL_SIZE) {
+        uint8_t size_class = (uint8_t) largest_size_class(db, size - KV_RECYCLED_REGION_TAIL_SIZE);
+        int r = region_block_recycle(db, arena, chained, size_class, offset, end);
+        if (r < 0) {
+            return -1;
+        }
+        offset += kv_block_disk_size(size_class);
+        size -= kv_block_disk_size(size_class);
+    }
+    
+    // A space lost at the end of the region could never be merged again with the regions next to it
+    // when it's next to a block in use.
+    uint8_t size_classes[KV_RECYCLED_REGION_TAIL_MAX_COUNT];
+    unsigned int count = region_tail_split(db, size, size_classes);
+    for(unsigned int i = 0 ; i < count ; i ++) {
+        int r = region_block_recycle(db, arena, chained, size_classes[i], offset, end);
+        if (r < 0) {
+            return -1;
+        }
+        offset += kv_block_disk_size(size_classes[i]);
+    }
     
     return 0;
 }
 
-uint64_t kv_block_create(kvdb * db, uint64_t next_block_offset, uint32_t hash_value,
-                         const char * key, size_t key_size,
-                         const char * value, size_t value_size)
+int kv_block_recycle_region(kvdb * db, uint64_t offset, uint64_t size)
 {
-    uint64_t block_size = block_size_round_up(key_size + value_size);
-    uint8_t log2_size = log2_round_up(block_size);
-    uint64_t offset = ntoh64(db->kv_free_blocks[log2_size]);
-    int use_new_block = 0;
-    //fprintf(stderr, "key, value: %i %i\n", (int) key_size, (int) value_size);
+    return region_recycle(db, NULL, offset, size, NULL);
+}
+
+int kv_block_write_next_offset(kvdb * db, uint64_t offset, uint64_t next_offset)
+{
+    char data[8];
+    h64_to_bytes(data, next_offset);
+    kv_block_cache_remove(db->kv_block_cache, offset);
+    ssize_t count = pwrite(db->kv_fd, data, sizeof(data), (off_t) (offset + KV_BLOCK_NEXT_OFFSET_OFFSET));
+    if (count < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+uint8_t kv_block_size_class(kvdb * db, size_t key_size, size_t value_size)
+{
+    uint64_t size = key_size + value_size;
+    unsigned int log2_size = log2_round_up(block_size_round_up(size));
+    if ((db->kv_block_size_classes == 0) || (log2_size <= KV_BLOCK_INTERMEDIATE_CLASS_MIN_LOG2) ||
+        (log2_size > KV_BLOCK_INTERMEDIATE_CLASS_MAX_LOG2 + 1)) {
+        return log2_size;
+    }
+    // Use the smallest size between the two powers of 2.
+    for(unsigned int step = 1 ; step <= 3 ; step ++) {
+        uint8_t size_class = size_class_make(log2_size - 1, step);
+        if (size <= kv_block_capacity(size_class)) {
+            return size_class;
+        }
+    }
+    return log2_size;
+}
+
+uint64_t kv_block_capacity(uint8_t size_class)
+{
+    if (size_class < KV_BLOCK_POW2_CLASS_COUNT) {
+        return ((uint64_t) 1) << size_class;
+    }
+    if (size_class >= KV_BLOCK_SIZE_CLASS_COUNT) {
+        return 0;
+    }
+    unsigned int idx = size_class - KV_BLOCK_POW2_CLASS_COUNT;
+    unsigned int log2_size = KV_BLOCK_INTERMEDIATE_CLASS_MIN_LOG2 + idx / 3;
+    unsigned int step = 1 + idx % 3;
+    return (((uint64_t) 1) << log2_size) + step * (((uint64_t) 1) << (log2_size - 2));
+}
+
+uint64_t kv_block_disk_size(uint8_t size_class)
+{
+    return KV_BLOCK_HEADER_SIZE + 8 + kv_block_capacity(size_class);
+}
+
+// takes the block at the head of the list of the file for the given size class.
+// Returns 0 if there's none.
+static uint64_t take_block(kvdb * db, uint8_t size_class)
+{
+    uint64_t * head = free_blocks_head(db, size_class);
+    uint64_t offset = ntoh64(* head);
+    if (offset == 0) {
+        return 0;
+    }
+    
+    // The next block is known without reading the file when the block has been recycled while the file is open.
+    struct kv_free_list * list = &db->kv_free_lists[size_class];
+    if ((list->kv_count > 0) && (list->kv_offsets[list->kv_count - 1] == offset)) {
+        free_list_pop(list);
+        * head = hton64(list->kv_count > 0 ? list->kv_offsets[list->kv_count - 1] : list->kv_next_offset);
+        return offset;
+    }
+    list->kv_count = 0;
+    
+    uint64_t next_free_offset;
+    // keep it in network order.
+    ssize_t count = pread(db->kv_fd, &next_free_offset, sizeof(next_free_offset), offset);
+    if (count < 0) {
+        return 0;
+    }
+    * head = next_free_offset;
+    
+    return offset;
+}
+
+// returns the smallest size class larger than the given one that has a recycled block.
+// the rest of the block should be large enough to be recycled.
+// Returns 0 if there's none.
+static uint8_t larger_size_class(kvdb * db, uint8_t size_class)
+{
+    uint64_t min_size = kv_block_disk_size(size_class) + kv_block_disk_size(KV_RECYCLED_REGION_MIN_LOG2_SIZE);
+    for(unsigned int log2_size = KV_RECYCLED_REGION_MIN_LOG2_SIZE ; log2_size < KV_BLOCK_POW2_CLASS_COUNT ; log2_size ++) {
+        unsigned int max_step = size_class_max_step(db, log2_size);
+        for(unsigned int step = 0 ; step <= max_step ; step ++) {
+            uint8_t larger = size_class_make(log2_size, step);
+            if (kv_block_disk_size(larger) < min_size) {
+                continue;
+            }
+            if (__atomic_load_n(free_blocks_head(db, larger), __ATOMIC_RELAXED) != 0) {
+                return larger;
+            }
+        }
+    }
+    return 0;
+}
+
+// takes a block of the given size class or of a larger one from the lists of the file.
+// p_size_class is set to the size class of the block.
+// Returns 0 if there's none.
+static uint64_t take_block_or_larger(kvdb * db, uint8_t size_class, uint8_t * p_size_class)
+{
+    * p_size_class = size_class;
+    uint64_t offset = take_block(db, size_class);
     if (offset != 0) {
-        // Use free block.
-        uint64_t next_free_offset;
-        //fprintf(stderr, "Use free block %i %i %i\n", (int) offset, (int) log2_size, (int)block_size);
-        // keep it in network order.
-        pread(db->kv_fd, &next_free_offset, sizeof(next_free_offset), offset);
-        db->kv_free_blocks[log2_size] = next_free_offset;
+        return offset;
     }
-    else {
-        // Use new block.
-        offset = ntoh64(* db->kv_filesize);
-        use_new_block = 1;
+    
+    // Then a larger block, to split.
+    uint8_t larger = larger_size_class(db, size_class);
+    if (larger == 0) {
+        return 0;
+    }
+    * p_size_class = larger;
+    return take_block(db, larger);
+}
+
+uint64_t kv_block_reuse(kvdb * db, uint8_t size_class)
+{
+    uint8_t taken_size_class;
+    uint64_t offset = take_block_or_larger(db, size_class, &taken_size_class);
+    if ((offset == 0) || (taken_size_class == size_class)) {
+        return offset;
+    }
+    
+    uint64_t size = kv_block_disk_size(size_class);
+    // The rest of the block is lost if there's an I/O error.
+    kv_block_recycle_region(db, offset + size, kv_block_disk_size(taken_size_class) - size);
+    
+    return offset;
+}
+
+int kv_block_reuse_cancel(kvdb * db, uint64_t offset, uint8_t size_class)
+{
+    // The block might still contain a previous block of another size class: its header is written again.
+    return free_blocks_push(db, size_class, offset);
+}
+
+static int compare_free_region_offset(const void * a, const void * b)
+{
+    const struct kv_free_region * region_a = a;
+    const struct kv_free_region * region_b = b;
+    if (region_a->offset == region_b->offset) {
+        return 0;
+    }
+    return region_a->offset < region_b->offset ? -1 : 1;
+}
+
+// reads the lists of the file to the lists in memory, the blocks are then in both.
+// the offset of the part of a list that couldn't be read is set in kv_next_offset.
+// Returns -1 if there's an I/O error or the memory can't be allocated.
+static int free_blocks_load(kvdb * db)
+{
+    int has_error = 0;
+    for(unsigned int size_class = 0 ; size_class < KV_BLOCK_SIZE_CLASS_COUNT ; size_class ++) {
+        if ((size_class >= KV_BLOCK_POW2_CLASS_COUNT) && (db->kv_class_free_blocks == NULL)) {
+            break;
+        }
+        uint64_t * head = free_blocks_head(db, size_class);
+        struct kv_free_list * list = &db->kv_free_lists[size_class];
+        if ((list->kv_count > 0) && (list->kv_offsets[list->kv_count - 1] != ntoh64(* head))) {
+            list->kv_count = 0;
+        }
+        // The blocks already in memory are followed by the rest of the list of the file.
+        uint64_t offset = list->kv_count > 0 ? list->kv_next_offset : ntoh64(* head);
+        while (offset != 0) {
+            uint64_t next_free_offset;
+            ssize_t count = pread(db->kv_fd, &next_free_offset, sizeof(next_free_offset), offset);
+            if ((count < (ssize_t) sizeof(next_free_offset)) || (free_list_push(list, offset) < 0)) {
+                has_error = 1;
+                break;
+            }
+            offset = ntoh64(next_free_offset);
+        }
+        list->kv_next_offset = offset;
+    }
+    return has_error ? -1 : 0;
+}
+
+// removes the blocks loaded with free_blocks_load() from the lists of the file and from the lists in memory.
+// keep_in_file leaves the lists of the file as they are.
+static void free_blocks_unload(kvdb * db, int keep_in_file)
+{
+    for(unsigned int size_class = 0 ; size_class < KV_BLOCK_SIZE_CLASS_COUNT ; size_class ++) {
+        if ((size_class >= KV_BLOCK_POW2_CLASS_COUNT) && (db->kv_class_free_blocks == NULL)) {
+            break;
+        }
+        struct kv_free_list * list = &db->kv_free_lists[size_class];
+        if (!keep_in_file) {
+            // The rest of a list that couldn't be read stays in the file.
+            * free_blocks_head(db, size_class) = hton64(list->kv_next_offset);
+        }
+        list->kv_count = 0;
+    }
+}
+
+// the regions taken by kv_block_free_regions_take() are chained in the file so that they're found again when
+// the process stops before giving them back. the link is after the header of a recycled block at the beginning
+// of the region: offset of the next region and size of the region, 8 bytes each.
+#define KV_FREE_REGION_LINK_OFFSET 16
+#define KV_FREE_REGION_MIN_CHAINED_SIZE (KV_FREE_REGION_LINK_OFFSET + 16)
+
+static int free_region_is_chained(const struct kv_free_region * region)
+{
+    return region->size >= KV_FREE_REGION_MIN_CHAINED_SIZE;
+}
+
+// Returns -1 if there's an I/O error.
+static int free_region_link_write(kvdb * db, const struct kv_free_region * region, uint64_t next_offset)
+{
+    char data[16];
+    h64_to_bytes(data, next_offset);
+    h64_to_bytes(data + 8, region->size);
+    ssize_t count = pwrite(db->kv_fd, data, sizeof(data), (off_t) (region->offset + KV_FREE_REGION_LINK_OFFSET));
+    if (count < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// reads the regions left chained in the file by a process that stopped before giving them back.
+// the rest of the chain is lost if it can't be read.
+// Returns -1 if the memory can't be allocated.
+static int free_regions_chain_read(kvdb * db, struct kv_free_region ** p_regions, size_t * p_count)
+{
+    struct kv_free_region * regions = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    uint64_t filesize = ntoh64(* db->kv_filesize);
+    uint64_t offset = ntoh64(* db->kv_free_regions_head);
+    // The regions are chained by offset: a corrupted chain stops when it goes back.
+    uint64_t previous_end = db->kv_header_size;
+    while ((offset >= previous_end) && (offset + KV_FREE_REGION_MIN_CHAINED_SIZE <= filesize)) {
+        char data[16];
+        ssize_t r = pread(db->kv_fd, data, sizeof(data), (off_t) (offset + KV_FREE_REGION_LINK_OFFSET));
+        if (r < (ssize_t) sizeof(data)) {
+            break;
+        }
+        uint64_t size = bytes_to_h64(data + 8);
+        if (offset + size > filesize) {
+            // The file has been shrunk before the chain was written.
+            size = filesize - offset;
+        }
+        if (size < KV_FREE_REGION_MIN_CHAINED_SIZE) {
+            break;
+        }
+        if (count == capacity) {
+            capacity = capacity == 0 ? 16 : capacity * 2;
+            struct kv_free_region * new_regions = realloc(regions, capacity * sizeof(* regions));
+            if (new_regions == NULL) {
+                free(regions);
+                return -1;
+            }
+            regions = new_regions;
+        }
+        regions[count].offset = offset;
+        regions[count].size = size;
+        count ++;
+        previous_end = offset + size;
+        offset = bytes_to_h64(data);
     }
+    * p_regions = regions;
+    * p_count = count;
+    return 0;
+}
+
+// gives the pages of a free region to the file system, the size of the file doesn't change.
+static void punch_hole(kvdb * db, uint64_t offset, uint64_t size)
+{
+    uint64_t start = KV_PAGE_ROUND_UP(db, offset);
+    uint64_t end = KV_PAGE_ROUND_DOWN(db, offset + size);
+    if (start >= end) {
+        return;
+    }
+    // It's only an optimization: errors are ignored.
+#if defined(FALLOC_FL_PUNCH_HOLE)
+    fallocate(db->kv_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t) start, (off_t) (end - start));
+#elif defined(F_PUNCHHOLE)
+    struct fpunchhole args;
+    args.fp_flags = 0;
+    args.reserved = 0;
+    args.fp_offset = (off_t) start;
+    args.fp_length = (off_t) (end - start);
+    fcntl(db->kv_fd, F_PUNCHHOLE, &args);
+#endif
+}
+
+// merges the regions that are next to each other, the regions are sorted by offset.
+// Returns the number of regions left.
+static size_t free_regions_merge(struct kv_free_region * regions, size_t count)
+{
+    // A space between them too small for a block is a part of a region that couldn't be recycled.
+    uint64_t min_block_size = kv_block_disk_size(KV_RECYCLED_REGION_MIN_LOG2_SIZE);
+    size_t merged_count = 0;
+    for(size_t i = 0 ; i < count ; i ++) {
+        if (regions[i].size == 0) {
+            continue;
+        }
+        if (merged_count > 0) {
+            struct kv_free_region * last = &regions[merged_count - 1];
+            if (regions[i].offset < last->offset + last->size + min_block_size) {
+                // A block given again after the vacuum was stopped overlaps the region.
+                uint64_t end = regions[i].offset + regions[i].size;
+                if (end > last->offset + last->size) {
+                    last->size = end - last->offset;
+                }
+                continue;
+            }
+        }
+        regions[merged_count] = regions[i];
+        merged_count ++;
+    }
+    return merged_count;
+}
+
+// links the regions to each other in the file, starting from the last one.
+// p_first_offset is set to the offset of the first region of the chain.
+// Returns -1 if there's an I/O error.
+static int free_regions_chain_write(kvdb * db, struct kv_free_region * regions, size_t count,
+                                    uint64_t * p_first_offset)
+{
+    uint64_t first_offset = 0;
+    for(size_t i = count ; i > 0 ; i --) {
+        if (!free_region_is_chained(&regions[i - 1])) {
+            continue;
+        }
+        if (free_region_link_write(db, &regions[i - 1], first_offset) < 0) {
+            return -1;
+        }
+        first_offset = regions[i - 1].offset;
+    }
+    * p_first_offset = first_offset;
+    return 0;
+}
+
+int kv_block_free_regions_update(kvdb * db, struct kv_free_region * regions, size_t count, size_t index)
+{
+    if (regions[index].size < KV_FREE_REGION_MIN_CHAINED_SIZE) {
+        // There's no room for the link: the few bytes left are lost.
+        regions[index].size = 0;
+    }
+    uint64_t next_offset = 0;
+    for(size_t i = index + 1 ; i < count ; i ++) {
+        if (free_region_is_chained(&regions[i])) {
+            next_offset = regions[i].offset;
+            break;
+        }
+    }
+    uint64_t offset = next_offset;
+    if (free_region_is_chained(&regions[index])) {
+        if (free_region_link_write(db, &regions[index], next_offset) < 0) {
+            return -1;
+        }
+        offset = regions[index].offset;
+    }
+    // The previous region is linked to it once it's written.
+    for(size_t i = index ; i > 0 ; i --) {
+        if (free_region_is_chained(&regions[i - 1])) {
+            return free_region_link_write(db, &regions[i - 1], offset);
+        }
+    }
+    * db->kv_free_regions_head = hton64(offset);
+    return 0;
+}
+
+int kv_block_free_regions_take(kvdb * db, struct kv_free_region ** p_regions, size_t * p_count)
+{
+    if (db->kv_block_arenas != NULL) {
+        for(unsigned int i = 0 ; i < KV_THREAD_SLOT_COUNT ; i ++) {
+            struct kv_block_arena * arena = &db->kv_block_arenas[i];
+            pthread_mutex_lock(&arena->kv_lock);
+            arena_release(db, arena);
+            pthread_mutex_unlock(&arena->kv_lock);
+        }
+    }
+    // The regions of a process that stopped before giving them back are taken again.
+    struct kv_free_region * chained_regions;
+    size_t chained_count;
+    if (free_regions_chain_read(db, &chained_regions, &chained_count) < 0) {
+        return -1;
+    }
+    // The rest of a list that can't be read stays in the file.
+    free_blocks_load(db);
     
-    uint64_t current_key_size = key_size;
-    uint64_t current_value_size = value_size;
-    char * data;
-    char * allocated = NULL;
-    if (8 + 4 + 1 + 8 + 8 + block_size > 4096) {
-        allocated = calloc(1, 8 + 4 + 1 + 8 + 8 + (size_t) block_size);
-        data = allocated;
+    size_t count = chained_count;
+    for(unsigned int size_class = 0 ; size_class < KV_BLOCK_SIZE_CLASS_COUNT ; size_class ++) {
+        count += db->kv_free_lists[size_class].kv_count;
     }
-    else {
-        data = alloca(8 + 4 + 1 + 8 + 8 + (size_t) block_size);
-        bzero(data, 8 + 4 + 1 + 8 + 8 + (size_t) block_size);
-    }
-    char * p = data;
-    next_block_offset = hton64(next_block_offset);
-    memcpy(p, &next_block_offset, sizeof(next_block_offset));
-    p += sizeof(next_block_offset);
-    hash_value = htonl(hash_value);
-    memcpy(p, &hash_value, sizeof(hash_value));
-    p += sizeof(hash_value);
-    memcpy(p, &log2_size, sizeof(log2_size));
-    p += sizeof(log2_size);
-    current_key_size = hton64(current_key_size);
-    memcpy(p, &current_key_size, sizeof(current_key_size));
-    p += sizeof(current_key_size);
-    memcpy(p, key, key_size);
-    p += key_size;
-    current_value_size = hton64(current_value_size);
-    memcpy(p, &current_value_size, sizeof(current_value_size));
-    p += sizeof(current_value_size);
-    memcpy(p, value, value_size);
-    p += value_size;
-    size_t remaining = (8 + 4 + 1 + 8 + 8 + block_size);
-    size_t write_offset = offset;
-    char * remaining_data = data;
-    while (remaining > 0) {
-        ssize_t count = pwrite(db->kv_fd, remaining_data, remaining, write_offset);
-        if (count < 0) {
-            if (allocated != NULL) {
-                free(allocated);
+    struct kv_free_region * regions = malloc((count + 1) * sizeof(* regions));
+    if (regions == NULL) {
+        free(chained_regions);
+        free_blocks_unload(db, 1);
+        return -1;
+    }
+    memcpy(regions, chained_regions, chained_count * sizeof(* regions));
+    free(chained_regions);
+    count = chained_count;
+    for(unsigned int size_class = 0 ; size_class < KV_BLOCK_SIZE_CLASS_COUNT ; size_class ++) {
+        struct kv_free_list * list = &db->kv_free_lists[size_class];
+        for(size_t i = 0 ; i < list->kv_count ; i ++) {
+            regions[count].offset = list->kv_offsets[i];
+            regions[count].size = kv_block_disk_size(size_class);
+            count ++;
+        }
+    }
+    qsort(regions, count, sizeof(* regions), compare_free_region_offset);
+    count = free_regions_merge(regions, count);
+    
+    // The regions are chained while the blocks are still in the lists of the file: the link doesn't overwrite
+    // the header of a recycled block. The regions of the previous chain are lost if the process stops meanwhile.
+    * db->kv_free_regions_head = hton64(0);
+    uint64_t first_offset;
+    if (free_regions_chain_write(db, regions, count, &first_offset) < 0) {
+        free(regions);
+        free_blocks_unload(db, 1);
+        return -1;
+    }
+    // The space is lost rather than given twice if the process stops in between.
+    free_blocks_unload(db, 0);
+    * db->kv_free_regions_head = hton64(first_offset);
+    
+    * p_regions = regions;
+    * p_count = count;
+    return 0;
+}
+
+int kv_block_free_regions_give_back(kvdb * db, struct kv_free_region * regions, size_t count, uint64_t mapped_end)
+{
+    int has_error = 0;
+    
+    size_t merged_count = free_regions_merge(regions, count);
+    if (merged_count < count) {
+        // The links of the regions merged with the previous ones could be overwritten.
+        uint64_t first_offset;
+        if (free_regions_chain_write(db, regions, merged_count, &first_offset) < 0) {
+            has_error = 1;
+        }
+        else {
+            * db->kv_free_regions_head = hton64(first_offset);
+        }
+    }
+    count = merged_count;
+    
+    // The end of the file is given back when it's free.
+    // Other processes might have mapped any part of the file, it's then never shrunk.
+    uint64_t filesize = ntoh64(* db->kv_filesize);
+    if ((count > 0) && !db->kv_multi_process) {
+        struct kv_free_region * last = &regions[count - 1];
+        uint64_t end = last->offset;
+        // The mapped tables should stay in the file.
+        if (end < mapped_end) {
+            end = mapped_end;
+        }
+        if ((last->offset + last->size + kv_block_disk_size(KV_RECYCLED_REGION_MIN_LOG2_SIZE) > filesize) &&
+            (end < filesize)) {
+            int r = ftruncate(db->kv_fd, (off_t) end);
+            if (r < 0) {
+                has_error = 1;
+            }
+            else {
+                * db->kv_filesize = hton64(end);
+                // The part of the chain past the end of the file is ignored until then.
+                last->size = end - last->offset;
+                if (kv_block_free_regions_update(db, regions, count, count - 1) < 0) {
+                    has_error = 1;
+                }
+            }
+        }
+    }
+    
+    // The regions leave the chain block by block as they're added to the lists.
+    for(size_t i = 0 ; i < count ; i ++) {
+        if (regions[i].size >= KV_HOLE_PUNCH_MIN_SIZE) {
+            // The link at the beginning of the region is kept.
+            punch_hole(db, regions[i].offset + KV_FREE_REGION_MIN_CHAINED_SIZE,
+                       regions[i].size - KV_FREE_REGION_MIN_CHAINED_SIZE);
+        }
+        // The regions before it are out of the chain, it's the first one.
+        struct free_regions_position chained;
+        chained.regions = regions + i;
+        chained.count = count - i;
+        chained.index = 0;
+        int r = region_recycle(db, NULL, regions[i].offset, regions[i].size, &chained);
+        if (r < 0) {
+            has_error = 1;
+        }
+    }
+    free(regions);
+    
+    return has_error ? -1 : 0;
+}
+
+uint64_t kv_block_disk_usage(kvdb * db)
+{
+    struct stat stat_buf;
+    if (fstat(db->kv_fd, &stat_buf) < 0) {
+        return 0;
+    }
+    return (uint64_t) stat_buf.st_blocks * 512;
+}
+
+int kv_block_coalesce(kvdb * db, uint64_t mapped_end, uint64_t * p_released)
+{
+    struct kv_free_region * regions;
+    size_t count;
+    uint64_t disk_usage = kv_block_disk_usage(db);
+    
+    int r = kv_block_free_regions_take(db, &regions, &count);
+    if (r < 0) {
+        return -1;
+    }
+    r = kv_block_free_regions_give_back(db, regions, count, mapped_end);
+    
+    if (p_released != NULL) {
+        uint64_t disk_usage_after = kv_block_disk_usage(db);
+        * p_released = disk_usage_after < disk_usage ? disk_usage - disk_usage_after : 0;
+    }
+    
+    return r;
+}
+
+int kv_block_iovec(struct iovec * iov, struct kv_block_header_buffer * buffer,
+                   uint64_t next_block_offset, uint32_t hash_value, uint8_t size_class,
+                   const char * key, size_t key_size,
+                   const char * value, size_t value_size)
+{
+    char * p = buffer->kv_header;
+    h64_to_bytes(p, next_block_offset);
+    p += 8;
+    h32_to_bytes(p, hash_value);
+    p += 4;
+    h8_to_bytes(p, size_class);
+    p += 1;
+    h64_to_bytes(p, key_size);
+    h64_to_bytes(buffer->kv_value_size, value_size);
+    
+    // The padding at the end of the block is not written.
+    iov[0].iov_base = buffer->kv_header;
+    iov[0].iov_len = sizeof(buffer->kv_header);
+    iov[1].iov_base = (void *) key;
+    iov[1].iov_len = key_size;
+    iov[2].iov_base = buffer->kv_value_size;
+    iov[2].iov_len = sizeof(buffer->kv_value_size);
+    iov[3].iov_base = (void *) value;
+    iov[3].iov_len = value_size;
+    
+    return KV_BLOCK_IOVEC_COUNT;
+}
+
+static int compare_read_request_offset(const void * a, const void * b)
+{
+    const struct kv_read_request * request_a = * (struct kv_read_request * const *) a;
+    const struct kv_read_request * request_b = * (struct kv_read_request * const *) b;
+    if (request_a->offset == request_b->offset) {
+        return 0;
+    }
+    return request_a->offset < request_b->offset ? -1 : 1;
+}
+
+void kv_read_many(kvdb * db, struct kv_read_request ** requests, unsigned int count)
+{
+    qsort(requests, count, sizeof(* requests), compare_read_request_offset);
+    if ((db->kv_uring != NULL) && (kv_uring_read_many(db->kv_uring, db->kv_fd, requests, count) == 0)) {
+        return;
+    }
+    for(unsigned int i = 0 ; i < count ; i ++) {
+        struct kv_read_request * request = requests[i];
+        request->result = pread(db->kv_fd, request->data, request->size, (off_t) request->offset);
+    }
+}
+
+int kv_pread(int fd, char * data, size_t size, uint64_t offset)
+{
+    while (size > 0) {
+        ssize_t count = pread(fd, data, size, (off_t) offset);
+        if (count <= 0) {
+            return -1;
+        }
+        data += count;
+        size -= count;
+        offset += count;
+    }
+    
+    return 0;
+}
+
+int kv_pwritev(int fd, struct iovec * iov, int iovcnt, uint64_t offset)
+{
+    while (iovcnt > 0) {
+        int count = iovcnt;
+        if (count > IOV_MAX) {
+            count = IOV_MAX;
+        }
+        ssize_t written = pwritev(fd, iov, count, (off_t) offset);
+        if (written < 0) {
+            return -1;
+        }
+        offset += written;
+        // Skip what has been written, it might be a partial write.
+        while ((iovcnt > 0) && ((size_t) written >= iov->iov_len)) {
+            written -= iov->iov_len;
+            iov ++;
+            iovcnt --;
+        }
+        if (written > 0) {
+            iov->iov_base = (char *) iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    
+    return 0;
+}
+
+// reserves space at the end of the file for the arena.
+// the space left in the arena is recycled.
+// Returns -1 if there's an I/O error.
+static int arena_reserve(kvdb * db, struct kv_block_arena * arena, uint64_t size)
+{
+    if (size < KV_BLOCK_ARENA_CHUNK_SIZE) {
+        size = KV_BLOCK_ARENA_CHUNK_SIZE;
+    }
+    
+    // The rest of the space and the blocks recycled by the arena go to the lists of the file,
+    // they're written without holding the lock of the database.
+    int r = region_recycle(db, arena, arena->kv_offset, arena->kv_end - arena->kv_offset, NULL);
+    if (r < 0) {
+        return -1;
+    }
+    arena->kv_offset = 0;
+    arena->kv_end = 0;
+    r = arena_free_lists_splice(db, arena);
+    if (r < 0) {
+        return -1;
+    }
+    
+    kv_alloc_lock(db);
+    uint64_t filesize = ntoh64(* db->kv_filesize);
+    // The file is extended so that it's never shorter than kv_filesize.
+    r = ftruncate(db->kv_fd, (off_t) (filesize + size));
+    if (r < 0) {
+        kv_alloc_unlock(db);
+        return -1;
+    }
+    * db->kv_filesize = hton64(filesize + size);
+    kv_alloc_unlock(db);
+    
+    arena->kv_offset = filesize;
+    arena->kv_end = filesize + size;
+    return 0;
+}
+
+// takes a block of the given size class from the arena.
+// Returns 0 if there's an I/O error.
+static uint64_t arena_alloc(kvdb * db, struct kv_block_arena * arena, uint8_t size_class)
+{
+    // The blocks recycled by the arena first.
+    uint64_t offset = free_list_pop(&arena->kv_free_lists[size_class]);
+    if (offset != 0) {
+        arena->kv_free_count --;
+        return offset;
+    }
+    
+    // Then the recycled blocks of the database.
+    if ((__atomic_load_n(free_blocks_head(db, size_class), __ATOMIC_RELAXED) != 0) ||
+        (larger_size_class(db, size_class) != 0)) {
+        uint8_t taken_size_class;
+        kv_alloc_lock(db);
+        offset = take_block_or_larger(db, size_class, &taken_size_class);
+        kv_alloc_unlock(db);
+        if (offset != 0) {
+            if (taken_size_class != size_class) {
+                uint64_t size = kv_block_disk_size(size_class);
+                // The rest of the block goes to the arena. It's lost if there's an I/O error.
+                region_recycle(db, arena, offset + size, kv_block_disk_size(taken_size_class) - size, NULL);
             }
+            return offset;
+        }
+    }
+    
+    uint64_t size = kv_block_disk_size(size_class);
+    if (arena->kv_offset + size > arena->kv_end) {
+        int r = arena_reserve(db, arena, size);
+        if (r < 0) {
             return 0;
         }
-        write_offset += count;
-        remaining_data += count;
-        remaining -= count;
     }
-    if (allocated != NULL) {
-        free(allocated);
+    offset = arena->kv_offset;
+    arena->kv_offset += size;
+    return offset;
+}
+
+uint64_t kv_block_create(kvdb * db, uint64_t next_block_offset, uint32_t hash_value,
+                         const char * key, size_t key_size,
+                         const char * value, size_t value_size)
+{
+    uint8_t size_class = kv_block_size_class(db, key_size, value_size);
+    uint64_t offset;
+    int use_new_block = 0;
+    struct kv_block_arena * arena = current_arena(db);
+    if (arena != NULL) {
+        // Writers don't wait for each other to allocate a block.
+        pthread_mutex_lock(&arena->kv_lock);
+        offset = arena_alloc(db, arena, size_class);
+        pthread_mutex_unlock(&arena->kv_lock);
+        if (offset == 0) {
+            return 0;
+        }
+    }
+    else {
+        offset = kv_block_reuse(db, size_class);
+        //fprintf(stderr, "key, value: %i %i\n", (int) key_size, (int) value_size);
+        if (offset == 0) {
+            // Use new block.
+            offset = ntoh64(* db->kv_filesize);
+            use_new_block = 1;
+        }
+    }
+    
+    struct kv_block_header_buffer buffer;
+    struct iovec iov[KV_BLOCK_IOVEC_COUNT];
+    int iovcnt = kv_block_iovec(iov, &buffer, next_block_offset, hash_value, size_class,
+                                key, key_size, value, value_size);
+    kv_block_cache_remove(db->kv_block_cache, offset);
+    int r = kv_pwritev(db->kv_fd, iov, iovcnt, offset);
+    if (r < 0) {
+        return 0;
     }
     if (use_new_block) {
         uint64_t filesize = ntoh64(* db->kv_filesize);
-        filesize += 8 + 4 + 1 + 8 + 8 + block_size;
+        filesize += kv_block_disk_size(size_class);
         (* db->kv_filesize) = hton64(filesize);
     }
     
@@ -9,12 +9,134 @@
 #ifndef kvdb_kvblock_h
 #define kvdb_kvblock_h
 
+#include <sys/uio.h>
+#include <limits.h>
+
 #include "kvtypes.h"
 
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+// size of the block header: next offset, hash value, size class and key size.
+#define KV_BLOCK_HEADER_SIZE KV_BLOCK_KEY_BYTES_OFFSET
+// number of iovec needed to write a block.
+#define KV_BLOCK_IOVEC_COUNT 4
+
+// fixed size parts of a block, used when building the iovec of a block.
+struct kv_block_header_buffer {
+    char kv_header[KV_BLOCK_HEADER_SIZE];
+    char kv_value_size[8];
+};
+
 uint64_t kv_block_create(kvdb * db, uint64_t next_block_offset, uint32_t hash_value,
                          const char * key, size_t key_size,
                          const char * value, size_t value_size);
 
+// a recycled block is added to the list of the file for its size class right away. the blocks recycled while
+// the file is open are also kept in memory, so that taking one doesn't need to read the file.
+void kv_block_free_lists_setup(kvdb * db);
+void kv_block_free_lists_unsetup(kvdb * db);
+// forgets the blocks kept in memory, when another process might have changed the lists of the file.
+void kv_block_free_lists_reset(kvdb * db);
+
+// when several threads change the database, each of them allocates the blocks from its own arena:
+// the blocks it recycled and space reserved at the end of the file. the recycled blocks are chained in the
+// file and added to the lists of the file when the arena reserves space, when it holds too many of them and
+// when the file is closed. they're lost if the process stops before.
+void kv_block_arenas_setup(kvdb * db);
+// gives the recycled blocks and the unused space of the arenas back to the database.
+void kv_block_arenas_unsetup(kvdb * db);
+
+// Returns -1 if there's an I/O error.
 int kv_block_recycle(kvdb * db, uint64_t offset);
 
+// makes an unused region of the file available for new blocks.
+// the region is split into blocks that are added to the lists of recycled blocks.
+// Returns -1 if there's an I/O error.
+int kv_block_recycle_region(kvdb * db, uint64_t offset, uint64_t size);
+
+// a region of the file made of recycled blocks.
+struct kv_free_region {
+    uint64_t offset;
+    uint64_t size;
+};
+
+// takes all the recycled blocks of the database, including the ones of the arenas.
+// p_regions is set to the regions they cover, sorted by offset. the regions are not available for
+// new blocks until they're given back with kv_block_free_regions_give_back().
+// they're chained in the file: the regions of a process that stopped before giving them back are taken again.
+// the writer lock should be held in exclusive mode.
+// Returns -1 if the memory can't be allocated or if there's an I/O error.
+int kv_block_free_regions_take(kvdb * db, struct kv_free_region ** p_regions, size_t * p_count);
+// writes to the chain of the file the region at index after its offset or its size changed, it should be
+// called before the space removed from the region is used. the regions of size 0 are not in the chain.
+// Returns -1 if there's an I/O error.
+int kv_block_free_regions_update(kvdb * db, struct kv_free_region * regions, size_t count, size_t index);
+// makes the regions available for new blocks, they should be sorted by offset.
+// the large regions are given to the file system and the file is shrunk when its end is free.
+// the file is never shrunk below mapped_end. regions is released.
+// Returns -1 if there's an I/O error.
+int kv_block_free_regions_give_back(kvdb * db, struct kv_free_region * regions, size_t count, uint64_t mapped_end);
+// returns the number of bytes of the disk used by the file.
+uint64_t kv_block_disk_usage(kvdb * db);
+
+// merges the recycled blocks that are next to each other, gives the large free regions to the file system
+// and shrinks the file when its end is free. the file is never shrunk below mapped_end.
+// the writer lock should be held in exclusive mode.
+// p_released is set to the number of bytes of the disk given back.
+// Returns -1 if there's an I/O error.
+int kv_block_coalesce(kvdb * db, uint64_t mapped_end, uint64_t * p_released);
+
+// changes the offset of the next block in the chain.
+// Returns -1 if there's an I/O error.
+int kv_block_write_next_offset(kvdb * db, uint64_t offset, uint64_t next_offset);
+
+// returns the size class of the block that will store the given key / value.
+uint8_t kv_block_size_class(kvdb * db, size_t key_size, size_t value_size);
+
+// returns the number of bytes available for the key and the value in a block of the given size class.
+// Returns 0 if the size class is not valid.
+uint64_t kv_block_capacity(uint8_t size_class);
+
+// returns the number of bytes used in the file by a block of the given size class.
+uint64_t kv_block_disk_size(uint8_t size_class);
+
+// takes a block of the given size class from the lists of recycled blocks.
+// Returns 0 if there's no recycled block available.
+uint64_t kv_block_reuse(kvdb * db, uint8_t size_class);
+// gives back a block taken with kv_block_reuse() that has not been written.
+// Returns -1 if there's an I/O error, the block is then lost.
+int kv_block_reuse_cancel(kvdb * db, uint64_t offset, uint8_t size_class);
+
+// fills iov with the data to write for a block.
+// buffer must be valid until the data has been written.
+// Returns the number of iovec filled (at most KV_BLOCK_IOVEC_COUNT).
+int kv_block_iovec(struct iovec * iov, struct kv_block_header_buffer * buffer,
+                   uint64_t next_block_offset, uint32_t hash_value, uint8_t size_class,
+                   const char * key, size_t key_size,
+                   const char * value, size_t value_size);
+
+// a read to perform with kv_read_many().
+struct kv_read_request {
+    uint64_t offset;
+    char * data;
+    size_t size;
+    // number of bytes read, -1 if there's an I/O error.
+    ssize_t result;
+};
+
+// performs all the given reads.
+// they are issued in the order of their offset in the file.
+// when io_uring is used, they are all in flight at the same time.
+void kv_read_many(kvdb * db, struct kv_read_request ** requests, unsigned int count);
+
+// reads size bytes at the given offset.
+// Returns -1 if there's an I/O error or if the file is too short.
+int kv_pread(int fd, char * data, size_t size, uint64_t offset);
+
+// writes all the given iovec at the given offset.
+// Returns -1 if there's an I/O error.
+int kv_pwritev(int fd, struct iovec * iov, int iovcnt, uint64_t offset);
+
 #endif
@@ -9,22 +9,105 @@
 #ifndef KVBLOOM_H
 #define KVBLOOM_H
 
+#include <xxhash.h>
+
 #include "kvmurmurhash.h"
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// blocked bloom filter: the first hash value selects a block of KV_BLOOM_FILTER_BLOCK_SIZE bytes,
+// the second one sets one bit in each of the 8 32-bit words of the block.
+// words are stored in little endian.
+
+#define KV_BLOOM_FILTER_BLOCK_WORD_COUNT 8
+
+static const uint32_t kv_bloom_filter_block_salts[KV_BLOOM_FILTER_BLOCK_WORD_COUNT] = {
+    0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+    0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U,
+};
+
+static inline uint8_t * table_bloom_filter_block(struct kvdb_table * table, uint32_t hash_value)
+{
+    uint64_t block_count = ntoh64(* table->kv_bloom_filter_size) / (KV_BLOOM_FILTER_BLOCK_SIZE * 8);
+    // Maps the hash value to [0, block_count) without a division.
+    uint64_t idx = ((uint64_t) hash_value * block_count) >> 32;
+    return table->kv_bloom_filter + idx * KV_BLOOM_FILTER_BLOCK_SIZE;
+}
+
+static inline unsigned int table_bloom_filter_block_bit(uint32_t hash_value, unsigned int word)
+{
+    return (hash_value * kv_bloom_filter_block_salts[word]) >> 27;
+}
+
+static inline void table_blocked_bloom_filter_set(struct kvdb_table * table, uint32_t * hash_values)
+{
+    uint8_t * block = table_bloom_filter_block(table, hash_values[0]);
+    for(unsigned int i = 0 ; i < KV_BLOOM_FILTER_BLOCK_WORD_COUNT ; i ++) {
+        unsigned int bit = table_bloom_filter_block_bit(hash_values[1], i);
+        // Writers of different buckets might set bits of the same byte.
+        __atomic_fetch_or(&block[i * 4 + bit / 8], (uint8_t) (1 << (bit % 8)), __ATOMIC_RELAXED);
+    }
+}
+
+static inline int table_blocked_bloom_filter_might_contain(struct kvdb_table * table, uint32_t * hash_values)
+{
+    const uint8_t * block = table_bloom_filter_block(table, hash_values[0]);
+#if defined(__AVX2__)
+    const __m256i salts = _mm256_loadu_si256((const __m256i *) kv_bloom_filter_block_salts);
+    __m256i bits = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_set1_epi32((int) hash_values[1]), salts), 27);
+    __m256i mask = _mm256_sllv_epi32(_mm256_set1_epi32(1), bits);
+    __m256i words = _mm256_load_si256((const __m256i *) block);
+    return _mm256_testc_si256(words, mask);
+#elif defined(__SSE2__)
+    uint32_t mask_values[KV_BLOOM_FILTER_BLOCK_WORD_COUNT];
+    for(unsigned int i = 0 ; i < KV_BLOOM_FILTER_BLOCK_WORD_COUNT ; i ++) {
+        mask_values[i] = 1U << table_bloom_filter_block_bit(hash_values[1], i);
+    }
+    __m128i mask_low = _mm_loadu_si128((const __m128i *) mask_values);
+    __m128i mask_high = _mm_loadu_si128((const __m128i *) (mask_values + 4));
+    __m128i words_low = _mm_load_si128((const __m128i *) block);
+    __m128i words_high = _mm_load_si128((const __m128i *) (block + 16));
+    __m128i result = _mm_and_si128(_mm_cmpeq_epi32(_mm_and_si128(words_low, mask_low), mask_low),
+                                   _mm_cmpeq_epi32(_mm_and_si128(words_high, mask_high), mask_high));
+    return _mm_movemask_epi8(result) == 0xffff;
+#else
+    for(unsigned int i = 0 ; i < KV_BLOOM_FILTER_BLOCK_WORD_COUNT ; i ++) {
+        unsigned int bit = table_bloom_filter_block_bit(hash_values[1], i);
+        if ((block[i * 4 + bit / 8] & (1 << (bit % 8))) == 0) {
+            return 0;
+        }
+    }
+    return 1;
+#endif
+}
+
 static inline void table_bloom_filter_set(struct kvdb_table * table, uint32_t * hash_values,
                                           int hash_count)
 {
+    if (table->kv_bloom_filter_type == KV_BLOOM_FILTER_TYPE_BLOCKED) {
+        table_blocked_bloom_filter_set(table, hash_values);
+        return;
+    }
+    
     //fprintf(stderr, "----set\n");
     for(unsigned int i = 0 ; i < hash_count ; i ++) {
         uint64_t idx = hash_values[i] % ntoh64(* table->kv_bloom_filter_size);
         //fprintf(stderr, "%u\n", (unsigned int) idx);
-        table->kv_bloom_filter[idx / 8] |= 1 << (idx % 8);
+        __atomic_fetch_or(&table->kv_bloom_filter[idx / 8], (uint8_t) (1 << (idx % 8)), __ATOMIC_RELAXED);
     }
 }
 
 static inline int table_bloom_filter_might_contain(struct kvdb_table * table, uint32_t * hash_values,
                                                    int hash_count)
 {
+    if (table->kv_bloom_filter_type == KV_BLOOM_FILTER_TYPE_BLOCKED) {
+        return table_blocked_bloom_filter_might_contain(table, hash_values);
+    }
+    
     //fprintf(stderr, "----get\n");
     for(unsigned int i = 0 ; i < hash_count ; i ++) {
         uint64_t idx = hash_values[i] % ntoh64(* table->kv_bloom_filter_size);
@@ -38,9 +121,26 @@ static inline int table_bloom_filter_might_contain(struct kvdb_table * table, ui
     return 1;
 }
 
-static inline void table_bloom_filter_compute_hash(uint32_t * hash_values, unsigned int hash_count,
+// odd constant used to derive more hash values from a 64-bit hash value.
+#define KV_HASH_VALUE_MULTIPLIER 0x9e3779b97f4a7c15ULL
+
+// the first hash value selects the bucket of the key and is stored with it, the other ones are used
+// by the bloom filter.
+static inline void table_bloom_filter_compute_hash(kvdb * db, uint32_t * hash_values, unsigned int hash_count,
                                                    const char * key, size_t key_size)
 {
+    if (db->kv_hash_function == KVDB_HASH_FUNCTION_XXHASH64) {
+        // a single pass over the key: the low bits select the bucket, the high bits select the block of
+        // the bloom filter and the next hash values mix all the bits again.
+        uint64_t hash = XXH64(key, key_size, 0);
+        hash_values[0] = (uint32_t) hash;
+        for(unsigned int i = 1 ; i < hash_count ; i ++) {
+            hash_values[i] = (uint32_t) (hash >> 32);
+            hash *= KV_HASH_VALUE_MULTIPLIER;
+        }
+        return;
+    }
+    
     uint32_t previous_hash_value = 0;
     for(unsigned int i = 0 ; i < hash_count ; i ++) {
         hash_values[i] = kv_murmur_hash(key, key_size, previous_hash_value);
@@ -0,0 +1,273 @@
+//
+//  kvcache.c
+//  kvdb
+//
+//  Copyright (c) 2013 etpan. All rights reserved.
+//
+
+#include "kvcache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+// number of shards, should be a power of 2.
+#define KV_BLOCK_CACHE_SHARD_COUNT 16
+// initial number of buckets of the hash table of a shard, should be a power of 2.
+#define KV_BLOCK_CACHE_FIRST_BUCKET_COUNT 64
+
+struct kv_block_cache_entry {
+    uint64_t offset;
+    // next entry in the same bucket of the hash table.
+    struct kv_block_cache_entry * hash_next;
+    // LRU list, the most recently used entry is first.
+    struct kv_block_cache_entry * lru_previous;
+    struct kv_block_cache_entry * lru_next;
+    size_t size;
+    char data[];
+};
+
+struct kv_block_cache_shard {
+    pthread_mutex_t lock;
+    struct kv_block_cache_entry ** buckets;
+    unsigned int bucket_count;
+    unsigned int count;
+    struct kv_block_cache_entry * lru_first;
+    struct kv_block_cache_entry * lru_last;
+    // memory used by the entries.
+    size_t size;
+    size_t max_size;
+    uint64_t hits;
+    uint64_t misses;
+};
+
+struct kv_block_cache {
+    struct kv_block_cache_shard shards[KV_BLOCK_CACHE_SHARD_COUNT];
+};
+
+static inline uint64_t offset_hash(uint64_t offset)
+{
+    // Blocks offsets are not random: mix the bits (fibonacci hashing).
+    return offset * 0x9e3779b97f4a7c15ULL;
+}
+
+static inline struct kv_block_cache_shard * cache_shard(struct kv_block_cache * cache, uint64_t hash)
+{
+    return &cache->shards[(hash >> 60) & (KV_BLOCK_CACHE_SHARD_COUNT - 1)];
+}
+
+static inline struct kv_block_cache_entry ** shard_bucket(struct kv_block_cache_shard * shard, uint64_t hash)
+{
+    return &shard->buckets[(hash >> 32) & (shard->bucket_count - 1)];
+}
+
+static inline size_t entry_memory_size(struct kv_block_cache_entry * entry)
+{
+    return sizeof(* entry) + entry->size;
+}
+
+struct kv_block_cache * kv_block_cache_new(size_t size)
+{
+    struct kv_block_cache * cache = malloc(sizeof(* cache));
+    for(unsigned int i = 0 ; i < KV_BLOCK_CACHE_SHARD_COUNT ; i ++) {
+        struct kv_block_cache_shard * shard = &cache->shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->bucket_count = KV_BLOCK_CACHE_FIRST_BUCKET_COUNT;
+        shard->buckets = calloc(shard->bucket_count, sizeof(* shard->buckets));
+        shard->count = 0;
+        shard->lru_first = NULL;
+        shard->lru_last = NULL;
+        shard->size = 0;
+        shard->max_size = size / KV_BLOCK_CACHE_SHARD_COUNT;
+        shard->hits = 0;
+        shard->misses = 0;
+    }
+    return cache;
+}
+
+static void shard_clear(struct kv_block_cache_shard * shard)
+{
+    struct kv_block_cache_entry * entry = shard->lru_first;
+    while (entry != NULL) {
+        struct kv_block_cache_entry * next = entry->lru_next;
+        free(entry);
+        entry = next;
+    }
+    memset(shard->buckets, 0, shard->bucket_count * sizeof(* shard->buckets));
+    shard->count = 0;
+    shard->lru_first = NULL;
+    shard->lru_last = NULL;
+    shard->size = 0;
+}
+
+void kv_block_cache_free(struct kv_block_cache * cache)
+{
+    for(unsigned int i = 0 ; i < KV_BLOCK_CACHE_SHARD_COUNT ; i ++) {
+        struct kv_block_cache_shard * shard = &cache->shards[i];
+        shard_clear(shard);
+        free(shard->buckets);
+        pthread_mutex_destroy(&shard->lock);
+    }
+    free(cache);
+}
+
+static void lru_unlink(struct kv_block_cache_shard * shard, struct kv_block_cache_entry * entry)
+{
+    if (entry->lru_previous != NULL) {
+        entry->lru_previous->lru_next = entry->lru_next;
+    }
+    else {
+        shard->lru_first = entry->lru_next;
+    }
+    if (entry->lru_next != NULL) {
+        entry->lru_next->lru_previous = entry->lru_previous;
+    }
+    else {
+        shard->lru_last = entry->lru_previous;
+    }
+}
+
+static void lru_push_first(struct kv_block_cache_shard * shard, struct kv_block_cache_entry * entry)
+{
+    entry->lru_previous = NULL;
+    entry->lru_next = shard->lru_first;
+    if (shard->lru_first != NULL) {
+        shard->lru_first->lru_previous = entry;
+    }
+    else {
+        shard->lru_last = entry;
+    }
+    shard->lru_first = entry;
+}
+
+// removes the entry from the hash table and the LRU list and releases it.
+static void shard_remove_entry(struct kv_block_cache_shard * shard, struct kv_block_cache_entry * entry)
+{
+    struct kv_block_cache_entry ** p_entry = shard_bucket(shard, offset_hash(entry->offset));
+    while (* p_entry != entry) {
+        p_entry = &(* p_entry)->hash_next;
+    }
+    * p_entry = entry->hash_next;
+    lru_unlink(shard, entry);
+    shard->size -= entry_memory_size(entry);
+    shard->count --;
+    free(entry);
+}
+
+static struct kv_block_cache_entry * shard_find(struct kv_block_cache_shard * shard, uint64_t hash, uint64_t offset)
+{
+    struct kv_block_cache_entry * entry = * shard_bucket(shard, hash);
+    while ((entry != NULL) && (entry->offset != offset)) {
+        entry = entry->hash_next;
+    }
+    return entry;
+}
+
+// doubles the number of buckets of the hash table.
+static void shard_grow(struct kv_block_cache_shard * shard)
+{
+    unsigned int old_bucket_count = shard->bucket_count;
+    struct kv_block_cache_entry ** old_buckets = shard->buckets;
+    shard->bucket_count = old_bucket_count * 2;
+    shard->buckets = calloc(shard->bucket_count, sizeof(* shard->buckets));
+    for(unsigned int i = 0 ; i < old_bucket_count ; i ++) {
+        struct kv_block_cache_entry * entry = old_buckets[i];
+        while (entry != NULL) {
+            struct kv_block_cache_entry * next = entry->hash_next;
+            struct kv_block_cache_entry ** bucket = shard_bucket(shard, offset_hash(entry->offset));
+            entry->hash_next = * bucket;
+            * bucket = entry;
+            entry = next;
+        }
+    }
+    free(old_buckets);
+}
+
+size_t kv_block_cache_lookup(struct kv_block_cache * cache, uint64_t offset, char * data, size_t size)
+{
+    uint64_t hash = offset_hash(offset);
+    struct kv_block_cache_shard * shard = cache_shard(cache, hash);
+    size_t result = 0;
+    
+    pthread_mutex_lock(&shard->lock);
+    struct kv_block_cache_entry * entry = shard_find(shard, hash, offset);
+    if ((entry != NULL) && (entry->size <= size)) {
+        memcpy(data, entry->data, entry->size);
+        result = entry->size;
+        lru_unlink(shard, entry);
+        lru_push_first(shard, entry);
+        shard->hits ++;
+    }
+    else {
+        shard->misses ++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    
+    return result;
+}
+
+void kv_block_cache_add(struct kv_block_cache * cache, uint64_t offset, const char * data, size_t size)
+{
+    uint64_t hash = offset_hash(offset);
+    struct kv_block_cache_shard * shard = cache_shard(cache, hash);
+    
+    if (sizeof(struct kv_block_cache_entry) + size > shard->max_size) {
+        return;
+    }
+    
+    struct kv_block_cache_entry * new_entry = malloc(sizeof(* new_entry) + size);
+    new_entry->offset = offset;
+    new_entry->size = size;
+    memcpy(new_entry->data, data, size);
+    
+    pthread_mutex_lock(&shard->lock);
+    struct kv_block_cache_entry * entry = shard_find(shard, hash, offset);
+    if (entry != NULL) {
+        shard_remove_entry(shard, entry);
+    }
+    while (shard->size + entry_memory_size(new_entry) > shard->max_size) {
+        shard_remove_entry(shard, shard->lru_last);
+    }
+    if (shard->count >= shard->bucket_count) {
+        shard_grow(shard);
+    }
+    struct kv_block_cache_entry ** bucket = shard_bucket(shard, hash);
+    new_entry->hash_next = * bucket;
+    * bucket = new_entry;
+    lru_push_first(shard, new_entry);
+    shard->size += entry_memory_size(new_entry);
+    shard->count ++;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void kv_block_cache_remove(struct kv_block_cache * cache, uint64_t offset)
+{
+    if (cache == NULL) {
+        return;
+    }
+    
+    uint64_t hash = offset_hash(offset);
+    struct kv_block_cache_shard * shard = cache_shard(cache, hash);
+    
+    pthread_mutex_lock(&shard->lock);
+    struct kv_block_cache_entry * entry = shard_find(shard, hash, offset);
+    if (entry != NULL) {
+        shard_remove_entry(shard, entry);
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void kv_block_cache_stats(struct kv_block_cache * cache, uint64_t * p_hits, uint64_t * p_misses)
+{
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    for(unsigned int i = 0 ; i < KV_BLOCK_CACHE_SHARD_COUNT ; i ++) {
+        struct kv_block_cache_shard * shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        hits += shard->hits;
+        misses += shard->misses;
+        pthread_mutex_unlock(&shard->lock);
+    }
+    * p_hits = hits;
+    * p_misses = misses;
+}
@@ -0,0 +1,37 @@
+//
+//  kvcache.h
+//  kvdb
+//
+//  Copyright (c) 2013 etpan. All rights reserved.
+//
+
+#ifndef KVCACHE_H
+#define KVCACHE_H
+
+#include <sys/types.h>
+#include <inttypes.h>
+
+// cache of the blocks read from the file, indexed by the offset of the block.
+// it's split in shards with their own lock and LRU list so that readers don't contend on a single lock.
+struct kv_block_cache;
+
+// creates a cache that uses at most size bytes.
+struct kv_block_cache * kv_block_cache_new(size_t size);
+void kv_block_cache_free(struct kv_block_cache * cache);
+
+// copies the block at the given offset to data, data should be at least size bytes.
+// Returns the size of the block, 0 if it's not in the cache or if it's larger than size.
+size_t kv_block_cache_lookup(struct kv_block_cache * cache, uint64_t offset, char * data, size_t size);
+
+// adds a copy of the block at the given offset to the cache.
+// the least recently used blocks are removed to make room for it.
+void kv_block_cache_add(struct kv_block_cache * cache, uint64_t offset, const char * data, size_t size);
+
+// removes the block at the given offset from the cache.
+// cache can be NULL.
+void kv_block_cache_remove(struct kv_block_cache * cache, uint64_t offset);
+
+// returns the number of lookups that found the block and the number of lookups that didn't.
+void kv_block_cache_stats(struct kv_block_cache * cache, uint64_t * p_hits, uint64_t * p_misses);
+
+#endif
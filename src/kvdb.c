@@ -14,19 +14,26 @@
 #include <unistd.h>
 
 #include <lz4.h>
+#include <lz4hc.h>
 
 #include "kvassert.h"
 #include "kvendian.h"
 #include "kvtypes.h"
-#include "kvprime.h"
 #include "kvpaddingutils.h"
 #include "kvbloom.h"
 #include "kvmurmurhash.h"
 #include "kvtable.h"
 #include "kvblock.h"
+#include "kvcache.h"
+#include "kvuring.h"
+#include "kvlock.h"
+#include "kvvacuum.h"
+#include "kvdictionary.h"
 
 #define MARKER "KVDB"
-#define VERSION 5
+#define VERSION 6
+// files created with this version don't have the extended header.
+#define LEGACY_VERSION 5
 
 static int kvdb_debug = 0;
 
@@ -35,6 +42,12 @@ static int internal_kvdb_get2(kvdb * db, const char * key, size_t key_size,
               char ** p_value, size_t * p_value_size, size_t * p_free_size);
 static int kvdb_get2(kvdb * db, const char * key, size_t key_size,
                      char ** p_value, size_t * p_value_size, size_t * p_free_size);
+static int ref_buffers_add(kvdb * db, char * buffer);
+static void ref_buffers_release(kvdb * db);
+static int internal_kvdb_get_ref(kvdb * db, const char * key, size_t key_size,
+                                 const char ** p_value, size_t * p_value_size);
+static int internal_kvdb_delete(kvdb * db, const char * key, size_t key_size, uint32_t ** p_seq);
+static int linear_grow(kvdb * db);
 
 kvdb * kvdb_new(const char * filename)
 {
@@ -44,12 +57,61 @@ kvdb * kvdb_new(const char * filename)
     KVDBAssert(db->kv_filename != NULL);
     db->kv_fd = -1;
     db->kv_opened = 0;
-    db->kv_firstmaxcount = kv_getnextprime(KV_FIRST_TABLE_MAX_COUNT);
+    db->kv_bucket_selection = KV_BUCKET_SELECTION_MASK;
+    db->kv_firstmaxcount = kv_table_round_count(db, KV_FIRST_TABLE_MAX_COUNT);
+    db->kv_hash_function = KVDB_HASH_FUNCTION_XXHASH64;
     db->kv_compression_type = KVDB_COMPRESSION_TYPE_LZ4;
+    db->kv_compression_min_saving = KV_COMPRESSION_DEFAULT_MIN_SAVING;
+    db->kv_storage_type = KVDB_STORAGE_TYPE_TABLES;
+    db->kv_bloom_filter_type = KV_BLOOM_FILTER_TYPE_BLOCKED;
+    db->kv_bloom_filter_bits_per_key = KV_BLOOM_FILTER_DEFAULT_BITS_PER_KEY;
+    db->kv_bucket_slot_count = KV_BUCKET_SLOT_COUNT;
+    db->kv_bucket_cell_count = 0;
+    db->kv_block_size_classes = KV_BLOCK_SIZE_CLASSES_PER_DOUBLING;
+    db->kv_header_size = KV_HEADER_SIZE;
     db->kv_filesize = NULL;
     db->kv_free_blocks = NULL;
+    db->kv_class_free_blocks = NULL;
+    db->kv_free_lists = NULL;
+    db->kv_linear_level = NULL;
+    db->kv_linear_split = NULL;
+    db->kv_consolidation_table = NULL;
+    db->kv_consolidation_source = NULL;
+    db->kv_consolidation_bucket = NULL;
+    db->kv_vacuum_table = NULL;
+    db->kv_vacuum_bucket = NULL;
+    db->kv_free_regions_head = NULL;
+    db->kv_vacuum_move = NULL;
+    db->kv_dictionary_head = NULL;
+    kv_dictionaries_setup(db);
     db->kv_first_table = NULL;
     db->kv_current_table = NULL;
+    db->kv_data_mapping.kv_bytes = NULL;
+    db->kv_data_mapping.kv_size = 0;
+    db->kv_old_data_mappings = NULL;
+    db->kv_old_data_mappings_count = 0;
+    db->kv_ref_buffers = NULL;
+    db->kv_ref_buffers_count = 0;
+    db->kv_scratch = NULL;
+    db->kv_scratch_size = 0;
+    db->kv_block_cache = NULL;
+    db->kv_block_cache_size = 0;
+    db->kv_io_backend = KVDB_IO_BACKEND_PREAD;
+    db->kv_uring = NULL;
+    db->kv_async_ops = NULL;
+    db->kv_async_count = 0;
+    db->kv_async_capacity = 0;
+    db->kv_concurrent = 0;
+    db->kv_multi_process = 0;
+    db->kv_global_seq = NULL;
+    db->kv_bucket_seqs = NULL;
+    db->kv_generation = NULL;
+    db->kv_known_generation = 0;
+    db->kv_writer_active = NULL;
+    db->kv_bucket_locks = NULL;
+    db->kv_reader_slots = NULL;
+    db->kv_retired_tables = NULL;
+    db->kv_block_arenas = NULL;
     
     return db;
 }
@@ -76,6 +138,156 @@ int kvdb_get_compression_type(kvdb * db)
     return db->kv_compression_type;
 }
 
+void kvdb_set_compression_min_saving(kvdb * db, unsigned int percent)
+{
+    if (db->kv_opened) {
+        return;
+    }
+    if (percent > 100) {
+        percent = 100;
+    }
+    db->kv_compression_min_saving = percent;
+}
+
+unsigned int kvdb_get_compression_min_saving(kvdb * db)
+{
+    return db->kv_compression_min_saving;
+}
+
+void kvdb_set_storage_type(kvdb * db, int storage_type)
+{
+    if (db->kv_opened) {
+        return;
+    }
+    db->kv_storage_type = storage_type;
+}
+
+int kvdb_get_storage_type(kvdb * db)
+{
+    return db->kv_storage_type;
+}
+
+void kvdb_set_hash_function(kvdb * db, int hash_function)
+{
+    if (db->kv_opened) {
+        return;
+    }
+    db->kv_hash_function = hash_function;
+}
+
+int kvdb_get_hash_function(kvdb * db)
+{
+    return db->kv_hash_function;
+}
+
+void kvdb_set_bloom_filter_bits_per_key(kvdb * db, unsigned int bits_per_key)
+{
+    if (db->kv_opened) {
+        return;
+    }
+    if (bits_per_key < 1) {
+        bits_per_key = 1;
+    }
+    if (bits_per_key > 255) {
+        bits_per_key = 255;
+    }
+    db->kv_bloom_filter_bits_per_key = bits_per_key;
+}
+
+unsigned int kvdb_get_bloom_filter_bits_per_key(kvdb * db)
+{
+    return db->kv_bloom_filter_bits_per_key;
+}
+
+void kvdb_set_expected_count(kvdb * db, uint64_t count)
+{
+    if (db->kv_opened) {
+        return;
+    }
+    uint64_t maxcount = (count + KV_MAX_MEAN_COLLISION - 1) / KV_MAX_MEAN_COLLISION;
+    db->kv_firstmaxcount = kv_table_round_count(db, maxcount > 0 ? maxcount : 1);
+}
+
+uint64_t kvdb_get_expected_count(kvdb * db)
+{
+    return db->kv_firstmaxcount * KV_MAX_MEAN_COLLISION;
+}
+
+void kvdb_set_inline_values(kvdb * db, int enabled)
+{
+    if (db->kv_opened) {
+        return;
+    }
+    db->kv_bucket_cell_count = enabled ? KV_BUCKET_CELL_COUNT : 0;
+}
+
+int kvdb_get_inline_values(kvdb * db)
+{
+    return db->kv_bucket_cell_count != 0;
+}
+
+void kvdb_set_block_cache_size(kvdb * db, size_t size)
+{
+    if (db->kv_opened) {
+        return;
+    }
+    db->kv_block_cache_size = size;
+}
+
+size_t kvdb_get_block_cache_size(kvdb * db)
+{
+    return db->kv_block_cache_size;
+}
+
+void kvdb_get_block_cache_stats(kvdb * db, uint64_t * p_hits, uint64_t * p_misses)
+{
+    if (db->kv_block_cache == NULL) {
+        * p_hits = 0;
+        * p_misses = 0;
+        return;
+    }
+    kv_block_cache_stats(db->kv_block_cache, p_hits, p_misses);
+}
+
+void kvdb_set_io_backend(kvdb * db, int io_backend)
+{
+    if (db->kv_opened) {
+        return;
+    }
+    db->kv_io_backend = io_backend;
+}
+
+int kvdb_get_io_backend(kvdb * db)
+{
+    return db->kv_io_backend;
+}
+
+void kvdb_set_concurrent_readers(kvdb * db, int enabled)
+{
+    if (db->kv_opened) {
+        return;
+    }
+    db->kv_concurrent = enabled;
+}
+
+int kvdb_get_concurrent_readers(kvdb * db)
+{
+    return db->kv_concurrent;
+}
+
+void kvdb_set_multi_process(kvdb * db, int enabled)
+{
+    if (db->kv_opened) {
+        return;
+    }
+    db->kv_multi_process = enabled;
+}
+
+int kvdb_get_multi_process(kvdb * db)
+{
+    return db->kv_multi_process;
+}
+
 int kvdb_open(kvdb * db)
 {
     int r;
@@ -92,6 +304,10 @@ int kvdb_open(kvdb * db)
         fprintf(stderr, "open failed\n");
         return -1;
     }
+    if (db->kv_multi_process) {
+        // Another process might be creating the file.
+        kv_file_lock(db);
+    }
     
     r = fstat(db->kv_fd, &stat_buf);
     if (r < 0) {
@@ -101,13 +317,22 @@ int kvdb_open(kvdb * db)
         return -1;
     }
     
-    uint64_t firstmaxcount = kv_getnextprime(KV_FIRST_TABLE_MAX_COUNT);
-    uint64_t first_mapping_size = KV_HEADER_SIZE + KV_TABLE_SIZE(firstmaxcount);
+    uint64_t firstmaxcount = db->kv_firstmaxcount;
+    uint64_t first_mapping_size = 0;
     
     char data[4 + 4 + 8 + 1];
     
     if (stat_buf.st_size == 0) {
         create_file = 1;
+        db->kv_bloom_filter_type = KV_BLOOM_FILTER_TYPE_BLOCKED;
+        db->kv_bucket_slot_count = KV_BUCKET_SLOT_COUNT;
+        db->kv_block_size_classes = KV_BLOCK_SIZE_CLASSES_PER_DOUBLING;
+        if (db->kv_bucket_selection != KV_BUCKET_SELECTION_MASK) {
+            // the handle was used to open a file created before.
+            db->kv_bucket_selection = KV_BUCKET_SELECTION_MASK;
+            firstmaxcount = kv_table_round_count(db, firstmaxcount);
+        }
+        first_mapping_size = KV_HEADER_SIZE + kv_table_disk_size(db, firstmaxcount);
         r = ftruncate(db->kv_fd, KV_PAGE_ROUND_UP(db, first_mapping_size));
         if (r < 0) {
             close(db->kv_fd);
@@ -120,8 +345,29 @@ int kvdb_open(kvdb * db)
         h64_to_bytes(&data[4 + 4], firstmaxcount);
         data[4 + 4 + 8] = db->kv_compression_type;
         write(db->kv_fd, data, sizeof(data));
+        char storage_type = db->kv_storage_type;
+        pwrite(db->kv_fd, &storage_type, 1, KV_HEADER_STORAGE_TYPE_OFFSET);
+        char table_format_data[5];
+        table_format_data[0] = db->kv_bloom_filter_type;
+        table_format_data[1] = db->kv_bloom_filter_bits_per_key;
+        table_format_data[2] = db->kv_bucket_slot_count;
+        table_format_data[3] = db->kv_bucket_cell_count;
+        table_format_data[4] = db->kv_block_size_classes;
+        pwrite(db->kv_fd, table_format_data, sizeof(table_format_data), KV_HEADER_BLOOM_FILTER_TYPE_OFFSET);
+        char bucket_selection = db->kv_bucket_selection;
+        pwrite(db->kv_fd, &bucket_selection, 1, KV_HEADER_BUCKET_SELECTION_OFFSET);
+        char hash_function = db->kv_hash_function;
+        pwrite(db->kv_fd, &hash_function, 1, KV_HEADER_HASH_FUNCTION_OFFSET);
         
         kv_table_header_write(db, KV_HEADER_SIZE, firstmaxcount);
+        if (db->kv_multi_process) {
+            // Another process might open the file as soon as it's unlocked.
+            h64_to_bytes(data, first_mapping_size);
+            pwrite(db->kv_fd, data, 8, KV_HEADER_FILESIZE_OFFSET);
+        }
+    }
+    if (db->kv_multi_process) {
+        kv_file_unlock(db);
     }
     
     char marker[4];
@@ -138,7 +384,52 @@ int kvdb_open(kvdb * db)
         fprintf(stderr, "file corrupted\n");
         return -1;
     }
-    if (version != VERSION) {
+    if (version == LEGACY_VERSION) {
+        if (db->kv_multi_process) {
+            fprintf(stderr, "the header of the file has no room for the state shared by the processes\n");
+            return -1;
+        }
+        db->kv_header_size = KV_HEADER_V5_SIZE;
+        db->kv_storage_type = KVDB_STORAGE_TYPE_TABLES;
+        db->kv_bloom_filter_type = KV_BLOOM_FILTER_TYPE_LEGACY;
+        db->kv_bucket_slot_count = 0;
+        db->kv_bucket_cell_count = 0;
+        db->kv_block_size_classes = 0;
+        db->kv_bucket_selection = KV_BUCKET_SELECTION_MODULO;
+        db->kv_hash_function = KVDB_HASH_FUNCTION_MURMUR;
+    }
+    else if (version == VERSION) {
+        char storage_type;
+        pread(db->kv_fd, &storage_type, 1, KV_HEADER_STORAGE_TYPE_OFFSET);
+        // these fields are 0 in files created before the blocked bloom filter, the slots, the cells,
+        // the size classes of the blocks, the power of 2 tables and xxHash.
+        unsigned char table_format_data[5];
+        pread(db->kv_fd, table_format_data, sizeof(table_format_data), KV_HEADER_BLOOM_FILTER_TYPE_OFFSET);
+        unsigned char bucket_selection;
+        pread(db->kv_fd, &bucket_selection, 1, KV_HEADER_BUCKET_SELECTION_OFFSET);
+        unsigned char hash_function;
+        pread(db->kv_fd, &hash_function, 1, KV_HEADER_HASH_FUNCTION_OFFSET);
+        db->kv_header_size = KV_HEADER_SIZE;
+        db->kv_storage_type = storage_type;
+        db->kv_bloom_filter_type = table_format_data[0];
+        if (db->kv_bloom_filter_type == KV_BLOOM_FILTER_TYPE_BLOCKED) {
+            db->kv_bloom_filter_bits_per_key = table_format_data[1];
+        }
+        db->kv_bucket_slot_count = table_format_data[2];
+        db->kv_bucket_cell_count = table_format_data[3];
+        db->kv_block_size_classes = table_format_data[4];
+        db->kv_bucket_selection = bucket_selection;
+        db->kv_hash_function = hash_function;
+        if (((db->kv_bucket_slot_count != 0) && (db->kv_bucket_slot_count != KV_BUCKET_SLOT_COUNT)) ||
+            ((db->kv_bucket_cell_count != 0) && (db->kv_bucket_cell_count != KV_BUCKET_CELL_COUNT)) ||
+            ((db->kv_block_size_classes != 0) && (db->kv_block_size_classes != KV_BLOCK_SIZE_CLASSES_PER_DOUBLING)) ||
+            ((db->kv_bucket_selection != KV_BUCKET_SELECTION_MODULO) && (db->kv_bucket_selection != KV_BUCKET_SELECTION_MASK)) ||
+            ((db->kv_hash_function != KVDB_HASH_FUNCTION_MURMUR) && (db->kv_hash_function != KVDB_HASH_FUNCTION_XXHASH64))) {
+            fprintf(stderr, "bad file format\n");
+            return -1;
+        }
+    }
+    else {
         fprintf(stderr, "bad file version\n");
         return -1;
     }
@@ -147,7 +438,14 @@ int kvdb_open(kvdb * db)
     db->kv_compression_type = compression_type;
     db->kv_opened = 1;
     
+    if (db->kv_multi_process) {
+        // The other processes don't change the chain of tables while it's mapped.
+        kv_file_lock(db);
+    }
     r = kv_tables_setup(db);
+    if (db->kv_multi_process) {
+        kv_file_unlock(db);
+    }
     if (r < 0) {
         fprintf(stderr, "can't map files\n");
         return -1;
@@ -156,9 +454,67 @@ int kvdb_open(kvdb * db)
     char * first_mapping = db->kv_first_table->kv_mapping.kv_bytes;
     db->kv_filesize = (uint64_t *) (first_mapping + KV_HEADER_FILESIZE_OFFSET);
     db->kv_free_blocks = (uint64_t *) (first_mapping + KV_HEADER_FREELIST_OFFSET);
+    if (db->kv_storage_type == KVDB_STORAGE_TYPE_LINEAR_HASHING) {
+        db->kv_linear_level = (uint64_t *) (first_mapping + KV_HEADER_LINEAR_LEVEL_OFFSET);
+        db->kv_linear_split = (uint64_t *) (first_mapping + KV_HEADER_LINEAR_SPLIT_OFFSET);
+    }
+    if (db->kv_header_size >= KV_HEADER_SIZE) {
+        db->kv_class_free_blocks = (uint64_t *) (first_mapping + KV_HEADER_CLASS_FREELIST_OFFSET);
+        db->kv_consolidation_table = (uint64_t *) (first_mapping + KV_HEADER_CONSOLIDATION_TABLE_OFFSET);
+        db->kv_consolidation_source = (uint64_t *) (first_mapping + KV_HEADER_CONSOLIDATION_SOURCE_OFFSET);
+        db->kv_consolidation_bucket = (uint64_t *) (first_mapping + KV_HEADER_CONSOLIDATION_BUCKET_OFFSET);
+        db->kv_vacuum_table = (uint64_t *) (first_mapping + KV_HEADER_VACUUM_TABLE_OFFSET);
+        db->kv_vacuum_bucket = (uint64_t *) (first_mapping + KV_HEADER_VACUUM_BUCKET_OFFSET);
+        db->kv_free_regions_head = (uint64_t *) (first_mapping + KV_HEADER_FREE_REGIONS_OFFSET);
+        db->kv_vacuum_move = (uint64_t *) (first_mapping + KV_HEADER_VACUUM_MOVE_OFFSET);
+        db->kv_dictionary_head = (uint64_t *) (first_mapping + KV_HEADER_DICTIONARY_OFFSET);
+    }
+    else {
+        memset(db->kv_legacy_consolidation_state, 0, sizeof(db->kv_legacy_consolidation_state));
+        db->kv_consolidation_table = &db->kv_legacy_consolidation_state[0];
+        db->kv_consolidation_source = &db->kv_legacy_consolidation_state[1];
+        db->kv_consolidation_bucket = &db->kv_legacy_consolidation_state[2];
+        memset(db->kv_legacy_vacuum_state, 0, sizeof(db->kv_legacy_vacuum_state));
+        db->kv_vacuum_table = &db->kv_legacy_vacuum_state[0];
+        db->kv_vacuum_bucket = &db->kv_legacy_vacuum_state[1];
+        db->kv_free_regions_head = &db->kv_legacy_vacuum_state[2];
+        db->kv_vacuum_move = &db->kv_legacy_vacuum_state[3];
+    }
     if (create_file) {
         * db->kv_filesize = hton64(first_mapping_size);
     }
+    kv_block_free_lists_setup(db);
+    if (!db->kv_multi_process) {
+        // The other processes recover when they find that the writer died.
+        r = kv_vacuum_recover(db);
+        if (r < 0) {
+            fprintf(stderr, "can't recover the vacuum\n");
+            kvdb_close(db);
+            return -1;
+        }
+    }
+    if (db->kv_multi_process) {
+        db->kv_concurrent = 1;
+    }
+    // The other processes can't remove the blocks they change from the cache.
+    if ((db->kv_block_cache_size > 0) && !db->kv_multi_process) {
+        db->kv_block_cache = kv_block_cache_new(db->kv_block_cache_size);
+    }
+    if (db->kv_io_backend == KVDB_IO_BACKEND_IO_URING) {
+        db->kv_uring = kv_uring_new();
+        if (db->kv_uring == NULL) {
+            db->kv_io_backend = KVDB_IO_BACKEND_PREAD;
+        }
+    }
+    if (db->kv_concurrent) {
+        r = kv_concurrency_setup(db);
+        if (r < 0) {
+            fprintf(stderr, "can't share the file\n");
+            db->kv_concurrent = 0;
+            kvdb_close(db);
+            return -1;
+        }
+    }
     
     return 0;
 }
@@ -169,39 +525,190 @@ void kvdb_close(kvdb * db)
         return;
     }
     
+    while (db->kv_async_count > 0) {
+        kvdb_poll(db);
+    }
+    free(db->kv_async_ops);
+    db->kv_async_ops = NULL;
+    db->kv_async_capacity = 0;
+    if (db->kv_uring != NULL) {
+        kv_uring_free(db->kv_uring);
+        db->kv_uring = NULL;
+    }
+    kv_data_mapping_unsetup(db);
+    ref_buffers_release(db);
+    free(db->kv_scratch);
+    db->kv_scratch = NULL;
+    db->kv_scratch_size = 0;
+    if (db->kv_block_cache != NULL) {
+        kv_block_cache_free(db->kv_block_cache);
+        db->kv_block_cache = NULL;
+    }
+    if (db->kv_concurrent) {
+        kv_concurrency_unsetup(db);
+    }
+    kv_block_free_lists_unsetup(db);
+    kv_dictionaries_unsetup(db);
     kv_tables_unsetup(db);
     close(db->kv_fd);
+    db->kv_linear_level = NULL;
+    db->kv_linear_split = NULL;
+    db->kv_consolidation_table = NULL;
+    db->kv_consolidation_source = NULL;
+    db->kv_consolidation_bucket = NULL;
+    db->kv_vacuum_table = NULL;
+    db->kv_vacuum_bucket = NULL;
+    db->kv_free_regions_head = NULL;
+    db->kv_vacuum_move = NULL;
+    db->kv_dictionary_head = NULL;
+    db->kv_current_table = NULL;
     db->kv_opened = 0;
 }
 
-int kvdb_set(kvdb * db, const char * key, size_t key_size, const char * value, size_t value_size)
+// returns 1 if the values of the database are compressed with LZ4.
+static int stored_value_is_lz4(kvdb * db)
 {
-    if (db->kv_compression_type == KVDB_COMPRESSION_TYPE_RAW) {
-        return internal_kvdb_set(db, key, key_size, value, value_size);
+    return (db->kv_compression_type == KVDB_COMPRESSION_TYPE_LZ4) ||
+        (db->kv_compression_type == KVDB_COMPRESSION_TYPE_LZ4HC) ||
+        (db->kv_compression_type == KVDB_COMPRESSION_TYPE_LZ4_DICTIONARY);
+}
+
+// a value compressed with a dictionary starts with a tag: the id of the dictionary with this flag.
+// it's never set in the first byte of the size of the other compressed values: LZ4 can't compress 2 GB.
+// a value stored uncompressed has the tag of the dictionary 0.
+#define KV_STORED_VALUE_TAG_FLAG 0x80
+// the tag is followed by the size of the value as a variable length integer.
+#define KV_STORED_VALUE_HEADER_MAX_SIZE (1 + 5)
+// LZ4 can't compress more than this ratio: a larger size in the header means that the value is corrupted.
+#define KV_LZ4_MAX_COMPRESSION_RATIO 255
+
+// header of a value compressed with LZ4.
+struct stored_value_header {
+    size_t value_size;
+    // dictionary used to compress the value, 0 if there's none.
+    unsigned int dictionary_id;
+    // the value is stored uncompressed after the header.
+    int raw;
+    // size of the header.
+    size_t size;
+};
+
+// checks the size of the value in the header against the size of the stored value.
+// Returns -1 if the value is corrupted.
+static int stored_value_header_check(struct stored_value_header * header, uint64_t stored_value_size)
+{
+    if (header->size > stored_value_size) {
+        return -1;
+    }
+    uint64_t compressed_size = stored_value_size - header->size;
+    if (header->raw) {
+        return compressed_size == header->value_size ? 0 : -1;
+    }
+    if ((compressed_size == 0) || (header->value_size > compressed_size * KV_LZ4_MAX_COMPRESSION_RATIO)) {
+        return -1;
+    }
+    return 0;
+}
+
+// reads the header at the beginning of a stored value, size is the number of bytes available.
+// the header is checked against the size of the whole stored value, which can't be larger than its block.
+// Returns -1 if the header is corrupted or incomplete.
+static int stored_value_header_read(const char * data, size_t size, uint64_t stored_value_size,
+                                    struct stored_value_header * header)
+{
+    if (size == 0) {
+        return -1;
     }
-    else if (db->kv_compression_type == KVDB_COMPRESSION_TYPE_LZ4) {
-        if (value_size == 0) {
-            return internal_kvdb_set(db, key, key_size, value, value_size);
+    if ((data[0] & KV_STORED_VALUE_TAG_FLAG) == 0) {
+        if (size < sizeof(uint32_t)) {
+            return -1;
         }
-        else {
-            int max_compressed_size = LZ4_compressBound((int) value_size);
-            char * compressed_value = NULL;
-            int allocated = 0;
-            if (max_compressed_size < 4096) {
-                compressed_value = alloca(sizeof(uint32_t) + max_compressed_size);
-            }
-            else {
-                allocated = 1;
-                compressed_value = malloc(sizeof(uint32_t) + max_compressed_size);
-            }
-            * (uint32_t *) compressed_value = htonl(value_size);
-            int compressed_value_size = LZ4_compress(value, compressed_value + sizeof(uint32_t), (int) value_size);
-            int r = internal_kvdb_set(db, key, key_size, compressed_value, sizeof(uint32_t) + compressed_value_size);
-            if (allocated) {
-                free(compressed_value);
-            }
-            return r;
+        header->value_size = bytes_to_h32((char *) data);
+        header->dictionary_id = 0;
+        header->raw = 0;
+        header->size = sizeof(uint32_t);
+        return stored_value_header_check(header, stored_value_size);
+    }
+    
+    header->dictionary_id = (unsigned char) data[0] & ~KV_STORED_VALUE_TAG_FLAG;
+    header->raw = (header->dictionary_id == 0);
+    uint64_t value_size = 0;
+    unsigned int shift = 0;
+    size_t position = 1;
+    while (1) {
+        if ((position >= size) || (position >= KV_STORED_VALUE_HEADER_MAX_SIZE)) {
+            return -1;
+        }
+        unsigned char byte = data[position];
+        position ++;
+        value_size |= ((uint64_t) (byte & 0x7f)) << shift;
+        if ((byte & 0x80) == 0) {
+            break;
+        }
+        shift += 7;
+    }
+    header->value_size = (size_t) value_size;
+    header->size = position;
+    return stored_value_header_check(header, stored_value_size);
+}
+
+// writes the header of a value compressed with a dictionary, or of a value stored uncompressed
+// when dictionary_id is 0.
+// Returns the size of the header.
+static size_t stored_value_header_write(char * data, unsigned int dictionary_id, size_t value_size)
+{
+    data[0] = KV_STORED_VALUE_TAG_FLAG | dictionary_id;
+    size_t position = 1;
+    while (value_size >= 0x80) {
+        data[position] = (char) (0x80 | (value_size & 0x7f));
+        position ++;
+        value_size >>= 7;
+    }
+    data[position] = (char) value_size;
+    position ++;
+    return position;
+}
+
+// decompresses a stored value into value, value_capacity should be at least the size of the value.
+// Returns -1 if the stored value is corrupted.
+static int stored_value_decompress(kvdb * db, struct stored_value_header * header,
+                                   const char * compressed, size_t compressed_size,
+                                   char * value, size_t value_capacity)
+{
+    int decompressed_size;
+    if (header->raw) {
+        if ((compressed_size != header->value_size) || (compressed_size > value_capacity)) {
+            return -1;
+        }
+        memcpy(value, compressed, compressed_size);
+        return 0;
+    }
+    else if (header->dictionary_id == 0) {
+        decompressed_size = LZ4_decompress_safe(compressed, value, (int) compressed_size, (int) value_capacity);
+    }
+    else {
+        struct kv_dictionary * dictionary = kv_dictionary_get(db, header->dictionary_id);
+        if (dictionary == NULL) {
+            return -1;
         }
+        decompressed_size = LZ4_decompress_safe_usingDict(compressed, value, (int) compressed_size, (int) value_capacity,
+                                                          dictionary->kv_data, (int) dictionary->kv_size);
+    }
+    if (decompressed_size != (int) header->value_size) {
+        return -1;
+    }
+    return 0;
+}
+
+// returns the maximum size of a value once prepared for storage.
+static size_t stored_value_size_bound(kvdb * db, size_t value_size)
+{
+    if ((db->kv_compression_type == KVDB_COMPRESSION_TYPE_RAW) || (value_size == 0)) {
+        return value_size;
+    }
+    else if (stored_value_is_lz4(db)) {
+        // The header of a value stored uncompressed is smaller than the margin of LZ4.
+        return KV_STORED_VALUE_HEADER_MAX_SIZE + LZ4_compressBound((int) value_size);
     }
     else {
         KVDBAssert(0);
@@ -209,61 +716,278 @@ int kvdb_set(kvdb * db, const char * key, size_t key_size, const char * value, s
     }
 }
 
-static int internal_kvdb_set(kvdb * db, const char * key, size_t key_size, const char * value, size_t value_size)
+// compresses the value with LZ4.
+// Returns the size of the compressed value with its header.
+static size_t stored_value_compress(kvdb * db, char * stored_value, const char * value, size_t value_size)
 {
-    uint32_t hash_value[KV_BLOOM_FILTER_HASH_COUNT];
-    table_bloom_filter_compute_hash(hash_value, KV_BLOOM_FILTER_HASH_COUNT, key, key_size);
+    int max_compressed_size = LZ4_compressBound((int) value_size);
+    struct kv_dictionary * dictionary = NULL;
+    if (db->kv_compression_type == KVDB_COMPRESSION_TYPE_LZ4_DICTIONARY) {
+        dictionary = kv_dictionary_current(db);
+    }
+    if (dictionary != NULL) {
+        size_t header_size = stored_value_header_write(stored_value, dictionary->kv_id, value_size);
+        // The state of the dictionary is shared by the writers.
+        LZ4_stream_t stream;
+        memcpy(&stream, dictionary->kv_stream, sizeof(stream));
+        int compressed_value_size = LZ4_compress_fast_continue(&stream, value, stored_value + header_size, (int) value_size,
+                                                               max_compressed_size, 1);
+        return header_size + compressed_value_size;
+    }
     
+    * (uint32_t *) stored_value = htonl(value_size);
+    int compressed_value_size;
+    if (db->kv_compression_type == KVDB_COMPRESSION_TYPE_LZ4HC) {
+        compressed_value_size = LZ4_compress_HC(value, stored_value + sizeof(uint32_t), (int) value_size,
+                                                max_compressed_size, LZ4HC_CLEVEL_DEFAULT);
+    }
+    else {
+        compressed_value_size = LZ4_compress(value, stored_value + sizeof(uint32_t), (int) value_size);
+    }
+    return sizeof(uint32_t) + compressed_value_size;
+}
+
+// returns 1 if the values can be stored with a tag byte, see stored_value_header_write().
+// the values of the files created before version 6 keep the 4-byte size header that older builds read.
+static int stored_value_has_tags(kvdb * db)
+{
+    return db->kv_header_size >= KV_HEADER_SIZE;
+}
+
+// prepares the value for storage (compression).
+// stored_value should be at least stored_value_size_bound() bytes.
+// Returns the size of the value to store.
+static size_t stored_value_encode(kvdb * db, char * stored_value, const char * value, size_t value_size)
+{
+    if ((db->kv_compression_type == KVDB_COMPRESSION_TYPE_RAW) || (value_size == 0)) {
+        memcpy(stored_value, value, value_size);
+        return value_size;
+    }
+    else if (!stored_value_has_tags(db)) {
+        // There's no header for a value stored uncompressed.
+        return stored_value_compress(db, stored_value, value, value_size);
+    }
+    else if (stored_value_is_lz4(db)) {
+        uint64_t max_stored_value_size = value_size - (uint64_t) value_size * db->kv_compression_min_saving / 100;
+        if (db->kv_compression_min_saving < 100) {
+            size_t stored_value_size = stored_value_compress(db, stored_value, value, value_size);
+            if (stored_value_size <= max_stored_value_size) {
+                return stored_value_size;
+            }
+        }
+        
+        // Compression doesn't save enough: the value is stored as is.
+        size_t header_size = stored_value_header_write(stored_value, 0, value_size);
+        memcpy(stored_value + header_size, value, value_size);
+        return header_size + value_size;
+    }
+    else {
+        KVDBAssert(0);
+        return 0;
+    }
+}
+
+int kvdb_set(kvdb * db, const char * key, size_t key_size, const char * value, size_t value_size)
+{
     int r;
-    r = kvdb_delete(db, key, key_size);
-    if (r == -1) {
-        // Not found: ignore.
+    if ((db->kv_compression_type == KVDB_COMPRESSION_TYPE_RAW) || (value_size == 0)) {
+        kv_writer_shared_lock(db);
+        r = internal_kvdb_set(db, key, key_size, value, value_size);
+        kv_writer_shared_unlock(db);
     }
-    else if (r == -2) {
-        return -2;
+    else {
+        size_t max_compressed_size = stored_value_size_bound(db, value_size);
+        char * compressed_value = NULL;
+        int allocated = 0;
+        if (max_compressed_size < 4096) {
+            compressed_value = alloca(max_compressed_size);
+        }
+        else {
+            allocated = 1;
+            compressed_value = malloc(max_compressed_size);
+        }
+        size_t compressed_value_size = stored_value_encode(db, compressed_value, value, value_size);
+        kv_writer_shared_lock(db);
+        r = internal_kvdb_set(db, key, key_size, compressed_value, compressed_value_size);
+        kv_writer_shared_unlock(db);
+        if (allocated) {
+            free(compressed_value);
+        }
     }
-    
-    r = kv_select_table(db);
     if (r < 0) {
-        return -2;
+        return r;
     }
-    struct kvdb_table * table = db->kv_current_table;
-    
-    uint32_t idx = hash_value[0] % ntoh64(* table->kv_maxcount);
-    struct kvdb_item * item = &table->kv_items[idx];
-    uint64_t offset = kv_block_create(db, ntoh64(item->kv_offset), hash_value[0], key, key_size, value, value_size);
-    if (offset == 0) {
+    return linear_grow(db);
+}
+
+// splits the buckets of the linear hashing table when there are too many items.
+// the split waits for the other writers.
+// Returns -2 if there's an I/O error.
+static int linear_grow(kvdb * db)
+{
+    if ((db->kv_storage_type != KVDB_STORAGE_TYPE_LINEAR_HASHING) || !kv_linear_needs_grow(db)) {
+        return 0;
+    }
+    kv_writer_lock(db);
+    int r = kv_linear_grow(db);
+    kv_writer_unlock(db);
+    if (r < 0) {
         return -2;
     }
-    item->kv_offset = hton64(offset);
-    table_bloom_filter_set(table, hash_value + 1, KV_BLOOM_FILTER_HASH_COUNT - 1);
-    
-    uint64_t count;
-    count = ntoh64(* table->kv_count);
-    count ++;
-    * table->kv_count = hton64(count);
-    
     return 0;
 }
 
-#define PRE_READ_KEY_SIZE 128
-#define MAX_ALLOCA_SIZE 4096
+// adds a key that is not in the database to the given bucket.
+// Returns -2 if there's an I/O error.
+static int insert_key(kvdb * db, uint32_t * hash_value, struct kvdb_table * table, struct kvdb_item * item,
+                      uint64_t * table_count, const char * key, size_t key_size, const char * value, size_t value_size)
+{
+    // Small keys and values are stored in the table when there's room in the bucket.
+    char * cell = NULL;
+    if (kv_bucket_cell_fits(key_size, value_size)) {
+        cell = kv_bucket_cell_get_free(table, item);
+    }
+    if (cell != NULL) {
+        kv_bucket_cell_write(cell, KV_BUCKET_CELL_FLAG_USED, hash_value[0], key, key_size, value, value_size);
+    }
+    else {
+        uint64_t offset = kv_block_create(db, ntoh64(item->kv_offset), hash_value[0], key, key_size, value, value_size);
+        if (offset == 0) {
+            return -2;
+        }
+        item->kv_offset = hton64(offset);
+        kv_bucket_slots_push(table, item, offset, hash_value[0]);
+    }
+    table_bloom_filter_set(table, hash_value + 1, KV_BLOOM_FILTER_HASH_COUNT - 1);
+    kv_table_count_add(table_count, 1);
+    return 0;
+}
 
-static void show_bucket(kvdb * db, uint32_t idx)
+// the buckets of the key are locked by this function.
+static int internal_kvdb_set(kvdb * db, const char * key, size_t key_size, const char * value, size_t value_size)
 {
-    struct kvdb_table * table = db->kv_first_table;
-    struct kvdb_item * item = &table->kv_items[idx];
-    uint64_t next_offset = ntoh64(item->kv_offset);
+    uint32_t hash_value[KV_BLOOM_FILTER_HASH_COUNT];
+    table_bloom_filter_compute_hash(db, hash_value, KV_BLOOM_FILTER_HASH_COUNT, key, key_size);
     
-    fprintf(stderr, "bucket: %llu\n", (unsigned long long) idx);
+    int r;
+    // The bucket of the new item is selected first so that it's locked with the other buckets of the key.
+    struct kvdb_table * table;
+    struct kvdb_item * item;
+    uint64_t * table_count;
+    r = kv_select_bucket(db, hash_value[0], &table, &item, &table_count);
+    if (r < 0) {
+        return -2;
+    }
+    struct kv_key_locks locks;
+    kv_key_lock(db, hash_value[0], &locks);
     
-    uint64_t previous_offset = 0;
+    // Readers should see either the previous value or the new one: the bucket of the previous value
+    // stays in a change until the new value is inserted.
+    uint32_t * delete_seq;
+    uint32_t * seq = NULL;
+    r = internal_kvdb_delete(db, key, key_size, &delete_seq);
+    if (r == -2) {
+        goto end_seq;
+    }
+    
+    seq = kv_bucket_seq(db, table, item);
+    if (seq == delete_seq) {
+        // Already in a change.
+        seq = NULL;
+    }
+    if (seq != NULL) {
+        kv_seq_write_begin(seq);
+    }
+    
+    r = insert_key(db, hash_value, table, item, table_count, key, key_size, value, value_size);
+
+end_seq:
+    if (seq != NULL) {
+        kv_seq_write_end(seq);
+    }
+    if (delete_seq != NULL) {
+        kv_seq_write_end(delete_seq);
+    }
+    kv_key_unlock(db, &locks);
+    return r;
+}
+
+// adds a key known not to be in the database, without looking for a previous value.
+// the database should not be used by other threads.
+// Returns -2 if there's an I/O error.
+static int internal_kvdb_insert(kvdb * db, const char * key, size_t key_size, const char * value, size_t value_size)
+{
+    uint32_t hash_value[KV_BLOOM_FILTER_HASH_COUNT];
+    table_bloom_filter_compute_hash(db, hash_value, KV_BLOOM_FILTER_HASH_COUNT, key, key_size);
+    
+    struct kvdb_table * table;
+    struct kvdb_item * item;
+    uint64_t * table_count;
+    if (kv_select_bucket(db, hash_value[0], &table, &item, &table_count) < 0) {
+        return -2;
+    }
+    return insert_key(db, hash_value, table, item, table_count, key, key_size, value, value_size);
+}
+
+// returns the first table where to look for a key.
+static struct kvdb_table * lookup_first_table(kvdb * db, uint32_t hash_value)
+{
+    if (db->kv_storage_type == KVDB_STORAGE_TYPE_LINEAR_HASHING) {
+        struct kvdb_table * table = NULL;
+        kv_linear_bucket(db, hash_value, &table);
+        return table;
+    }
+    return db->kv_first_table;
+}
+
+// returns the next table where to look for a key.
+static struct kvdb_table * lookup_next_table(kvdb * db, struct kvdb_table * table)
+{
+    if (db->kv_storage_type == KVDB_STORAGE_TYPE_LINEAR_HASHING) {
+        // A key can only be in a single bucket.
+        return NULL;
+    }
+    return table->kv_next_table;
+}
+
+// returns the bucket of the given table where to look for a key.
+static struct kvdb_item * lookup_bucket(kvdb * db, struct kvdb_table * table, uint32_t hash_value)
+{
+    if (db->kv_storage_type == KVDB_STORAGE_TYPE_LINEAR_HASHING) {
+        return kv_linear_bucket(db, hash_value, &table);
+    }
+    return kv_table_bucket(table, hash_value);
+}
+
+// returns the counter of items to update when removing an item from the given table.
+static uint64_t * lookup_table_count(kvdb * db, struct kvdb_table * table)
+{
+    if (db->kv_storage_type == KVDB_STORAGE_TYPE_LINEAR_HASHING) {
+        return db->kv_first_table->kv_count;
+    }
+    return table->kv_count;
+}
+
+#define PRE_READ_KEY_SIZE 128
+// largest block read entirely during a lookup once its header matches, the value then doesn't need another read.
+#define PRE_READ_BLOCK_SIZE 4096
+#define MAX_ALLOCA_SIZE 4096
+
+static void show_bucket(kvdb * db, uint32_t idx)
+{
+    struct kvdb_table * table = db->kv_first_table;
+    struct kvdb_item * item = &table->kv_items[idx];
+    uint64_t next_offset = ntoh64(item->kv_offset);
+    
+    fprintf(stderr, "bucket: %llu\n", (unsigned long long) idx);
+    
+    uint64_t previous_offset = 0;
     
     // Run through all chained blocks in the bucket.
     while (next_offset != 0) {
         uint32_t current_hash_value;
         uint64_t current_offset;
-        uint8_t log2_size;
+        uint8_t size_class;
         uint64_t current_key_size;
         char * current_key;
         ssize_t r;
@@ -279,7 +1003,7 @@ static void show_bucket(kvdb * db, uint32_t idx)
         p += 8;
         current_hash_value = bytes_to_h32(p);
         p += 4;
-        log2_size = bytes_to_h8(p);
+        size_class = bytes_to_h8(p);
         p += 1;
         current_key_size = bytes_to_h64(p);
         p += 8;
@@ -314,61 +1038,181 @@ static void show_bucket(kvdb * db, uint32_t idx)
     fprintf(stderr, "-----\n");
 }
 
-static int find_key(kvdb * db, const char * key, size_t key_size,
+// maximum number of buckets visited by a lookup, the tables double in size so there are never that many.
+#define FIND_KEY_MAX_SEQ_COUNT 64
+
+// counters read by a lookup done without lock, see kvlock.h.
+struct find_key_seqs {
+    int enabled;
+    uint32_t global_value;
+    unsigned int count;
+    uint32_t * seqs[FIND_KEY_MAX_SEQ_COUNT];
+    uint32_t values[FIND_KEY_MAX_SEQ_COUNT];
+};
+
+static void find_key_seqs_init(kvdb * db, struct find_key_seqs * seqs, int lock_free)
+{
+    seqs->enabled = lock_free && db->kv_concurrent;
+    seqs->count = 0;
+    if (seqs->enabled) {
+        seqs->global_value = kv_seq_read_begin(db->kv_global_seq);
+    }
+}
+
+// waits until the given bucket is not being changed and remembers its counter.
+static void find_key_seqs_add(kvdb * db, struct find_key_seqs * seqs, struct kvdb_table * table, struct kvdb_item * item)
+{
+    if (!seqs->enabled || (seqs->count == FIND_KEY_MAX_SEQ_COUNT)) {
+        return;
+    }
+    uint32_t * seq = kv_bucket_seq(db, table, item);
+    seqs->seqs[seqs->count] = seq;
+    seqs->values[seqs->count] = kv_seq_read_begin(seq);
+    seqs->count ++;
+}
+
+// Returns 1 if the buckets visited by the lookup have been changed since they have been read.
+static int find_key_seqs_changed(kvdb * db, struct find_key_seqs * seqs)
+{
+    if (!seqs->enabled) {
+        return 0;
+    }
+    for(unsigned int i = 0 ; i < seqs->count ; i ++) {
+        if (kv_seq_read_changed(seqs->seqs[i], seqs->values[i])) {
+            return 1;
+        }
+    }
+    return kv_seq_read_changed(db->kv_global_seq, seqs->global_value);
+}
+
+// when lock_free is set and concurrent readers are enabled, the lookup doesn't use any lock and
+// returns 1 when the database has been changed while looking for the key. The result of the callback should then
+// be ignored and the lookup done again.
+static int find_key(kvdb * db, const char * key, size_t key_size, int lock_free,
                     findkey_callback callback, void * cb_data)
 {
     uint32_t hash_values[KV_BLOOM_FILTER_HASH_COUNT];
-    table_bloom_filter_compute_hash(hash_values, KV_BLOOM_FILTER_HASH_COUNT, key, key_size);
+    table_bloom_filter_compute_hash(db, hash_values, KV_BLOOM_FILTER_HASH_COUNT, key, key_size);
     
     struct find_key_cb_params params;
     params.key = key;
     params.key_size = key_size;
     
+    struct find_key_seqs seqs;
+    find_key_seqs_init(db, &seqs, lock_free);
+    if (seqs.enabled && kv_tables_stale(db)) {
+        // Another process has added or removed tables.
+        kv_tables_refresh(db);
+        return 1;
+    }
+    // The mapping of the data might be replaced by kvdb_get_ref() in another thread.
+    int use_data_mapping = !db->kv_concurrent;
+    
     // Run through all tables.
-    struct kvdb_table * table = db->kv_first_table;
+    struct kvdb_table * table = lookup_first_table(db, hash_values[0]);
     while (table != NULL) {
         // Is the key likely to be in this table?
         // Use a bloom filter to guess.
         if (!table_bloom_filter_might_contain(table, hash_values + 1, KV_BLOOM_FILTER_HASH_COUNT - 1)) {
-            table = table->kv_next_table;
+            table = lookup_next_table(db, table);
             continue;
         }
         
         // Find a bucket.
         uint64_t previous_offset = 0;
-        uint32_t idx = hash_values[0] % ntoh64(* table->kv_maxcount);
-        struct kvdb_item * item = &table->kv_items[idx];
+        struct kvdb_item * item = lookup_bucket(db, table, hash_values[0]);
+        if (item == NULL) {
+            // The linear hash table is being split.
+            return find_key_seqs_changed(db, &seqs) ? 1 : -1;
+        }
+        uint32_t idx = (uint32_t) (item - table->kv_items);
+        find_key_seqs_add(db, &seqs, table, item);
+        
+        // Look in the cells of the bucket first.
+        char * cell = kv_bucket_cell_lookup(table, item, hash_values[0], key, key_size);
+        if (cell != NULL) {
+            params.previous_offset = 0;
+            params.current_offset = 0;
+            params.next_offset = 0;
+            params.table = table;
+            params.item = item;
+            params.cell = cell;
+            params.block = NULL;
+            params.block_size = 0;
+            params.table_count = lookup_table_count(db, table);
+            params.size_class = 0;
+            callback(db, &params, cb_data);
+            return find_key_seqs_changed(db, &seqs);
+        }
+        
         uint64_t next_offset = ntoh64(item->kv_offset);
+        unsigned int position = 0;
         if (kvdb_debug) {
             fprintf(stderr, "before\n");
             show_bucket(db, idx);
         }
         
         // Run through all chained blocks in the bucket.
-        while (next_offset != 0) {
+        while (1) {
+            // The chain might be read while it's changed: don't follow it further.
+            if (find_key_seqs_changed(db, &seqs)) {
+                return 1;
+            }
+            
+            // Skip the blocks that the slots of the bucket show as not matching.
+            next_offset = kv_bucket_slots_seek(table, item, hash_values[0], next_offset, &position, &previous_offset);
+            if (next_offset == 0) {
+                break;
+            }
+            int slot_matches = kv_bucket_slots_match(table, item, hash_values[0], next_offset, position);
+            position ++;
+            
             uint32_t current_hash_value;
             uint64_t current_offset;
-            uint8_t log2_size;
+            uint8_t size_class;
             uint64_t current_key_size;
             char * current_key;
             ssize_t r;
             
             current_offset = next_offset;
-            char block_header_data[KV_BLOCK_KEY_BYTES_OFFSET + PRE_READ_KEY_SIZE];
+            char block_data[PRE_READ_BLOCK_SIZE];
+            size_t block_data_size = KV_BLOCK_KEY_BYTES_OFFSET + PRE_READ_KEY_SIZE;
             
-            r = pread(db->kv_fd, block_header_data, sizeof(block_header_data), (off_t) next_offset);
-            if (r < 0)
-                return -1;
-            char * p = block_header_data;
+            // Use the cache or the mapping of the file when there's one.
+            char * block_header = NULL;
+            size_t cached_size = 0;
+            if (db->kv_block_cache != NULL) {
+                cached_size = kv_block_cache_lookup(db->kv_block_cache, current_offset, block_data, sizeof(block_data));
+            }
+            if (cached_size != 0) {
+                block_header = block_data;
+                block_data_size = cached_size;
+            }
+            else if (use_data_mapping) {
+                block_header = (char *) kv_data_mapping_lookup(db, current_offset, block_data_size);
+            }
+            if (block_header == NULL) {
+                // Only the header and the beginning of the key are read: most blocks of the chain are skipped.
+                // The block that the slots show as matching is likely the one looked up: it's read at once.
+                if (slot_matches) {
+                    block_data_size = sizeof(block_data);
+                }
+                r = pread(db->kv_fd, block_data, block_data_size, (off_t) next_offset);
+                if (r < KV_BLOCK_KEY_BYTES_OFFSET)
+                    return find_key_seqs_changed(db, &seqs) ? 1 : -1;
+                block_header = block_data;
+                block_data_size = (size_t) r;
+            }
+            char * p = block_header;
             next_offset = bytes_to_h64(p);
             p += 8;
             current_hash_value = bytes_to_h32(p);
             p += 4;
-            log2_size = bytes_to_h8(p);
+            size_class = bytes_to_h8(p);
             p += 1;
             current_key_size = bytes_to_h64(p);
             p += 8;
-            current_key = block_header_data + KV_BLOCK_KEY_BYTES_OFFSET;
+            current_key = block_header + KV_BLOCK_KEY_BYTES_OFFSET;
             
             if (current_hash_value != hash_values[0]) {
                 previous_offset = current_offset;
@@ -377,25 +1221,43 @@ static int find_key(kvdb * db, const char * key, size_t key_size,
             
             int cmp_result;
             
-            if (current_key_size != key_size) {
+            if ((current_key_size != key_size) || (kv_block_capacity(size_class) == 0)) {
                 previous_offset = current_offset;
                 continue;
             }
-            char * allocated = NULL;
-            if (current_key_size > PRE_READ_KEY_SIZE) {
-                if (current_key_size <= MAX_ALLOCA_SIZE) {
-                    current_key = alloca(current_key_size);
+            if ((block_header == block_data) && (cached_size == 0)) {
+                // The rest of the block is read at once when it's small enough.
+                uint64_t block_disk_size = kv_block_disk_size(size_class);
+                if ((block_disk_size > block_data_size) && (block_disk_size <= sizeof(block_data))) {
+                    r = pread(db->kv_fd, block_data + block_data_size, (size_t) block_disk_size - block_data_size,
+                              (off_t) (current_offset + block_data_size));
+                    if (r < 0) {
+                        return find_key_seqs_changed(db, &seqs) ? 1 : -1;
+                    }
+                    block_data_size += (size_t) r;
                 }
-                else {
-                    allocated = malloc((size_t) current_key_size);
-                    current_key = allocated;
+            }
+            char * allocated = NULL;
+            if (KV_BLOCK_KEY_BYTES_OFFSET + current_key_size > block_data_size) {
+                current_key = NULL;
+                if (use_data_mapping) {
+                    current_key = (char *) kv_data_mapping_lookup(db, current_offset + KV_BLOCK_KEY_BYTES_OFFSET, current_key_size);
                 }
-                r = pread(db->kv_fd, current_key, (size_t) current_key_size, (off_t) (current_offset + KV_BLOCK_KEY_BYTES_OFFSET));
-                if (r < 0) {
-                    if (allocated != NULL) {
-                        free(allocated);
+                if (current_key == NULL) {
+                    if (current_key_size <= MAX_ALLOCA_SIZE) {
+                        current_key = alloca(current_key_size);
+                    }
+                    else {
+                        allocated = malloc((size_t) current_key_size);
+                        current_key = allocated;
+                    }
+                    r = pread(db->kv_fd, current_key, (size_t) current_key_size, (off_t) (current_offset + KV_BLOCK_KEY_BYTES_OFFSET));
+                    if (r < 0) {
+                        if (allocated != NULL) {
+                            free(allocated);
+                        }
+                        return find_key_seqs_changed(db, &seqs) ? 1 : -1;
                     }
-                    return -1;
                 }
             }
             cmp_result = memcmp(key, current_key, key_size) != 0;
@@ -410,12 +1272,46 @@ static int find_key(kvdb * db, const char * key, size_t key_size,
             params.previous_offset = previous_offset;
             params.current_offset = current_offset;
             params.next_offset = next_offset;
+            params.table = table;
             params.item = item;
-            params.table_count = table->kv_count;
-            params.log2_size = log2_size;
+            params.cell = NULL;
+            params.block = block_header;
+            params.block_size = block_data_size;
+            if (block_header != block_data) {
+                // The whole block is available in the mapping of the file.
+                const char * block = kv_data_mapping_lookup(db, current_offset, kv_block_disk_size(size_class));
+                if (block != NULL) {
+                    params.block = block;
+                    params.block_size = (size_t) kv_block_disk_size(size_class);
+                }
+            }
+            if ((db->kv_block_cache != NULL) && (cached_size == 0) && (block_header == block_data)) {
+                // Only keep the blocks that have been read entirely.
+                uint64_t value_size_offset = KV_BLOCK_KEY_BYTES_OFFSET + key_size;
+                if (value_size_offset + 8 <= block_data_size) {
+                    uint64_t block_size = value_size_offset + 8 + bytes_to_h64(block_data + value_size_offset);
+                    if (block_size <= block_data_size) {
+                        if (find_key_seqs_changed(db, &seqs)) {
+                            return 1;
+                        }
+                        kv_block_cache_add(db->kv_block_cache, current_offset, block_data, (size_t) block_size);
+                        if (find_key_seqs_changed(db, &seqs)) {
+                            // The writer might have changed the block before it was added.
+                            kv_block_cache_remove(db->kv_block_cache, current_offset);
+                            return 1;
+                        }
+                    }
+                }
+            }
+            params.table_count = lookup_table_count(db, table);
+            params.size_class = size_class;
             
             callback(db, &params, cb_data);
             
+            if (find_key_seqs_changed(db, &seqs)) {
+                return 1;
+            }
+            
             if (kvdb_debug) {
                 fprintf(stderr, "after\n");
                 show_bucket(db, idx);
@@ -423,54 +1319,90 @@ static int find_key(kvdb * db, const char * key, size_t key_size,
             
             return 0;
         }
-        table = table->kv_next_table;
+        table = lookup_next_table(db, table);
     }
+    
+    return find_key_seqs_changed(db, &seqs);
+}
 
+// removes a block from the chain of its bucket and recycles it.
+// Returns -2 if there's an I/O error.
+static int unlink_block(kvdb * db, struct kvdb_table * table, struct kvdb_item * item,
+                        uint64_t previous_offset, uint64_t offset, uint64_t next_offset)
+{
+    int r;
+    
+    if (previous_offset == 0) {
+        item->kv_offset = hton64(next_offset);
+    }
+    else {
+        r = kv_block_write_next_offset(db, previous_offset, next_offset);
+        if (r < 0) {
+            return -2;
+        }
+    }
+    r = kv_bucket_slots_remove(db, table, item, offset);
+    if (r < 0) {
+        return -2;
+    }
+    r = kv_block_recycle(db, offset);
+    if (r < 0) {
+        return -2;
+    }
     return 0;
 }
 
 struct delete_key_params {
     int result;
     int found;
+    // counter of the bucket being changed, the change should be ended by the caller.
+    uint32_t * seq;
 };
 
 static void delete_key_callback(kvdb * db, struct find_key_cb_params * params,
                                 void * data) {
     struct delete_key_params * deletekeyparams = data;
-    ssize_t write_count;
     int r;
     
-    if (params->previous_offset == 0) {
-        params->item->kv_offset = hton64(params->next_offset);
+    deletekeyparams->seq = kv_bucket_seq(db, params->table, params->item);
+    if (deletekeyparams->seq != NULL) {
+        kv_seq_write_begin(deletekeyparams->seq);
     }
-    else {
-        uint64_t offset_to_write = hton64(params->next_offset);
-        write_count = pwrite(db->kv_fd, &offset_to_write, sizeof(offset_to_write), params->previous_offset);
-        if (write_count < 0) {
-            deletekeyparams->result = -2;
-            return;
-        }
+    
+    if (params->cell != NULL) {
+        memset(params->cell, 0, KV_BUCKET_CELL_SIZE);
+        kv_table_count_add(params->table_count, -1);
+        deletekeyparams->result = 0;
+        deletekeyparams->found = 1;
+        return;
     }
-    r = kv_block_recycle(db, params->current_offset);
+    
+    r = unlink_block(db, params->table, params->item, params->previous_offset, params->current_offset,
+                     params->next_offset);
     if (r < 0) {
-        deletekeyparams->result = -2;
+        deletekeyparams->result = r;
         return;
     }
     
-    * params->table_count = hton64(ntoh64(* params->table_count) - 1);
+    kv_table_count_add(params->table_count, -1);
     deletekeyparams->result = 0;
     deletekeyparams->found = 1;
 }
 
-int kvdb_delete(kvdb * db, const char * key, size_t key_size)
+// when the key is found, the bucket where it was is left in a change that should be ended
+// with kv_seq_write_end() on the counter stored in p_seq.
+// the buckets of the key should be locked by the caller.
+static int internal_kvdb_delete(kvdb * db, const char * key, size_t key_size, uint32_t ** p_seq)
 {
     int r;
     struct delete_key_params data;
     
     data.found = 0;
     data.result = -1;
+    data.seq = NULL;
     
-    r = find_key(db, key, key_size, delete_key_callback, &data);
+    r = find_key(db, key, key_size, 0, delete_key_callback, &data);
+    * p_seq = data.seq;
     if (r < 0) {
         return -2;
     }
@@ -484,6 +1416,35 @@ int kvdb_delete(kvdb * db, const char * key, size_t key_size)
     return 0;
 }
 
+int kvdb_delete(kvdb * db, const char * key, size_t key_size)
+{
+    uint32_t hash_values[KV_BLOOM_FILTER_HASH_COUNT];
+    table_bloom_filter_compute_hash(db, hash_values, KV_BLOOM_FILTER_HASH_COUNT, key, key_size);
+    
+    uint32_t * seq;
+    struct kv_key_locks locks;
+    kv_writer_shared_lock(db);
+    kv_key_lock(db, hash_values[0], &locks);
+    int r = internal_kvdb_delete(db, key, key_size, &seq);
+    if (seq != NULL) {
+        kv_seq_write_end(seq);
+    }
+    kv_key_unlock(db, &locks);
+    kv_writer_shared_unlock(db);
+    return r;
+}
+
+// returns the given range of the block found by find_key() when it has already been read.
+// offset is relative to the beginning of the block.
+// Returns NULL if the range needs to be read from the file.
+static const char * found_block_range(struct find_key_cb_params * params, uint64_t offset, uint64_t size)
+{
+    if ((params->block == NULL) || (offset + size > params->block_size)) {
+        return NULL;
+    }
+    return params->block + offset;
+}
+
 struct read_value_params {
     uint64_t value_size;
     char * value;
@@ -498,18 +1459,54 @@ static void read_value_callback(kvdb * db, struct find_key_cb_params * params,
     struct read_value_params * readparams = data;
     ssize_t r;
     
+    if (params->cell != NULL) {
+        readparams->value_size = kv_bucket_cell_value_size(params->cell);
+        if (!kv_bucket_cell_fits(params->key_size, (size_t) readparams->value_size)) {
+            // The cell is being changed.
+            readparams->result = -2;
+            return;
+        }
+        readparams->value = malloc((size_t) readparams->value_size);
+        memcpy(readparams->value, kv_bucket_cell_value(params->cell), (size_t) readparams->value_size);
+        readparams->result = 0;
+        readparams->found = 1;
+        readparams->free_size = 0;
+        return;
+    }
+    
+    uint64_t value_size_offset = KV_BLOCK_KEY_BYTES_OFFSET + params->key_size;
     uint64_t value_size;
-    r = pread(db->kv_fd, &value_size, sizeof(value_size),
-              params->current_offset + 8 + 4 + 1 + 8 + params->key_size);
-    if (r < 0) {
+    const char * value_size_data = found_block_range(params, value_size_offset, 8);
+    if (value_size_data != NULL) {
+        value_size = bytes_to_h64((char *) value_size_data);
+    }
+    else {
+        r = pread(db->kv_fd, &value_size, sizeof(value_size),
+                  params->current_offset + value_size_offset);
+        if (r < 0) {
+            readparams->result = -2;
+            return;
+        }
+        value_size = ntoh64(value_size);
+    }
+    if (value_size > kv_block_capacity(params->size_class)) {
+        // The block is corrupted or it's being changed.
         readparams->result = -2;
         return;
     }
     
-    value_size = ntoh64(value_size);
     readparams->value_size = value_size;
     readparams->value = malloc((size_t) value_size);
     
+    const char * value_data = found_block_range(params, value_size_offset + 8, value_size);
+    if (value_data != NULL) {
+        memcpy(readparams->value, value_data, (size_t) value_size);
+        readparams->result = 0;
+        readparams->found = 1;
+        readparams->free_size = kv_block_capacity(params->size_class) - (value_size + params->key_size);
+        return;
+    }
+    
     uint64_t remaining = value_size;
     char * value_p = readparams->value;
     while (remaining > 0) {
@@ -527,7 +1524,7 @@ static void read_value_callback(kvdb * db, struct find_key_cb_params * params,
     
     readparams->result = 0;
     readparams->found = 1;
-    readparams->free_size = (1 << params->log2_size) - (value_size + params->key_size);
+    readparams->free_size = kv_block_capacity(params->size_class) - (value_size + params->key_size);
 }
 
 int kvdb_get(kvdb * db, const char * key, size_t key_size,
@@ -536,31 +1533,42 @@ int kvdb_get(kvdb * db, const char * key, size_t key_size,
     return kvdb_get2(db, key, key_size, p_value, p_value_size, NULL);
 }
 
-static int kvdb_get2(kvdb * db, const char * key, size_t key_size,
-                     char ** p_value, size_t * p_value_size, size_t * p_free_size)
+// decodes a value read from the storage (decompression).
+// stored_value is released by this function.
+// result stored in p_value should be released using free().
+// Returns -1 if the stored value is corrupted.
+static int stored_value_decode(kvdb * db, char * stored_value, size_t stored_value_size,
+                               char ** p_value, size_t * p_value_size)
 {
-    if (db->kv_compression_type == KVDB_COMPRESSION_TYPE_RAW) {
-        return internal_kvdb_get2(db, key, key_size, p_value, p_value_size, p_free_size);
+    * p_value = NULL;
+    * p_value_size = 0;
+    if ((db->kv_compression_type == KVDB_COMPRESSION_TYPE_RAW) || (stored_value_size == 0)) {
+        * p_value = stored_value;
+        * p_value_size = stored_value_size;
+        return 0;
     }
-    else if (db->kv_compression_type == KVDB_COMPRESSION_TYPE_LZ4) {
-        char * compressed_value;
-        size_t compressed_value_size;
-        int r = internal_kvdb_get2(db, key, key_size, &compressed_value, &compressed_value_size, p_free_size);
-        if (r < 0) {
-            return r;
+    else if (stored_value_is_lz4(db)) {
+        struct stored_value_header header;
+        if (stored_value_header_read(stored_value, stored_value_size, stored_value_size, &header) < 0) {
+            free(stored_value);
+            return -1;
         }
-        if (compressed_value_size == 0) {
-            * p_value = NULL;
-            * p_value_size = 0;
+        
+        size_t value_size = header.value_size;
+        if (header.raw) {
+            // The value is moved to the beginning of the buffer instead of being copied.
+            memmove(stored_value, stored_value + header.size, value_size);
+            * p_value_size = value_size;
+            * p_value = stored_value;
             return 0;
         }
-    
-        size_t value_size = ntohl(* (uint32_t *) compressed_value);
         char * value = malloc(value_size);
-        LZ4_decompress_fast(compressed_value + sizeof(uint32_t), value, (int) value_size);
-        free(compressed_value);
-        if (p_free_size != NULL) {
-            * p_free_size = 0;
+        int r = stored_value_decompress(db, &header, stored_value + header.size, stored_value_size - header.size,
+                                        value, value_size);
+        free(stored_value);
+        if (r < 0) {
+            free(value);
+            return -1;
         }
         * p_value_size = value_size;
         * p_value = value;
@@ -568,101 +1576,2079 @@ static int kvdb_get2(kvdb * db, const char * key, size_t key_size,
     }
     else {
         KVDBAssert(0);
-        return 0;
+        return -1;
     }
 }
 
-static int internal_kvdb_get2(kvdb * db, const char * key, size_t key_size,
-              char ** p_value, size_t * p_value_size, size_t * p_free_size)
+// returns a buffer of at least the given size, reused between calls.
+static char * scratch_buffer(kvdb * db, size_t size)
 {
-    int r;
-    struct read_value_params data;
-    
-    data.value_size = 0;
-    data.value = NULL;
-    data.result = -1;
-    data.found = 0;
-    data.free_size = 0;
+    if (size > db->kv_scratch_size) {
+        free(db->kv_scratch);
+        db->kv_scratch = malloc(size);
+        db->kv_scratch_size = size;
+    }
+    return db->kv_scratch;
+}
 
-    r = find_key(db, key, key_size, read_value_callback, &data);
-    if (r < 0) {
-        return -2;
+struct read_value_into_params {
+    char * buffer;
+    size_t buffer_size;
+    // when set, the buffer is allocated to the size of the value instead of being provided by the caller.
+    int allocate;
+    size_t value_size;
+    int result;
+    int found;
+};
+
+// makes sure that the buffer has room for the value.
+// Returns -3 if the buffer of the caller is too small, -2 if the buffer can't be allocated.
+static int read_value_into_reserve(struct read_value_into_params * readparams, size_t value_size)
+{
+    readparams->value_size = value_size;
+    if (!readparams->allocate) {
+        return value_size > readparams->buffer_size ? -3 : 0;
     }
-    if (data.result < 0) {
-        return data.result;
+    if ((readparams->buffer != NULL) && (value_size <= readparams->buffer_size)) {
+        return 0;
     }
-    if (!data.found) {
-        return -1;
+    // An empty value still has a buffer to release.
+    char * buffer = realloc(readparams->buffer, value_size > 0 ? value_size : 1);
+    if (buffer == NULL) {
+        return -2;
     }
-    
-    if (p_free_size != NULL) {
-        * p_free_size = data.free_size;
+    readparams->buffer = buffer;
+    readparams->buffer_size = value_size;
+    return 0;
+}
+
+// decodes the value stored in a cell into the buffer of the caller.
+static void read_cell_value_into(kvdb * db, char * cell, struct read_value_into_params * readparams)
+{
+    const char * stored_value = kv_bucket_cell_value(cell);
+    size_t stored_value_size = kv_bucket_cell_value_size(cell);
+    readparams->found = 1;
+    if (!kv_bucket_cell_fits(kv_bucket_cell_key_size(cell), stored_value_size)) {
+        // The cell is being changed.
+        readparams->result = -2;
+        return;
     }
     
-    * p_value = data.value;
-    * p_value_size = (size_t) data.value_size;
-    
-    return 0;
+    int r;
+    if ((db->kv_compression_type == KVDB_COMPRESSION_TYPE_RAW) || (stored_value_size == 0)) {
+        r = read_value_into_reserve(readparams, stored_value_size);
+        if (r < 0) {
+            readparams->result = r;
+            return;
+        }
+        memcpy(readparams->buffer, stored_value, stored_value_size);
+        readparams->result = 0;
+    }
+    else if (stored_value_is_lz4(db)) {
+        struct stored_value_header header;
+        if (stored_value_header_read(stored_value, stored_value_size, stored_value_size, &header) < 0) {
+            readparams->result = -2;
+            return;
+        }
+        r = read_value_into_reserve(readparams, header.value_size);
+        if (r < 0) {
+            readparams->result = r;
+            return;
+        }
+        if (stored_value_decompress(db, &header, stored_value + header.size, stored_value_size - header.size,
+                                    readparams->buffer, readparams->buffer_size) < 0) {
+            readparams->result = -2;
+            return;
+        }
+        readparams->result = 0;
+    }
+    else {
+        KVDBAssert(0);
+    }
 }
 
-int kvdb_enumerate_keys(kvdb * db, kvdb_enumerate_callback callback, void * cb_data)
+static void read_value_into_callback(kvdb * db, struct find_key_cb_params * params,
+                                     void * data)
 {
-    struct kvdb_table * table = db->kv_first_table;
-	struct kvdb_enumerate_cb_params cb_params;
-	int stop = 0;
-	
-    // Run through all tables.
-    while (table != NULL) {
-		struct kvdb_item * item = table->kv_items;
-		// Run through all buckets.
-		uint64_t count = ntoh64(*table->kv_maxcount);
-		while (count) {
-			uint64_t current_offset = ntoh64(item->kv_offset);
-			// Run through all chained blocks in the bucket.
-			while (current_offset != 0) {
-				char block_header_data[KV_BLOCK_KEY_BYTES_OFFSET + PRE_READ_KEY_SIZE];
-				ssize_t r = pread(db->kv_fd, block_header_data, sizeof(block_header_data), (off_t) current_offset);
-				if (r < 0) {
-					return -2;
-				}
-				char * p = block_header_data;
-				uint64_t next_offset = bytes_to_h64(p);
-				p += 8+4+1; // ignore hash_value and log2_size
-				size_t current_key_size = (size_t) bytes_to_h64(p);
-				p += 8;
-				char * current_key = block_header_data + KV_BLOCK_KEY_BYTES_OFFSET;
-				char * allocated = NULL;
-				if (current_key_size > PRE_READ_KEY_SIZE) {
-					if (current_key_size <= MAX_ALLOCA_SIZE) {
-						current_key = alloca(current_key_size);
-					}
-					else {
-						allocated = malloc(current_key_size);
-						current_key = allocated;
-					}
-					r = pread(db->kv_fd, current_key, current_key_size, (off_t) (current_offset + KV_BLOCK_KEY_BYTES_OFFSET));
-					if (r < 0) {
-						if (allocated != NULL) {
-							free(allocated);
-						}
-						return -2;
-					}
-				}
-				cb_params.key = current_key;
-				cb_params.key_size = current_key_size;
-				callback(db, &cb_params, cb_data, &stop);
-				if (allocated != NULL) {
-					free(allocated);
-				}
-				if (stop) {
-					return 0;
-				}
-                current_offset = next_offset;
-			}
-			item ++;
-			count --;
-		}
-		table = table->kv_next_table;
-	}
-	return 0;
+    struct read_value_into_params * readparams = data;
+    uint64_t value_size_offset = params->current_offset + KV_BLOCK_KEY_BYTES_OFFSET + params->key_size;
+    // size of the stored value, followed by the header of the compressed value.
+    char sizes_data[8 + KV_STORED_VALUE_HEADER_MAX_SIZE];
+    int r;
+    
+    if (params->cell != NULL) {
+        read_cell_value_into(db, params->cell, readparams);
+        return;
+    }
+    
+    ssize_t count;
+    const char * block_sizes_data = found_block_range(params, value_size_offset - params->current_offset, 8);
+    if (block_sizes_data != NULL) {
+        // The header of the compressed value is only available when the value is not empty.
+        count = sizeof(sizes_data);
+        while ((count > 8) && (found_block_range(params, value_size_offset - params->current_offset, count) == NULL)) {
+            count --;
+        }
+        memcpy(sizes_data, block_sizes_data, count);
+    }
+    else {
+        count = pread(db->kv_fd, sizes_data, sizeof(sizes_data), (off_t) value_size_offset);
+    }
+    if (count < 8) {
+        readparams->result = -2;
+        return;
+    }
+    uint64_t stored_value_size = bytes_to_h64(sizes_data);
+    readparams->found = 1;
+    if (stored_value_size > kv_block_capacity(params->size_class)) {
+        // The block is corrupted or it's being changed.
+        readparams->result = -2;
+        return;
+    }
+    
+    if ((db->kv_compression_type == KVDB_COMPRESSION_TYPE_RAW) || (stored_value_size == 0)) {
+        r = read_value_into_reserve(readparams, (size_t) stored_value_size);
+        if (r < 0) {
+            readparams->result = r;
+            return;
+        }
+        const char * stored_value = found_block_range(params, value_size_offset + 8 - params->current_offset, stored_value_size);
+        if (stored_value != NULL) {
+            memcpy(readparams->buffer, stored_value, (size_t) stored_value_size);
+        }
+        else {
+            r = kv_pread(db->kv_fd, readparams->buffer, (size_t) stored_value_size, value_size_offset + 8);
+            if (r < 0) {
+                readparams->result = -2;
+                return;
+            }
+        }
+        readparams->result = 0;
+    }
+    else if (stored_value_is_lz4(db)) {
+        struct stored_value_header header;
+        size_t header_data_size = (size_t) count - 8;
+        if (header_data_size > stored_value_size) {
+            header_data_size = (size_t) stored_value_size;
+        }
+        if (stored_value_header_read(sizes_data + 8, header_data_size, stored_value_size, &header) < 0) {
+            readparams->result = -2;
+            return;
+        }
+        r = read_value_into_reserve(readparams, header.value_size);
+        if (r < 0) {
+            readparams->result = r;
+            return;
+        }
+        size_t compressed_size = (size_t) stored_value_size - header.size;
+        const char * compressed_value = found_block_range(params, value_size_offset + 8 + header.size - params->current_offset,
+                                                          compressed_size);
+        char * allocated = NULL;
+        if (compressed_value == NULL) {
+            char * buffer;
+            if (db->kv_concurrent) {
+                // The scratch buffer can't be shared between readers.
+                allocated = malloc(compressed_size);
+                buffer = allocated;
+            }
+            else {
+                buffer = scratch_buffer(db, compressed_size);
+            }
+            r = kv_pread(db->kv_fd, buffer, compressed_size, value_size_offset + 8 + header.size);
+            if (r < 0) {
+                free(allocated);
+                readparams->result = -2;
+                return;
+            }
+            compressed_value = buffer;
+        }
+        r = stored_value_decompress(db, &header, compressed_value, compressed_size,
+                                    readparams->buffer, readparams->buffer_size);
+        free(allocated);
+        if (r < 0) {
+            readparams->result = -2;
+            return;
+        }
+        readparams->result = 0;
+    }
+    else {
+        KVDBAssert(0);
+    }
+}
+
+// looks up a key and decodes its value into the buffer of the parameters.
+// Returns -1 if the key is not found, -2 if there's a I/O error, -3 if the buffer is too small.
+static int internal_kvdb_get_into(kvdb * db, const char * key, size_t key_size,
+                                  struct read_value_into_params * data)
+{
+    int r;
+    
+    struct kv_reader_slot * slot = kv_reader_enter(db);
+    do {
+        // An allocated buffer is kept when the lookup is done again.
+        data->value_size = 0;
+        data->result = -1;
+        data->found = 0;
+        
+        r = find_key(db, key, key_size, 1, read_value_into_callback, data);
+    } while (r == 1);
+    kv_reader_leave(slot);
+    if (r < 0) {
+        return -2;
+    }
+    if (!data->found) {
+        return -1;
+    }
+    return data->result;
+}
+
+int kvdb_get_into(kvdb * db, const char * key, size_t key_size,
+                  char * buffer, size_t buffer_size, size_t * p_value_size)
+{
+    struct read_value_into_params data;
+    data.buffer = buffer;
+    data.buffer_size = buffer_size;
+    data.allocate = 0;
+    int r = internal_kvdb_get_into(db, key, key_size, &data);
+    if ((r == 0) || (r == -3)) {
+        * p_value_size = data.value_size;
+    }
+    return r;
+}
+
+static int kvdb_get2(kvdb * db, const char * key, size_t key_size,
+                     char ** p_value, size_t * p_value_size, size_t * p_free_size)
+{
+    if (db->kv_compression_type == KVDB_COMPRESSION_TYPE_RAW) {
+        return internal_kvdb_get2(db, key, key_size, p_value, p_value_size, p_free_size);
+    }
+    else if (stored_value_is_lz4(db)) {
+        // The value is decompressed from the block that has been read or from the scratch buffer: the only
+        // allocation is the buffer returned to the caller, sized by the checked header of the stored value.
+        struct read_value_into_params data;
+        data.buffer = NULL;
+        data.buffer_size = 0;
+        data.allocate = 1;
+        int r = internal_kvdb_get_into(db, key, key_size, &data);
+        if (r < 0) {
+            free(data.buffer);
+            return r;
+        }
+        * p_value = data.buffer;
+        * p_value_size = data.value_size;
+        if (p_free_size != NULL) {
+            * p_free_size = 0;
+        }
+        return 0;
+    }
+    else {
+        KVDBAssert(0);
+        return 0;
+    }
+}
+
+struct ref_value_params {
+    const char * value;
+    uint64_t value_size;
+    int result;
+    int found;
+    // buffer where the value is decompressed, kept by the database if it's returned.
+    char * buffer;
+    size_t buffer_size;
+};
+
+// sets the value of the parameters from the stored value, decompressing it in the buffer of the parameters when
+// needed.
+static void ref_value_decode(kvdb * db, struct ref_value_params * refparams,
+                             const char * stored_value, uint64_t stored_value_size)
+{
+    if ((db->kv_compression_type == KVDB_COMPRESSION_TYPE_RAW) || (stored_value_size == 0)) {
+        refparams->value = stored_value;
+        refparams->value_size = stored_value_size;
+        refparams->result = 0;
+        refparams->found = 1;
+    }
+    else if (stored_value_is_lz4(db)) {
+        struct stored_value_header header;
+        if (stored_value_header_read(stored_value, (size_t) stored_value_size, stored_value_size, &header) < 0) {
+            refparams->result = -2;
+            return;
+        }
+        if (header.raw) {
+            // The value points to the mapping of the file as for a raw database.
+            refparams->value = stored_value + header.size;
+            refparams->value_size = header.value_size;
+            refparams->result = 0;
+            refparams->found = 1;
+            return;
+        }
+        size_t value_size = header.value_size;
+        if (value_size > refparams->buffer_size) {
+            char * buffer = realloc(refparams->buffer, value_size);
+            if (buffer == NULL) {
+                refparams->result = -2;
+                return;
+            }
+            refparams->buffer = buffer;
+            refparams->buffer_size = value_size;
+        }
+        if (stored_value_decompress(db, &header, stored_value + header.size, (size_t) stored_value_size - header.size,
+                                    refparams->buffer, value_size) < 0) {
+            refparams->result = -2;
+            return;
+        }
+        refparams->value = refparams->buffer;
+        refparams->value_size = value_size;
+        refparams->result = 0;
+        refparams->found = 1;
+    }
+    else {
+        KVDBAssert(0);
+    }
+}
+
+// the value is decoded here so that the lookup checks that the block has not been changed meanwhile.
+static void ref_value_callback(kvdb * db, struct find_key_cb_params * params,
+                               void * data)
+{
+    struct ref_value_params * refparams = data;
+    uint64_t value_size_offset = params->current_offset + KV_BLOCK_KEY_BYTES_OFFSET + params->key_size;
+    
+    if (params->cell != NULL) {
+        uint64_t value_size = kv_bucket_cell_value_size(params->cell);
+        if (!kv_bucket_cell_fits(params->key_size, (size_t) value_size)) {
+            // The cell is being changed.
+            refparams->result = -2;
+            return;
+        }
+        ref_value_decode(db, refparams, kv_bucket_cell_value(params->cell), value_size);
+        return;
+    }
+    
+    const char * p = kv_data_mapping_get(db, value_size_offset, 8);
+    if (p == NULL) {
+        refparams->result = -2;
+        return;
+    }
+    uint64_t value_size = bytes_to_h64((char *) p);
+    // The size might be corrupted or being changed.
+    if (value_size + params->key_size > kv_block_capacity(params->size_class)) {
+        refparams->result = -2;
+        return;
+    }
+    const char * value = kv_data_mapping_get(db, value_size_offset + 8, value_size);
+    if (value == NULL) {
+        refparams->result = -2;
+        return;
+    }
+    ref_value_decode(db, refparams, value, value_size);
+}
+
+int kvdb_get_ref(kvdb * db, const char * key, size_t key_size,
+                 const char ** p_value, size_t * p_value_size)
+{
+    // The writers of single keys run at the same time: the lookup checks the counters of the buckets.
+    // The changes that release the mapping of the data wait for the end of the lookup.
+    kv_writer_shared_lock(db);
+    kv_ref_lock(db);
+    int r = internal_kvdb_get_ref(db, key, key_size, p_value, p_value_size);
+    kv_ref_unlock(db);
+    kv_writer_shared_unlock(db);
+    return r;
+}
+
+static int internal_kvdb_get_ref(kvdb * db, const char * key, size_t key_size,
+                                 const char ** p_value, size_t * p_value_size)
+{
+    int r;
+    struct ref_value_params data;
+    
+    // Make sure the whole file is mapped so that the lookup doesn't need any read.
+    if (kv_data_mapping_get(db, 0, ntoh64(* db->kv_filesize)) == NULL) {
+        return -2;
+    }
+    
+    // The buffer is reused when the key has been changed during the lookup.
+    data.buffer = NULL;
+    data.buffer_size = 0;
+    do {
+        data.value = NULL;
+        data.value_size = 0;
+        data.result = -1;
+        data.found = 0;
+        
+        r = find_key(db, key, key_size, 1, ref_value_callback, &data);
+    } while (r == 1);
+    if ((r < 0) || (data.result < 0) || !data.found || (data.value != data.buffer)) {
+        free(data.buffer);
+        data.buffer = NULL;
+    }
+    if (r < 0) {
+        return -2;
+    }
+    if (data.result < 0) {
+        return data.result;
+    }
+    if (!data.found) {
+        return -1;
+    }
+    if ((data.buffer != NULL) && (ref_buffers_add(db, data.buffer) < 0)) {
+        free(data.buffer);
+        return -2;
+    }
+    
+    * p_value = data.value;
+    * p_value_size = (size_t) data.value_size;
+    return 0;
+}
+
+// keeps the buffer of a value returned by kvdb_get_ref() until kvdb_release_refs().
+// Returns -1 if the memory can't be allocated.
+static int ref_buffers_add(kvdb * db, char * buffer)
+{
+    char ** buffers = realloc(db->kv_ref_buffers, (db->kv_ref_buffers_count + 1) * sizeof(* buffers));
+    if (buffers == NULL) {
+        return -1;
+    }
+    db->kv_ref_buffers = buffers;
+    db->kv_ref_buffers[db->kv_ref_buffers_count] = buffer;
+    db->kv_ref_buffers_count ++;
+    return 0;
+}
+
+static void ref_buffers_release(kvdb * db)
+{
+    for(unsigned int i = 0 ; i < db->kv_ref_buffers_count ; i ++) {
+        free(db->kv_ref_buffers[i]);
+    }
+    free(db->kv_ref_buffers);
+    db->kv_ref_buffers = NULL;
+    db->kv_ref_buffers_count = 0;
+}
+
+void kvdb_release_refs(kvdb * db)
+{
+    kv_writer_lock(db);
+    kv_data_mapping_release_unused(db);
+    ref_buffers_release(db);
+    kv_writer_unlock(db);
+}
+
+static int internal_kvdb_get2(kvdb * db, const char * key, size_t key_size,
+              char ** p_value, size_t * p_value_size, size_t * p_free_size)
+{
+    int r;
+    struct read_value_params data;
+    
+    struct kv_reader_slot * slot = kv_reader_enter(db);
+    do {
+        data.value_size = 0;
+        data.value = NULL;
+        data.result = -1;
+        data.found = 0;
+        data.free_size = 0;
+        
+        r = find_key(db, key, key_size, 1, read_value_callback, &data);
+        if (r == 1) {
+            // The key has been changed during the lookup.
+            free(data.value);
+        }
+    } while (r == 1);
+    kv_reader_leave(slot);
+    if (r < 0) {
+        return -2;
+    }
+    if (data.result < 0) {
+        return data.result;
+    }
+    if (!data.found) {
+        return -1;
+    }
+    
+    if (p_free_size != NULL) {
+        * p_free_size = data.free_size;
+    }
+    
+    * p_value = data.value;
+    * p_value_size = (size_t) data.value_size;
+    
+    return 0;
+}
+
+// state of the lookup of one of the keys of kvdb_mget().
+struct mget_key_state {
+    const char * key;
+    size_t key_size;
+    uint32_t hash_values[KV_BLOOM_FILTER_HASH_COUNT];
+    // counters of the buckets visited, see find_key().
+    struct find_key_seqs seqs;
+    // set when the buckets have been changed during the lookup, the key is then looked up again on its own.
+    int changed;
+    // table and bucket being looked up.
+    struct kvdb_table * table;
+    struct kvdb_item * item;
+    // next block of the chain to read, 0 if the lookup is finished.
+    uint64_t offset;
+    // position of this block in the chain.
+    unsigned int position;
+    // offset of the block of the key, 0 if it's not found.
+    uint64_t found_offset;
+    // cell of the key when it's stored in the table.
+    char * found_cell;
+    int result;
+    struct kv_read_request request;
+    char block_header_data[KV_BLOCK_KEY_BYTES_OFFSET + PRE_READ_KEY_SIZE];
+};
+
+// look for the first table, starting at the given one, that might contain the key.
+static void mget_seek_table(kvdb * db, struct mget_key_state * state, struct kvdb_table * table)
+{
+    while (table != NULL) {
+        if (table_bloom_filter_might_contain(table, state->hash_values + 1, KV_BLOOM_FILTER_HASH_COUNT - 1)) {
+            struct kvdb_item * item = lookup_bucket(db, table, state->hash_values[0]);
+            if (item == NULL) {
+                // The linear hash table is being split.
+                state->changed = 1;
+                break;
+            }
+            find_key_seqs_add(db, &state->seqs, table, item);
+            state->found_cell = kv_bucket_cell_lookup(table, item, state->hash_values[0], state->key, state->key_size);
+            if (state->found_cell != NULL) {
+                // The key is stored in the table: no read is needed.
+                break;
+            }
+            uint64_t previous_offset;
+            state->position = 0;
+            uint64_t offset = kv_bucket_slots_seek(table, item, state->hash_values[0], ntoh64(item->kv_offset),
+                                                   &state->position, &previous_offset);
+            if (offset != 0) {
+                state->table = table;
+                state->item = item;
+                state->offset = offset;
+                return;
+            }
+        }
+        table = lookup_next_table(db, table);
+    }
+    state->table = NULL;
+    state->offset = 0;
+}
+
+// go to the next block of the chain that might be the one of the key.
+static void mget_next_block(struct mget_key_state * state, uint64_t next_offset)
+{
+    uint64_t previous_offset;
+    state->position ++;
+    state->offset = kv_bucket_slots_seek(state->table, state->item, state->hash_values[0], next_offset,
+                                         &state->position, &previous_offset);
+}
+
+// check whether the block that has just been read is the one of the key.
+// Returns 1 if it matches, 0 if it doesn't, -1 if there's an I/O error.
+static int mget_check_block(kvdb * db, struct mget_key_state * state)
+{
+    if (state->request.result < KV_BLOCK_KEY_BYTES_OFFSET) {
+        return -1;
+    }
+    char * p = state->block_header_data;
+    uint64_t next_offset = bytes_to_h64(p);
+    p += 8;
+    uint32_t current_hash_value = bytes_to_h32(p);
+    p += 4 + 1; // ignore size_class
+    uint64_t current_key_size = bytes_to_h64(p);
+    
+    if ((current_hash_value != state->hash_values[0]) || (current_key_size != state->key_size)) {
+        mget_next_block(state, next_offset);
+        return 0;
+    }
+    
+    int cmp_result;
+    if (current_key_size > PRE_READ_KEY_SIZE) {
+        char * current_key = malloc((size_t) current_key_size);
+        if (current_key == NULL) {
+            return -1;
+        }
+        ssize_t r = pread(db->kv_fd, current_key, (size_t) current_key_size,
+                          (off_t) (state->offset + KV_BLOCK_KEY_BYTES_OFFSET));
+        if (r != (ssize_t) current_key_size) {
+            free(current_key);
+            return -1;
+        }
+        cmp_result = memcmp(state->key, current_key, state->key_size);
+        free(current_key);
+    }
+    else {
+        if ((size_t) state->request.result < KV_BLOCK_KEY_BYTES_OFFSET + current_key_size) {
+            return -1;
+        }
+        cmp_result = memcmp(state->key, state->block_header_data + KV_BLOCK_KEY_BYTES_OFFSET, state->key_size);
+    }
+    if (cmp_result != 0) {
+        mget_next_block(state, next_offset);
+        return 0;
+    }
+    
+    return 1;
+}
+
+static int internal_kvdb_mget(kvdb * db, const char ** keys, const size_t * key_sizes, unsigned int count,
+                              char ** values, size_t * value_sizes, int * results)
+{
+    int has_error = 0;
+    
+    if (count == 0) {
+        return 0;
+    }
+    
+    struct mget_key_state * states = malloc(count * sizeof(* states));
+    struct kv_read_request ** requests = malloc(count * sizeof(* requests));
+    if ((states == NULL) || (requests == NULL)) {
+        free(states);
+        free(requests);
+        for(unsigned int i = 0 ; i < count ; i ++) {
+            values[i] = NULL;
+            value_sizes[i] = 0;
+            results[i] = -2;
+        }
+        return -2;
+    }
+    
+    // Compute all the hashes and check the bloom filters before doing any I/O.
+    for(unsigned int i = 0 ; i < count ; i ++) {
+        struct mget_key_state * state = &states[i];
+        state->key = keys[i];
+        state->key_size = key_sizes[i];
+        state->changed = 0;
+        state->found_offset = 0;
+        state->found_cell = NULL;
+        state->result = -1;
+        state->request.result = 0;
+        find_key_seqs_init(db, &state->seqs, 1);
+        table_bloom_filter_compute_hash(db, state->hash_values, KV_BLOOM_FILTER_HASH_COUNT, state->key, state->key_size);
+        mget_seek_table(db, state, lookup_first_table(db, state->hash_values[0]));
+    }
+    
+    // Walk all the chains together: each round reads the next block of each pending lookup.
+    while (1) {
+        unsigned int request_count = 0;
+        for(unsigned int i = 0 ; i < count ; i ++) {
+            struct mget_key_state * state = &states[i];
+            if (state->offset == 0) {
+                continue;
+            }
+            state->request.offset = state->offset;
+            state->request.data = state->block_header_data;
+            state->request.size = sizeof(state->block_header_data);
+            requests[request_count] = &state->request;
+            request_count ++;
+        }
+        if (request_count == 0) {
+            break;
+        }
+        
+        kv_read_many(db, requests, request_count);
+        
+        for(unsigned int i = 0 ; i < count ; i ++) {
+            struct mget_key_state * state = &states[i];
+            if (state->offset == 0) {
+                continue;
+            }
+            // The chain might be read while it's changed: don't follow it further.
+            if (find_key_seqs_changed(db, &state->seqs)) {
+                state->changed = 1;
+                state->offset = 0;
+                continue;
+            }
+            int r = mget_check_block(db, state);
+            if (r < 0) {
+                state->result = -2;
+                state->offset = 0;
+            }
+            else if (r == 1) {
+                state->found_offset = state->offset;
+                state->offset = 0;
+            }
+            else if (state->offset == 0) {
+                // End of the chain: try the next tables.
+                mget_seek_table(db, state, lookup_next_table(db, state->table));
+            }
+        }
+    }
+    
+    // Read all the values.
+    unsigned int request_count = 0;
+    for(unsigned int i = 0 ; i < count ; i ++) {
+        struct mget_key_state * state = &states[i];
+        if ((state->found_offset == 0) || state->changed) {
+            continue;
+        }
+        uint64_t value_size;
+        size_t value_size_position = KV_BLOCK_KEY_BYTES_OFFSET + state->key_size;
+        if ((size_t) state->request.result >= value_size_position + 8) {
+            value_size = bytes_to_h64(state->block_header_data + value_size_position);
+        }
+        else {
+            ssize_t r = pread(db->kv_fd, &value_size, sizeof(value_size),
+                              (off_t) (state->found_offset + value_size_position));
+            if (r < (ssize_t) sizeof(value_size)) {
+                state->result = -2;
+                continue;
+            }
+            value_size = ntoh64(value_size);
+        }
+        uint8_t size_class = bytes_to_h8(state->block_header_data + KV_BLOCK_SIZE_CLASS_OFFSET);
+        if (value_size > kv_block_capacity(size_class)) {
+            // The block is corrupted or being changed.
+            state->result = -2;
+            continue;
+        }
+        state->request.offset = state->found_offset + value_size_position + 8;
+        state->request.size = (size_t) value_size;
+        state->request.data = malloc((size_t) value_size);
+        if ((state->request.data == NULL) && (value_size != 0)) {
+            state->result = -2;
+            continue;
+        }
+        requests[request_count] = &state->request;
+        request_count ++;
+    }
+    kv_read_many(db, requests, request_count);
+    
+    // Decompress the values.
+    for(unsigned int i = 0 ; i < count ; i ++) {
+        struct mget_key_state * state = &states[i];
+        values[i] = NULL;
+        value_sizes[i] = 0;
+        char * stored_value = NULL;
+        size_t stored_value_size = 0;
+        int cell_fits = 1;
+        if (state->found_cell != NULL) {
+            // The size might be corrupted or being changed.
+            cell_fits = kv_bucket_cell_fits(kv_bucket_cell_key_size(state->found_cell),
+                                            kv_bucket_cell_value_size(state->found_cell));
+            if (cell_fits) {
+                stored_value_size = kv_bucket_cell_value_size(state->found_cell);
+                stored_value = malloc(stored_value_size);
+                if (stored_value != NULL) {
+                    memcpy(stored_value, kv_bucket_cell_value(state->found_cell), stored_value_size);
+                }
+            }
+        }
+        else if ((state->found_offset != 0) && !state->changed && (state->result != -2)) {
+            stored_value = state->request.data;
+            stored_value_size = state->request.size;
+            if (state->request.result != (ssize_t) stored_value_size) {
+                free(stored_value);
+                stored_value = NULL;
+            }
+        }
+        
+        if (state->changed || find_key_seqs_changed(db, &state->seqs)) {
+            // The values that have been read might be incomplete.
+            free(stored_value);
+            state->result = kvdb_get2(db, state->key, state->key_size, &values[i], &value_sizes[i], NULL);
+        }
+        else if ((state->found_cell != NULL) || ((state->found_offset != 0) && (state->result != -2))) {
+            state->result = -2;
+            if (cell_fits && ((stored_value != NULL) || (stored_value_size == 0))) {
+                int r = stored_value_decode(db, stored_value, stored_value_size, &values[i], &value_sizes[i]);
+                state->result = r < 0 ? -2 : 0;
+            }
+        }
+        if (state->result == -2) {
+            has_error = 1;
+        }
+        results[i] = state->result;
+    }
+    
+    free(requests);
+    free(states);
+    
+    return has_error ? -2 : 0;
+}
+
+// the lookups don't use any lock, as kvdb_get(): the keys whose buckets are changed meanwhile are looked up
+// again one at a time.
+int kvdb_mget(kvdb * db, const char ** keys, const size_t * key_sizes, unsigned int count,
+              char ** values, size_t * value_sizes, int * results)
+{
+    if (db->kv_concurrent && kv_tables_stale(db)) {
+        // Another process has added or removed tables.
+        kv_tables_refresh(db);
+    }
+    struct kv_reader_slot * slot = kv_reader_enter(db);
+    int r = internal_kvdb_mget(db, keys, key_sizes, count, values, value_sizes, results);
+    kv_reader_leave(slot);
+    return r;
+}
+
+// keys of a bucket collected by kvdb_enumerate_keys(), each key is stored after its size.
+struct enumerate_bucket_keys {
+    char * data;
+    size_t size;
+    size_t capacity;
+};
+
+static void enumerate_bucket_keys_add(struct enumerate_bucket_keys * keys, const char * key, size_t key_size)
+{
+    size_t needed = keys->size + sizeof(size_t) + key_size;
+    if (needed > keys->capacity) {
+        keys->capacity = needed * 2;
+        keys->data = realloc(keys->data, keys->capacity);
+    }
+    memcpy(keys->data + keys->size, &key_size, sizeof(size_t));
+    memcpy(keys->data + keys->size + sizeof(size_t), key, key_size);
+    keys->size = needed;
+}
+
+// collects the keys of a bucket.
+// Returns 1 if the bucket has been changed while reading it, -2 if there's a I/O error.
+static int enumerate_bucket(kvdb * db, struct kvdb_table * table, struct kvdb_item * item,
+                            struct enumerate_bucket_keys * keys)
+{
+    struct find_key_seqs seqs;
+    find_key_seqs_init(db, &seqs, 1);
+    find_key_seqs_add(db, &seqs, table, item);
+    
+    keys->size = 0;
+    char * cells = kv_table_bucket_cells(table, item);
+    for(unsigned int i = 0 ; (cells != NULL) && (i < KV_BUCKET_CELL_COUNT) ; i ++) {
+        char * cell = cells + i * KV_BUCKET_CELL_SIZE;
+        if ((cell[KV_BUCKET_CELL_FLAGS_OFFSET] & KV_BUCKET_CELL_FLAG_USED) == 0) {
+            continue;
+        }
+        if (!kv_bucket_cell_fits(kv_bucket_cell_key_size(cell), kv_bucket_cell_value_size(cell))) {
+            return find_key_seqs_changed(db, &seqs) ? 1 : -2;
+        }
+        enumerate_bucket_keys_add(keys, kv_bucket_cell_key(cell), kv_bucket_cell_key_size(cell));
+    }
+    
+    uint64_t current_offset = ntoh64(item->kv_offset);
+    // Run through all chained blocks in the bucket.
+    while (current_offset != 0) {
+        if (find_key_seqs_changed(db, &seqs)) {
+            return 1;
+        }
+        char block_header_data[KV_BLOCK_KEY_BYTES_OFFSET + PRE_READ_KEY_SIZE];
+        ssize_t r = pread(db->kv_fd, block_header_data, sizeof(block_header_data), (off_t) current_offset);
+        if (r < KV_BLOCK_KEY_BYTES_OFFSET) {
+            return find_key_seqs_changed(db, &seqs) ? 1 : -2;
+        }
+        char * p = block_header_data;
+        uint64_t next_offset = bytes_to_h64(p);
+        p += 8 + 4; // ignore hash_value
+        uint8_t size_class = bytes_to_h8(p);
+        p += 1;
+        uint64_t current_key_size = bytes_to_h64(p);
+        p += 8;
+        if ((kv_block_capacity(size_class) == 0) || (current_key_size > kv_block_capacity(size_class))) {
+            // The block is corrupted or it's being changed.
+            return find_key_seqs_changed(db, &seqs) ? 1 : -2;
+        }
+        char * current_key = block_header_data + KV_BLOCK_KEY_BYTES_OFFSET;
+        char * allocated = NULL;
+        if (current_key_size > PRE_READ_KEY_SIZE) {
+            allocated = malloc((size_t) current_key_size);
+            current_key = allocated;
+            r = pread(db->kv_fd, current_key, (size_t) current_key_size, (off_t) (current_offset + KV_BLOCK_KEY_BYTES_OFFSET));
+            if (r < 0) {
+                free(allocated);
+                return find_key_seqs_changed(db, &seqs) ? 1 : -2;
+            }
+        }
+        enumerate_bucket_keys_add(keys, current_key, (size_t) current_key_size);
+        free(allocated);
+        current_offset = next_offset;
+    }
+    
+    return find_key_seqs_changed(db, &seqs);
+}
+
+int kvdb_enumerate_keys(kvdb * db, kvdb_enumerate_callback callback, void * cb_data)
+{
+    struct kvdb_enumerate_cb_params cb_params;
+    struct enumerate_bucket_keys keys = { NULL, 0, 0 };
+    int stop = 0;
+    int result = 0;
+    
+    // The keys of each bucket are collected before calling the callback: a concurrent reader can't
+    // call it with a key read while the bucket is changed. Items don't move between buckets during the enumeration.
+    struct kv_reader_slot * slot = kv_reader_enter(db);
+    kv_structure_read_lock(db);
+    while (kv_tables_stale(db)) {
+        // Another process has changed the tables: they're mapped again without the lock, which is taken after
+        // the writer lock.
+        kv_structure_read_unlock(db);
+        kv_tables_refresh(db);
+        kv_structure_read_lock(db);
+    }
+    
+    // Run through all tables.
+    struct kvdb_table * table = db->kv_first_table;
+    while ((table != NULL) && !stop) {
+        // Run through all buckets.
+        uint64_t count = ntoh64(* table->kv_maxcount);
+        for(uint64_t idx = 0 ; (idx < count) && !stop ; idx ++) {
+            struct kvdb_item * item = &table->kv_items[idx];
+            int r;
+            do {
+                r = enumerate_bucket(db, table, item, &keys);
+            } while (r == 1);
+            if (r < 0) {
+                result = -2;
+                stop = 1;
+                break;
+            }
+            
+            size_t position = 0;
+            while ((position < keys.size) && !stop) {
+                memcpy(&cb_params.key_size, keys.data + position, sizeof(size_t));
+                cb_params.key = keys.data + position + sizeof(size_t);
+                position += sizeof(size_t) + cb_params.key_size;
+                callback(db, &cb_params, cb_data, &stop);
+            }
+        }
+        table = table->kv_next_table;
+    }
+    
+    kv_structure_read_unlock(db);
+    kv_reader_leave(slot);
+    free(keys.data);
+    return result;
+}
+
+int kvdb_consolidate(kvdb * db, unsigned int budget)
+{
+    kv_writer_lock(db);
+    int r = kv_tables_consolidate(db, budget);
+    kv_writer_unlock(db);
+    if (r < 0) {
+        return -2;
+    }
+    return r;
+}
+
+int kvdb_release_free_space(kvdb * db, uint64_t * p_released)
+{
+    kv_writer_lock(db);
+    uint64_t filesize = ntoh64(* db->kv_filesize);
+    int r = kv_block_coalesce(db, kv_tables_mapped_end(db), p_released);
+    if (ntoh64(* db->kv_filesize) < filesize) {
+        // The mapping of the file might cover the part that has been removed.
+        kv_data_mapping_unsetup(db);
+    }
+    kv_writer_unlock(db);
+    if (r < 0) {
+        return -2;
+    }
+    return 0;
+}
+
+int kvdb_vacuum(kvdb * db, uint64_t io_budget, uint64_t * p_reclaimed)
+{
+    kv_writer_lock(db);
+    uint64_t filesize = ntoh64(* db->kv_filesize);
+    uint64_t disk_usage = kv_block_disk_usage(db);
+    int r = kv_vacuum(db, io_budget);
+    if (ntoh64(* db->kv_filesize) < filesize) {
+        // The mapping of the file might cover the part that has been removed.
+        kv_data_mapping_unsetup(db);
+    }
+    if (p_reclaimed != NULL) {
+        uint64_t current_disk_usage = kv_block_disk_usage(db);
+        * p_reclaimed = disk_usage > current_disk_usage ? disk_usage - current_disk_usage : 0;
+    }
+    kv_writer_unlock(db);
+    if (r < 0) {
+        return -2;
+    }
+    return r;
+}
+
+// location of a key of the database being compacted.
+struct compact_entry {
+    // bucket of the key in the compacted database.
+    uint64_t bucket;
+    // offset of the block of the key, 0 if it's stored in a cell.
+    uint64_t offset;
+    char * cell;
+    uint8_t size_class;
+};
+
+struct compact_entries {
+    struct compact_entry * entries;
+    size_t count;
+    size_t capacity;
+};
+
+// Returns -1 if the memory can't be allocated.
+static int compact_entries_add(struct compact_entries * entries, uint64_t bucket, uint64_t offset,
+                               char * cell, uint8_t size_class)
+{
+    if (entries->count == entries->capacity) {
+        size_t capacity = entries->capacity == 0 ? 1024 : entries->capacity * 2;
+        struct compact_entry * reallocated = realloc(entries->entries, capacity * sizeof(* reallocated));
+        if (reallocated == NULL) {
+            return -1;
+        }
+        entries->entries = reallocated;
+        entries->capacity = capacity;
+    }
+    struct compact_entry * entry = &entries->entries[entries->count];
+    entry->bucket = bucket;
+    entry->offset = offset;
+    entry->cell = cell;
+    entry->size_class = size_class;
+    entries->count ++;
+    return 0;
+}
+
+static int compare_compact_entry(const void * a, const void * b)
+{
+    const struct compact_entry * entry_a = a;
+    const struct compact_entry * entry_b = b;
+    if (entry_a->bucket != entry_b->bucket) {
+        return entry_a->bucket < entry_b->bucket ? -1 : 1;
+    }
+    if (entry_a->offset != entry_b->offset) {
+        return entry_a->offset < entry_b->offset ? -1 : 1;
+    }
+    return 0;
+}
+
+// returns the number of keys of the database.
+static uint64_t compact_key_count(kvdb * db)
+{
+    if (db->kv_storage_type == KVDB_STORAGE_TYPE_LINEAR_HASHING) {
+        return ntoh64(* db->kv_first_table->kv_count);
+    }
+    uint64_t count = 0;
+    struct kvdb_table * table = db->kv_first_table;
+    while (table != NULL) {
+        count += ntoh64(* table->kv_count);
+        table = table->kv_next_table;
+    }
+    return count;
+}
+
+// returns the bucket of the key with the given hash value in the compacted database.
+static uint64_t compact_bucket(kvdb * destination, uint32_t hash_value)
+{
+    struct kvdb_table * table = destination->kv_first_table;
+    return lookup_bucket(destination, table, hash_value) - table->kv_items;
+}
+
+// returns the bucket of the given key in the compacted database.
+// hash_value is the one stored with the key, the key is hashed again when the compacted database uses
+// another hash function.
+static uint64_t compact_key_bucket(kvdb * db, kvdb * destination, uint32_t hash_value,
+                                   const char * key, size_t key_size)
+{
+    if (destination->kv_hash_function != db->kv_hash_function) {
+        uint32_t hash_values[KV_BLOOM_FILTER_HASH_COUNT];
+        table_bloom_filter_compute_hash(destination, hash_values, KV_BLOOM_FILTER_HASH_COUNT, key, key_size);
+        hash_value = hash_values[0];
+    }
+    return compact_bucket(destination, hash_value);
+}
+
+// returns the bucket of the key of the given block in the compacted database.
+// Returns -1 if there's an error.
+static int compact_block_bucket(kvdb * db, kvdb * destination, uint64_t offset, char * header,
+                                uint8_t size_class, uint64_t * p_bucket)
+{
+    uint32_t hash_value = bytes_to_h32(header + KV_BLOCK_HASH_VALUE_OFFSET);
+    if (destination->kv_hash_function == db->kv_hash_function) {
+        * p_bucket = compact_bucket(destination, hash_value);
+        return 0;
+    }
+    
+    uint64_t key_size = bytes_to_h64(header + KV_BLOCK_KEY_SIZE_OFFSET);
+    if (key_size > kv_block_capacity(size_class)) {
+        // The block is corrupted.
+        return -1;
+    }
+    char * key = malloc((size_t) key_size + 1);
+    if (key == NULL) {
+        return -1;
+    }
+    int r = kv_pread(db->kv_fd, key, (size_t) key_size, offset + KV_BLOCK_KEY_BYTES_OFFSET);
+    if (r < 0) {
+        free(key);
+        return -1;
+    }
+    * p_bucket = compact_key_bucket(db, destination, hash_value, key, (size_t) key_size);
+    free(key);
+    return 0;
+}
+
+// collects the location of all the keys of the database.
+// Returns -1 if there's an error.
+static int compact_collect(kvdb * db, kvdb * destination, struct compact_entries * entries)
+{
+    struct kvdb_table * table = db->kv_first_table;
+    while (table != NULL) {
+        uint64_t count = ntoh64(* table->kv_maxcount);
+        for(uint64_t idx = 0 ; idx < count ; idx ++) {
+            struct kvdb_item * item = &table->kv_items[idx];
+            char * cells = kv_table_bucket_cells(table, item);
+            for(unsigned int i = 0 ; (cells != NULL) && (i < KV_BUCKET_CELL_COUNT) ; i ++) {
+                char * cell = cells + i * KV_BUCKET_CELL_SIZE;
+                if ((cell[KV_BUCKET_CELL_FLAGS_OFFSET] & KV_BUCKET_CELL_FLAG_USED) == 0) {
+                    continue;
+                }
+                uint64_t bucket = compact_key_bucket(db, destination, kv_bucket_cell_hash_value(cell),
+                                                     kv_bucket_cell_key(cell), kv_bucket_cell_key_size(cell));
+                if (compact_entries_add(entries, bucket, 0, cell, 0) < 0) {
+                    return -1;
+                }
+            }
+            
+            uint64_t offset = ntoh64(item->kv_offset);
+            while (offset != 0) {
+                char header[KV_BLOCK_KEY_BYTES_OFFSET];
+                int r = kv_pread(db->kv_fd, header, sizeof(header), offset);
+                if (r < 0) {
+                    return -1;
+                }
+                uint8_t size_class = bytes_to_h8(header + KV_BLOCK_SIZE_CLASS_OFFSET);
+                if (kv_block_capacity(size_class) == 0) {
+                    // The block is corrupted.
+                    return -1;
+                }
+                uint64_t bucket;
+                if (compact_block_bucket(db, destination, offset, header, size_class, &bucket) < 0) {
+                    return -1;
+                }
+                if (compact_entries_add(entries, bucket, offset, NULL, size_class) < 0) {
+                    return -1;
+                }
+                offset = bytes_to_h64(header + KV_BLOCK_NEXT_OFFSET_OFFSET);
+            }
+        }
+        table = table->kv_next_table;
+    }
+    return 0;
+}
+
+// copies a key and its stored value to the compacted database.
+// buffer is used to read the block, it's grown when needed.
+// Returns -1 if there's an error.
+static int compact_copy(kvdb * db, kvdb * destination, struct compact_entry * entry,
+                        char ** p_buffer, size_t * p_buffer_size)
+{
+    if (entry->offset == 0) {
+        char * cell = entry->cell;
+        return internal_kvdb_insert(destination, kv_bucket_cell_key(cell), kv_bucket_cell_key_size(cell),
+                                    kv_bucket_cell_value(cell), kv_bucket_cell_value_size(cell));
+    }
+    
+    size_t disk_size = (size_t) kv_block_disk_size(entry->size_class);
+    if (* p_buffer_size < disk_size) {
+        char * buffer = realloc(* p_buffer, disk_size);
+        if (buffer == NULL) {
+            return -1;
+        }
+        * p_buffer = buffer;
+        * p_buffer_size = disk_size;
+    }
+    char * buffer = * p_buffer;
+    // The padding at the end of the last block of the file might not have been written.
+    ssize_t count = pread(db->kv_fd, buffer, disk_size, (off_t) entry->offset);
+    if (count < KV_BLOCK_KEY_BYTES_OFFSET) {
+        return -1;
+    }
+    uint64_t key_size = bytes_to_h64(buffer + KV_BLOCK_KEY_SIZE_OFFSET);
+    if (KV_BLOCK_KEY_BYTES_OFFSET + key_size + 8 > (uint64_t) count) {
+        return -1;
+    }
+    char * key = buffer + KV_BLOCK_KEY_BYTES_OFFSET;
+    uint64_t value_size = bytes_to_h64(key + key_size);
+    if (KV_BLOCK_KEY_BYTES_OFFSET + key_size + 8 + value_size > (uint64_t) count) {
+        return -1;
+    }
+    // The keys of the database are unique: there's no previous value to look for.
+    return internal_kvdb_insert(destination, key, (size_t) key_size, key + key_size + 8, (size_t) value_size);
+}
+
+// suffix of the temporary file where a database is compacted before it replaces the destination file.
+#define KV_COMPACT_FILENAME_SUFFIX ".compact-XXXXXX"
+
+// compacts the database to a new temporary file next to filename.
+// p_temporary_filename is set to the name of the file, it should be released with free().
+// Returns -2 if there's an I/O error, the temporary file is then removed.
+static int compact_to_temporary(kvdb * db, const char * filename, char ** p_temporary_filename)
+{
+    size_t temporary_filename_size = strlen(filename) + sizeof(KV_COMPACT_FILENAME_SUFFIX);
+    char * temporary_filename = malloc(temporary_filename_size);
+    snprintf(temporary_filename, temporary_filename_size, "%s%s", filename, KV_COMPACT_FILENAME_SUFFIX);
+    // The file is created empty here: an existing file would be opened and its keys merged with the ones
+    // of the database.
+    int fd = mkstemp(temporary_filename);
+    if (fd < 0) {
+        free(temporary_filename);
+        return -2;
+    }
+    close(fd);
+    kvdb * destination = kvdb_new(temporary_filename);
+    // The stored values are copied without being decoded.
+    destination->kv_compression_type = db->kv_compression_type;
+    destination->kv_storage_type = db->kv_storage_type;
+    destination->kv_bloom_filter_bits_per_key = db->kv_bloom_filter_bits_per_key;
+    destination->kv_bucket_cell_count = db->kv_bucket_cell_count;
+    
+    kv_writer_lock(db);
+    // A single table with room for the database to grow.
+    kvdb_set_expected_count(destination, compact_key_count(db) * 2);
+    int has_error = 0;
+    struct compact_entries entries = { NULL, 0, 0 };
+    char * buffer = NULL;
+    size_t buffer_size = 0;
+    if (kvdb_open(destination) < 0) {
+        has_error = 1;
+    }
+    // The ids of the dictionaries are consecutive: they keep the same ids in the compacted database.
+    struct kv_dictionary * dictionary;
+    for(unsigned int id = 1 ; !has_error && ((dictionary = kv_dictionary_get(db, id)) != NULL) ; id ++) {
+        if (kv_dictionary_add(destination, dictionary->kv_data, dictionary->kv_size) < 0) {
+            has_error = 1;
+        }
+    }
+    if (!has_error && (compact_collect(db, destination, &entries) < 0)) {
+        has_error = 1;
+    }
+    if (!has_error) {
+        // The blocks are written in the order of the buckets: a lookup reads its chain at one place of the file.
+        qsort(entries.entries, entries.count, sizeof(* entries.entries), compare_compact_entry);
+        for(size_t i = 0 ; i < entries.count ; i ++) {
+            if (compact_copy(db, destination, &entries.entries[i], &buffer, &buffer_size) < 0) {
+                has_error = 1;
+                break;
+            }
+        }
+    }
+    kv_writer_unlock(db);
+    free(buffer);
+    free(entries.entries);
+    
+    if (!has_error && (fsync(destination->kv_fd) < 0)) {
+        has_error = 1;
+    }
+    kvdb_close(destination);
+    kvdb_free(destination);
+    if (has_error) {
+        unlink(temporary_filename);
+        free(temporary_filename);
+        return -2;
+    }
+    * p_temporary_filename = temporary_filename;
+    return 0;
+}
+
+int kvdb_compact_to(kvdb * db, const char * dest_filename)
+{
+    // Another path, a link for example, might lead to the file of the database.
+    struct stat db_stat;
+    struct stat dest_stat;
+    if (fstat(db->kv_fd, &db_stat) < 0) {
+        return -2;
+    }
+    if ((stat(dest_filename, &dest_stat) == 0) && (dest_stat.st_dev == db_stat.st_dev) &&
+        (dest_stat.st_ino == db_stat.st_ino)) {
+        return -1;
+    }
+    
+    // The destination file is only replaced once the compacted database is complete.
+    char * temporary_filename;
+    int r = compact_to_temporary(db, dest_filename, &temporary_filename);
+    if (r < 0) {
+        return r;
+    }
+    r = rename(temporary_filename, dest_filename);
+    if (r < 0) {
+        unlink(temporary_filename);
+    }
+    free(temporary_filename);
+    if (r < 0) {
+        return -2;
+    }
+    return 0;
+}
+
+int kvdb_compact(kvdb * db)
+{
+    if (db->kv_multi_process) {
+        // The other processes would keep using the previous file.
+        return -1;
+    }
+    
+    char * filename;
+    int r = compact_to_temporary(db, db->kv_filename, &filename);
+    if (r < 0) {
+        return r;
+    }
+    r = rename(filename, db->kv_filename);
+    if (r < 0) {
+        unlink(filename);
+        free(filename);
+        return -2;
+    }
+    free(filename);
+    
+    kvdb_close(db);
+    r = kvdb_open(db);
+    if (r < 0) {
+        return -2;
+    }
+    return 0;
+}
+
+// values larger than this are not sampled to build a dictionary.
+#define KV_DICTIONARY_SAMPLE_MAX_SIZE 4096
+
+struct dictionary_sample {
+    char * data;
+    size_t size;
+    size_t capacity;
+};
+
+// appends a stored value to the sample, once decompressed. it's truncated when the sample is full.
+// Returns -1 if the stored value is corrupted.
+static int dictionary_sample_add(kvdb * db, struct dictionary_sample * sample,
+                                 const char * stored_value, size_t stored_value_size)
+{
+    struct stored_value_header header;
+    if (stored_value_size == 0) {
+        return 0;
+    }
+    if (stored_value_header_read(stored_value, stored_value_size, stored_value_size, &header) < 0) {
+        return -1;
+    }
+    if (header.value_size > KV_DICTIONARY_SAMPLE_MAX_SIZE) {
+        return 0;
+    }
+    char value[KV_DICTIONARY_SAMPLE_MAX_SIZE];
+    if (stored_value_decompress(db, &header, stored_value + header.size, stored_value_size - header.size,
+                                value, sizeof(value)) < 0) {
+        return -1;
+    }
+    size_t size = header.value_size;
+    if (size > sample->capacity - sample->size) {
+        size = sample->capacity - sample->size;
+    }
+    memcpy(sample->data + sample->size, value, size);
+    sample->size += size;
+    return 0;
+}
+
+// fills the sample with the values of the database.
+// the keys are spread in the buckets by their hash value: the first buckets are a random sample.
+// Returns -1 if there's an error.
+static int dictionary_sample_collect(kvdb * db, struct dictionary_sample * sample)
+{
+    char block[KV_BLOCK_KEY_BYTES_OFFSET + KV_DICTIONARY_SAMPLE_MAX_SIZE + KV_STORED_VALUE_HEADER_MAX_SIZE];
+    struct kvdb_table * table = db->kv_first_table;
+    while (table != NULL) {
+        uint64_t count = ntoh64(* table->kv_maxcount);
+        for(uint64_t idx = 0 ; idx < count ; idx ++) {
+            if (sample->size == sample->capacity) {
+                return 0;
+            }
+            struct kvdb_item * item = &table->kv_items[idx];
+            char * cells = kv_table_bucket_cells(table, item);
+            for(unsigned int i = 0 ; (cells != NULL) && (i < KV_BUCKET_CELL_COUNT) ; i ++) {
+                char * cell = cells + i * KV_BUCKET_CELL_SIZE;
+                if ((cell[KV_BUCKET_CELL_FLAGS_OFFSET] & KV_BUCKET_CELL_FLAG_USED) == 0) {
+                    continue;
+                }
+                if (dictionary_sample_add(db, sample, kv_bucket_cell_value(cell), kv_bucket_cell_value_size(cell)) < 0) {
+                    return -1;
+                }
+            }
+            
+            uint64_t offset = ntoh64(item->kv_offset);
+            while (offset != 0) {
+                // The padding at the end of the last block of the file might not have been written.
+                ssize_t r = pread(db->kv_fd, block, sizeof(block), (off_t) offset);
+                if (r < KV_BLOCK_KEY_BYTES_OFFSET) {
+                    return -1;
+                }
+                uint64_t key_size = bytes_to_h64(block + KV_BLOCK_KEY_SIZE_OFFSET);
+                if (KV_BLOCK_KEY_BYTES_OFFSET + key_size + 8 <= (uint64_t) r) {
+                    uint64_t value_size = bytes_to_h64(block + KV_BLOCK_KEY_BYTES_OFFSET + key_size);
+                    // Larger values are not read.
+                    if (KV_BLOCK_KEY_BYTES_OFFSET + key_size + 8 + value_size <= (uint64_t) r) {
+                        if (dictionary_sample_add(db, sample, block + KV_BLOCK_KEY_BYTES_OFFSET + key_size + 8,
+                                                  (size_t) value_size) < 0) {
+                            return -1;
+                        }
+                    }
+                }
+                offset = bytes_to_h64(block + KV_BLOCK_NEXT_OFFSET_OFFSET);
+            }
+        }
+        table = table->kv_next_table;
+    }
+    return 0;
+}
+
+int kvdb_train_dictionary(kvdb * db, size_t dictionary_size)
+{
+    if ((db->kv_compression_type != KVDB_COMPRESSION_TYPE_LZ4_DICTIONARY) || (dictionary_size == 0)) {
+        return -1;
+    }
+    if (dictionary_size > KV_DICTIONARY_MAX_SIZE) {
+        dictionary_size = KV_DICTIONARY_MAX_SIZE;
+    }
+    
+    struct dictionary_sample sample;
+    sample.data = malloc(dictionary_size);
+    sample.size = 0;
+    sample.capacity = dictionary_size;
+    kv_writer_lock(db);
+    int r = dictionary_sample_collect(db, &sample);
+    if (r < 0) {
+        r = -2;
+    }
+    else if (sample.size == 0) {
+        r = -1;
+    }
+    else {
+        r = kv_dictionary_add(db, sample.data, sample.size);
+    }
+    kv_writer_unlock(db);
+    free(sample.data);
+    return r;
+}
+
+struct kvdb_batch_op {
+    // key and value are stored in the same allocated buffer.
+    char * key;
+    size_t key_size;
+    // value prepared for storage.
+    char * value;
+    size_t value_size;
+    int is_delete;
+    // order of the change in the batch.
+    unsigned int index;
+    // superseded by a later change of the same key.
+    int skip;
+    
+    // location of the new block, computed during commit.
+    struct kvdb_table * table;
+    struct kvdb_item * item;
+    // cell used instead of a block for small values.
+    char * cell;
+    uint64_t * table_count;
+    uint32_t hash_value;
+    uint8_t size_class;
+    uint64_t offset;
+    uint64_t next_offset;
+    // the block has been taken from the recycled blocks.
+    int reused;
+    
+    // current value of the key, removed once the new values of the batch are visible.
+    int old_found;
+    struct kvdb_table * old_table;
+    struct kvdb_item * old_item;
+    char * old_cell;
+    uint64_t old_offset;
+    uint64_t * old_table_count;
+};
+
+struct kvdb_batch {
+    kvdb * db;
+    struct kvdb_batch_op * ops;
+    unsigned int count;
+    unsigned int capacity;
+    // a change could not be added since the memory could not be allocated: the commit fails.
+    int failed;
+};
+
+kvdb_batch * kvdb_batch_new(kvdb * db)
+{
+    kvdb_batch * batch = malloc(sizeof(* batch));
+    if (batch == NULL) {
+        return NULL;
+    }
+    batch->db = db;
+    batch->ops = NULL;
+    batch->count = 0;
+    batch->capacity = 0;
+    batch->failed = 0;
+    return batch;
+}
+
+static void batch_clear(kvdb_batch * batch)
+{
+    for(unsigned int i = 0 ; i < batch->count ; i ++) {
+        free(batch->ops[i].key);
+    }
+    batch->count = 0;
+    batch->failed = 0;
+}
+
+void kvdb_batch_free(kvdb_batch * batch)
+{
+    batch_clear(batch);
+    free(batch->ops);
+    free(batch);
+}
+
+// Returns NULL if the memory can't be allocated, the batch is then marked as failed.
+static struct kvdb_batch_op * batch_add_op(kvdb_batch * batch, const char * key, size_t key_size,
+                                           size_t value_buffer_size)
+{
+    if (batch->count == batch->capacity) {
+        unsigned int capacity = batch->capacity == 0 ? 64 : batch->capacity * 2;
+        struct kvdb_batch_op * ops = realloc(batch->ops, capacity * sizeof(* ops));
+        if (ops == NULL) {
+            batch->failed = 1;
+            return NULL;
+        }
+        batch->ops = ops;
+        batch->capacity = capacity;
+    }
+    char * buffer = malloc(key_size + value_buffer_size);
+    if (buffer == NULL) {
+        batch->failed = 1;
+        return NULL;
+    }
+    struct kvdb_batch_op * op = &batch->ops[batch->count];
+    memset(op, 0, sizeof(* op));
+    op->key = buffer;
+    memcpy(op->key, key, key_size);
+    op->key_size = key_size;
+    op->value = op->key + key_size;
+    op->index = batch->count;
+    batch->count ++;
+    return op;
+}
+
+void kvdb_batch_put(kvdb_batch * batch, const char * key, size_t key_size,
+                    const char * value, size_t value_size)
+{
+    struct kvdb_batch_op * op = batch_add_op(batch, key, key_size,
+                                             stored_value_size_bound(batch->db, value_size));
+    if (op == NULL) {
+        return;
+    }
+    op->value_size = stored_value_encode(batch->db, op->value, value, value_size);
+}
+
+void kvdb_batch_delete(kvdb_batch * batch, const char * key, size_t key_size)
+{
+    struct kvdb_batch_op * op = batch_add_op(batch, key, key_size, 0);
+    if (op == NULL) {
+        return;
+    }
+    op->is_delete = 1;
+}
+
+// order by key, then by order in the batch.
+static int compare_batch_op_key(const void * a, const void * b)
+{
+    const struct kvdb_batch_op * op_a = * (struct kvdb_batch_op * const *) a;
+    const struct kvdb_batch_op * op_b = * (struct kvdb_batch_op * const *) b;
+    size_t min_size = op_a->key_size < op_b->key_size ? op_a->key_size : op_b->key_size;
+    int cmp = memcmp(op_a->key, op_b->key, min_size);
+    if (cmp != 0) {
+        return cmp;
+    }
+    if (op_a->key_size != op_b->key_size) {
+        return op_a->key_size < op_b->key_size ? -1 : 1;
+    }
+    return op_a->index < op_b->index ? -1 : 1;
+}
+
+// order by bucket, then by order in the batch.
+static int compare_batch_op_bucket(const void * a, const void * b)
+{
+    const struct kvdb_batch_op * op_a = * (struct kvdb_batch_op * const *) a;
+    const struct kvdb_batch_op * op_b = * (struct kvdb_batch_op * const *) b;
+    if (op_a->item != op_b->item) {
+        return op_a->item < op_b->item ? -1 : 1;
+    }
+    return op_a->index < op_b->index ? -1 : 1;
+}
+
+// order by offset in the file.
+static int compare_batch_op_offset(const void * a, const void * b)
+{
+    const struct kvdb_batch_op * op_a = * (struct kvdb_batch_op * const *) a;
+    const struct kvdb_batch_op * op_b = * (struct kvdb_batch_op * const *) b;
+    return op_a->offset < op_b->offset ? -1 : 1;
+}
+
+#define BATCH_ZERO_PADDING_SIZE 4096
+
+static char batch_zero_padding[BATCH_ZERO_PADDING_SIZE];
+
+// write the blocks of the batch, sorted by offset.
+// blocks that are next to each other in the file are written using a single pwritev().
+// Returns -1 if there's an I/O error or if the memory can't be allocated.
+static int batch_write_blocks(kvdb * db, struct kvdb_batch_op ** puts, unsigned int put_count)
+{
+    struct iovec * iov = malloc(put_count * (KV_BLOCK_IOVEC_COUNT + 1) * sizeof(* iov));
+    struct kv_block_header_buffer * buffers = malloc(put_count * sizeof(* buffers));
+    if ((iov == NULL) || (buffers == NULL)) {
+        free(buffers);
+        free(iov);
+        return -1;
+    }
+    int iovcnt = 0;
+    uint64_t run_offset = 0;
+    uint64_t run_end = 0;
+    int r = 0;
+    
+    for(unsigned int i = 0 ; i < put_count ; i ++) {
+        struct kvdb_batch_op * op = puts[i];
+        // The cache might still have the block that was recycled at this offset.
+        kv_block_cache_remove(db->kv_block_cache, op->offset);
+        if ((iovcnt > 0) && (op->offset != run_end)) {
+            r = kv_pwritev(db->kv_fd, iov, iovcnt, run_offset);
+            if (r < 0) {
+                break;
+            }
+            iovcnt = 0;
+        }
+        if (iovcnt == 0) {
+            run_offset = op->offset;
+        }
+        iovcnt += kv_block_iovec(&iov[iovcnt], &buffers[i], op->next_offset, op->hash_value, op->size_class,
+                                 op->key, op->key_size, op->value, op->value_size);
+        uint64_t disk_size = kv_block_disk_size(op->size_class);
+        uint64_t padding = disk_size - (KV_BLOCK_HEADER_SIZE + op->key_size + 8 + op->value_size);
+        run_end = op->offset + disk_size;
+        if (padding <= BATCH_ZERO_PADDING_SIZE) {
+            iov[iovcnt].iov_base = batch_zero_padding;
+            iov[iovcnt].iov_len = (size_t) padding;
+            iovcnt ++;
+        }
+        else {
+            // Large padding is not written: start a new run after this block.
+            run_end = 0;
+        }
+    }
+    if ((r == 0) && (iovcnt > 0)) {
+        r = kv_pwritev(db->kv_fd, iov, iovcnt, run_offset);
+    }
+    
+    free(buffers);
+    free(iov);
+    return r;
+}
+
+// remembers where the current value of the key of a change is.
+static void batch_locate_callback(kvdb * db, struct find_key_cb_params * params, void * data)
+{
+    struct kvdb_batch_op * op = data;
+    op->old_found = 1;
+    op->old_table = params->table;
+    op->old_item = params->item;
+    op->old_cell = params->cell;
+    op->old_offset = params->current_offset;
+    op->old_table_count = params->table_count;
+}
+
+// removes the previous value of the key of a change.
+// the batch might have added blocks in front of it: the block before it is found by following the chain.
+// Returns -2 if there's an I/O error.
+static int batch_remove_old_value(kvdb * db, struct kvdb_batch_op * op)
+{
+    int r = 0;
+    uint32_t * seq = kv_bucket_seq(db, op->old_table, op->old_item);
+    if (seq != NULL) {
+        kv_seq_write_begin(seq);
+    }
+    
+    if (op->old_cell != NULL) {
+        memset(op->old_cell, 0, KV_BUCKET_CELL_SIZE);
+    }
+    else {
+        uint64_t previous_offset = 0;
+        uint64_t offset = ntoh64(op->old_item->kv_offset);
+        uint64_t next_offset;
+        while (1) {
+            char data[8];
+            if ((offset == 0) || (kv_pread(db->kv_fd, data, sizeof(data), offset + KV_BLOCK_NEXT_OFFSET_OFFSET) < 0)) {
+                r = -2;
+                break;
+            }
+            next_offset = bytes_to_h64(data);
+            if (offset == op->old_offset) {
+                break;
+            }
+            previous_offset = offset;
+            offset = next_offset;
+        }
+        if (r == 0) {
+            r = unlink_block(db, op->old_table, op->old_item, previous_offset, offset, next_offset);
+        }
+    }
+    if (r == 0) {
+        kv_table_count_add(op->old_table_count, -1);
+    }
+    
+    if (seq != NULL) {
+        kv_seq_write_end(seq);
+    }
+    return r;
+}
+
+// the new values are written and made visible before the previous ones are removed: when an error happens
+// before they are visible, the database is left unchanged.
+static int internal_kvdb_batch_commit(kvdb_batch * batch)
+{
+    kvdb * db = batch->db;
+    unsigned int count = batch->count;
+    unsigned int put_count = 0;
+    int r = 0;
+    
+    if (batch->failed) {
+        batch_clear(batch);
+        return -2;
+    }
+    if (count == 0) {
+        return 0;
+    }
+    
+    // Only keep the last change of each key.
+    struct kvdb_batch_op ** ops = malloc(count * sizeof(* ops));
+    if (ops == NULL) {
+        batch_clear(batch);
+        return -2;
+    }
+    for(unsigned int i = 0 ; i < count ; i ++) {
+        ops[i] = &batch->ops[i];
+    }
+    qsort(ops, count, sizeof(* ops), compare_batch_op_key);
+    for(unsigned int i = 0 ; i + 1 < count ; i ++) {
+        if ((ops[i]->key_size == ops[i + 1]->key_size) &&
+            (memcmp(ops[i]->key, ops[i + 1]->key, ops[i]->key_size) == 0)) {
+            ops[i]->skip = 1;
+        }
+    }
+    
+    unsigned int change_count = 0;
+    for(unsigned int i = 0 ; i < count ; i ++) {
+        struct kvdb_batch_op * op = &batch->ops[i];
+        if (op->skip) {
+            continue;
+        }
+        ops[change_count] = op;
+        change_count ++;
+    }
+    // The changes that insert a value are at the beginning of the list.
+    for(unsigned int i = 0 ; i < change_count ; i ++) {
+        if (!ops[i]->is_delete) {
+            struct kvdb_batch_op * op = ops[i];
+            ops[i] = ops[put_count];
+            ops[put_count] = op;
+            put_count ++;
+        }
+    }
+    unsigned int selected_count = 0;
+    
+    // Readers see all the changes of the batch at once.
+    kv_global_write_begin(db);
+    
+    // Choose the bucket of each new block.
+    // It might create new tables so it needs to happen before allocating space at the end of the file.
+    for(unsigned int i = 0 ; i < put_count ; i ++) {
+        struct kvdb_batch_op * op = ops[i];
+        uint32_t hash_values[KV_BLOOM_FILTER_HASH_COUNT];
+        table_bloom_filter_compute_hash(db, hash_values, KV_BLOOM_FILTER_HASH_COUNT, op->key, op->key_size);
+        r = kv_select_bucket(db, hash_values[0], &op->table, &op->item, &op->table_count);
+        if (r < 0) {
+            r = -2;
+            goto revert_count;
+        }
+        op->hash_value = hash_values[0];
+        op->size_class = kv_block_size_class(db, op->key_size, op->value_size);
+        op->cell = NULL;
+        if (kv_bucket_cell_fits(op->key_size, op->value_size)) {
+            // The cell is reserved: it's not visible until the blocks of the batch have been written.
+            op->cell = kv_bucket_cell_get_free(op->table, op->item);
+            if (op->cell != NULL) {
+                kv_bucket_cell_write(op->cell, KV_BUCKET_CELL_FLAG_RESERVED, op->hash_value,
+                                     op->key, op->key_size, op->value, op->value_size);
+            }
+        }
+        table_bloom_filter_set(op->table, hash_values + 1, KV_BLOOM_FILTER_HASH_COUNT - 1);
+        // The count is updated early so that the table selection takes the batch into account.
+        * op->table_count = hton64(ntoh64(* op->table_count) + 1);
+        selected_count ++;
+    }
+    
+    // Find the current values of the keys. The reserved cells are not seen by the lookup.
+    for(unsigned int i = 0 ; i < change_count ; i ++) {
+        struct kvdb_batch_op * op = ops[i];
+        op->old_found = 0;
+        if (find_key(db, op->key, op->key_size, 0, batch_locate_callback, op) < 0) {
+            r = -2;
+            goto revert_count;
+        }
+    }
+    
+    // Keep the changes that need a block at the beginning of the list.
+    unsigned int block_count = 0;
+    for(unsigned int i = 0 ; i < put_count ; i ++) {
+        if (ops[i]->cell == NULL) {
+            struct kvdb_batch_op * op = ops[i];
+            ops[i] = ops[block_count];
+            ops[block_count] = op;
+            block_count ++;
+        }
+    }
+    
+    // Use recycled blocks first, then contiguous space at the end of the file.
+    uint64_t filesize = ntoh64(* db->kv_filesize);
+    for(unsigned int i = 0 ; i < block_count ; i ++) {
+        struct kvdb_batch_op * op = ops[i];
+        op->offset = kv_block_reuse(db, op->size_class);
+        op->reused = op->offset != 0;
+        if (op->offset == 0) {
+            op->offset = filesize;
+            filesize += kv_block_disk_size(op->size_class);
+        }
+    }
+    
+    // Chain the new blocks that belong to the same bucket.
+    qsort(ops, block_count, sizeof(* ops), compare_batch_op_bucket);
+    for(unsigned int i = 0 ; i < block_count ; i ++) {
+        if ((i > 0) && (ops[i - 1]->item == ops[i]->item)) {
+            ops[i]->next_offset = ops[i - 1]->offset;
+        }
+        else {
+            ops[i]->next_offset = ntoh64(ops[i]->item->kv_offset);
+        }
+    }
+    
+    qsort(ops, block_count, sizeof(* ops), compare_batch_op_offset);
+    r = batch_write_blocks(db, ops, block_count);
+    if (r < 0) {
+        r = -2;
+        goto revert_blocks;
+    }
+    * db->kv_filesize = hton64(filesize);
+    
+    // Make the new blocks visible: the last block of each bucket becomes the head of the chain.
+    qsort(ops, block_count, sizeof(* ops), compare_batch_op_bucket);
+    for(unsigned int i = 0 ; i < block_count ; i ++) {
+        kv_bucket_slots_push(ops[i]->table, ops[i]->item, ops[i]->offset, ops[i]->hash_value);
+        if ((i + 1 == block_count) || (ops[i + 1]->item != ops[i]->item)) {
+            ops[i]->item->kv_offset = hton64(ops[i]->offset);
+        }
+    }
+    for(unsigned int i = block_count ; i < put_count ; i ++) {
+        ops[i]->cell[KV_BUCKET_CELL_FLAGS_OFFSET] = KV_BUCKET_CELL_FLAG_USED;
+    }
+    
+    // Remove the previous values of the keys.
+    for(unsigned int i = 0 ; i < change_count ; i ++) {
+        if (!ops[i]->old_found) {
+            continue;
+        }
+        if (batch_remove_old_value(db, ops[i]) < 0) {
+            r = -2;
+        }
+    }
+    kv_global_write_end(db);
+    
+    // Buckets are split once all the new blocks are in their bucket.
+    if ((db->kv_storage_type == KVDB_STORAGE_TYPE_LINEAR_HASHING) && (kv_linear_grow(db) < 0)) {
+        r = -2;
+    }
+    goto free_ops;
+
+revert_blocks:
+    for(unsigned int i = 0 ; i < block_count ; i ++) {
+        if (ops[i]->reused) {
+            // The block is lost if there's no memory.
+            kv_block_reuse_cancel(db, ops[i]->offset, ops[i]->size_class);
+        }
+    }
+revert_count:
+    for(unsigned int i = 0 ; i < selected_count ; i ++) {
+        uint64_t * table_count = ops[i]->table_count;
+        * table_count = hton64(ntoh64(* table_count) - 1);
+        if (ops[i]->cell != NULL) {
+            memset(ops[i]->cell, 0, KV_BUCKET_CELL_SIZE);
+        }
+    }
+    kv_global_write_end(db);
+free_ops:
+    free(ops);
+    batch_clear(batch);
+    return r;
+}
+
+int kvdb_batch_commit(kvdb_batch * batch)
+{
+    kv_writer_lock(batch->db);
+    int r = internal_kvdb_batch_commit(batch);
+    kv_writer_unlock(batch->db);
+    return r;
+}
+
+struct kvdb_async_op {
+    // batch of the changes that follow each other in the queue, NULL for a lookup.
+    kvdb_batch * batch;
+    // copy of the key of a lookup.
+    char * key;
+    size_t key_size;
+    kvdb_get_callback * get_callback;
+    kvdb_set_callback * set_callback;
+    void * cb_data;
+};
+
+// returns the next operation of the queue, it's queued once the count is incremented.
+// Returns NULL if the memory can't be allocated.
+static struct kvdb_async_op * async_next_op(kvdb * db)
+{
+    if (db->kv_async_count == db->kv_async_capacity) {
+        unsigned int capacity = db->kv_async_capacity == 0 ? 16 : db->kv_async_capacity * 2;
+        struct kvdb_async_op * ops = realloc(db->kv_async_ops, capacity * sizeof(* ops));
+        if (ops == NULL) {
+            return NULL;
+        }
+        db->kv_async_ops = ops;
+        db->kv_async_capacity = capacity;
+    }
+    struct kvdb_async_op * op = &db->kv_async_ops[db->kv_async_count];
+    op->batch = NULL;
+    op->key = NULL;
+    op->key_size = 0;
+    op->get_callback = NULL;
+    op->set_callback = NULL;
+    return op;
+}
+
+void kvdb_get_async(kvdb * db, const char * key, size_t key_size,
+                    kvdb_get_callback * callback, void * cb_data)
+{
+    struct kvdb_async_op * op = async_next_op(db);
+    char * key_copy = op != NULL ? malloc(key_size) : NULL;
+    if (key_copy == NULL) {
+        callback(db, -2, NULL, 0, cb_data);
+        return;
+    }
+    memcpy(key_copy, key, key_size);
+    op->key = key_copy;
+    op->key_size = key_size;
+    op->get_callback = callback;
+    op->cb_data = cb_data;
+    db->kv_async_count ++;
+}
+
+void kvdb_set_async(kvdb * db, const char * key, size_t key_size,
+                    const char * value, size_t value_size,
+                    kvdb_set_callback * callback, void * cb_data)
+{
+    struct kvdb_async_op * op = async_next_op(db);
+    if (op == NULL) {
+        if (callback != NULL) {
+            callback(db, -2, cb_data);
+        }
+        return;
+    }
+    // The change is added to the batch of the previous change when they follow each other.
+    kvdb_batch * batch = NULL;
+    if (db->kv_async_count > 0) {
+        batch = db->kv_async_ops[db->kv_async_count - 1].batch;
+    }
+    if (batch == NULL) {
+        batch = kvdb_batch_new(db);
+        if (batch == NULL) {
+            if (callback != NULL) {
+                callback(db, -2, cb_data);
+            }
+            return;
+        }
+    }
+    // The commit of the batch fails if the change can't be added.
+    kvdb_batch_put(batch, key, key_size, value, value_size);
+    op->batch = batch;
+    op->set_callback = callback;
+    op->cb_data = cb_data;
+    db->kv_async_count ++;
+}
+
+// performs lookups using a single kvdb_mget().
+static void async_run_gets(kvdb * db, struct kvdb_async_op * ops, unsigned int count)
+{
+    const char ** keys = malloc(count * sizeof(* keys));
+    size_t * key_sizes = malloc(count * sizeof(* key_sizes));
+    char ** values = malloc(count * sizeof(* values));
+    size_t * value_sizes = malloc(count * sizeof(* value_sizes));
+    int * results = malloc(count * sizeof(* results));
+    
+    if ((keys == NULL) || (key_sizes == NULL) || (values == NULL) || (value_sizes == NULL) || (results == NULL)) {
+        for(unsigned int i = 0 ; i < count ; i ++) {
+            ops[i].get_callback(db, -2, NULL, 0, ops[i].cb_data);
+        }
+        goto free_arrays;
+    }
+    for(unsigned int i = 0 ; i < count ; i ++) {
+        keys[i] = ops[i].key;
+        key_sizes[i] = ops[i].key_size;
+    }
+    kvdb_mget(db, keys, key_sizes, count, values, value_sizes, results);
+    for(unsigned int i = 0 ; i < count ; i ++) {
+        ops[i].get_callback(db, results[i], values[i], value_sizes[i], ops[i].cb_data);
+    }
+    
+free_arrays:
+    free(results);
+    free(value_sizes);
+    free(values);
+    free(key_sizes);
+    free(keys);
+}
+
+// applies the changes of a single batch.
+static void async_run_sets(kvdb * db, struct kvdb_async_op * ops, unsigned int count)
+{
+    kvdb_batch * batch = ops[0].batch;
+    int r = kvdb_batch_commit(batch);
+    kvdb_batch_free(batch);
+    for(unsigned int i = 0 ; i < count ; i ++) {
+        if (ops[i].set_callback != NULL) {
+            ops[i].set_callback(db, r, ops[i].cb_data);
+        }
+    }
+}
+
+int kvdb_poll(kvdb * db)
+{
+    struct kvdb_async_op * ops = db->kv_async_ops;
+    unsigned int count = db->kv_async_count;
+    
+    // The callbacks might queue new operations.
+    db->kv_async_ops = NULL;
+    db->kv_async_count = 0;
+    db->kv_async_capacity = 0;
+    
+    unsigned int i = 0;
+    while (i < count) {
+        unsigned int end = i + 1;
+        while ((end < count) && (ops[end].batch == ops[i].batch)) {
+            end ++;
+        }
+        if (ops[i].batch != NULL) {
+            async_run_sets(db, ops + i, end - i);
+        }
+        else {
+            async_run_gets(db, ops + i, end - i);
+        }
+        i = end;
+    }
+    
+    for(unsigned int i = 0 ; i < count ; i ++) {
+        free(ops[i].key);
+    }
+    free(ops);
+    
+    return (int) count;
 }
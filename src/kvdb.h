@@ -3,6 +3,7 @@
 #define KVDB_H
 
 #include <sys/types.h>
+#include <inttypes.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -15,6 +16,35 @@ typedef struct kvdb kvdb;
 enum {
     KVDB_COMPRESSION_TYPE_RAW,
     KVDB_COMPRESSION_TYPE_LZ4,
+    // LZ4 with a dictionary trained on the values of the database, see kvdb_train_dictionary().
+    // it's useful for small values that share a lot of structure.
+    KVDB_COMPRESSION_TYPE_LZ4_DICTIONARY,
+    // LZ4 high compression: the values are smaller and read as fast but they're much slower to write.
+    // it's useful for data written once and read many times.
+    KVDB_COMPRESSION_TYPE_LZ4HC,
+};
+
+enum {
+    // when the table is full, a new table twice larger is added.
+    // a lookup might need to check all the tables.
+    KVDB_STORAGE_TYPE_TABLES,
+    // the table grows one bucket at a time (linear hashing).
+    // a lookup only needs to check a single bucket.
+    KVDB_STORAGE_TYPE_LINEAR_HASHING,
+};
+
+enum {
+    // three chained 32-bit MurmurHash2 of the key. files created before use it.
+    KVDB_HASH_FUNCTION_MURMUR,
+    // a single 64-bit xxHash of the key.
+    KVDB_HASH_FUNCTION_XXHASH64,
+};
+
+enum {
+    // the reads are done one at a time using pread().
+    KVDB_IO_BACKEND_PREAD,
+    // on Linux, the reads of kvdb_mget() and kvdb_poll() are in flight at the same time using io_uring.
+    KVDB_IO_BACKEND_IO_URING,
 };
 
 // creates a kvdb.
@@ -23,6 +53,70 @@ kvdb * kvdb_new(const char * filename);
 void kvdb_set_compression_type(kvdb * db, int compression_type);
 int kvdb_get_compression_type(kvdb * db);
 
+// a value is stored uncompressed when compression saves less than the given percentage of its size, for example
+// when it's already compressed. reading such a value doesn't need to decompress it. the default is 10.
+// 100 disables compression of the new values and 0 keeps all the values that compression doesn't make larger.
+// it's not used with the files created by older versions of kvdb: their values are always compressed so that
+// older versions can still read them.
+void kvdb_set_compression_min_saving(kvdb * db, unsigned int percent);
+unsigned int kvdb_get_compression_min_saving(kvdb * db);
+
+// the storage type is used when the file is created.
+void kvdb_set_storage_type(kvdb * db, int storage_type);
+int kvdb_get_storage_type(kvdb * db);
+
+// the hash function of the keys is used when the file is created. the default is KVDB_HASH_FUNCTION_XXHASH64.
+void kvdb_set_hash_function(kvdb * db, int hash_function);
+int kvdb_get_hash_function(kvdb * db);
+
+// number of bits of the bloom filters for each key, used when the file is created.
+// more bits means less useless reads when a key is not in the database but larger tables.
+void kvdb_set_bloom_filter_bits_per_key(kvdb * db, unsigned int bits_per_key);
+unsigned int kvdb_get_bloom_filter_bits_per_key(kvdb * db);
+
+// number of keys that the database is expected to hold, used when the file is created to size the first table.
+// the first table is full at this number of keys. a small hint keeps the file of a small database small,
+// a large one avoids adding tables while the database is loaded. the default is about 393000 keys.
+void kvdb_set_expected_count(kvdb * db, uint64_t count);
+uint64_t kvdb_get_expected_count(kvdb * db);
+
+// stores the small keys and values directly in the table instead of a block, used when the file is created.
+// it saves a read for those keys but makes the tables larger. disabled by default.
+void kvdb_set_inline_values(kvdb * db, int enabled);
+int kvdb_get_inline_values(kvdb * db);
+
+// size in bytes of the cache of the blocks read by the lookups, used when the file is opened.
+// a lookup of a block in the cache doesn't need any read. 0 disables the cache (default).
+// only the blocks of at most 4096 bytes are kept: a larger value is always read from the file.
+// kvdb_mget() doesn't use the cache.
+void kvdb_set_block_cache_size(kvdb * db, size_t size);
+size_t kvdb_get_block_cache_size(kvdb * db);
+
+// number of lookups of blocks that were found in the cache and number of lookups that needed a read.
+void kvdb_get_block_cache_stats(kvdb * db, uint64_t * p_hits, uint64_t * p_misses);
+
+// the I/O backend is used when the file is opened.
+// pread() is used when io_uring is not available: kvdb_get_io_backend() then returns KVDB_IO_BACKEND_PREAD.
+void kvdb_set_io_backend(kvdb * db, int io_backend);
+int kvdb_get_io_backend(kvdb * db);
+
+// when enabled, the handle can be shared between threads, it's used when the file is opened.
+// kvdb_get(), kvdb_get_into() and kvdb_enumerate_keys() don't take any lock and run alongside a change of the database.
+// kvdb_set() and kvdb_delete() run at the same time when they don't change the same buckets.
+// the other functions are serialized. the keys can't be changed from an enumeration callback.
+// the asynchronous functions and kvdb_close() should still be called from a single thread.
+void kvdb_set_concurrent_readers(kvdb * db, int enabled);
+int kvdb_get_concurrent_readers(kvdb * db);
+
+// when enabled, several processes of the same host can open the file at the same time, it's used when the file
+// is opened. it also enables the concurrent readers.
+// the changes of all the processes are serialized by a lock of the file, the lookups still don't take any lock.
+// the block cache is not used and files created by the version 5 can't be opened.
+// the keys can't be changed from an enumeration callback. the consolidation and the splits of the linear hashing
+// table wait for the enumerations of all the processes.
+void kvdb_set_multi_process(kvdb * db, int enabled);
+int kvdb_get_multi_process(kvdb * db);
+
 // destroy a kvdb.
 void kvdb_free(kvdb * db);
 
@@ -43,6 +137,36 @@ int kvdb_set(kvdb * db, const char * key, size_t key_size,
 int kvdb_get(kvdb * db, const char * key, size_t key_size,
              char ** p_value, size_t * p_value_size);
 
+// retrieve a value into a buffer provided by the caller.
+// the size of the value is stored in p_value_size.
+// Returns -1 if item is not found.
+// Returns -2 if there's a I/O error.
+// Returns -3 if the buffer is too small. p_value_size is then set to the needed size.
+int kvdb_get_into(kvdb * db, const char * key, size_t key_size,
+                  char * buffer, size_t buffer_size, size_t * p_value_size);
+
+// retrieve a value without copying it.
+// for a raw database, the result points to a read-only mapping of the file.
+// for a compressed database, the value is decompressed in a buffer owned by the database.
+// the result should not be released. it's valid until kvdb_release_refs(), kvdb_close() or a change of the
+// database, the other calls to kvdb_get_ref() in any thread don't change it.
+// the lookup runs alongside the readers and the writers of single keys.
+// Returns -1 if item is not found.
+// Returns -2 if there's a I/O error.
+int kvdb_get_ref(kvdb * db, const char * key, size_t key_size,
+                 const char ** p_value, size_t * p_value_size);
+
+// releases the resources used by the values returned by kvdb_get_ref().
+void kvdb_release_refs(kvdb * db);
+
+// retrieve the values of several keys at once.
+// the lookups of all the keys are done together to group the reads.
+// results[i] is set to 0 if the key is found, -1 if it's not found, -2 if there's a I/O error.
+// values stored in values[i] should be released using free().
+// Returns -2 if there's a I/O error for one of the keys.
+int kvdb_mget(kvdb * db, const char ** keys, const size_t * key_sizes, unsigned int count,
+              char ** values, size_t * value_sizes, int * results);
+
 // Returns -1 if item is not found.
 // Returns -2 if there's a I/O error.
 int kvdb_delete(kvdb * db, const char * key, size_t key_size);
@@ -59,6 +183,117 @@ typedef void kvdb_enumerate_callback(kvdb * db,
 // Returns -2 if there's a I/O error.
 int kvdb_enumerate_keys(kvdb * db, kvdb_enumerate_callback callback, void * cb_data);
 
+// moves the items of the tables added while the database grew to a single table.
+// the first table keeps its items: it's stored after the header of the file and can't be recycled, so moving
+// its items would not save any space and the lookups would still visit it. the lookups then visit at most two
+// tables.
+// the work is done in steps: budget is the number of buckets to visit during this call.
+// it can be called between other operations until it returns 0.
+// the space used by the emptied tables is then recycled.
+// Returns 0 when the consolidation is done.
+// Returns 1 if there's more to do.
+// Returns -2 if there's a I/O error.
+int kvdb_consolidate(kvdb * db, unsigned int budget);
+
+// merges the free blocks that are next to each other so that they can be reused by values of any size.
+// the large free regions are given back to the file system and the file is shrunk when its end is free.
+// in multi-process mode, the file is not shrunk.
+// p_released, if not NULL, is set to the number of bytes of disk space given back.
+// Returns -2 if there's a I/O error.
+int kvdb_release_free_space(kvdb * db, uint64_t * p_released);
+
+// moves the blocks of the values to the free space closer to the beginning of the file, bucket by bucket,
+// then releases the free space like kvdb_release_free_space().
+// the work is done in steps: io_budget is the number of bytes to read and write during this call.
+// it can be called between other operations until it returns 0. if the process stops, no value and no free space
+// is lost: the free space it was using is given back when the file is opened again.
+// p_reclaimed, if not NULL, is set to the number of bytes of disk space given back.
+// Returns 0 when the vacuum is done.
+// Returns 1 if there's more to do.
+// Returns -2 if there's a I/O error.
+int kvdb_vacuum(kvdb * db, uint64_t io_budget, uint64_t * p_reclaimed);
+
+// writes all the keys of the database to a new database in dest_filename.
+// the new database has a single table sized for the number of keys, its blocks are written in the order
+// of the buckets and it has no free blocks. writers wait for the end of the copy.
+// it's written to a temporary file in the same directory that replaces dest_filename with an atomic rename
+// once complete: an existing file is left untouched if there's an error.
+// Returns -1 if dest_filename is the file of the database, whatever the path leading to it.
+// Returns -2 if there's a I/O error.
+int kvdb_compact_to(kvdb * db, const char * dest_filename);
+
+// compacts the database like kvdb_compact_to() then replaces its file with an atomic rename and opens it again.
+// the database should not be used by other threads during this call.
+// Returns -1 in multi-process mode.
+// Returns -2 if there's a I/O error, the database is then closed if it can't be opened again.
+int kvdb_compact(kvdb * db);
+
+// builds a dictionary of at most dictionary_size bytes (up to 64 KB) from a sample of the values of the database.
+// the new values are then compressed with it. the previous dictionaries are kept in the file for the values
+// compressed before, up to 127 dictionaries can be added.
+// Returns -1 if the compression type is not KVDB_COMPRESSION_TYPE_LZ4_DICTIONARY, if there's no value to sample
+// or if there's no room for another dictionary.
+// Returns -2 if there's a I/O error.
+int kvdb_train_dictionary(kvdb * db, size_t dictionary_size);
+
+typedef struct kvdb_batch kvdb_batch;
+
+// creates a batch of changes for the given database.
+// changes are applied when calling kvdb_batch_commit().
+// Returns NULL if the memory can't be allocated.
+kvdb_batch * kvdb_batch_new(kvdb * db);
+
+// destroy a batch. changes that have not been committed are discarded.
+void kvdb_batch_free(kvdb_batch * batch);
+
+// add the insertion of a key / value to the batch.
+// if the key already exists in the database, it will be replaced.
+// if the memory can't be allocated, the commit of the batch fails.
+void kvdb_batch_put(kvdb_batch * batch, const char * key, size_t key_size,
+                    const char * value, size_t value_size);
+
+// add the removal of a key to the batch.
+// if the memory can't be allocated, the commit of the batch fails.
+void kvdb_batch_delete(kvdb_batch * batch, const char * key, size_t key_size);
+
+// apply all the changes of the batch to the database.
+// when the same key is changed several times, the last change wins.
+// new blocks are written together and made visible once all of them have been written, the previous values
+// are removed after that. if an error happens before the new values are visible, the database is unchanged.
+// there's no journal: a crash during the commit can leave only part of the batch applied.
+// the batch is empty after this call.
+// Returns -2 if there's a I/O error or if the memory could not be allocated. when the memory of a change could
+// not be allocated by kvdb_batch_put() or kvdb_batch_delete(), the database is unchanged.
+int kvdb_batch_commit(kvdb_batch * batch);
+
+// called when the lookup requested by kvdb_get_async() is done.
+// result is 0 if the key is found, -1 if it's not found, -2 if there's a I/O error or the memory can't be
+// allocated.
+// value should be released using free().
+typedef void kvdb_get_callback(kvdb * db, int result, char * value, size_t value_size, void * cb_data);
+
+// called when the change requested by kvdb_set_async() is done.
+// result is 0 if it succeeded, -2 if there's a I/O error or the memory can't be allocated.
+typedef void kvdb_set_callback(kvdb * db, int result, void * cb_data);
+
+// queues the lookup of a key, it's performed by kvdb_poll().
+// if the memory can't be allocated, the callback is called with -2 before this function returns.
+void kvdb_get_async(kvdb * db, const char * key, size_t key_size,
+                    kvdb_get_callback * callback, void * cb_data);
+
+// queues the insertion of a key / value, it's performed by kvdb_poll().
+// callback can be NULL. if the memory can't be allocated, it's called with -2 before this function returns.
+void kvdb_set_async(kvdb * db, const char * key, size_t key_size,
+                    const char * value, size_t value_size,
+                    kvdb_set_callback * callback, void * cb_data);
+
+// performs the queued operations in order and calls their callbacks.
+// lookups that follow each other are done together: the reads of all their chains are in flight at the same time.
+// changes that follow each other are applied as a single batch.
+// operations queued by the callbacks are performed by the next call.
+// Returns the number of operations performed.
+int kvdb_poll(kvdb * db);
+
 #ifdef __cplusplus
 }
 #endif
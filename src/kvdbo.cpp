@@ -9,6 +9,7 @@
 #include <string>
 #include <vector>
 #include <stdlib.h>
+#include <string.h>
 
 struct kvdbo {
     // underlaying kvdb.
@@ -153,6 +154,19 @@ int kvdbo_get(kvdbo * db,
     return kvdb_get(db->db, key, key_size, p_value, p_value_size);
 }
 
+int kvdbo_get_into(kvdbo * db,
+                   const char * key,
+                   size_t key_size,
+                   char * buffer,
+                   size_t buffer_size,
+                   size_t * p_value_size)
+{
+    if (db->pending_keys_delete.find(std::string(key, key_size)) != db->pending_keys_delete.end()) {
+        return -1;
+    }
+    return kvdb_get_into(db->db, key, key_size, buffer, buffer_size, p_value_size);
+}
+
 int kvdbo_delete(kvdbo * db, const char* key, size_t key_size)
 {
     std::string key_str(key, key_size);
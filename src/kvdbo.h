@@ -41,6 +41,15 @@ int kvdbo_set(kvdbo * db, const char * key, size_t key_size,
 int kvdbo_get(kvdbo * db, const char * key, size_t key_size,
               char ** p_value, size_t * p_value_size);
 
+// retrieve the value for the given key into a buffer provided by the caller.
+// the size of the value is stored in p_value_size.
+// Returns -1 if item is not found.
+// Returns -2 if there's a I/O error.
+// Returns -3 if the buffer is too small. p_value_size is then set to the needed size.
+// kvdbo_flush() must be called to write on disk all pending changes.
+int kvdbo_get_into(kvdbo * db, const char * key, size_t key_size,
+                   char * buffer, size_t buffer_size, size_t * p_value_size);
+
 // remove the given key.
 // Returns -1 if item is not found.
 // Returns -2 if there's a I/O error.
@@ -0,0 +1,183 @@
+//
+//  kvdictionary.c
+//  kvdb
+//
+//  Copyright (c) 2013 etpan. All rights reserved.
+//
+
+#include "kvdictionary.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "kvblock.h"
+#include "kvendian.h"
+
+void kv_dictionaries_setup(kvdb * db)
+{
+    for(unsigned int i = 0 ; i <= KV_DICTIONARY_MAX_ID ; i ++) {
+        db->kv_dictionaries[i] = NULL;
+    }
+    db->kv_current_dictionary = NULL;
+    db->kv_loaded_dictionary_head = 0;
+}
+
+static void dictionary_free(struct kv_dictionary * dictionary)
+{
+    if (dictionary->kv_stream != NULL) {
+        LZ4_freeStream(dictionary->kv_stream);
+    }
+    free(dictionary->kv_data);
+    free(dictionary);
+}
+
+void kv_dictionaries_unsetup(kvdb * db)
+{
+    for(unsigned int i = 0 ; i <= KV_DICTIONARY_MAX_ID ; i ++) {
+        if (db->kv_dictionaries[i] != NULL) {
+            dictionary_free(db->kv_dictionaries[i]);
+        }
+    }
+    kv_dictionaries_setup(db);
+}
+
+// reads the dictionary stored at the given offset if it has not been read yet.
+// p_next_offset is set to the offset of the previous dictionary.
+// p_loaded is set to 1 if it had already been read.
+// Returns NULL if there's an error.
+static struct kv_dictionary * dictionary_load(kvdb * db, uint64_t offset, uint64_t * p_next_offset, int * p_loaded)
+{
+    char header[KV_BLOCK_KEY_BYTES_OFFSET + 8];
+    int r = kv_pread(db->kv_fd, header, sizeof(header), offset);
+    if (r < 0) {
+        return NULL;
+    }
+    uint32_t id = bytes_to_h32(header + KV_BLOCK_HASH_VALUE_OFFSET);
+    uint64_t key_size = bytes_to_h64(header + KV_BLOCK_KEY_SIZE_OFFSET);
+    uint64_t size = bytes_to_h64(header + KV_BLOCK_KEY_BYTES_OFFSET);
+    if ((id == 0) || (id > KV_DICTIONARY_MAX_ID) || (key_size != 0) || (size == 0) || (size > KV_DICTIONARY_MAX_SIZE)) {
+        // The block is corrupted.
+        return NULL;
+    }
+    * p_next_offset = bytes_to_h64(header + KV_BLOCK_NEXT_OFFSET_OFFSET);
+    struct kv_dictionary * dictionary = __atomic_load_n(&db->kv_dictionaries[id], __ATOMIC_ACQUIRE);
+    if (dictionary != NULL) {
+        * p_loaded = 1;
+        return dictionary;
+    }
+    
+    dictionary = malloc(sizeof(* dictionary));
+    if (dictionary == NULL) {
+        return NULL;
+    }
+    dictionary->kv_id = id;
+    dictionary->kv_size = (size_t) size;
+    dictionary->kv_data = malloc((size_t) size);
+    dictionary->kv_stream = LZ4_createStream();
+    if ((dictionary->kv_data == NULL) || (dictionary->kv_stream == NULL)) {
+        dictionary_free(dictionary);
+        return NULL;
+    }
+    r = kv_pread(db->kv_fd, dictionary->kv_data, (size_t) size, offset + sizeof(header));
+    if (r < 0) {
+        dictionary_free(dictionary);
+        return NULL;
+    }
+    LZ4_loadDict(dictionary->kv_stream, dictionary->kv_data, (int) size);
+    
+    // Readers might load it at the same time.
+    struct kv_dictionary * expected = NULL;
+    if (!__atomic_compare_exchange_n(&db->kv_dictionaries[id], &expected, dictionary, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        dictionary_free(dictionary);
+        dictionary = expected;
+    }
+    * p_loaded = 0;
+    return dictionary;
+}
+
+// reads the dictionaries added by this process or by other ones.
+// all of them are read when all is set, otherwise only the ones added since the last call.
+// Returns -1 if there's an error.
+static int dictionaries_load(kvdb * db, int all)
+{
+    if (db->kv_dictionary_head == NULL) {
+        return 0;
+    }
+    uint64_t head = ntoh64(__atomic_load_n(db->kv_dictionary_head, __ATOMIC_ACQUIRE));
+    if (!all && (head == __atomic_load_n(&db->kv_loaded_dictionary_head, __ATOMIC_ACQUIRE))) {
+        return 0;
+    }
+    
+    struct kv_dictionary * newest = NULL;
+    uint64_t offset = head;
+    while (offset != 0) {
+        uint64_t next_offset;
+        int loaded;
+        struct kv_dictionary * dictionary = dictionary_load(db, offset, &next_offset, &loaded);
+        if (dictionary == NULL) {
+            return -1;
+        }
+        if (newest == NULL) {
+            newest = dictionary;
+        }
+        if (loaded && !all) {
+            // The previous ones have been read before.
+            break;
+        }
+        offset = next_offset;
+    }
+    __atomic_store_n(&db->kv_current_dictionary, newest, __ATOMIC_RELEASE);
+    __atomic_store_n(&db->kv_loaded_dictionary_head, head, __ATOMIC_RELEASE);
+    return 0;
+}
+
+struct kv_dictionary * kv_dictionary_current(kvdb * db)
+{
+    if (dictionaries_load(db, 0) < 0) {
+        return NULL;
+    }
+    return __atomic_load_n(&db->kv_current_dictionary, __ATOMIC_ACQUIRE);
+}
+
+struct kv_dictionary * kv_dictionary_get(kvdb * db, unsigned int id)
+{
+    if ((id == 0) || (id > KV_DICTIONARY_MAX_ID)) {
+        return NULL;
+    }
+    struct kv_dictionary * dictionary = __atomic_load_n(&db->kv_dictionaries[id], __ATOMIC_ACQUIRE);
+    if (dictionary != NULL) {
+        return dictionary;
+    }
+    // Another thread might be reading the previous dictionaries: look at all of them.
+    if (dictionaries_load(db, 1) < 0) {
+        return NULL;
+    }
+    return __atomic_load_n(&db->kv_dictionaries[id], __ATOMIC_ACQUIRE);
+}
+
+int kv_dictionary_add(kvdb * db, const char * data, size_t size)
+{
+    if ((db->kv_dictionary_head == NULL) || (size == 0) || (size > KV_DICTIONARY_MAX_SIZE)) {
+        return -1;
+    }
+    if (dictionaries_load(db, 0) < 0) {
+        return -2;
+    }
+    struct kv_dictionary * current = db->kv_current_dictionary;
+    unsigned int id = (current != NULL) ? current->kv_id + 1 : 1;
+    if (id > KV_DICTIONARY_MAX_ID) {
+        return -1;
+    }
+    
+    uint64_t offset = kv_block_create(db, ntoh64(* db->kv_dictionary_head), id, NULL, 0, data, size);
+    if (offset == 0) {
+        return -2;
+    }
+    // The block is written before it's visible to the other processes.
+    __atomic_store_n(db->kv_dictionary_head, hton64(offset), __ATOMIC_RELEASE);
+    if (dictionaries_load(db, 0) < 0) {
+        return -2;
+    }
+    return 0;
+}
@@ -0,0 +1,42 @@
+//
+//  kvdictionary.h
+//  kvdb
+//
+//  Copyright (c) 2013 etpan. All rights reserved.
+//
+
+#ifndef KVDICTIONARY_H
+#define KVDICTIONARY_H
+
+#include <sys/types.h>
+#include <inttypes.h>
+#include <lz4.h>
+
+#include "kvtypes.h"
+
+// dictionary used to compress the values with KVDB_COMPRESSION_TYPE_LZ4_DICTIONARY.
+// a dictionary is stored in a block that is not in any bucket: the hash value is the id of the dictionary,
+// the key is empty and the value is the content of the dictionary. the next block is the previous dictionary.
+// the newest one is used to compress the new values, the others are kept for the values compressed before.
+struct kv_dictionary {
+    unsigned int kv_id;
+    char * kv_data;
+    size_t kv_size;
+    // state of the compression with the dictionary loaded, copied before compressing a value.
+    LZ4_stream_t * kv_stream;
+};
+
+void kv_dictionaries_setup(kvdb * db);
+void kv_dictionaries_unsetup(kvdb * db);
+
+// returns the newest dictionary, NULL if there's none.
+struct kv_dictionary * kv_dictionary_current(kvdb * db);
+
+// returns the dictionary with the given id, NULL if there's none.
+struct kv_dictionary * kv_dictionary_get(kvdb * db, unsigned int id);
+
+// adds a dictionary, it becomes the newest one. the writer lock should be held in exclusive mode.
+// Returns -1 if the file has no room for dictionaries or if all the ids are used, -2 if there's a I/O error.
+int kv_dictionary_add(kvdb * db, const char * data, size_t size);
+
+#endif
@@ -0,0 +1,414 @@
+//
+//  kvlock.c
+//  kvdb
+//
+//  Copyright (c) 2013 etpan. All rights reserved.
+//
+
+#ifdef __linux__
+// for F_OFD_SETLKW.
+#define _GNU_SOURCE
+#endif
+
+#include "kvlock.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "kvtable.h"
+#include "kvblock.h"
+#include "kvvacuum.h"
+
+static uint32_t s_next_thread_slot = 0;
+static __thread int s_thread_slot = -1;
+
+int kv_concurrency_setup(kvdb * db)
+{
+    if (db->kv_multi_process) {
+        // The counters are shared with the other processes.
+        char * header = db->kv_first_table->kv_mapping.kv_bytes;
+        db->kv_generation = (uint64_t *) (header + KV_HEADER_GENERATION_OFFSET);
+        db->kv_writer_active = (uint32_t *) (header + KV_HEADER_WRITER_ACTIVE_OFFSET);
+        db->kv_global_seq = (uint32_t *) (header + KV_HEADER_GLOBAL_SEQ_OFFSET);
+        db->kv_bucket_seqs = (uint32_t *) (header + KV_HEADER_BUCKET_SEQS_OFFSET);
+        pthread_mutex_init(&db->kv_structure_file_lock, NULL);
+        db->kv_structure_file_count = 0;
+    }
+    else {
+        db->kv_process_global_seq = 0;
+        db->kv_global_seq = &db->kv_process_global_seq;
+        db->kv_bucket_seqs = calloc(KV_BUCKET_SEQ_COUNT, sizeof(* db->kv_bucket_seqs));
+    }
+    db->kv_bucket_locks = malloc(KV_BUCKET_SEQ_COUNT * sizeof(* db->kv_bucket_locks));
+    for(unsigned int i = 0 ; i < KV_BUCKET_SEQ_COUNT ; i ++) {
+        pthread_mutex_init(&db->kv_bucket_locks[i], NULL);
+    }
+    posix_memalign((void **) &db->kv_reader_slots, 64, KV_THREAD_SLOT_COUNT * sizeof(* db->kv_reader_slots));
+    for(unsigned int i = 0 ; i < KV_THREAD_SLOT_COUNT ; i ++) {
+        db->kv_reader_slots[i].kv_count = 0;
+    }
+    pthread_rwlock_init(&db->kv_write_lock, NULL);
+    pthread_rwlock_init(&db->kv_structure_lock, NULL);
+    pthread_mutex_init(&db->kv_alloc_lock, NULL);
+    pthread_mutex_init(&db->kv_ref_lock, NULL);
+    db->kv_retired_tables = NULL;
+    kv_block_arenas_setup(db);
+    
+    if (db->kv_multi_process) {
+        // Another process might have changed the tables since they have been mapped.
+        kv_writer_lock(db);
+        int r = kv_tables_reload(db);
+        kv_writer_unlock(db);
+        if (r < 0) {
+            kv_concurrency_unsetup(db);
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+void kv_concurrency_unsetup(kvdb * db)
+{
+    // The unused space of the arenas goes back to the lists of the file.
+    kv_writer_lock(db);
+    kv_block_arenas_unsetup(db);
+    kv_writer_unlock(db);
+    kv_tables_release_retired(db);
+    pthread_mutex_destroy(&db->kv_alloc_lock);
+    pthread_mutex_destroy(&db->kv_ref_lock);
+    pthread_rwlock_destroy(&db->kv_structure_lock);
+    pthread_rwlock_destroy(&db->kv_write_lock);
+    free(db->kv_reader_slots);
+    db->kv_reader_slots = NULL;
+    for(unsigned int i = 0 ; i < KV_BUCKET_SEQ_COUNT ; i ++) {
+        pthread_mutex_destroy(&db->kv_bucket_locks[i]);
+    }
+    free(db->kv_bucket_locks);
+    db->kv_bucket_locks = NULL;
+    if (db->kv_multi_process) {
+        pthread_mutex_destroy(&db->kv_structure_file_lock);
+        db->kv_generation = NULL;
+        db->kv_writer_active = NULL;
+    }
+    else {
+        free(db->kv_bucket_seqs);
+    }
+    db->kv_bucket_seqs = NULL;
+    db->kv_global_seq = NULL;
+}
+
+unsigned int kv_thread_slot(void)
+{
+    // Each thread uses its own slot most of the time so that threads don't write to the same cache line.
+    if (s_thread_slot == -1) {
+        s_thread_slot = (int) (__atomic_fetch_add(&s_next_thread_slot, 1, __ATOMIC_RELAXED) & (KV_THREAD_SLOT_COUNT - 1));
+    }
+    return (unsigned int) s_thread_slot;
+}
+
+struct kv_reader_slot * kv_reader_enter(kvdb * db)
+{
+    if (!db->kv_concurrent) {
+        return NULL;
+    }
+    struct kv_reader_slot * slot = &db->kv_reader_slots[kv_thread_slot()];
+    __atomic_fetch_add(&slot->kv_count, 1, __ATOMIC_SEQ_CST);
+    return slot;
+}
+
+void kv_reader_leave(struct kv_reader_slot * slot)
+{
+    if (slot == NULL) {
+        return;
+    }
+    __atomic_fetch_sub(&slot->kv_count, 1, __ATOMIC_RELEASE);
+}
+
+// Returns 1 if no reader is using the database.
+static int no_reader(kvdb * db)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for(unsigned int i = 0 ; i < KV_THREAD_SLOT_COUNT ; i ++) {
+        if (__atomic_load_n(&db->kv_reader_slots[i].kv_count, __ATOMIC_ACQUIRE) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// the locks of the file are owned by the open file description on Linux, so that the handles of a process
+// exclude each other. elsewhere, they're owned by the process.
+#ifdef F_OFD_SETLKW
+#define KV_SETLKW F_OFD_SETLKW
+#else
+#define KV_SETLKW F_SETLKW
+#endif
+
+// the writer lock and the structure lock are single bytes of the file locked independently.
+#define KV_FILE_WRITER_LOCK_POSITION 0
+#define KV_FILE_STRUCTURE_LOCK_POSITION 1
+
+static void file_lock(int fd, off_t position, short type)
+{
+    struct flock lock;
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = type;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = position;
+    lock.l_len = 1;
+    while ((fcntl(fd, KV_SETLKW, &lock) < 0) && (errno == EINTR)) {
+        // Try again.
+    }
+}
+
+void kv_file_lock(kvdb * db)
+{
+    file_lock(db->kv_fd, KV_FILE_WRITER_LOCK_POSITION, F_WRLCK);
+}
+
+void kv_file_unlock(kvdb * db)
+{
+    file_lock(db->kv_fd, KV_FILE_WRITER_LOCK_POSITION, F_UNLCK);
+}
+
+// makes the counters left odd by a writer that died even again, otherwise the readers would wait forever.
+static void repair_seqs(kvdb * db)
+{
+    fprintf(stderr, "a writer died while changing the file - %s\n", db->kv_filename);
+    for(unsigned int i = 0 ; i < KV_BUCKET_SEQ_COUNT ; i ++) {
+        if (db->kv_bucket_seqs[i] & 1) {
+            kv_seq_write_end(&db->kv_bucket_seqs[i]);
+        }
+    }
+    if (* db->kv_global_seq & 1) {
+        kv_seq_write_end(db->kv_global_seq);
+    }
+}
+
+// takes the lock of the file after the writer lock of this process.
+static void process_writer_lock(kvdb * db)
+{
+    kv_file_lock(db);
+    int died = * db->kv_writer_active;
+    if (died) {
+        repair_seqs(db);
+    }
+    __atomic_store_n(db->kv_writer_active, 1, __ATOMIC_RELAXED);
+    // The other processes might have taken or recycled blocks.
+    kv_block_free_lists_reset(db);
+    if (died || kv_tables_stale(db)) {
+        kv_tables_reload(db);
+    }
+    if (died) {
+        kv_vacuum_recover(db);
+    }
+}
+
+static void process_writer_unlock(kvdb * db)
+{
+    __atomic_store_n(db->kv_writer_active, 0, __ATOMIC_RELEASE);
+    kv_file_unlock(db);
+}
+
+void kv_writer_lock(kvdb * db)
+{
+    if (!db->kv_concurrent) {
+        return;
+    }
+    pthread_rwlock_wrlock(&db->kv_write_lock);
+    if (db->kv_multi_process) {
+        process_writer_lock(db);
+    }
+}
+
+void kv_writer_unlock(kvdb * db)
+{
+    if (!db->kv_concurrent) {
+        return;
+    }
+    if (db->kv_multi_process) {
+        process_writer_unlock(db);
+    }
+    if ((db->kv_retired_tables != NULL) && no_reader(db)) {
+        kv_tables_release_retired(db);
+    }
+    pthread_rwlock_unlock(&db->kv_write_lock);
+}
+
+void kv_writer_shared_lock(kvdb * db)
+{
+    if (!db->kv_concurrent) {
+        return;
+    }
+    if (db->kv_multi_process) {
+        // The lock of the file is held by a single thread.
+        kv_writer_lock(db);
+        return;
+    }
+    pthread_rwlock_rdlock(&db->kv_write_lock);
+}
+
+void kv_writer_shared_unlock(kvdb * db)
+{
+    if (!db->kv_concurrent) {
+        return;
+    }
+    if (db->kv_multi_process) {
+        kv_writer_unlock(db);
+        return;
+    }
+    pthread_rwlock_unlock(&db->kv_write_lock);
+}
+
+void kv_tables_refresh(kvdb * db)
+{
+    // The tables are mapped again when the lock is taken.
+    kv_writer_lock(db);
+    kv_writer_unlock(db);
+}
+
+static int compare_stripe(const void * a, const void * b)
+{
+    unsigned int stripe_a = * (const unsigned int *) a;
+    unsigned int stripe_b = * (const unsigned int *) b;
+    if (stripe_a == stripe_b) {
+        return 0;
+    }
+    return stripe_a < stripe_b ? -1 : 1;
+}
+
+void kv_key_lock(kvdb * db, uint32_t hash_value, struct kv_key_locks * locks)
+{
+    locks->kv_count = 0;
+    if (!db->kv_concurrent) {
+        return;
+    }
+    
+    if (db->kv_storage_type == KVDB_STORAGE_TYPE_LINEAR_HASHING) {
+        // The buckets don't change while the writers of single keys run.
+        struct kvdb_table * table = NULL;
+        struct kvdb_item * item = kv_linear_bucket(db, hash_value, &table);
+        locks->kv_stripes[0] = kv_bucket_stripe(table, item);
+        locks->kv_count = 1;
+    }
+    else {
+        // Tables might be added by the other writers: they can only contain keys locked by them.
+        struct kvdb_table * table = db->kv_first_table;
+        while ((table != NULL) && (locks->kv_count < KV_KEY_LOCK_MAX_COUNT)) {
+            locks->kv_stripes[locks->kv_count] = kv_bucket_stripe(table, kv_table_bucket(table, hash_value));
+            locks->kv_count ++;
+            table = __atomic_load_n(&table->kv_next_table, __ATOMIC_ACQUIRE);
+        }
+    }
+    
+    // Lock in the order of the stripes to avoid deadlocks.
+    qsort(locks->kv_stripes, locks->kv_count, sizeof(* locks->kv_stripes), compare_stripe);
+    unsigned int count = 0;
+    for(unsigned int i = 0 ; i < locks->kv_count ; i ++) {
+        if ((count > 0) && (locks->kv_stripes[count - 1] == locks->kv_stripes[i])) {
+            continue;
+        }
+        locks->kv_stripes[count] = locks->kv_stripes[i];
+        count ++;
+    }
+    locks->kv_count = count;
+    for(unsigned int i = 0 ; i < locks->kv_count ; i ++) {
+        pthread_mutex_lock(&db->kv_bucket_locks[locks->kv_stripes[i]]);
+    }
+}
+
+void kv_key_unlock(kvdb * db, struct kv_key_locks * locks)
+{
+    for(unsigned int i = locks->kv_count ; i > 0 ; i --) {
+        pthread_mutex_unlock(&db->kv_bucket_locks[locks->kv_stripes[i - 1]]);
+    }
+    locks->kv_count = 0;
+}
+
+void kv_alloc_lock(kvdb * db)
+{
+    if (db->kv_concurrent) {
+        pthread_mutex_lock(&db->kv_alloc_lock);
+    }
+}
+
+void kv_alloc_unlock(kvdb * db)
+{
+    if (db->kv_concurrent) {
+        pthread_mutex_unlock(&db->kv_alloc_lock);
+    }
+}
+
+void kv_ref_lock(kvdb * db)
+{
+    if (db->kv_concurrent) {
+        pthread_mutex_lock(&db->kv_ref_lock);
+    }
+}
+
+void kv_ref_unlock(kvdb * db)
+{
+    if (db->kv_concurrent) {
+        pthread_mutex_unlock(&db->kv_ref_lock);
+    }
+}
+
+void kv_structure_read_lock(kvdb * db)
+{
+    if (!db->kv_concurrent) {
+        return;
+    }
+    pthread_rwlock_rdlock(&db->kv_structure_lock);
+    if (db->kv_multi_process) {
+        // The first reader of the process takes the lock of the file for all of them.
+        pthread_mutex_lock(&db->kv_structure_file_lock);
+        if (db->kv_structure_file_count == 0) {
+            file_lock(db->kv_fd, KV_FILE_STRUCTURE_LOCK_POSITION, F_RDLCK);
+        }
+        db->kv_structure_file_count ++;
+        pthread_mutex_unlock(&db->kv_structure_file_lock);
+    }
+}
+
+void kv_structure_read_unlock(kvdb * db)
+{
+    if (!db->kv_concurrent) {
+        return;
+    }
+    if (db->kv_multi_process) {
+        pthread_mutex_lock(&db->kv_structure_file_lock);
+        db->kv_structure_file_count --;
+        if (db->kv_structure_file_count == 0) {
+            file_lock(db->kv_fd, KV_FILE_STRUCTURE_LOCK_POSITION, F_UNLCK);
+        }
+        pthread_mutex_unlock(&db->kv_structure_file_lock);
+    }
+    pthread_rwlock_unlock(&db->kv_structure_lock);
+}
+
+void kv_structure_write_lock(kvdb * db)
+{
+    if (!db->kv_concurrent) {
+        return;
+    }
+    pthread_rwlock_wrlock(&db->kv_structure_lock);
+    if (db->kv_multi_process) {
+        file_lock(db->kv_fd, KV_FILE_STRUCTURE_LOCK_POSITION, F_WRLCK);
+    }
+}
+
+void kv_structure_write_unlock(kvdb * db)
+{
+    if (!db->kv_concurrent) {
+        return;
+    }
+    if (db->kv_multi_process) {
+        file_lock(db->kv_fd, KV_FILE_STRUCTURE_LOCK_POSITION, F_UNLCK);
+    }
+    pthread_rwlock_unlock(&db->kv_structure_lock);
+}
@@ -0,0 +1,195 @@
+//
+//  kvlock.h
+//  kvdb
+//
+//  Copyright (c) 2013 etpan. All rights reserved.
+//
+
+#ifndef KVLOCK_H
+#define KVLOCK_H
+
+#include <sched.h>
+#include <pthread.h>
+
+#include "kvtypes.h"
+
+// When concurrent readers are enabled, the readers don't take any lock.
+// The writer makes a sequence counter odd while it changes a bucket. A reader reads the counter before
+// looking at the bucket and checks that it didn't change afterwards, otherwise it starts again.
+// Changes that affect several buckets (batches, splits, consolidation) use the global counter.
+// Writers of single keys run at the same time: they lock the buckets of the key, each lock protects
+// the buckets that share its counter.
+// In multi-process mode, the counters are in the header of the file and the writers of all the processes
+// are serialized by a lock of the file. A process that adds or removes tables changes the generation
+// stored in the header: the other processes map the tables again the next time they use them.
+
+// number of counters and locks for the buckets, should be a power of 2.
+// the counters fit in the header of the file, after KV_HEADER_BUCKET_SEQS_OFFSET.
+#define KV_BUCKET_SEQ_COUNT 512
+// number of counters of active readers and of allocation arenas, should be a power of 2.
+#define KV_THREAD_SLOT_COUNT 64
+// maximum number of buckets locked for a key, the tables double in size so there are never that many.
+#define KV_KEY_LOCK_MAX_COUNT 64
+
+// counter of the readers using the database, on its own cache line.
+struct kv_reader_slot {
+    uint32_t kv_count;
+    char kv_padding[64 - sizeof(uint32_t)];
+};
+
+static inline uint32_t kv_seq_read_begin(uint32_t * seq)
+{
+    uint32_t value;
+    while ((value = __atomic_load_n(seq, __ATOMIC_ACQUIRE)) & 1) {
+        sched_yield();
+    }
+    return value;
+}
+
+// Returns 1 if a change happened since kv_seq_read_begin().
+static inline int kv_seq_read_changed(uint32_t * seq, uint32_t value)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(seq, __ATOMIC_RELAXED) != value;
+}
+
+static inline void kv_seq_write_begin(uint32_t * seq)
+{
+    __atomic_store_n(seq, * seq + 1, __ATOMIC_RELAXED);
+    // The change must not be visible before the counter is odd.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline void kv_seq_write_end(uint32_t * seq)
+{
+    __atomic_store_n(seq, * seq + 1, __ATOMIC_RELEASE);
+}
+
+// returns the index of the counter and of the lock of the given bucket.
+static inline unsigned int kv_bucket_stripe(struct kvdb_table * table, struct kvdb_item * item)
+{
+    uint64_t idx = (uint64_t) (item - table->kv_items);
+    return (unsigned int) ((idx + (table->kv_offset >> 3) * 31) & (KV_BUCKET_SEQ_COUNT - 1));
+}
+
+// returns the counter of the given bucket, NULL if concurrent readers are not enabled.
+static inline uint32_t * kv_bucket_seq(kvdb * db, struct kvdb_table * table, struct kvdb_item * item)
+{
+    if (db->kv_bucket_seqs == NULL) {
+        return NULL;
+    }
+    return &db->kv_bucket_seqs[kv_bucket_stripe(table, item)];
+}
+
+static inline void kv_bucket_write_begin(kvdb * db, struct kvdb_table * table, struct kvdb_item * item)
+{
+    uint32_t * seq = kv_bucket_seq(db, table, item);
+    if (seq != NULL) {
+        kv_seq_write_begin(seq);
+    }
+}
+
+static inline void kv_bucket_write_end(kvdb * db, struct kvdb_table * table, struct kvdb_item * item)
+{
+    uint32_t * seq = kv_bucket_seq(db, table, item);
+    if (seq != NULL) {
+        kv_seq_write_end(seq);
+    }
+}
+
+static inline void kv_global_write_begin(kvdb * db)
+{
+    if (db->kv_concurrent) {
+        kv_seq_write_begin(db->kv_global_seq);
+    }
+}
+
+static inline void kv_global_write_end(kvdb * db)
+{
+    if (db->kv_concurrent) {
+        kv_seq_write_end(db->kv_global_seq);
+    }
+}
+
+// returns 1 if another process has added or removed tables since this process mapped them.
+static inline int kv_tables_stale(kvdb * db)
+{
+    if (db->kv_generation == NULL) {
+        return 0;
+    }
+    return __atomic_load_n(db->kv_generation, __ATOMIC_ACQUIRE) !=
+        __atomic_load_n(&db->kv_known_generation, __ATOMIC_RELAXED);
+}
+
+// tells the other processes that tables have been added or removed, the writer lock is held.
+static inline void kv_tables_generation_bump(kvdb * db)
+{
+    if (db->kv_generation == NULL) {
+        return;
+    }
+    uint64_t generation = * db->kv_generation + 1;
+    __atomic_store_n(&db->kv_known_generation, generation, __ATOMIC_RELAXED);
+    __atomic_store_n(db->kv_generation, generation, __ATOMIC_SEQ_CST);
+}
+
+// allocates the counters and the locks, when concurrent readers are enabled.
+// Returns -1 if the file can't be shared with other processes.
+int kv_concurrency_setup(kvdb * db);
+void kv_concurrency_unsetup(kvdb * db);
+
+// returns the slot of the current thread, in [0, KV_THREAD_SLOT_COUNT).
+// several threads might share a slot.
+unsigned int kv_thread_slot(void);
+
+// registers a reader so that the tables it might use are not unmapped.
+// Returns NULL if concurrent readers are not enabled.
+struct kv_reader_slot * kv_reader_enter(kvdb * db);
+void kv_reader_leave(struct kv_reader_slot * slot);
+
+// serializes the changes of the database with all the other writers.
+// in multi-process mode, the tables changed by the other processes are mapped again.
+void kv_writer_lock(kvdb * db);
+// the tables removed from the database are released when there's no reader.
+void kv_writer_unlock(kvdb * db);
+
+// allows the change of a single key alongside the other writers of single keys.
+// the buckets of the key should then be locked with kv_key_lock().
+// in multi-process mode, it's the same as kv_writer_lock().
+void kv_writer_shared_lock(kvdb * db);
+void kv_writer_shared_unlock(kvdb * db);
+
+// maps the tables changed by the other processes, it waits for their writers.
+void kv_tables_refresh(kvdb * db);
+
+// lock of the file shared by the processes, taken by kv_writer_lock() in multi-process mode.
+void kv_file_lock(kvdb * db);
+void kv_file_unlock(kvdb * db);
+
+// locks of the buckets where a key can be.
+struct kv_key_locks {
+    unsigned int kv_count;
+    unsigned int kv_stripes[KV_KEY_LOCK_MAX_COUNT];
+};
+
+// locks the bucket of the key in every table, the table selected for new items should already exist.
+// the locks are taken in the same order by all writers.
+void kv_key_lock(kvdb * db, uint32_t hash_value, struct kv_key_locks * locks);
+void kv_key_unlock(kvdb * db, struct kv_key_locks * locks);
+
+// protects the size of the file, the lists of recycled blocks and the creation of tables.
+void kv_alloc_lock(kvdb * db);
+void kv_alloc_unlock(kvdb * db);
+
+// protects the mapping of the data and the buffer of the values returned by kvdb_get_ref() between the readers
+// that hold the writer lock in shared mode.
+void kv_ref_lock(kvdb * db);
+void kv_ref_unlock(kvdb * db);
+
+// excludes the enumeration of the keys while items are moved between buckets.
+// in multi-process mode, it also excludes the enumerations of the other processes.
+void kv_structure_read_lock(kvdb * db);
+void kv_structure_read_unlock(kvdb * db);
+void kv_structure_write_lock(kvdb * db);
+void kv_structure_write_unlock(kvdb * db);
+
+#endif
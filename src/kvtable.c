@@ -9,6 +9,7 @@
 #include "kvtable.h"
 
 #include <strings.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/mman.h>
 #include <stdio.h>
@@ -16,15 +17,47 @@
 #include "kvtypes.h"
 #include "kvprime.h"
 #include "kvpaddingutils.h"
+#include "kvbloom.h"
+#include "kvblock.h"
+#include "kvlock.h"
 
 static int map_table(kvdb * db, struct kvdb_table ** result, uint64_t offset, int is_first);
-static int mapping_setup(struct kvdb_mapping * mapping, int fd, off_t offset, size_t size);
+static int mapping_setup(struct kvdb_mapping * mapping, int fd, off_t offset, size_t size, int prot);
 static void mapping_unsetup(struct kvdb_mapping * mapping);
 static void unmap_table(struct kvdb_table * table);
 
+uint64_t kv_table_bloom_filter_size(kvdb * db, uint64_t maxcount)
+{
+    if (db->kv_bloom_filter_type == KV_BLOOM_FILTER_TYPE_BLOCKED) {
+        // Enough bits for a full table.
+        uint64_t bits = maxcount * KV_MAX_MEAN_COLLISION * db->kv_bloom_filter_bits_per_key;
+        uint64_t block_bits = KV_BLOOM_FILTER_BLOCK_SIZE * 8;
+        return (bits + block_bits - 1) / block_bits * block_bits;
+    }
+    return kv_getnextprime(maxcount * KV_TABLE_BITS_FOR_BLOOM_FILTER);
+}
+
+uint64_t kv_table_disk_size(kvdb * db, uint64_t maxcount)
+{
+    return KV_TABLE_SIZE(maxcount, kv_table_bloom_filter_size(db, maxcount), db->kv_bucket_slot_count,
+                         db->kv_bucket_cell_count);
+}
+
+uint64_t kv_table_round_count(kvdb * db, uint64_t maxcount)
+{
+    if (db->kv_bucket_selection == KV_BUCKET_SELECTION_MASK) {
+        uint64_t count = 1;
+        while (count < maxcount) {
+            count <<= 1;
+        }
+        return count;
+    }
+    return kv_getnextprime(maxcount);
+}
+
 int kv_table_header_write(kvdb * db, uint64_t table_start, uint64_t maxcount)
 {
-    uint64_t bloomsize = kv_getnextprime(maxcount * KV_TABLE_BITS_FOR_BLOOM_FILTER);
+    uint64_t bloomsize = kv_table_bloom_filter_size(db, maxcount);
     char data[KV_TABLE_HEADER_SIZE];
     bzero(data, KV_TABLE_HEADER_SIZE);
     h64_to_bytes(&data[KV_TABLE_BLOOM_SIZE_OFFSET], bloomsize);
@@ -38,7 +71,7 @@ int kv_table_header_write(kvdb * db, uint64_t table_start, uint64_t maxcount)
 
 int kv_tables_setup(kvdb * db)
 {
-    map_table(db, &db->kv_first_table, KV_HEADER_SIZE, 1);
+    map_table(db, &db->kv_first_table, db->kv_header_size, 1);
     return 0;
 }
 
@@ -47,17 +80,81 @@ void kv_tables_unsetup(kvdb * db)
     unmap_table(db->kv_first_table);
 }
 
+void kv_tables_release_retired(kvdb * db)
+{
+    unmap_table(db->kv_retired_tables);
+    db->kv_retired_tables = NULL;
+}
+
+static uint64_t table_mapped_end(struct kvdb_table * table)
+{
+    uint64_t end = 0;
+    while (table != NULL) {
+        uint64_t mapping_offset = table->kv_offset - (uint64_t) (table->kv_table_start - table->kv_mapping.kv_bytes);
+        if (mapping_offset + table->kv_mapping.kv_size > end) {
+            end = mapping_offset + table->kv_mapping.kv_size;
+        }
+        table = table->kv_next_table;
+    }
+    return end;
+}
+
+uint64_t kv_tables_mapped_end(kvdb * db)
+{
+    uint64_t end = table_mapped_end(db->kv_first_table);
+    uint64_t retired_end = table_mapped_end(db->kv_retired_tables);
+    return end > retired_end ? end : retired_end;
+}
+
+int kv_tables_reload(kvdb * db)
+{
+    uint64_t generation = __atomic_load_n(db->kv_generation, __ATOMIC_ACQUIRE);
+    
+    // Keep the tables that are still in the chain stored in the file.
+    struct kvdb_table * table = db->kv_first_table;
+    while ((table->kv_next_table != NULL) &&
+           (table->kv_next_table->kv_offset == ntoh64(* table->kv_next_table_offset))) {
+        table = table->kv_next_table;
+    }
+    
+    struct kvdb_table * removed = table->kv_next_table;
+    __atomic_store_n(&table->kv_next_table, NULL, __ATOMIC_RELEASE);
+    if (removed != NULL) {
+        // Readers of this process might still be using them.
+        struct kvdb_table * last = removed;
+        while (last->kv_next_table != NULL) {
+            last = last->kv_next_table;
+        }
+        last->kv_next_table = db->kv_retired_tables;
+        db->kv_retired_tables = removed;
+    }
+    db->kv_current_table = NULL;
+    
+    if (* table->kv_next_table_offset != 0) {
+        int r = map_table(db, &table->kv_next_table, ntoh64(* table->kv_next_table_offset), 0);
+        if (r < 0) {
+            return -1;
+        }
+    }
+    __atomic_store_n(&db->kv_known_generation, generation, __ATOMIC_RELAXED);
+    
+    return 0;
+}
+
 uint64_t kv_table_create(kvdb * db, uint64_t size, struct kvdb_table ** result)
 {
     //fprintf(stderr, "create table %llu", (unsigned long long) size);
-    uint64_t mapping_size = KV_TABLE_SIZE(size);
+    uint64_t mapping_size = kv_table_disk_size(db, size);
     uint64_t offset = ntoh64(* db->kv_filesize);
+    if (db->kv_bloom_filter_type == KV_BLOOM_FILTER_TYPE_BLOCKED) {
+        // Align the blocks of the bloom filter.
+        offset = (offset + KV_BLOOM_FILTER_BLOCK_SIZE - 1) / KV_BLOOM_FILTER_BLOCK_SIZE * KV_BLOOM_FILTER_BLOCK_SIZE;
+    }
     int r;
     r = ftruncate(db->kv_fd, offset + mapping_size);
     if (r < 0)
         return 0;
-    uint64_t filesize = ntoh64(* db->kv_filesize);
-    filesize += mapping_size;
+    uint64_t filesize = offset + mapping_size;
     r = kv_table_header_write(db, offset, size);
     if (r < 0)
         return 0;
@@ -67,6 +164,8 @@ uint64_t kv_table_create(kvdb * db, uint64_t size, struct kvdb_table ** result)
     
     // When everything succeeded, update file size
     * db->kv_filesize = hton64(filesize);
+    // The caller adds the table to the chain before releasing the writer lock.
+    kv_tables_generation_bump(db);
     
     return offset;
 }
@@ -75,40 +174,57 @@ static int map_table(kvdb * db, struct kvdb_table ** result, uint64_t offset, in
 {
     struct kvdb_table * table;
     uint64_t maxcount;
+    uint64_t bloomsize;
     ssize_t read_result;
-    char data[8];
+    char data[8 + 8];
     int r;
     off_t pre_page_align_size;
     
     table = calloc(1, sizeof(* table));
     if (is_first) {
-        pre_page_align_size = KV_HEADER_SIZE;
+        pre_page_align_size = db->kv_header_size;
     }
     else {
         off_t mapping_offset = KV_PAGE_ROUND_DOWN(db, offset);
         pre_page_align_size = offset - mapping_offset;
     }
     
-    read_result = pread(db->kv_fd, data, 8, offset + KV_TABLE_MAX_COUNT_OFFSET);
-    if (read_result < 0) {
+    read_result = pread(db->kv_fd, data, sizeof(data), offset + KV_TABLE_BLOOM_SIZE_OFFSET);
+    if (read_result < (ssize_t) sizeof(data)) {
         return -1;
     }
-    maxcount = bytes_to_h64(data);
-    uint64_t mapping_size = pre_page_align_size + KV_TABLE_SIZE(maxcount);
-    r = mapping_setup(&table->kv_mapping, db->kv_fd, offset - pre_page_align_size, (size_t) mapping_size);
+    bloomsize = bytes_to_h64(data);
+    maxcount = bytes_to_h64(data + 8);
+    uint64_t mapping_size = pre_page_align_size + KV_TABLE_SIZE(maxcount, bloomsize, db->kv_bucket_slot_count,
+                                                                db->kv_bucket_cell_count);
+    r = mapping_setup(&table->kv_mapping, db->kv_fd, offset - pre_page_align_size, (size_t) mapping_size,
+                      PROT_READ | PROT_WRITE);
     if (r < 0) {
         return -1;
     }
+    table->kv_offset = offset;
     table->kv_table_start = table->kv_mapping.kv_bytes + pre_page_align_size;
     
-    table->kv_items = (struct kvdb_item *) (table->kv_table_start + KV_TABLE_ITEMS_OFFSET_OFFSET(maxcount));
+    table->kv_items = (struct kvdb_item *) (table->kv_table_start + KV_TABLE_ITEMS_OFFSET_OFFSET(bloomsize));
     table->kv_next_table_offset = (uint64_t *) (table->kv_table_start + KV_TABLE_NEXT_TABLE_OFFSET_OFFSET);
     table->kv_count = (uint64_t *) (table->kv_table_start + KV_TABLE_COUNT_OFFSET);
     table->kv_bloom_filter_size = (uint64_t *) (table->kv_table_start + KV_TABLE_BLOOM_SIZE_OFFSET);
     table->kv_maxcount = (uint64_t *) (table->kv_table_start + KV_TABLE_MAX_COUNT_OFFSET);
     table->kv_bloom_filter = (uint8_t *) (table->kv_table_start + KV_TABLE_BLOOM_FILTER_OFFSET);
-    
-    * result = table;
+    table->kv_bloom_filter_type = db->kv_bloom_filter_type;
+    table->kv_bucket_selection = db->kv_bucket_selection;
+    if (db->kv_bucket_slot_count != 0) {
+        table->kv_bucket_slots = (uint64_t *) (table->kv_items + maxcount);
+    }
+    else {
+        table->kv_bucket_slots = NULL;
+    }
+    if (db->kv_bucket_cell_count != 0) {
+        table->kv_bucket_cells = (char *) (table->kv_items + maxcount * (1 + db->kv_bucket_slot_count));
+    }
+    else {
+        table->kv_bucket_cells = NULL;
+    }
     
     if (* table->kv_next_table_offset != 0) {
         r = map_table(db, &table->kv_next_table, ntoh64(* table->kv_next_table_offset), 0);
@@ -120,6 +236,9 @@ static int map_table(kvdb * db, struct kvdb_table ** result, uint64_t offset, in
         table->kv_next_table = NULL;
     }
     
+    // Concurrent readers might follow the pointer as soon as it's set.
+    __atomic_store_n(result, table, __ATOMIC_RELEASE);
+    
     return 0;
 }
 
@@ -135,10 +254,11 @@ static void unmap_table(struct kvdb_table * table)
     unmap_table(next_table);
 }
 
-static int mapping_setup(struct kvdb_mapping * mapping, int fd, off_t offset, size_t size)
+static int mapping_setup(struct kvdb_mapping * mapping, int fd, off_t offset, size_t size, int prot)
 {
-    mapping->kv_bytes = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+    mapping->kv_bytes = mmap(NULL, size, prot, MAP_SHARED, fd, offset);
     if (mapping->kv_bytes == MAP_FAILED) {
+        mapping->kv_bytes = NULL;
         return -1;
     }
     mapping->kv_size = size;
@@ -160,3 +280,885 @@ static void mapping_unsetup(struct kvdb_mapping * mapping)
     mapping->kv_bytes = NULL;
     mapping->kv_size = 0;
 }
+
+const char * kv_data_mapping_lookup(kvdb * db, uint64_t offset, uint64_t size)
+{
+    if (offset + size > db->kv_data_mapping.kv_size) {
+        return NULL;
+    }
+    return db->kv_data_mapping.kv_bytes + offset;
+}
+
+const char * kv_data_mapping_get(kvdb * db, uint64_t offset, uint64_t size)
+{
+    const char * result = kv_data_mapping_lookup(db, offset, size);
+    if (result != NULL) {
+        return result;
+    }
+    
+    uint64_t filesize = ntoh64(* db->kv_filesize);
+    if (offset + size > filesize) {
+        return NULL;
+    }
+    
+    // The file has grown: map it again.
+    // The previous mapping is kept since values returned by kvdb_get_ref() might still use it.
+    struct kvdb_mapping mapping;
+    int r = mapping_setup(&mapping, db->kv_fd, 0, (size_t) KV_PAGE_ROUND_UP(db, filesize), PROT_READ);
+    if (r < 0) {
+        return NULL;
+    }
+    if (db->kv_data_mapping.kv_bytes != NULL) {
+        db->kv_old_data_mappings = realloc(db->kv_old_data_mappings,
+                                           (db->kv_old_data_mappings_count + 1) * sizeof(* db->kv_old_data_mappings));
+        db->kv_old_data_mappings[db->kv_old_data_mappings_count] = db->kv_data_mapping;
+        db->kv_old_data_mappings_count ++;
+    }
+    db->kv_data_mapping = mapping;
+    
+    return db->kv_data_mapping.kv_bytes + offset;
+}
+
+void kv_data_mapping_release_unused(kvdb * db)
+{
+    for(unsigned int i = 0 ; i < db->kv_old_data_mappings_count ; i ++) {
+        mapping_unsetup(&db->kv_old_data_mappings[i]);
+    }
+    free(db->kv_old_data_mappings);
+    db->kv_old_data_mappings = NULL;
+    db->kv_old_data_mappings_count = 0;
+}
+
+void kv_data_mapping_unsetup(kvdb * db)
+{
+    kv_data_mapping_release_unused(db);
+    mapping_unsetup(&db->kv_data_mapping);
+}
+
+static inline uint64_t bucket_slot_create(uint64_t offset, uint32_t hash_value)
+{
+    return KV_BUCKET_SLOT_TAG(hash_value) | offset;
+}
+
+static inline uint64_t bucket_slot_offset(uint64_t slot)
+{
+    return slot & KV_BUCKET_SLOT_OFFSET_MASK;
+}
+
+// reads the next offset and the hash value of a block.
+static int block_read_next_and_hash(kvdb * db, uint64_t offset, uint64_t * p_next_offset, uint32_t * p_hash_value)
+{
+    char data[8 + 4];
+    int r = kv_pread(db->kv_fd, data, sizeof(data), offset);
+    if (r < 0) {
+        return -1;
+    }
+    * p_next_offset = bytes_to_h64(data);
+    * p_hash_value = bytes_to_h32(data + 8);
+    return 0;
+}
+
+void kv_bucket_slots_push(struct kvdb_table * table, struct kvdb_item * item, uint64_t offset, uint32_t hash_value)
+{
+    uint64_t * slots = kv_table_bucket_slots(table, item);
+    if (slots == NULL) {
+        return;
+    }
+    
+    // The block described by the last slot is pushed out of the slots.
+    int more = slots[KV_BUCKET_SLOT_COUNT - 1] != 0;
+    for(unsigned int i = KV_BUCKET_SLOT_COUNT - 1 ; i > 0 ; i --) {
+        slots[i] = slots[i - 1];
+    }
+    slots[0] = hton64(bucket_slot_create(offset, hash_value));
+    if (more) {
+        slots[KV_BUCKET_SLOT_COUNT - 1] = hton64(ntoh64(slots[KV_BUCKET_SLOT_COUNT - 1]) | KV_BUCKET_SLOT_MORE_FLAG);
+    }
+}
+
+// describes in the last slot the block that follows the one of the slot before it.
+static int bucket_slots_refill_last(kvdb * db, uint64_t * slots)
+{
+    uint64_t previous_offset = bucket_slot_offset(ntoh64(slots[KV_BUCKET_SLOT_COUNT - 2]));
+    uint64_t offset;
+    uint64_t next_offset;
+    uint32_t hash_value;
+    int r;
+    
+    slots[KV_BUCKET_SLOT_COUNT - 1] = 0;
+    if (previous_offset == 0) {
+        return 0;
+    }
+    r = block_read_next_and_hash(db, previous_offset, &offset, &hash_value);
+    if (r < 0) {
+        return -1;
+    }
+    if (offset == 0) {
+        return 0;
+    }
+    r = block_read_next_and_hash(db, offset, &next_offset, &hash_value);
+    if (r < 0) {
+        return -1;
+    }
+    uint64_t slot = bucket_slot_create(offset, hash_value);
+    if (next_offset != 0) {
+        slot |= KV_BUCKET_SLOT_MORE_FLAG;
+    }
+    slots[KV_BUCKET_SLOT_COUNT - 1] = hton64(slot);
+    return 0;
+}
+
+int kv_bucket_slots_remove(kvdb * db, struct kvdb_table * table, struct kvdb_item * item, uint64_t offset)
+{
+    uint64_t * slots = kv_table_bucket_slots(table, item);
+    if (slots == NULL) {
+        return 0;
+    }
+    
+    uint64_t last_slot = ntoh64(slots[KV_BUCKET_SLOT_COUNT - 1]);
+    unsigned int position = 0;
+    while ((position < KV_BUCKET_SLOT_COUNT) && (bucket_slot_offset(ntoh64(slots[position])) != offset)) {
+        position ++;
+    }
+    if (position == KV_BUCKET_SLOT_COUNT) {
+        // The block was after the blocks described by the slots.
+        if ((last_slot & KV_BUCKET_SLOT_MORE_FLAG) == 0) {
+            return 0;
+        }
+        uint64_t next_offset;
+        uint32_t hash_value;
+        int r = block_read_next_and_hash(db, bucket_slot_offset(last_slot), &next_offset, &hash_value);
+        if (r < 0) {
+            return -1;
+        }
+        if (next_offset == 0) {
+            slots[KV_BUCKET_SLOT_COUNT - 1] = hton64(last_slot & ~KV_BUCKET_SLOT_MORE_FLAG);
+        }
+        return 0;
+    }
+    
+    for(unsigned int i = position ; i < KV_BUCKET_SLOT_COUNT - 1 ; i ++) {
+        slots[i] = slots[i + 1];
+    }
+    slots[KV_BUCKET_SLOT_COUNT - 1] = 0;
+    if ((last_slot & KV_BUCKET_SLOT_MORE_FLAG) == 0) {
+        if (position < KV_BUCKET_SLOT_COUNT - 1) {
+            slots[KV_BUCKET_SLOT_COUNT - 2] = hton64(last_slot);
+        }
+        return 0;
+    }
+    // The block that was after the slots needs a slot.
+    if (position < KV_BUCKET_SLOT_COUNT - 1) {
+        slots[KV_BUCKET_SLOT_COUNT - 2] = hton64(last_slot & ~KV_BUCKET_SLOT_MORE_FLAG);
+    }
+    return bucket_slots_refill_last(db, slots);
+}
+
+int kv_bucket_slots_rebuild(kvdb * db, struct kvdb_table * table, struct kvdb_item * item)
+{
+    uint64_t * slots = kv_table_bucket_slots(table, item);
+    if (slots == NULL) {
+        return 0;
+    }
+    
+    uint64_t offset = ntoh64(item->kv_offset);
+    for(unsigned int i = 0 ; i < KV_BUCKET_SLOT_COUNT ; i ++) {
+        if (offset == 0) {
+            slots[i] = 0;
+            continue;
+        }
+        uint64_t next_offset;
+        uint32_t hash_value;
+        int r = block_read_next_and_hash(db, offset, &next_offset, &hash_value);
+        if (r < 0) {
+            return -1;
+        }
+        uint64_t slot = bucket_slot_create(offset, hash_value);
+        if ((i == KV_BUCKET_SLOT_COUNT - 1) && (next_offset != 0)) {
+            slot |= KV_BUCKET_SLOT_MORE_FLAG;
+        }
+        slots[i] = hton64(slot);
+        offset = next_offset;
+    }
+    return 0;
+}
+
+uint64_t kv_bucket_slots_seek(struct kvdb_table * table, struct kvdb_item * item, uint32_t hash_value,
+                              uint64_t offset, unsigned int * p_position, uint64_t * p_previous_offset)
+{
+    uint64_t * slots = kv_table_bucket_slots(table, item);
+    unsigned int position = * p_position;
+    if ((slots == NULL) || (offset == 0)) {
+        return offset;
+    }
+    
+    uint64_t tag = KV_BUCKET_SLOT_TAG(hash_value);
+    while (position < KV_BUCKET_SLOT_COUNT) {
+        uint64_t slot = ntoh64(slots[position]);
+        if (bucket_slot_offset(slot) != offset) {
+            // The slots don't match the chain: don't use them.
+            position = KV_BUCKET_SLOT_COUNT;
+            break;
+        }
+        if ((slot & KV_BUCKET_SLOT_TAG_MASK) == tag) {
+            break;
+        }
+        if (position == KV_BUCKET_SLOT_COUNT - 1) {
+            if ((slot & KV_BUCKET_SLOT_MORE_FLAG) == 0) {
+                offset = 0;
+            }
+            // Otherwise, the next block is only known by reading this one.
+            break;
+        }
+        * p_previous_offset = offset;
+        position ++;
+        offset = bucket_slot_offset(ntoh64(slots[position]));
+        if (offset == 0) {
+            break;
+        }
+    }
+    * p_position = position;
+    return offset;
+}
+
+int kv_bucket_slots_match(struct kvdb_table * table, struct kvdb_item * item, uint32_t hash_value,
+                          uint64_t offset, unsigned int position)
+{
+    uint64_t * slots = kv_table_bucket_slots(table, item);
+    if ((slots == NULL) || (offset == 0) || (position >= KV_BUCKET_SLOT_COUNT)) {
+        return 0;
+    }
+    
+    uint64_t slot = ntoh64(slots[position]);
+    return (bucket_slot_offset(slot) == offset) && ((slot & KV_BUCKET_SLOT_TAG_MASK) == KV_BUCKET_SLOT_TAG(hash_value));
+}
+
+char * kv_bucket_cell_lookup(struct kvdb_table * table, struct kvdb_item * item, uint32_t hash_value,
+                             const char * key, size_t key_size)
+{
+    char * cells = kv_table_bucket_cells(table, item);
+    if (cells == NULL) {
+        return NULL;
+    }
+    for(unsigned int i = 0 ; i < KV_BUCKET_CELL_COUNT ; i ++) {
+        char * cell = cells + i * KV_BUCKET_CELL_SIZE;
+        if ((cell[KV_BUCKET_CELL_FLAGS_OFFSET] & KV_BUCKET_CELL_FLAG_USED) == 0) {
+            continue;
+        }
+        if ((kv_bucket_cell_hash_value(cell) != hash_value) || (kv_bucket_cell_key_size(cell) != key_size)) {
+            continue;
+        }
+        if (memcmp(kv_bucket_cell_key(cell), key, key_size) == 0) {
+            return cell;
+        }
+    }
+    return NULL;
+}
+
+char * kv_bucket_cell_get_free(struct kvdb_table * table, struct kvdb_item * item)
+{
+    char * cells = kv_table_bucket_cells(table, item);
+    if (cells == NULL) {
+        return NULL;
+    }
+    for(unsigned int i = 0 ; i < KV_BUCKET_CELL_COUNT ; i ++) {
+        char * cell = cells + i * KV_BUCKET_CELL_SIZE;
+        if (cell[KV_BUCKET_CELL_FLAGS_OFFSET] == 0) {
+            return cell;
+        }
+    }
+    return NULL;
+}
+
+void kv_bucket_cell_write(char * cell, char flags, uint32_t hash_value,
+                          const char * key, size_t key_size, const char * value, size_t value_size)
+{
+    cell[KV_BUCKET_CELL_KEY_SIZE_OFFSET] = (char) key_size;
+    cell[KV_BUCKET_CELL_VALUE_SIZE_OFFSET] = (char) value_size;
+    cell[KV_BUCKET_CELL_VALUE_SIZE_OFFSET + 1] = 0;
+    h32_to_bytes(cell + KV_BUCKET_CELL_HASH_VALUE_OFFSET, hash_value);
+    memcpy(cell + KV_BUCKET_CELL_DATA_OFFSET, key, key_size);
+    memcpy(cell + KV_BUCKET_CELL_DATA_OFFSET + key_size, value, value_size);
+    cell[KV_BUCKET_CELL_FLAGS_OFFSET] = flags;
+}
+
+// moves the key and the value of a cell to the given bucket.
+// a block is created if the bucket has no empty cell.
+// Returns -1 if there's an I/O error.
+static int bucket_cell_move(kvdb * db, char * cell, struct kvdb_table * table, struct kvdb_item * item)
+{
+    uint32_t hash_value = kv_bucket_cell_hash_value(cell);
+    const char * key = kv_bucket_cell_key(cell);
+    size_t key_size = kv_bucket_cell_key_size(cell);
+    const char * value = kv_bucket_cell_value(cell);
+    size_t value_size = kv_bucket_cell_value_size(cell);
+    
+    char * new_cell = kv_bucket_cell_get_free(table, item);
+    if (new_cell != NULL) {
+        kv_bucket_cell_write(new_cell, KV_BUCKET_CELL_FLAG_USED, hash_value, key, key_size, value, value_size);
+    }
+    else {
+        uint64_t offset = kv_block_create(db, ntoh64(item->kv_offset), hash_value, key, key_size, value, value_size);
+        if (offset == 0) {
+            return -1;
+        }
+        item->kv_offset = hton64(offset);
+        kv_bucket_slots_push(table, item, offset, hash_value);
+    }
+    uint32_t hash_values[KV_BLOOM_FILTER_HASH_COUNT];
+    table_bloom_filter_compute_hash(db, hash_values, KV_BLOOM_FILTER_HASH_COUNT, key, key_size);
+    table_bloom_filter_set(table, hash_values + 1, KV_BLOOM_FILTER_HASH_COUNT - 1);
+    memset(cell, 0, KV_BUCKET_CELL_SIZE);
+    
+    return 0;
+}
+
+// returns the bucket at the given address of the linear hashing table.
+// the first table has firstmaxcount buckets, then each table has as many buckets as all the previous ones.
+// Returns NULL if the table of the bucket has not been created yet.
+static struct kvdb_item * linear_bucket_at(kvdb * db, uint64_t address, struct kvdb_table ** p_table)
+{
+    struct kvdb_table * table = db->kv_first_table;
+    uint64_t base = 0;
+    uint64_t size = db->kv_firstmaxcount;
+    while (address >= base + size) {
+        base += size;
+        size = base;
+        table = table->kv_next_table;
+        if (table == NULL) {
+            return NULL;
+        }
+    }
+    * p_table = table;
+    return &table->kv_items[address - base];
+}
+
+static uint64_t linear_address(kvdb * db, uint32_t hash_value)
+{
+    uint64_t level = ntoh64(* db->kv_linear_level);
+    uint64_t split = ntoh64(* db->kv_linear_split);
+    uint64_t address = kv_bucket_select(db->kv_bucket_selection, hash_value, db->kv_firstmaxcount << level);
+    if (address < split) {
+        // the bucket has already been split during this round.
+        address = kv_bucket_select(db->kv_bucket_selection, hash_value, db->kv_firstmaxcount << (level + 1));
+    }
+    return address;
+}
+
+struct kvdb_item * kv_linear_bucket(kvdb * db, uint32_t hash_value, struct kvdb_table ** p_table)
+{
+    return linear_bucket_at(db, linear_address(db, hash_value), p_table);
+}
+
+// a chain of blocks built while splitting a bucket.
+struct linear_split_chain {
+    uint64_t head;
+    uint64_t tail;
+    // next offset currently stored in the tail block.
+    uint64_t tail_next_offset;
+};
+
+static int linear_split_chain_append(kvdb * db, struct linear_split_chain * chain,
+                                     uint64_t offset, uint64_t next_offset)
+{
+    if (chain->head == 0) {
+        chain->head = offset;
+    }
+    else if (chain->tail_next_offset != offset) {
+        int r = kv_block_write_next_offset(db, chain->tail, offset);
+        if (r < 0) {
+            return -1;
+        }
+    }
+    chain->tail = offset;
+    chain->tail_next_offset = next_offset;
+    return 0;
+}
+
+static int linear_split_chain_terminate(kvdb * db, struct linear_split_chain * chain)
+{
+    if ((chain->head == 0) || (chain->tail_next_offset == 0)) {
+        return 0;
+    }
+    return kv_block_write_next_offset(db, chain->tail, 0);
+}
+
+#define BLOCK_PRE_READ_KEY_SIZE 128
+
+// adds the key of a block to the bloom filter of the given table.
+// block_header_data contains the first bytes of the block, the rest of the key is read if needed.
+// Returns -1 if there's an I/O error.
+static int table_bloom_filter_set_block_key(kvdb * db, struct kvdb_table * table, uint64_t offset,
+                                            char * block_header_data, ssize_t pre_read_size, uint64_t key_size)
+{
+    char * key = block_header_data + KV_BLOCK_KEY_BYTES_OFFSET;
+    char * allocated = NULL;
+    if (KV_BLOCK_KEY_BYTES_OFFSET + key_size > (uint64_t) pre_read_size) {
+        allocated = malloc((size_t) key_size);
+        key = allocated;
+        int r = kv_pread(db->kv_fd, key, (size_t) key_size, offset + KV_BLOCK_KEY_BYTES_OFFSET);
+        if (r < 0) {
+            free(allocated);
+            return -1;
+        }
+    }
+    uint32_t hash_values[KV_BLOOM_FILTER_HASH_COUNT];
+    table_bloom_filter_compute_hash(db, hash_values, KV_BLOOM_FILTER_HASH_COUNT, key, (size_t) key_size);
+    table_bloom_filter_set(table, hash_values + 1, KV_BLOOM_FILTER_HASH_COUNT - 1);
+    free(allocated);
+    return 0;
+}
+
+// splits the next bucket: its items are shared with a new bucket at the end of the table.
+static int linear_split(kvdb * db)
+{
+    uint64_t level = ntoh64(* db->kv_linear_level);
+    uint64_t split = ntoh64(* db->kv_linear_split);
+    uint64_t round_size = db->kv_firstmaxcount << level;
+    uint64_t new_address = split + round_size;
+    struct kvdb_table * table = NULL;
+    struct kvdb_table * new_table = NULL;
+    struct kvdb_item * item;
+    struct kvdb_item * new_item;
+    int r;
+    
+    item = linear_bucket_at(db, split, &table);
+    new_item = linear_bucket_at(db, new_address, &new_table);
+    if (new_item == NULL) {
+        // Add a table with as many buckets as the existing ones.
+        struct kvdb_table * last_table = db->kv_first_table;
+        while (last_table->kv_next_table != NULL) {
+            last_table = last_table->kv_next_table;
+        }
+        uint64_t offset = kv_table_create(db, new_address, &last_table->kv_next_table);
+        if (offset == 0) {
+            return -1;
+        }
+        * last_table->kv_next_table_offset = hton64(offset);
+        new_item = linear_bucket_at(db, new_address, &new_table);
+    }
+    
+    // Dispatch the blocks of the chain between the two buckets.
+    struct linear_split_chain kept_chain = { 0, 0, 0 };
+    struct linear_split_chain moved_chain = { 0, 0, 0 };
+    uint64_t offset = ntoh64(item->kv_offset);
+    while (offset != 0) {
+        char block_header_data[KV_BLOCK_KEY_BYTES_OFFSET + BLOCK_PRE_READ_KEY_SIZE];
+        ssize_t count = pread(db->kv_fd, block_header_data, sizeof(block_header_data), (off_t) offset);
+        if (count < KV_BLOCK_KEY_BYTES_OFFSET) {
+            return -1;
+        }
+        char * p = block_header_data;
+        uint64_t next_offset = bytes_to_h64(p);
+        p += 8;
+        uint32_t hash_value = bytes_to_h32(p);
+        p += 4 + 1;
+        uint64_t key_size = bytes_to_h64(p);
+        
+        if (kv_bucket_select(db->kv_bucket_selection, hash_value, round_size * 2) == split) {
+            r = linear_split_chain_append(db, &kept_chain, offset, next_offset);
+        }
+        else {
+            r = linear_split_chain_append(db, &moved_chain, offset, next_offset);
+            if (r == 0) {
+                // The bloom filter of the table of the new bucket needs the key.
+                r = table_bloom_filter_set_block_key(db, new_table, offset, block_header_data, count, key_size);
+            }
+        }
+        if (r < 0) {
+            return -1;
+        }
+        offset = next_offset;
+    }
+    r = linear_split_chain_terminate(db, &kept_chain);
+    if (r < 0) {
+        return -1;
+    }
+    r = linear_split_chain_terminate(db, &moved_chain);
+    if (r < 0) {
+        return -1;
+    }
+    item->kv_offset = hton64(kept_chain.head);
+    new_item->kv_offset = hton64(moved_chain.head);
+    char * cells = kv_table_bucket_cells(table, item);
+    if (cells != NULL) {
+        for(unsigned int i = 0 ; i < KV_BUCKET_CELL_COUNT ; i ++) {
+            char * cell = cells + i * KV_BUCKET_CELL_SIZE;
+            if ((cell[KV_BUCKET_CELL_FLAGS_OFFSET] & KV_BUCKET_CELL_FLAG_USED) == 0) {
+                continue;
+            }
+            if (kv_bucket_select(db->kv_bucket_selection, kv_bucket_cell_hash_value(cell), round_size * 2) == split) {
+                continue;
+            }
+            r = bucket_cell_move(db, cell, new_table, new_item);
+            if (r < 0) {
+                return -1;
+            }
+        }
+    }
+    r = kv_bucket_slots_rebuild(db, table, item);
+    if (r < 0) {
+        return -1;
+    }
+    r = kv_bucket_slots_rebuild(db, new_table, new_item);
+    if (r < 0) {
+        return -1;
+    }
+    
+    split ++;
+    if (split == round_size) {
+        split = 0;
+        level ++;
+        * db->kv_linear_level = hton64(level);
+    }
+    * db->kv_linear_split = hton64(split);
+    
+    return 0;
+}
+
+int kv_linear_needs_grow(kvdb * db)
+{
+    uint64_t level = ntoh64(* db->kv_linear_level);
+    uint64_t split = ntoh64(* db->kv_linear_split);
+    uint64_t bucket_count = (db->kv_firstmaxcount << level) + split;
+    return ntoh64(__atomic_load_n(db->kv_first_table->kv_count, __ATOMIC_RELAXED)) > bucket_count * KV_MAX_MEAN_COLLISION;
+}
+
+int kv_linear_grow(kvdb * db)
+{
+    while (kv_linear_needs_grow(db)) {
+        // Items move between buckets: readers will look again and the keys can't be enumerated.
+        kv_structure_write_lock(db);
+        kv_global_write_begin(db);
+        int r = linear_split(db);
+        kv_global_write_end(db);
+        kv_structure_write_unlock(db);
+        if (r < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Returns 1 if new items should go to a table after the given one.
+static int table_is_full(struct kvdb_table * table)
+{
+    uint64_t count = ntoh64(__atomic_load_n(table->kv_count, __ATOMIC_RELAXED));
+    return count > ntoh64(* table->kv_maxcount) * KV_MAX_MEAN_COLLISION;
+}
+
+// sets the table where new items are inserted.
+// Returns -1 if there's an I/O error.
+static int select_table(kvdb * db)
+{
+    struct kvdb_table * table = __atomic_load_n(&db->kv_current_table, __ATOMIC_ACQUIRE);
+    if ((table != NULL) && !table_is_full(table)) {
+        return 0;
+    }
+    
+    // Writers of single keys might fill the table at the same time.
+    kv_alloc_lock(db);
+    if (db->kv_current_table == NULL) {
+        db->kv_current_table = db->kv_first_table;
+    }
+    
+    table = db->kv_current_table;
+    while (table_is_full(table)) {
+        if (table->kv_next_table == NULL) {
+            uint64_t nextsize = kv_table_round_count(db, ntoh64(* table->kv_maxcount) * 2);
+            uint64_t offset = kv_table_create(db, nextsize, &table->kv_next_table);
+            if (offset == 0) {
+                kv_alloc_unlock(db);
+                return -1;
+            }
+            * table->kv_next_table_offset = hton64(offset);
+        }
+        
+        table = table->kv_next_table;
+    }
+    __atomic_store_n(&db->kv_current_table, table, __ATOMIC_RELEASE);
+    kv_alloc_unlock(db);
+    
+    return 0;
+}
+
+int kv_select_bucket(kvdb * db, uint32_t hash_value, struct kvdb_table ** p_table,
+                     struct kvdb_item ** p_item, uint64_t ** p_count)
+{
+    if (db->kv_storage_type == KVDB_STORAGE_TYPE_LINEAR_HASHING) {
+        // The number of items of the whole table is stored in the first table.
+        * p_item = kv_linear_bucket(db, hash_value, p_table);
+        * p_count = db->kv_first_table->kv_count;
+        return 0;
+    }
+    
+    int r = select_table(db);
+    if (r < 0) {
+        return -1;
+    }
+    struct kvdb_table * table = __atomic_load_n(&db->kv_current_table, __ATOMIC_ACQUIRE);
+    * p_table = table;
+    * p_item = kv_table_bucket(table, hash_value);
+    * p_count = table->kv_count;
+    return 0;
+}
+
+// returns the table stored at the given offset of the file.
+// Returns NULL if it's not in the chain of tables.
+struct kvdb_table * kv_table_at_offset(kvdb * db, uint64_t offset)
+{
+    struct kvdb_table * table = db->kv_first_table;
+    while (table != NULL) {
+        if (table->kv_offset == offset) {
+            return table;
+        }
+        table = table->kv_next_table;
+    }
+    return NULL;
+}
+
+// creates the table that will receive the items of all the tables except the first one.
+// the first table stays in the chain since it's part of the first mapping of the file, its items are not moved.
+// Returns 0 if there's nothing to consolidate, -1 if there's an I/O error.
+static int consolidation_start(kvdb * db)
+{
+    struct kvdb_table * first_table = db->kv_first_table;
+    if ((first_table->kv_next_table == NULL) || (first_table->kv_next_table->kv_next_table == NULL)) {
+        return 0;
+    }
+    
+    uint64_t count = 0;
+    struct kvdb_table * last_table = first_table;
+    while (last_table->kv_next_table != NULL) {
+        last_table = last_table->kv_next_table;
+        count += ntoh64(* last_table->kv_count);
+    }
+    // Leave room for the table to grow.
+    uint64_t maxcount = count * 2 / KV_MAX_MEAN_COLLISION;
+    if (maxcount < db->kv_firstmaxcount) {
+        maxcount = db->kv_firstmaxcount;
+    }
+    maxcount = kv_table_round_count(db, maxcount);
+    uint64_t offset = kv_table_create(db, maxcount, &last_table->kv_next_table);
+    if (offset == 0) {
+        return -1;
+    }
+    * last_table->kv_next_table_offset = hton64(offset);
+    
+    * db->kv_consolidation_table = hton64(offset);
+    * db->kv_consolidation_source = hton64(first_table->kv_next_table->kv_offset);
+    * db->kv_consolidation_bucket = hton64(0);
+    
+    return 1;
+}
+
+// moves the first item of the given bucket to the destination table.
+// Returns -1 if there's an I/O error.
+static int consolidation_move_item(kvdb * db, struct kvdb_table * source, struct kvdb_item * item,
+                                   struct kvdb_table * destination)
+{
+    uint64_t offset = ntoh64(item->kv_offset);
+    char block_header_data[KV_BLOCK_KEY_BYTES_OFFSET + BLOCK_PRE_READ_KEY_SIZE];
+    ssize_t count = pread(db->kv_fd, block_header_data, sizeof(block_header_data), (off_t) offset);
+    if (count < KV_BLOCK_KEY_BYTES_OFFSET) {
+        return -1;
+    }
+    char * p = block_header_data;
+    uint64_t next_offset = bytes_to_h64(p);
+    p += 8;
+    uint32_t hash_value = bytes_to_h32(p);
+    p += 4 + 1;
+    uint64_t key_size = bytes_to_h64(p);
+    
+    int r = table_bloom_filter_set_block_key(db, destination, offset, block_header_data, count, key_size);
+    if (r < 0) {
+        return -1;
+    }
+    struct kvdb_item * destination_item = kv_table_bucket(destination, hash_value);
+    r = kv_block_write_next_offset(db, offset, ntoh64(destination_item->kv_offset));
+    if (r < 0) {
+        return -1;
+    }
+    destination_item->kv_offset = hton64(offset);
+    kv_bucket_slots_push(destination, destination_item, offset, hash_value);
+    item->kv_offset = hton64(next_offset);
+    r = kv_bucket_slots_remove(db, source, item, offset);
+    if (r < 0) {
+        return -1;
+    }
+    
+    * destination->kv_count = hton64(ntoh64(* destination->kv_count) + 1);
+    * source->kv_count = hton64(ntoh64(* source->kv_count) - 1);
+    
+    return 0;
+}
+
+// moves the keys stored in the cells of the given bucket to the destination table.
+// Returns -1 if there's an I/O error.
+static int consolidation_move_cells(kvdb * db, struct kvdb_table * source, struct kvdb_item * item,
+                                    struct kvdb_table * destination)
+{
+    char * cells = kv_table_bucket_cells(source, item);
+    if (cells == NULL) {
+        return 0;
+    }
+    for(unsigned int i = 0 ; i < KV_BUCKET_CELL_COUNT ; i ++) {
+        char * cell = cells + i * KV_BUCKET_CELL_SIZE;
+        if ((cell[KV_BUCKET_CELL_FLAGS_OFFSET] & KV_BUCKET_CELL_FLAG_USED) == 0) {
+            continue;
+        }
+        struct kvdb_item * destination_item = kv_table_bucket(destination, kv_bucket_cell_hash_value(cell));
+        int r = bucket_cell_move(db, cell, destination, destination_item);
+        if (r < 0) {
+            return -1;
+        }
+        * destination->kv_count = hton64(ntoh64(* destination->kv_count) + 1);
+        * source->kv_count = hton64(ntoh64(* source->kv_count) - 1);
+    }
+    return 0;
+}
+
+// returns a table that still has items to move to the destination table.
+static struct kvdb_table * consolidation_next_source(kvdb * db, struct kvdb_table * destination)
+{
+    struct kvdb_table * table = db->kv_first_table->kv_next_table;
+    while (table != NULL) {
+        if ((table != destination) && (* table->kv_count != 0)) {
+            return table;
+        }
+        table = table->kv_next_table;
+    }
+    return NULL;
+}
+
+// removes the emptied tables from the chain of tables and recycles their space in the file.
+static int consolidation_finish(kvdb * db, struct kvdb_table * destination)
+{
+    struct kvdb_table * first_table = db->kv_first_table;
+    struct kvdb_table * table = first_table->kv_next_table;
+    struct kvdb_table * after_destination = destination->kv_next_table;
+    
+    kv_global_write_begin(db);
+    first_table->kv_next_table = destination;
+    * first_table->kv_next_table_offset = hton64(destination->kv_offset);
+    destination->kv_next_table = NULL;
+    * destination->kv_next_table_offset = hton64(0);
+    kv_tables_generation_bump(db);
+    kv_global_write_end(db);
+    * db->kv_consolidation_table = hton64(0);
+    * db->kv_consolidation_source = hton64(0);
+    * db->kv_consolidation_bucket = hton64(0);
+    db->kv_current_table = NULL;
+    
+    int has_error = 0;
+    while (table != NULL) {
+        struct kvdb_table * next_table = table->kv_next_table;
+        if (table == destination) {
+            next_table = after_destination;
+        }
+        else {
+            uint64_t offset = table->kv_offset;
+            uint64_t size = KV_TABLE_SIZE(ntoh64(* table->kv_maxcount), ntoh64(* table->kv_bloom_filter_size),
+                                          db->kv_bucket_slot_count, db->kv_bucket_cell_count);
+            if (db->kv_concurrent) {
+                // Readers might still be using the table.
+                table->kv_next_table = db->kv_retired_tables;
+                db->kv_retired_tables = table;
+            }
+            else {
+                table->kv_next_table = NULL;
+                unmap_table(table);
+            }
+            int r = kv_block_recycle_region(db, offset, size);
+            if (r < 0) {
+                has_error = 1;
+            }
+        }
+        table = next_table;
+    }
+    
+    return has_error ? -1 : 0;
+}
+
+int kv_tables_consolidate(kvdb * db, uint64_t budget)
+{
+    int r;
+    
+    if (db->kv_storage_type == KVDB_STORAGE_TYPE_LINEAR_HASHING) {
+        // There's already a single table.
+        return 0;
+    }
+    
+    if (* db->kv_consolidation_table == 0) {
+        r = consolidation_start(db);
+        if (r <= 0) {
+            return r;
+        }
+    }
+    
+    struct kvdb_table * destination = kv_table_at_offset(db, ntoh64(* db->kv_consolidation_table));
+    if (destination == NULL) {
+        return -1;
+    }
+    // New items go to the destination table.
+    db->kv_current_table = destination;
+    
+    struct kvdb_table * source = NULL;
+    while (budget > 0) {
+        uint64_t source_offset = ntoh64(* db->kv_consolidation_source);
+        if (source_offset == 0) {
+            // Items might have been added to a table after its buckets have been visited.
+            source = consolidation_next_source(db, destination);
+            if (source == NULL) {
+                kv_structure_write_lock(db);
+                r = consolidation_finish(db, destination);
+                kv_structure_write_unlock(db);
+                if (r < 0) {
+                    return -1;
+                }
+                return 0;
+            }
+            * db->kv_consolidation_source = hton64(source->kv_offset);
+            * db->kv_consolidation_bucket = hton64(0);
+            continue;
+        }
+        if ((source == NULL) || (source->kv_offset != source_offset)) {
+            source = kv_table_at_offset(db, source_offset);
+            if (source == NULL) {
+                return -1;
+            }
+        }
+        
+        uint64_t idx = ntoh64(* db->kv_consolidation_bucket);
+        if ((source == destination) || (* source->kv_count == 0) || (idx >= ntoh64(* source->kv_maxcount))) {
+            // Go to the next table.
+            struct kvdb_table * next_table = source->kv_next_table;
+            * db->kv_consolidation_source = hton64(next_table != NULL ? next_table->kv_offset : 0);
+            * db->kv_consolidation_bucket = hton64(0);
+            continue;
+        }
+        
+        struct kvdb_item * item = &source->kv_items[idx];
+        budget --;
+        // The item is in neither bucket for a moment: readers will look again.
+        int chain_done = (item->kv_offset == 0);
+        kv_structure_write_lock(db);
+        kv_global_write_begin(db);
+        if (chain_done) {
+            r = consolidation_move_cells(db, source, item, destination);
+        }
+        else {
+            r = consolidation_move_item(db, source, item, destination);
+        }
+        kv_global_write_end(db);
+        kv_structure_write_unlock(db);
+        if (r < 0) {
+            return -1;
+        }
+        if (chain_done) {
+            * db->kv_consolidation_bucket = hton64(idx + 1);
+        }
+    }
+    
+    return 1;
+}
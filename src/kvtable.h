@@ -15,33 +15,164 @@
 #include "kvendian.h"
 #include "kvprime.h"
 
+// returns the number of bits of the bloom filter of a new table.
+uint64_t kv_table_bloom_filter_size(kvdb * db, uint64_t maxcount);
+// returns the number of bytes used in the file by a new table.
+uint64_t kv_table_disk_size(kvdb * db, uint64_t maxcount);
+
+// returns the number of buckets of a new table with room for at least maxcount buckets.
+uint64_t kv_table_round_count(kvdb * db, uint64_t maxcount);
+
 int kv_table_header_write(kvdb * db, uint64_t table_start, uint64_t maxcount);
 uint64_t kv_table_create(kvdb * db, uint64_t size, struct kvdb_table ** result);
 
 int kv_tables_setup(kvdb * db);
 void kv_tables_unsetup(kvdb * db);
+// unmaps the tables removed from the database while readers might have been using them.
+void kv_tables_release_retired(kvdb * db);
+// returns the table of the chain at the given offset, NULL if there's none.
+struct kvdb_table * kv_table_at_offset(kvdb * db, uint64_t offset);
+// returns the end of the part of the file mapped for the tables, including the retired ones.
+uint64_t kv_tables_mapped_end(kvdb * db);
+// maps the tables added by other processes, the ones they removed are retired.
+// the writer lock is held.
+// Returns -1 if a table can't be mapped.
+int kv_tables_reload(kvdb * db);
+
+// returns a pointer to the given range of the file if the current read-only mapping of the file covers it.
+// Returns NULL otherwise.
+const char * kv_data_mapping_lookup(kvdb * db, uint64_t offset, uint64_t size);
+// returns a pointer to the given range of the file, in the read-only mapping of the file.
+// the file is mapped again if it has grown.
+// Returns NULL if the range can't be mapped.
+const char * kv_data_mapping_get(kvdb * db, uint64_t offset, uint64_t size);
+// unmap the previous mappings of the file.
+void kv_data_mapping_release_unused(kvdb * db);
+void kv_data_mapping_unsetup(kvdb * db);
 
-static inline int kv_select_table(kvdb * db)
+// returns the index of the bucket of the given hash value among count buckets.
+static inline uint64_t kv_bucket_select(int bucket_selection, uint32_t hash_value, uint64_t count)
 {
-    if (db->kv_current_table == NULL) {
-        db->kv_current_table = db->kv_first_table;
+    if (bucket_selection == KV_BUCKET_SELECTION_MASK) {
+        return hash_value & (count - 1);
     }
-    
-    //fprintf(stderr, "count %i\n", (int) (* db->kv_current_table->kv_count));
-    while (ntoh64(* db->kv_current_table->kv_count) > ntoh64(* db->kv_current_table->kv_maxcount) * KV_MAX_MEAN_COLLISION) {
-        if (db->kv_current_table->kv_next_table == NULL) {
-            uint64_t nextsize = kv_getnextprime(ntoh64(* db->kv_current_table->kv_maxcount) * 2);
-            uint64_t offset = kv_table_create(db, nextsize, &db->kv_current_table->kv_next_table);
-            if (offset == 0) {
-                return -1;
-            }
-            * db->kv_current_table->kv_next_table_offset = hton64(offset);
-        }
-        
-        db->kv_current_table = db->kv_current_table->kv_next_table;
+    return hash_value % count;
+}
+
+// returns the bucket of the given table for the given hash value.
+static inline struct kvdb_item * kv_table_bucket(struct kvdb_table * table, uint32_t hash_value)
+{
+    return &table->kv_items[kv_bucket_select(table->kv_bucket_selection, hash_value, ntoh64(* table->kv_maxcount))];
+}
+
+// returns the slots of the given bucket, NULL if the table has no slots.
+static inline uint64_t * kv_table_bucket_slots(struct kvdb_table * table, struct kvdb_item * item)
+{
+    if (table->kv_bucket_slots == NULL) {
+        return NULL;
+    }
+    return &table->kv_bucket_slots[(item - table->kv_items) * KV_BUCKET_SLOT_COUNT];
+}
+
+// returns the cells of the given bucket, NULL if the table has no cells.
+static inline char * kv_table_bucket_cells(struct kvdb_table * table, struct kvdb_item * item)
+{
+    if (table->kv_bucket_cells == NULL) {
+        return NULL;
+    }
+    return &table->kv_bucket_cells[(item - table->kv_items) * KV_BUCKET_CELL_COUNT * KV_BUCKET_CELL_SIZE];
+}
+
+// returns whether a key and its stored value are small enough to be stored in a cell.
+static inline int kv_bucket_cell_fits(size_t key_size, size_t value_size)
+{
+    return key_size + value_size <= KV_BUCKET_CELL_DATA_SIZE;
+}
+
+static inline uint32_t kv_bucket_cell_hash_value(char * cell)
+{
+    return bytes_to_h32(cell + KV_BUCKET_CELL_HASH_VALUE_OFFSET);
+}
+
+static inline size_t kv_bucket_cell_key_size(char * cell)
+{
+    return (unsigned char) cell[KV_BUCKET_CELL_KEY_SIZE_OFFSET];
+}
+
+static inline const char * kv_bucket_cell_key(char * cell)
+{
+    return cell + KV_BUCKET_CELL_DATA_OFFSET;
+}
+
+static inline size_t kv_bucket_cell_value_size(char * cell)
+{
+    return (unsigned char) cell[KV_BUCKET_CELL_VALUE_SIZE_OFFSET];
+}
+
+static inline const char * kv_bucket_cell_value(char * cell)
+{
+    return cell + KV_BUCKET_CELL_DATA_OFFSET + kv_bucket_cell_key_size(cell);
+}
+
+// returns the cell of the bucket that contains the given key, NULL if there's none.
+char * kv_bucket_cell_lookup(struct kvdb_table * table, struct kvdb_item * item, uint32_t hash_value,
+                             const char * key, size_t key_size);
+// returns an empty cell of the bucket, NULL if there's none.
+char * kv_bucket_cell_get_free(struct kvdb_table * table, struct kvdb_item * item);
+// fills a cell. the key is visible once the flags of the cell are KV_BUCKET_CELL_FLAG_USED.
+void kv_bucket_cell_write(char * cell, char flags, uint32_t hash_value,
+                          const char * key, size_t key_size, const char * value, size_t value_size);
+
+// updates the slots of a bucket when a block is added at the head of its chain.
+void kv_bucket_slots_push(struct kvdb_table * table, struct kvdb_item * item, uint64_t offset, uint32_t hash_value);
+// updates the slots of a bucket when a block has been removed from its chain.
+// the headers of the blocks that follow might be read.
+// Returns -1 if there's an I/O error.
+int kv_bucket_slots_remove(kvdb * db, struct kvdb_table * table, struct kvdb_item * item, uint64_t offset);
+// computes the slots of a bucket by reading the headers of the first blocks of its chain.
+// Returns -1 if there's an I/O error.
+int kv_bucket_slots_rebuild(kvdb * db, struct kvdb_table * table, struct kvdb_item * item);
+// returns the next block of the chain that might have the given hash value, starting at the block at offset.
+// the blocks that can't match are skipped using the slots, without reading them.
+// p_position is the position in the chain of the block at offset, it's updated to the one of the returned block.
+// p_previous_offset is set to the offset of the block before the returned one when blocks are skipped.
+// Returns 0 if no more blocks of the chain can match.
+uint64_t kv_bucket_slots_seek(struct kvdb_table * table, struct kvdb_item * item, uint32_t hash_value,
+                              uint64_t offset, unsigned int * p_position, uint64_t * p_previous_offset);
+// returns 1 if the slot at the given position of the chain is the block at offset and has the tag of the given
+// hash value: the block is then likely the one looked up.
+int kv_bucket_slots_match(struct kvdb_table * table, struct kvdb_item * item, uint32_t hash_value,
+                          uint64_t offset, unsigned int position);
+
+// returns the bucket of the linear hashing table for the given hash value.
+// p_table is set to the table that contains the bucket.
+struct kvdb_item * kv_linear_bucket(kvdb * db, uint32_t hash_value, struct kvdb_table ** p_table);
+
+// returns 1 if the mean number of items per bucket of the linear hashing table is too high.
+int kv_linear_needs_grow(kvdb * db);
+
+// splits buckets of the linear hashing table until the mean number of items per bucket is low enough.
+// Returns -1 if there's an I/O error.
+int kv_linear_grow(kvdb * db);
+
+// selects the bucket where a new item with the given hash value will be inserted.
+// p_count is set to the counter of items to increment.
+// Returns -1 if there's an I/O error.
+int kv_select_bucket(kvdb * db, uint32_t hash_value, struct kvdb_table ** p_table,
+                     struct kvdb_item ** p_item, uint64_t ** p_count);
+
+// moves items from the tables added after the first one to a single table, doing at most budget steps.
+// Returns 0 when done, 1 if there's more to do, -1 if there's an I/O error.
+int kv_tables_consolidate(kvdb * db, uint64_t budget);
+
+// adds delta to the number of items of a table.
+// writers of different buckets might change it at the same time.
+static inline void kv_table_count_add(uint64_t * count, int64_t delta)
+{
+    uint64_t value = __atomic_load_n(count, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(count, &value, hton64(ntoh64(value) + delta), 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
     }
-    
-    return 0;
 }
 
 
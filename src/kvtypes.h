@@ -11,21 +11,79 @@
 
 #include <inttypes.h>
 #include <sys/types.h>
+#include <pthread.h>
 
 #include "kvdb.h"
 
-#define KV_HEADER_SIZE (4 + 4 + 8 + 1 + 8 + 64 * 8)
+#define KV_HEADER_V5_SIZE (4 + 4 + 8 + 1 + 8 + 64 * 8)
+#define KV_HEADER_SIZE 4096
 #define KV_HEADER_MARKER_OFFSET 0
 #define KV_HEADER_VERSION_OFFSET 4
 #define KV_HEADER_FIRSTMAXCOUNT_OFFSET (4 + 4)
+#define KV_HEADER_COMPRESSION_TYPE_OFFSET (4 + 4 + 8)
 #define KV_HEADER_FILESIZE_OFFSET (4 + 4 + 8 + 1)
 #define KV_HEADER_FREELIST_OFFSET (4 + 4 + 8 + 1 + 8)
+#define KV_HEADER_STORAGE_TYPE_OFFSET KV_HEADER_V5_SIZE
+#define KV_HEADER_LINEAR_LEVEL_OFFSET (KV_HEADER_V5_SIZE + 1)
+#define KV_HEADER_LINEAR_SPLIT_OFFSET (KV_HEADER_V5_SIZE + 1 + 8)
+#define KV_HEADER_CONSOLIDATION_TABLE_OFFSET (KV_HEADER_V5_SIZE + 1 + 8 + 8)
+#define KV_HEADER_CONSOLIDATION_SOURCE_OFFSET (KV_HEADER_V5_SIZE + 1 + 8 + 8 + 8)
+#define KV_HEADER_CONSOLIDATION_BUCKET_OFFSET (KV_HEADER_V5_SIZE + 1 + 8 + 8 + 8 + 8)
+#define KV_HEADER_BLOOM_FILTER_TYPE_OFFSET (KV_HEADER_V5_SIZE + 1 + 8 + 8 + 8 + 8 + 8)
+#define KV_HEADER_BLOOM_FILTER_BITS_PER_KEY_OFFSET (KV_HEADER_V5_SIZE + 1 + 8 + 8 + 8 + 8 + 8 + 1)
+#define KV_HEADER_BUCKET_SLOT_COUNT_OFFSET (KV_HEADER_V5_SIZE + 1 + 8 + 8 + 8 + 8 + 8 + 1 + 1)
+#define KV_HEADER_BUCKET_CELL_COUNT_OFFSET (KV_HEADER_V5_SIZE + 1 + 8 + 8 + 8 + 8 + 8 + 1 + 1 + 1)
+#define KV_HEADER_BLOCK_SIZE_CLASSES_OFFSET (KV_HEADER_V5_SIZE + 1 + 8 + 8 + 8 + 8 + 8 + 1 + 1 + 1 + 1)
+#define KV_HEADER_VACUUM_TABLE_OFFSET (KV_HEADER_V5_SIZE + 1 + 8 + 8 + 8 + 8 + 8 + 1 + 1 + 1 + 1 + 1)
+#define KV_HEADER_VACUUM_BUCKET_OFFSET (KV_HEADER_V5_SIZE + 1 + 8 + 8 + 8 + 8 + 8 + 1 + 1 + 1 + 1 + 1 + 8)
+#define KV_HEADER_DICTIONARY_OFFSET (KV_HEADER_V5_SIZE + 1 + 8 + 8 + 8 + 8 + 8 + 1 + 1 + 1 + 1 + 1 + 8 + 8)
+#define KV_HEADER_BUCKET_SELECTION_OFFSET (KV_HEADER_V5_SIZE + 1 + 8 + 8 + 8 + 8 + 8 + 1 + 1 + 1 + 1 + 1 + 8 + 8 + 8)
+#define KV_HEADER_HASH_FUNCTION_OFFSET (KV_HEADER_V5_SIZE + 1 + 8 + 8 + 8 + 8 + 8 + 1 + 1 + 1 + 1 + 1 + 8 + 8 + 8 + 1)
+#define KV_HEADER_FREE_REGIONS_OFFSET (KV_HEADER_V5_SIZE + 1 + 8 + 8 + 8 + 8 + 8 + 1 + 1 + 1 + 1 + 1 + 8 + 8 + 8 + 1 + 1)
+#define KV_HEADER_VACUUM_MOVE_OFFSET (KV_HEADER_V5_SIZE + 1 + 8 + 8 + 8 + 8 + 8 + 1 + 1 + 1 + 1 + 1 + 8 + 8 + 8 + 1 + 1 + 8)
+#define KV_HEADER_GENERATION_OFFSET 1024
+#define KV_HEADER_WRITER_ACTIVE_OFFSET (1024 + 8)
+#define KV_HEADER_GLOBAL_SEQ_OFFSET (1024 + 8 + 4)
+#define KV_HEADER_CLASS_FREELIST_OFFSET 1088
+#define KV_HEADER_BUCKET_SEQS_OFFSET 2048
 
 // 1. marker                                  4 bytes
 // 2. version                                 4 bytes
 // 3. first table max count                   8 bytes
-// 4. storage type                            1 byte
-// 5. recycled blocks offset (for each size)  64 * 8 bytes
+// 4. compression type                        1 byte
+// 5. file size                               8 bytes
+// 6. recycled blocks offset (for each size)  64 * 8 bytes
+// version 6 and later, the header is KV_HEADER_SIZE bytes:
+// 7. storage type                            1 byte
+// 8. linear hashing level                    8 bytes
+// 9. linear hashing next bucket to split     8 bytes
+// 10. consolidation destination table        8 bytes
+// 11. consolidation source table             8 bytes
+// 12. consolidation next bucket to move      8 bytes
+// 13. bloom filter type                      1 byte
+// 14. bloom filter bits per key              1 byte
+// 15. number of slots per bucket             1 byte
+// 16. number of cells per bucket             1 byte
+// 17. block size classes per doubling        1 byte
+// 18. vacuum table                           8 bytes
+// 19. vacuum next bucket to visit            8 bytes
+// 20. newest dictionary of the values        8 bytes
+// 21. selection of the bucket of a key       1 byte
+// 22. hash function of the keys              1 byte
+// 23. first free region taken by the vacuum  8 bytes
+// 24. block being moved by the vacuum        8 bytes
+// 25. new offset of the block being moved    8 bytes
+// 26. size of the block being moved          8 bytes
+// 27. unused
+// state shared by the processes using the file in multi-process mode, in host order:
+// 28. generation of the chain of tables      8 bytes, at KV_HEADER_GENERATION_OFFSET
+// 29. a writer is changing the file          4 bytes
+// 30. global sequence counter                4 bytes
+// 31. unused
+// 32. recycled blocks offset (for each size class between two powers of 2)
+//                                            KV_BLOCK_INTERMEDIATE_CLASS_COUNT * 8 bytes, at KV_HEADER_CLASS_FREELIST_OFFSET
+// 33. unused
+// 34. sequence counters of the buckets       KV_BUCKET_SEQ_COUNT * 4 bytes, at KV_HEADER_BUCKET_SEQS_OFFSET
 
 /*
  table:
@@ -33,10 +91,27 @@
  2. count:                               8 bytes
  3. bloom_size:                          8 bytes
  4. maxcount                             8 bytes
- 5. bloom filter table                   BLOOM_FILTER_SIZE(size) bytes
+ 5. bloom filter table                   BLOOM_FILTER_SIZE(bloom_size) bytes
  6. offset to items (actual hash table)  maxcount items of 8 bytes
+ 7. slots of the buckets                 maxcount * slot_count slots of 8 bytes
+ 8. cells of the buckets                 maxcount * cell_count cells of 32 bytes
  
- table mapping size: 8 + 8 + 8 + 8 + BLOOM_FILTER_SIZE(maxcount) + (maxcount * 8)
+ table mapping size: 8 + 8 + 8 + 8 + BLOOM_FILTER_SIZE(bloom_size) + (maxcount * 8) + (maxcount * slot_count * 8)
+   + (maxcount * cell_count * 32)
+ 
+ the slots of a bucket describe the first blocks of its chain, so that blocks of other keys can be
+ skipped without reading them.
+ slot: 1. tag: high bits of the hash value   16 bits
+       2. more blocks after the last slot    1 bit
+       3. offset of the block                47 bits
+ 
+ the cells of a bucket store small keys and values in the table, without a block.
+ cell: 1. flags                              1 byte
+       2. key size                           1 byte
+       3. value size                         1 byte
+       4. unused                             1 byte
+       5. hash value                         4 bytes
+       6. key bytes, then value bytes        24 bytes
 */
 
 #define KV_TABLE_NEXT_TABLE_OFFSET_OFFSET 0
@@ -44,40 +119,111 @@
 #define KV_TABLE_BLOOM_SIZE_OFFSET 16
 #define KV_TABLE_MAX_COUNT_OFFSET 24
 #define KV_TABLE_BLOOM_FILTER_OFFSET 32
-#define KV_TABLE_ITEMS_OFFSET_OFFSET(maxcount) (KV_TABLE_HEADER_SIZE + KV_TABLE_BLOOM_FILTER_SIZE(maxcount))
+#define KV_TABLE_ITEMS_OFFSET_OFFSET(bloomsize) (KV_TABLE_HEADER_SIZE + KV_TABLE_BLOOM_FILTER_SIZE(bloomsize))
 
 #define KV_TABLE_HEADER_SIZE (8 + 8 + 8 + 8)
 
-#define KV_TABLE_SIZE(maxcount) (KV_TABLE_HEADER_SIZE + KV_TABLE_BLOOM_FILTER_SIZE(maxcount) + maxcount * 8)
+#define KV_TABLE_SIZE(maxcount, bloomsize, slotcount, cellcount) \
+    (KV_TABLE_HEADER_SIZE + KV_TABLE_BLOOM_FILTER_SIZE(bloomsize) + maxcount * 8 * (1 + slotcount) + \
+     maxcount * KV_BUCKET_CELL_SIZE * cellcount)
 #define KV_FIRST_TABLE_MAX_COUNT (1 << 17)
 
-#define KV_TABLE_BITS_FOR_BLOOM_FILTER 5
-#define KV_TABLE_BLOOM_FILTER_SIZE(maxcount) (KV_BYTE_ROUND_UP(kv_getnextprime(maxcount * KV_TABLE_BITS_FOR_BLOOM_FILTER)) / 8)
+// bloomsize is the number of bits of the bloom filter.
+#define KV_TABLE_BLOOM_FILTER_SIZE(bloomsize) (KV_BYTE_ROUND_UP(bloomsize) / 8)
 #define KV_BLOOM_FILTER_HASH_COUNT 3
 
+// bloom filter of version 5 files: the bits of the keys are spread over the whole filter.
+#define KV_BLOOM_FILTER_TYPE_LEGACY 0
+// the bits of a key are all in a block of KV_BLOOM_FILTER_BLOCK_SIZE bytes.
+// tables using it start at a multiple of KV_BLOOM_FILTER_BLOCK_SIZE so that a block never spans two cache lines.
+#define KV_BLOOM_FILTER_TYPE_BLOCKED 1
+
+#define KV_TABLE_BITS_FOR_BLOOM_FILTER 5
+#define KV_BLOOM_FILTER_BLOCK_SIZE 32
+#define KV_BLOOM_FILTER_DEFAULT_BITS_PER_KEY 10
+
 #define KV_MAX_MEAN_COLLISION 3
 
+// tables of the files created before: the number of buckets is a prime number and the bucket of a key is
+// its hash value modulo the number of buckets.
+#define KV_BUCKET_SELECTION_MODULO 0
+// the number of buckets is a power of 2 and the bucket of a key is given by the low bits of its hash value,
+// without a division. the linear hashing table still splits a bucket into itself and the one at the end.
+#define KV_BUCKET_SELECTION_MASK 1
+
+#define KV_BUCKET_SLOT_COUNT 4
+#define KV_BUCKET_SLOT_TAG_MASK (((uint64_t) 0xffff) << 48)
+#define KV_BUCKET_SLOT_MORE_FLAG (((uint64_t) 1) << 47)
+#define KV_BUCKET_SLOT_OFFSET_MASK (KV_BUCKET_SLOT_MORE_FLAG - 1)
+#define KV_BUCKET_SLOT_TAG(hash_value) (((uint64_t) ((hash_value) >> 16)) << 48)
+
+#define KV_BUCKET_CELL_COUNT 2
+#define KV_BUCKET_CELL_SIZE 32
+#define KV_BUCKET_CELL_FLAGS_OFFSET 0
+#define KV_BUCKET_CELL_KEY_SIZE_OFFSET 1
+#define KV_BUCKET_CELL_VALUE_SIZE_OFFSET 2
+#define KV_BUCKET_CELL_HASH_VALUE_OFFSET 4
+#define KV_BUCKET_CELL_DATA_OFFSET 8
+#define KV_BUCKET_CELL_DATA_SIZE (KV_BUCKET_CELL_SIZE - KV_BUCKET_CELL_DATA_OFFSET)
+// the cell contains a key.
+#define KV_BUCKET_CELL_FLAG_USED 1
+// the cell is filled but not visible yet.
+#define KV_BUCKET_CELL_FLAG_RESERVED 2
+
 /*
  block:
  1. next offset  8 bytes
  2. hash_value   4 bytes
- 3. key size     8 bytes
- 4. key bytes    variable length
- 5. data size    8 bytes
- 6. data bytes   variable length
+ 3. size class   1 byte
+ 4. key size     8 bytes
+ 5. key bytes    variable length
+ 6. data size    8 bytes
+ 7. data bytes   variable length
+ 
+ the size class gives the number of bytes available for the key and the data:
+ - below KV_BLOCK_POW2_CLASS_COUNT, it's the log2 of the size.
+ - otherwise, it's one of the sizes between two powers of 2: 2^n + i * 2^(n - 2), i in [1, 3].
  */
 
 #define KV_BLOCK_NEXT_OFFSET_OFFSET 0
 #define KV_BLOCK_HASH_VALUE_OFFSET 8
-#define KV_BLOCK_LOG2SIZE_OFFSET 9
+#define KV_BLOCK_SIZE_CLASS_OFFSET 12
 #define KV_BLOCK_KEY_SIZE_OFFSET 13
 #define KV_BLOCK_KEY_BYTES_OFFSET 21
 
+#define KV_BLOCK_POW2_CLASS_COUNT 64
+// the sizes between two powers of 2 are used from 2^KV_BLOCK_INTERMEDIATE_CLASS_MIN_LOG2 to
+// 2^(KV_BLOCK_INTERMEDIATE_CLASS_MAX_LOG2 + 1), larger blocks are rounded up to a power of 2.
+#define KV_BLOCK_INTERMEDIATE_CLASS_MIN_LOG2 4
+#define KV_BLOCK_INTERMEDIATE_CLASS_MAX_LOG2 39
+#define KV_BLOCK_INTERMEDIATE_CLASS_COUNT \
+    (3 * (KV_BLOCK_INTERMEDIATE_CLASS_MAX_LOG2 - KV_BLOCK_INTERMEDIATE_CLASS_MIN_LOG2 + 1))
+#define KV_BLOCK_SIZE_CLASS_COUNT (KV_BLOCK_POW2_CLASS_COUNT + KV_BLOCK_INTERMEDIATE_CLASS_COUNT)
+// value of the header field: 4 size classes between two powers of 2, including the power of 2.
+// files created before use only powers of 2.
+#define KV_BLOCK_SIZE_CLASSES_PER_DOUBLING 4
+
+// ids of the dictionaries of the values are from 1 to KV_DICTIONARY_MAX_ID.
+#define KV_DICTIONARY_MAX_ID 127
+// LZ4 only uses the last 64 KB of a dictionary.
+#define KV_DICTIONARY_MAX_SIZE (64 * 1024)
+
+// a value is stored uncompressed when compression saves less than this percentage of its size.
+#define KV_COMPRESSION_DEFAULT_MIN_SAVING 10
+
 struct kvdb_mapping {
     char * kv_bytes;
     size_t kv_size;
 };
 
+struct kv_block_cache;
+struct kv_uring;
+struct kvdb_async_op;
+struct kv_reader_slot;
+struct kv_block_arena;
+struct kv_free_list;
+struct kv_dictionary;
+
 struct kvdb {
     char * kv_filename;
     int kv_pagesize;
@@ -85,10 +231,103 @@ struct kvdb {
     int kv_opened;
     uint64_t kv_firstmaxcount;
     int kv_compression_type;
+    // percentage of the size of a value that compression should save, see kvdb_set_compression_min_saving().
+    unsigned int kv_compression_min_saving;
+    int kv_storage_type;
+    int kv_bloom_filter_type;
+    unsigned int kv_bloom_filter_bits_per_key;
+    // 0 or KV_BUCKET_SLOT_COUNT.
+    unsigned int kv_bucket_slot_count;
+    // 0 or KV_BUCKET_CELL_COUNT.
+    unsigned int kv_bucket_cell_count;
+    // 0 or KV_BLOCK_SIZE_CLASSES_PER_DOUBLING.
+    unsigned int kv_block_size_classes;
+    // KV_BUCKET_SELECTION_MODULO or KV_BUCKET_SELECTION_MASK.
+    int kv_bucket_selection;
+    int kv_hash_function;
+    uint64_t kv_header_size;
     uint64_t * kv_filesize; // host order
     uint64_t * kv_free_blocks; // host order
+    // lists of the size classes between two powers of 2, NULL for version 5 files.
+    uint64_t * kv_class_free_blocks;
+    // first blocks of the lists of the file, the ones recycled since the file has been opened.
+    struct kv_free_list * kv_free_lists;
+    // linear hashing state, NULL when using KVDB_STORAGE_TYPE_TABLES.
+    uint64_t * kv_linear_level;
+    uint64_t * kv_linear_split;
+    // state of kvdb_consolidate(), offsets of the tables or 0 if no consolidation is running.
+    uint64_t * kv_consolidation_table;
+    uint64_t * kv_consolidation_source;
+    uint64_t * kv_consolidation_bucket;
+    // the header of version 5 files has no room for the consolidation state, it's kept in memory.
+    uint64_t kv_legacy_consolidation_state[3];
+    // state of kvdb_vacuum(), offset of the table or 0 if no vacuum is running.
+    uint64_t * kv_vacuum_table;
+    uint64_t * kv_vacuum_bucket;
+    // offset of the first free region taken by kv_block_free_regions_take(), 0 if none, see kvblock.h.
+    uint64_t * kv_free_regions_head;
+    // block being moved by kvdb_vacuum(): offset, new offset and size, the offset is 0 if none.
+    uint64_t * kv_vacuum_move;
+    uint64_t kv_legacy_vacuum_state[6];
+    // offset of the newest dictionary, NULL for version 5 files.
+    uint64_t * kv_dictionary_head;
+    // dictionaries read from the file indexed by id, see kvdictionary.h.
+    struct kv_dictionary * kv_dictionaries[KV_DICTIONARY_MAX_ID + 1];
+    // newest dictionary, used to compress the new values.
+    struct kv_dictionary * kv_current_dictionary;
+    // offset of the newest dictionary when they have been read.
+    uint64_t kv_loaded_dictionary_head;
     struct kvdb_table * kv_first_table;
     struct kvdb_table * kv_current_table;
+    // read-only mapping of the whole file, used by kvdb_get_ref().
+    struct kvdb_mapping kv_data_mapping;
+    // previous mappings of the file, released by kvdb_release_refs().
+    struct kvdb_mapping * kv_old_data_mappings;
+    unsigned int kv_old_data_mappings_count;
+    // buffers where the values returned by kvdb_get_ref() are decompressed, released by kvdb_release_refs().
+    char ** kv_ref_buffers;
+    unsigned int kv_ref_buffers_count;
+    // buffer reused to read compressed values.
+    char * kv_scratch;
+    size_t kv_scratch_size;
+    // cache of the blocks found by the lookups, NULL if it's disabled.
+    struct kv_block_cache * kv_block_cache;
+    size_t kv_block_cache_size;
+    int kv_io_backend;
+    // NULL when the reads use pread().
+    struct kv_uring * kv_uring;
+    // operations queued by kvdb_get_async() and kvdb_set_async(), run by kvdb_poll().
+    struct kvdb_async_op * kv_async_ops;
+    unsigned int kv_async_count;
+    unsigned int kv_async_capacity;
+    // concurrent readers, see kvlock.h.
+    int kv_concurrent;
+    // the file is shared with other processes, the counters are then in the header of the file.
+    int kv_multi_process;
+    uint32_t * kv_global_seq;
+    uint32_t kv_process_global_seq;
+    uint32_t * kv_bucket_seqs;
+    // changed by a process when it adds or removes tables, NULL if the file is not shared with other processes.
+    uint64_t * kv_generation;
+    // generation of the tables mapped by this process.
+    uint64_t kv_known_generation;
+    // set while a process holds the writer lock, it's still set if the process died.
+    uint32_t * kv_writer_active;
+    // number of threads of this process holding the structure lock of the file in shared mode.
+    pthread_mutex_t kv_structure_file_lock;
+    unsigned int kv_structure_file_count;
+    pthread_mutex_t * kv_bucket_locks;
+    struct kv_reader_slot * kv_reader_slots;
+    // taken in shared mode to change a single key, in exclusive mode for the other changes.
+    pthread_rwlock_t kv_write_lock;
+    pthread_rwlock_t kv_structure_lock;
+    // protects the file size, the lists of recycled blocks and the creation of tables.
+    pthread_mutex_t kv_alloc_lock;
+    // protects the mapping of the data and the buffer of the values returned by kvdb_get_ref().
+    pthread_mutex_t kv_ref_lock;
+    struct kv_block_arena * kv_block_arenas;
+    // tables removed by the consolidation, unmapped once no reader uses them.
+    struct kvdb_table * kv_retired_tables;
 };
 
 struct kvdb_item {
@@ -98,10 +337,18 @@ struct kvdb_item {
 
 struct kvdb_table {
     struct kvdb_mapping kv_mapping;
+    // location of the table in the file.
+    uint64_t kv_offset;
     char * kv_table_start;
     struct kvdb_item * kv_items;
     uint64_t * kv_bloom_filter_size; // host order
     uint8_t * kv_bloom_filter;
+    int kv_bloom_filter_type;
+    int kv_bucket_selection;
+    // KV_BUCKET_SLOT_COUNT slots for each bucket, NULL if the table has no slots.
+    uint64_t * kv_bucket_slots;
+    // KV_BUCKET_CELL_COUNT cells for each bucket, NULL if the table has no cells.
+    char * kv_bucket_cells;
     uint64_t * kv_next_table_offset; // host order
     uint64_t * kv_count; // host order
     uint64_t * kv_maxcount; // host order
@@ -114,9 +361,16 @@ struct find_key_cb_params {
     uint64_t previous_offset;
     uint64_t current_offset;
     uint64_t next_offset;
+    struct kvdb_table * table;
     struct kvdb_item * item;
+    // cell of the key when it's stored in the table, NULL if it's in a block.
+    char * cell;
+    // beginning of the block when it has already been read by the lookup, NULL otherwise.
+    const char * block;
+    // number of bytes of the block available in block.
+    size_t block_size;
     uint64_t * table_count;
-    size_t log2_size;
+    uint8_t size_class;
 };
 
 typedef void findkey_callback(kvdb * db, struct find_key_cb_params * params,
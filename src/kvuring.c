@@ -0,0 +1,257 @@
+//
+//  kvuring.c
+//  kvdb
+//
+//  Copyright (c) 2013 etpan. All rights reserved.
+//
+
+#include "kvuring.h"
+
+#include <stdlib.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define KV_HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef KV_HAVE_IO_URING
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// maximum number of reads in flight.
+#define KV_URING_ENTRIES 64
+// microseconds between two looks at the completion queue when the kernel can't wait for the reads.
+#define KV_URING_POLL_DELAY 100
+
+struct kv_uring {
+    int fd;
+    // the threads share the queues.
+    pthread_mutex_t lock;
+    // submission queue.
+    char * sq_ring;
+    size_t sq_ring_size;
+    unsigned * sq_head;
+    unsigned * sq_tail;
+    unsigned * sq_ring_mask;
+    unsigned * sq_array;
+    struct io_uring_sqe * sqes;
+    size_t sqes_size;
+    // completion queue, it shares the mapping of the submission queue when cq_ring_size is 0.
+    char * cq_ring;
+    size_t cq_ring_size;
+    unsigned * cq_head;
+    unsigned * cq_tail;
+    unsigned * cq_ring_mask;
+    struct io_uring_cqe * cqes;
+    // the buffers are read using readv() to support older kernels.
+    struct iovec iov[KV_URING_ENTRIES];
+};
+
+static int uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+struct kv_uring * kv_uring_new(void)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = (int) syscall(__NR_io_uring_setup, KV_URING_ENTRIES, &params);
+    if (fd < 0) {
+        return NULL;
+    }
+    
+    struct kv_uring * ring = malloc(sizeof(* ring));
+    if (ring == NULL) {
+        close(fd);
+        return NULL;
+    }
+    ring->fd = fd;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = 0;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        goto close_fd;
+    }
+    if (ring->cq_ring_size == 0) {
+        ring->cq_ring = ring->sq_ring;
+    }
+    else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            goto unmap_sq_ring;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        goto unmap_cq_ring;
+    }
+    
+    ring->sq_head = (unsigned *) (ring->sq_ring + params.sq_off.head);
+    ring->sq_tail = (unsigned *) (ring->sq_ring + params.sq_off.tail);
+    ring->sq_ring_mask = (unsigned *) (ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (ring->sq_ring + params.sq_off.array);
+    ring->cq_head = (unsigned *) (ring->cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (ring->cq_ring + params.cq_off.tail);
+    ring->cq_ring_mask = (unsigned *) (ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (ring->cq_ring + params.cq_off.cqes);
+    pthread_mutex_init(&ring->lock, NULL);
+    
+    return ring;
+
+unmap_cq_ring:
+    if (ring->cq_ring_size != 0) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+unmap_sq_ring:
+    munmap(ring->sq_ring, ring->sq_ring_size);
+close_fd:
+    close(fd);
+    free(ring);
+    return NULL;
+}
+
+void kv_uring_free(struct kv_uring * ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring_size != 0) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+    pthread_mutex_destroy(&ring->lock);
+    free(ring);
+}
+
+// stores the results of the reads that have completed.
+// Returns the number of completed reads.
+static unsigned int uring_reap(struct kv_uring * ring)
+{
+    unsigned int count = 0;
+    unsigned head = * ring->cq_head;
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe * cqe = &ring->cqes[head & * ring->cq_ring_mask];
+        struct kv_read_request * request = (struct kv_read_request *) (uintptr_t) cqe->user_data;
+        request->result = cqe->res < 0 ? -1 : cqe->res;
+        head ++;
+        count ++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    return count;
+}
+
+// performs at most KV_URING_ENTRIES reads.
+// Returns -1 if some of the reads could not be submitted or waited for, once none of them is in flight.
+static int uring_read_group(struct kv_uring * ring, int fd, struct kv_read_request ** requests, unsigned int count)
+{
+    unsigned tail = * ring->sq_tail;
+    for(unsigned int i = 0 ; i < count ; i ++) {
+        struct kv_read_request * request = requests[i];
+        unsigned index = tail & * ring->sq_ring_mask;
+        struct io_uring_sqe * sqe = &ring->sqes[index];
+        ring->iov[i].iov_base = request->data;
+        ring->iov[i].iov_len = request->size;
+        memset(sqe, 0, sizeof(* sqe));
+        sqe->opcode = IORING_OP_READV;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t) (uintptr_t) &ring->iov[i];
+        sqe->len = 1;
+        sqe->off = request->offset;
+        sqe->user_data = (uint64_t) (uintptr_t) request;
+        ring->sq_array[index] = index;
+        tail ++;
+    }
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+    
+    int has_error = 0;
+    unsigned int submitted = 0;
+    while (submitted < count) {
+        int r = uring_enter(ring->fd, count - submitted, 0, 0);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (submitted == 0) {
+                // Nothing has been submitted: drop the entries and let the caller use pread().
+                __atomic_store_n(ring->sq_tail, __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+                return -1;
+            }
+            // Some reads are in flight: drop the others and let the caller read all of them again with pread().
+            __atomic_store_n(ring->sq_tail, __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+            count = submitted;
+            has_error = 1;
+            break;
+        }
+        submitted += r;
+    }
+    
+    // The reads in flight use the buffers of the caller: wait for all of them.
+    unsigned int completed = uring_reap(ring);
+    while (completed < count) {
+        int r = uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS);
+        if ((r < 0) && (errno != EINTR) && (errno != EAGAIN) && (errno != EBUSY)) {
+            // The reads still complete without waiting in the kernel: poll the queue, then let the caller read
+            // again with pread().
+            has_error = 1;
+            usleep(KV_URING_POLL_DELAY);
+        }
+        completed += uring_reap(ring);
+    }
+    
+    return has_error ? -1 : 0;
+}
+
+int kv_uring_read_many(struct kv_uring * ring, int fd, struct kv_read_request ** requests, unsigned int count)
+{
+    int r = 0;
+    pthread_mutex_lock(&ring->lock);
+    while (count > 0) {
+        unsigned int group_count = count;
+        if (group_count > KV_URING_ENTRIES) {
+            group_count = KV_URING_ENTRIES;
+        }
+        r = uring_read_group(ring, fd, requests, group_count);
+        if (r < 0) {
+            break;
+        }
+        requests += group_count;
+        count -= group_count;
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return r;
+}
+
+#else
+
+struct kv_uring * kv_uring_new(void)
+{
+    return NULL;
+}
+
+void kv_uring_free(struct kv_uring * ring)
+{
+}
+
+int kv_uring_read_many(struct kv_uring * ring, int fd, struct kv_read_request ** requests, unsigned int count)
+{
+    return -1;
+}
+
+#endif
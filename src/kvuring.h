@@ -0,0 +1,26 @@
+//
+//  kvuring.h
+//  kvdb
+//
+//  Copyright (c) 2013 etpan. All rights reserved.
+//
+
+#ifndef KVURING_H
+#define KVURING_H
+
+#include "kvblock.h"
+
+// io_uring instance used to have several reads in flight at once.
+// it's only available on Linux, other systems use pread().
+struct kv_uring;
+
+// Returns NULL if io_uring is not available.
+struct kv_uring * kv_uring_new(void);
+void kv_uring_free(struct kv_uring * ring);
+
+// submits all the given reads at once and waits for them.
+// the threads that use the same instance wait for each other.
+// Returns -1 if the reads could not be submitted or waited for, they should then all be done with pread().
+int kv_uring_read_many(struct kv_uring * ring, int fd, struct kv_read_request ** requests, unsigned int count);
+
+#endif
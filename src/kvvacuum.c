@@ -0,0 +1,382 @@
+//
+//  kvvacuum.c
+//  kvdb
+//
+//  Copyright (c) 2013 etpan. All rights reserved.
+//
+
+#include "kvvacuum.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "kvblock.h"
+#include "kvcache.h"
+#include "kvendian.h"
+#include "kvlock.h"
+#include "kvtable.h"
+
+// free regions of the file where the blocks can be moved, sorted by offset.
+struct vacuum_regions {
+    struct kv_free_region * regions;
+    size_t count;
+    size_t capacity;
+};
+
+// takes space for a block of the given size in the first region where it fits before offset.
+// the space is removed from the chain of the file before it's used.
+// Returns 0 if there's none.
+static uint64_t regions_alloc(kvdb * db, struct vacuum_regions * free_regions, uint64_t size, uint64_t offset)
+{
+    for(size_t i = 0 ; i < free_regions->count ; i ++) {
+        struct kv_free_region * region = &free_regions->regions[i];
+        if (region->offset + size > offset) {
+            // The block would not be closer to the beginning of the file.
+            return 0;
+        }
+        if (region->size >= size) {
+            struct kv_free_region previous = * region;
+            region->offset += size;
+            region->size -= size;
+            if (kv_block_free_regions_update(db, free_regions->regions, free_regions->count, i) < 0) {
+                * region = previous;
+                return 0;
+            }
+            return previous.offset;
+        }
+    }
+    return 0;
+}
+
+// adds the space of a moved block to the regions and to the chain of the file.
+// Returns -1 if the memory can't be allocated, the regions are then unchanged.
+static int regions_add(kvdb * db, struct vacuum_regions * free_regions, uint64_t offset, uint64_t size)
+{
+    // Find the first region after the block.
+    size_t low = 0;
+    size_t high = free_regions->count;
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        if (free_regions->regions[middle].offset < offset) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+    
+    struct kv_free_region * previous = low > 0 ? &free_regions->regions[low - 1] : NULL;
+    struct kv_free_region * next = low < free_regions->count ? &free_regions->regions[low] : NULL;
+    // The space is lost if the process stops before the chain is written.
+    if ((previous != NULL) && (previous->offset + previous->size == offset)) {
+        previous->size += size;
+        if ((next != NULL) && (offset + size == next->offset)) {
+            previous->size += next->size;
+            next->size = 0;
+        }
+        kv_block_free_regions_update(db, free_regions->regions, free_regions->count, low - 1);
+        return 0;
+    }
+    if ((next != NULL) && (offset + size == next->offset)) {
+        next->offset = offset;
+        next->size += size;
+        kv_block_free_regions_update(db, free_regions->regions, free_regions->count, low);
+        return 0;
+    }
+    
+    if (free_regions->count == free_regions->capacity) {
+        size_t capacity = free_regions->capacity == 0 ? 16 : free_regions->capacity * 2;
+        struct kv_free_region * regions = realloc(free_regions->regions, capacity * sizeof(* regions));
+        if (regions == NULL) {
+            return -1;
+        }
+        free_regions->regions = regions;
+        free_regions->capacity = capacity;
+    }
+    memmove(&free_regions->regions[low + 1], &free_regions->regions[low],
+            (free_regions->count - low) * sizeof(* free_regions->regions));
+    free_regions->regions[low].offset = offset;
+    free_regions->regions[low].size = size;
+    free_regions->count ++;
+    kv_block_free_regions_update(db, free_regions->regions, free_regions->count, low);
+    return 0;
+}
+
+// adds the space of a block to the regions, or recycles it on its own if the memory can't be allocated.
+// Returns -1 if there's an I/O error.
+static int regions_release(kvdb * db, struct vacuum_regions * free_regions, uint64_t offset, uint64_t size)
+{
+    if (regions_add(db, free_regions, offset, size) == 0) {
+        return 0;
+    }
+    return kv_block_recycle_region(db, offset, size);
+}
+
+// copies the block at offset to destination.
+// p_size is set to the number of bytes copied.
+// Returns -1 if there's an I/O error.
+static int move_block(kvdb * db, uint64_t offset, uint8_t size_class, uint64_t destination, uint64_t * p_size)
+{
+    uint64_t disk_size = kv_block_disk_size(size_class);
+    char * data = malloc((size_t) disk_size);
+    if (data == NULL) {
+        return -1;
+    }
+    // The padding at the end of the last block of the file might not have been written.
+    ssize_t count = pread(db->kv_fd, data, (size_t) disk_size, (off_t) offset);
+    if (count < KV_BLOCK_KEY_BYTES_OFFSET) {
+        free(data);
+        return -1;
+    }
+    uint64_t key_size = bytes_to_h64(data + KV_BLOCK_KEY_SIZE_OFFSET);
+    if (KV_BLOCK_KEY_BYTES_OFFSET + key_size + 8 > (uint64_t) count) {
+        free(data);
+        return -1;
+    }
+    uint64_t value_size = bytes_to_h64(data + KV_BLOCK_KEY_BYTES_OFFSET + key_size);
+    uint64_t size = KV_BLOCK_KEY_BYTES_OFFSET + key_size + 8 + value_size;
+    if (size > (uint64_t) count) {
+        free(data);
+        return -1;
+    }
+    
+    struct iovec iov;
+    iov.iov_base = data;
+    iov.iov_len = (size_t) size;
+    kv_block_cache_remove(db->kv_block_cache, destination);
+    int r = kv_pwritev(db->kv_fd, &iov, 1, destination);
+    free(data);
+    if (r < 0) {
+        return -1;
+    }
+    
+    * p_size = size;
+    return 0;
+}
+
+static void budget_spend(uint64_t * p_budget, uint64_t size)
+{
+    * p_budget = * p_budget > size ? * p_budget - size : 0;
+}
+
+// moves the blocks of the chain of the bucket to the free regions before them.
+// Returns -1 if there's an I/O error.
+static int vacuum_bucket(kvdb * db, struct vacuum_regions * free_regions, struct kvdb_table * table,
+                         struct kvdb_item * item, uint64_t * p_budget)
+{
+    uint64_t previous_offset = 0;
+    uint64_t offset = ntoh64(item->kv_offset);
+    int moved = 0;
+    while (offset != 0) {
+        char header[KV_BLOCK_KEY_BYTES_OFFSET];
+        int r = kv_pread(db->kv_fd, header, sizeof(header), offset);
+        if (r < 0) {
+            return -1;
+        }
+        budget_spend(p_budget, sizeof(header));
+        uint64_t next_offset = bytes_to_h64(header + KV_BLOCK_NEXT_OFFSET_OFFSET);
+        uint8_t size_class = bytes_to_h8(header + KV_BLOCK_SIZE_CLASS_OFFSET);
+        uint64_t destination = 0;
+        if (kv_block_capacity(size_class) != 0) {
+            destination = regions_alloc(db, free_regions, kv_block_disk_size(size_class), offset);
+        }
+        if (destination != 0) {
+            // If the process stops, kv_vacuum_recover() frees the copy that the bucket doesn't use.
+            db->kv_vacuum_move[1] = hton64(destination);
+            db->kv_vacuum_move[2] = hton64(kv_block_disk_size(size_class));
+            db->kv_vacuum_move[0] = hton64(offset);
+            uint64_t size;
+            r = move_block(db, offset, size_class, destination, &size);
+            if (r < 0) {
+                regions_release(db, free_regions, destination, kv_block_disk_size(size_class));
+                db->kv_vacuum_move[0] = 0;
+                return -1;
+            }
+            budget_spend(p_budget, 2 * size);
+            if (previous_offset == 0) {
+                item->kv_offset = hton64(destination);
+            }
+            else {
+                r = kv_block_write_next_offset(db, previous_offset, destination);
+                if (r < 0) {
+                    regions_release(db, free_regions, destination, kv_block_disk_size(size_class));
+                    db->kv_vacuum_move[0] = 0;
+                    return -1;
+                }
+            }
+            kv_block_cache_remove(db->kv_block_cache, offset);
+            r = regions_release(db, free_regions, offset, kv_block_disk_size(size_class));
+            db->kv_vacuum_move[0] = 0;
+            if (r < 0) {
+                return -1;
+            }
+            offset = destination;
+            moved = 1;
+        }
+        previous_offset = offset;
+        offset = next_offset;
+    }
+    
+    if (moved) {
+        return kv_bucket_slots_rebuild(db, table, item);
+    }
+    return 0;
+}
+
+int kv_vacuum(kvdb * db, uint64_t io_budget)
+{
+    struct vacuum_regions free_regions;
+    int has_error = 0;
+    int result = 1;
+    
+    int r = kv_block_free_regions_take(db, &free_regions.regions, &free_regions.count);
+    if (r < 0) {
+        return -1;
+    }
+    free_regions.capacity = free_regions.count;
+    
+    if (* db->kv_vacuum_table == 0) {
+        * db->kv_vacuum_table = hton64(db->kv_first_table->kv_offset);
+        * db->kv_vacuum_bucket = hton64(0);
+    }
+    
+    struct kvdb_table * table = NULL;
+    while (io_budget > 0) {
+        uint64_t table_offset = ntoh64(* db->kv_vacuum_table);
+        if ((table == NULL) || (table->kv_offset != table_offset)) {
+            table = kv_table_at_offset(db, table_offset);
+            if (table == NULL) {
+                // The table has been removed by the consolidation: start again.
+                * db->kv_vacuum_table = hton64(db->kv_first_table->kv_offset);
+                * db->kv_vacuum_bucket = hton64(0);
+                continue;
+            }
+        }
+        
+        uint64_t idx = ntoh64(* db->kv_vacuum_bucket);
+        if (idx >= ntoh64(* table->kv_maxcount)) {
+            // Go to the next table.
+            if (table->kv_next_table == NULL) {
+                * db->kv_vacuum_table = hton64(0);
+                * db->kv_vacuum_bucket = hton64(0);
+                result = 0;
+                break;
+            }
+            * db->kv_vacuum_table = hton64(table->kv_next_table->kv_offset);
+            * db->kv_vacuum_bucket = hton64(0);
+            continue;
+        }
+        
+        struct kvdb_item * item = &table->kv_items[idx];
+        budget_spend(&io_budget, sizeof(* item));
+        if (item->kv_offset != 0) {
+            // Readers of the bucket will look again.
+            kv_structure_write_lock(db);
+            kv_bucket_write_begin(db, table, item);
+            r = vacuum_bucket(db, &free_regions, table, item, &io_budget);
+            kv_bucket_write_end(db, table, item);
+            kv_structure_write_unlock(db);
+            if (r < 0) {
+                has_error = 1;
+                break;
+            }
+        }
+        * db->kv_vacuum_bucket = hton64(idx + 1);
+    }
+    
+    r = kv_block_free_regions_give_back(db, free_regions.regions, free_regions.count, kv_tables_mapped_end(db));
+    if (r < 0) {
+        has_error = 1;
+    }
+    
+    return has_error ? -1 : result;
+}
+
+// Returns 1 if the block at offset is in the chain of the bucket.
+// Returns -1 if there's an I/O error.
+static int bucket_has_block(kvdb * db, struct kvdb_item * item, uint64_t offset)
+{
+    uint64_t current_offset = ntoh64(item->kv_offset);
+    while (current_offset != 0) {
+        if (current_offset == offset) {
+            return 1;
+        }
+        char data[8];
+        int r = kv_pread(db->kv_fd, data, sizeof(data), current_offset + KV_BLOCK_NEXT_OFFSET_OFFSET);
+        if (r < 0) {
+            return -1;
+        }
+        current_offset = bytes_to_h64(data);
+    }
+    return 0;
+}
+
+int kv_vacuum_recover(kvdb * db)
+{
+    if ((* db->kv_free_regions_head == 0) && (db->kv_vacuum_move[0] == 0)) {
+        return 0;
+    }
+    
+    // The chained regions are taken with the other recycled blocks.
+    struct vacuum_regions free_regions;
+    int r = kv_block_free_regions_take(db, &free_regions.regions, &free_regions.count);
+    if (r < 0) {
+        return -1;
+    }
+    free_regions.capacity = free_regions.count;
+    
+    int has_error = 0;
+    struct kvdb_table * table = NULL;
+    struct kvdb_item * item = NULL;
+    if (* db->kv_vacuum_table != 0) {
+        table = kv_table_at_offset(db, ntoh64(* db->kv_vacuum_table));
+        uint64_t idx = ntoh64(* db->kv_vacuum_bucket);
+        if ((table != NULL) && (idx < ntoh64(* table->kv_maxcount))) {
+            item = &table->kv_items[idx];
+        }
+    }
+    
+    if ((db->kv_vacuum_move[0] != 0) && (item != NULL)) {
+        // The copy that the chain of the bucket doesn't use is free. The block might already be in a region:
+        // the regions that overlap are merged when they're given back.
+        uint64_t offset = ntoh64(db->kv_vacuum_move[0]);
+        uint64_t destination = ntoh64(db->kv_vacuum_move[1]);
+        uint64_t size = ntoh64(db->kv_vacuum_move[2]);
+        uint64_t free_offset = 0;
+        r = bucket_has_block(db, item, offset);
+        if (r == 1) {
+            free_offset = destination;
+        }
+        else if (r == 0) {
+            r = bucket_has_block(db, item, destination);
+            if (r == 1) {
+                free_offset = offset;
+            }
+        }
+        if (r < 0) {
+            has_error = 1;
+        }
+        if (free_offset != 0) {
+            r = regions_add(db, &free_regions, free_offset, size);
+            if (r < 0) {
+                has_error = 1;
+            }
+        }
+    }
+    if (item != NULL) {
+        // The slots might still point to the blocks before they were moved.
+        r = kv_bucket_slots_rebuild(db, table, item);
+        if (r < 0) {
+            has_error = 1;
+        }
+    }
+    
+    r = kv_block_free_regions_give_back(db, free_regions.regions, free_regions.count, kv_tables_mapped_end(db));
+    if (r < 0) {
+        has_error = 1;
+    }
+    db->kv_vacuum_move[0] = 0;
+    
+    return has_error ? -1 : 0;
+}
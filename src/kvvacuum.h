@@ -0,0 +1,31 @@
+//
+//  kvvacuum.h
+//  kvdb
+//
+//  Copyright (c) 2013 etpan. All rights reserved.
+//
+
+#ifndef KVVACUUM_H
+#define KVVACUUM_H
+
+#include <inttypes.h>
+
+#include "kvtypes.h"
+
+// the vacuum moves the blocks of the keys to free space closer to the beginning of the file.
+// the buckets of the tables are visited in order, so that the blocks of a bucket end up next to each other.
+// a block is copied before the chain points to the copy and it's recycled afterwards: if the process stops,
+// no key is lost. the free space taken by the step is chained in the file and the block being moved is
+// recorded in the header, kv_vacuum_recover() gives them back.
+
+// performs a step of the vacuum, the writer lock should be held in exclusive mode.
+// io_budget is the number of bytes to read and write during this step, each bucket visited counts as 8 bytes.
+// Returns 0 when the vacuum is done, 1 if there's more to do, -1 if there's an I/O error.
+int kv_vacuum(kvdb * db, uint64_t io_budget);
+
+// gives back the free space of a step of the vacuum of a process that stopped before the end of the step.
+// it should be called before any other change of the file, with the writer lock held in exclusive mode.
+// Returns -1 if there's an I/O error.
+int kv_vacuum_recover(kvdb * db);
+
+#endif
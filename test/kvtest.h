@@ -0,0 +1,112 @@
+//
+//  kvtest.h
+//  kvdb
+//
+//  Copyright (c) 2013 etpan. All rights reserved.
+//
+
+#ifndef KVTEST_H
+#define KVTEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "kvdb.h"
+
+// stops the test when the condition is false.
+#define KVTEST_CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+// returns the path of a file of the test in the directory given as the first argument, the current directory
+// otherwise. the file is removed. the result should be released with free().
+static inline char * kvtest_filename(int argc, char ** argv, const char * name)
+{
+    const char * directory = argc > 1 ? argv[1] : ".";
+    size_t size = strlen(directory) + 1 + strlen(name) + 1;
+    char * filename = malloc(size);
+    snprintf(filename, size, "%s/%s", directory, name);
+    unlink(filename);
+    return filename;
+}
+
+// size of the buffers given to kvtest_make_key().
+#define KVTEST_KEY_SIZE 32
+
+// writes the key of the given index to key, a buffer of KVTEST_KEY_SIZE bytes.
+// Returns the size of the key.
+static inline size_t kvtest_make_key(char * key, unsigned int idx)
+{
+    return (size_t) snprintf(key, KVTEST_KEY_SIZE, "key-%u", idx);
+}
+
+// options of kvtest_open().
+enum {
+    // the values are stored uncompressed.
+    KVTEST_OPEN_RAW = 1 << 0,
+    KVTEST_OPEN_CONCURRENT = 1 << 1,
+    KVTEST_OPEN_MULTI_PROCESS = 1 << 2,
+    // the small values are stored in the tables.
+    KVTEST_OPEN_INLINE_VALUES = 1 << 3,
+    // the reads of kvdb_mget() use io_uring when it's available.
+    KVTEST_OPEN_IO_URING = 1 << 4,
+};
+
+// opens a database with the given storage type and options. the test stops if it can't be opened.
+static inline kvdb * kvtest_open(const char * filename, int storage_type, int options)
+{
+    kvdb * db = kvdb_new(filename);
+    kvdb_set_storage_type(db, storage_type);
+    if (options & KVTEST_OPEN_RAW) {
+        kvdb_set_compression_type(db, KVDB_COMPRESSION_TYPE_RAW);
+    }
+    if (options & KVTEST_OPEN_CONCURRENT) {
+        kvdb_set_concurrent_readers(db, 1);
+    }
+    if (options & KVTEST_OPEN_MULTI_PROCESS) {
+        kvdb_set_multi_process(db, 1);
+    }
+    if (options & KVTEST_OPEN_INLINE_VALUES) {
+        kvdb_set_inline_values(db, 1);
+    }
+    if (options & KVTEST_OPEN_IO_URING) {
+        kvdb_set_io_backend(db, KVDB_IO_BACKEND_IO_URING);
+    }
+    KVTEST_CHECK(kvdb_open(db) == 0);
+    return db;
+}
+
+// closes and releases a database opened with kvtest_open().
+static inline void kvtest_close(kvdb * db)
+{
+    kvdb_close(db);
+    kvdb_free(db);
+}
+
+// checks that the key has the expected value.
+static inline void kvtest_check_value(kvdb * db, const char * key, size_t key_size,
+                                      const char * expected, size_t expected_size)
+{
+    char * value;
+    size_t value_size;
+    KVTEST_CHECK(kvdb_get(db, key, key_size, &value, &value_size) == 0);
+    KVTEST_CHECK((value_size == expected_size) && (memcmp(value, expected, value_size) == 0));
+    free(value);
+}
+
+// returns the size of a file.
+static inline off_t kvtest_file_size(const char * filename)
+{
+    struct stat stat_info;
+    KVTEST_CHECK(stat(filename, &stat_info) == 0);
+    return stat_info.st_size;
+}
+
+#endif
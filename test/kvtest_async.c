@@ -0,0 +1,151 @@
+//
+//  kvtest_async.c
+//  kvdb
+//
+
+// checks that kvdb_poll() performs the operations queued by kvdb_get_async() and kvdb_set_async() in order:
+// a lookup queued after a change finds the new value, and the operations queued by a callback are performed by
+// the next call.
+// usage: kvtest-async [directory]
+
+#include <string.h>
+
+#include "kvdb.h"
+#include "kvtest.h"
+
+#define KEY_COUNT 300
+#define VALUE_SIZE 100
+
+// results of the callbacks, indexed by key.
+struct async_results {
+    int get_results[KEY_COUNT];
+    int get_versions[KEY_COUNT];
+    int set_results[KEY_COUNT];
+    unsigned int get_count;
+    unsigned int set_count;
+};
+
+// the value of a key starts with its version.
+static size_t make_value(char * value, unsigned int idx, unsigned int version)
+{
+    memset(value, 'a' + idx % 26, VALUE_SIZE);
+    value[0] = (char) ('0' + version);
+    return VALUE_SIZE;
+}
+
+// the index of the key is in the callback data.
+struct async_op_data {
+    struct async_results * results;
+    unsigned int idx;
+};
+
+static struct async_op_data op_data[KEY_COUNT];
+
+static void get_callback(kvdb * db, int result, char * value, size_t value_size, void * cb_data)
+{
+    (void) db;
+    struct async_op_data * data = cb_data;
+    struct async_results * results = data->results;
+    char expected[VALUE_SIZE];
+    results->get_results[data->idx] = result;
+    results->get_count ++;
+    if (result == 0) {
+        KVTEST_CHECK(value_size == VALUE_SIZE);
+        results->get_versions[data->idx] = value[0] - '0';
+        make_value(expected, data->idx, (unsigned int) results->get_versions[data->idx]);
+        KVTEST_CHECK(memcmp(value, expected, VALUE_SIZE) == 0);
+        free(value);
+    }
+}
+
+static void set_callback(kvdb * db, int result, void * cb_data)
+{
+    (void) db;
+    struct async_op_data * data = cb_data;
+    data->results->set_results[data->idx] = result;
+    data->results->set_count ++;
+}
+
+// queues the lookup of the key again once it's found: the lookup is performed by the next kvdb_poll().
+static void get_again_callback(kvdb * db, int result, char * value, size_t value_size, void * cb_data)
+{
+    (void) value_size;
+    struct async_op_data * data = cb_data;
+    KVTEST_CHECK(result == 0);
+    free(value);
+    kvdb_get_async(db, "key-0", strlen("key-0"), get_callback, data);
+}
+
+static void set_keys(kvdb * db, unsigned int version)
+{
+    char key[KVTEST_KEY_SIZE];
+    char value[VALUE_SIZE];
+    for(unsigned int idx = 0 ; idx < KEY_COUNT ; idx ++) {
+        kvdb_set_async(db, key, kvtest_make_key(key, idx), value, make_value(value, idx, version),
+                       set_callback, &op_data[idx]);
+    }
+}
+
+static void get_keys(kvdb * db, unsigned int first_idx, unsigned int count)
+{
+    char key[KVTEST_KEY_SIZE];
+    for(unsigned int idx = first_idx ; idx < first_idx + count ; idx ++) {
+        kvdb_get_async(db, key, kvtest_make_key(key, idx), get_callback, &op_data[idx]);
+    }
+}
+
+static void run(int argc, char ** argv, const char * name, int options)
+{
+    char * filename = kvtest_filename(argc, argv, name);
+    kvdb * db = kvtest_open(filename, KVDB_STORAGE_TYPE_TABLES, options);
+    struct async_results results;
+    memset(&results, 0, sizeof(results));
+    for(unsigned int idx = 0 ; idx < KEY_COUNT ; idx ++) {
+        op_data[idx].results = &results;
+        op_data[idx].idx = idx;
+    }
+
+    // The lookups of the first half run before the changes, the others after them.
+    get_keys(db, 0, KEY_COUNT / 2);
+    set_keys(db, 1);
+    get_keys(db, KEY_COUNT / 2, KEY_COUNT / 2);
+    KVTEST_CHECK(kvdb_poll(db) == 2 * KEY_COUNT);
+    KVTEST_CHECK((results.get_count == KEY_COUNT) && (results.set_count == KEY_COUNT));
+    for(unsigned int idx = 0 ; idx < KEY_COUNT ; idx ++) {
+        KVTEST_CHECK(results.set_results[idx] == 0);
+        if (idx < KEY_COUNT / 2) {
+            KVTEST_CHECK(results.get_results[idx] == -1);
+        }
+        else {
+            KVTEST_CHECK((results.get_results[idx] == 0) && (results.get_versions[idx] == 1));
+        }
+    }
+
+    // Changes and lookups alternate, a callback queues a lookup.
+    memset(&results, 0, sizeof(results));
+    kvdb_get_async(db, "key-0", strlen("key-0"), get_again_callback, &op_data[0]);
+    set_keys(db, 2);
+    get_keys(db, 1, KEY_COUNT - 1);
+    kvdb_set_async(db, "key-1", strlen("key-1"), "x", 1, NULL, NULL);
+    KVTEST_CHECK(kvdb_poll(db) == 2 * KEY_COUNT + 1);
+    KVTEST_CHECK((results.get_count == KEY_COUNT - 1) && (results.set_count == KEY_COUNT));
+    for(unsigned int idx = 1 ; idx < KEY_COUNT ; idx ++) {
+        KVTEST_CHECK((results.get_results[idx] == 0) && (results.get_versions[idx] == 2));
+    }
+    KVTEST_CHECK(kvdb_poll(db) == 1);
+    KVTEST_CHECK((results.get_results[0] == 0) && (results.get_versions[0] == 2));
+    KVTEST_CHECK(kvdb_poll(db) == 0);
+    kvtest_check_value(db, "key-1", strlen("key-1"), "x", 1);
+
+    kvtest_close(db);
+    unlink(filename);
+    free(filename);
+}
+
+int main(int argc, char ** argv)
+{
+    run(argc, argv, "async.kvdb", 0);
+    run(argc, argv, "async-raw.kvdb", KVTEST_OPEN_RAW | KVTEST_OPEN_INLINE_VALUES);
+    run(argc, argv, "async-uring.kvdb", KVTEST_OPEN_IO_URING);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,118 @@
+//
+//  kvtest_batch_failure.c
+//  kvdb
+//
+//  Copyright (c) 2013 etpan. All rights reserved.
+//
+
+// checks that a batch that fails to write its blocks leaves the database unchanged.
+// the writes fail because the size of the files of the process is limited to the current size of the file.
+// usage: kvtest-batch-failure [directory]
+
+#include <signal.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include "kvdb.h"
+#include "kvtest.h"
+
+#define KEY_COUNT 2000
+#define LARGE_VALUE_COUNT 50
+#define LARGE_VALUE_SIZE 8000
+#define MAX_VALUE_SIZE 8192
+
+static size_t make_value(char * value, unsigned int idx, unsigned int version, size_t padding)
+{
+    size_t size = (size_t) snprintf(value, MAX_VALUE_SIZE, "value-%u-%u", idx, version);
+    memset(value + size, 'x', padding);
+    return size + padding;
+}
+
+static void check_values(kvdb * db, unsigned int version)
+{
+    char key[KVTEST_KEY_SIZE];
+    char expected[MAX_VALUE_SIZE];
+    for(unsigned int idx = 0 ; idx < KEY_COUNT ; idx ++) {
+        size_t expected_size = make_value(expected, idx, version, 0);
+        kvtest_check_value(db, key, kvtest_make_key(key, idx), expected, expected_size);
+    }
+}
+
+// returns the previous limit.
+static rlim_t set_file_size_limit(rlim_t limit)
+{
+    struct rlimit rl;
+    KVTEST_CHECK(getrlimit(RLIMIT_FSIZE, &rl) == 0);
+    rlim_t previous_limit = rl.rlim_cur;
+    rl.rlim_cur = limit;
+    KVTEST_CHECK(setrlimit(RLIMIT_FSIZE, &rl) == 0);
+    return previous_limit;
+}
+
+static void run(int argc, char ** argv, int storage_type, int inline_values)
+{
+    char * filename = kvtest_filename(argc, argv, "batch-failure.kvdb");
+    kvdb * db = kvtest_open(filename, storage_type, KVTEST_OPEN_RAW | (inline_values ? KVTEST_OPEN_INLINE_VALUES : 0));
+    
+    char key[KVTEST_KEY_SIZE];
+    char value[MAX_VALUE_SIZE];
+    kvdb_batch * batch = kvdb_batch_new(db);
+    for(unsigned int idx = 0 ; idx < KEY_COUNT ; idx ++) {
+        kvdb_batch_put(batch, key, kvtest_make_key(key, idx), value, make_value(value, idx, 0, 0));
+    }
+    KVTEST_CHECK(kvdb_batch_commit(batch) == 0);
+    // Larger values replace half of the keys then they're set back: their blocks are recycled and the next
+    // batch reuses some of them before it needs to grow the file.
+    for(unsigned int idx = 0 ; idx < KEY_COUNT ; idx += 2) {
+        KVTEST_CHECK(kvdb_set(db, key, kvtest_make_key(key, idx), value, make_value(value, idx, 1, 200)) == 0);
+    }
+    for(unsigned int idx = 0 ; idx < KEY_COUNT ; idx += 2) {
+        KVTEST_CHECK(kvdb_set(db, key, kvtest_make_key(key, idx), value, make_value(value, idx, 0, 0)) == 0);
+    }
+    check_values(db, 0);
+    
+    rlim_t previous_limit = set_file_size_limit((rlim_t) kvtest_file_size(filename));
+    for(unsigned int idx = 0 ; idx < KEY_COUNT ; idx ++) {
+        kvdb_batch_put(batch, key, kvtest_make_key(key, idx), value, make_value(value, idx, 1, 0));
+    }
+    for(unsigned int idx = 0 ; idx < LARGE_VALUE_COUNT ; idx ++) {
+        size_t key_size = (size_t) snprintf(key, sizeof(key), "large-%u", idx);
+        memset(value, 'l', LARGE_VALUE_SIZE);
+        kvdb_batch_put(batch, key, key_size, value, LARGE_VALUE_SIZE);
+    }
+    kvdb_batch_delete(batch, key, kvtest_make_key(key, 1));
+    KVTEST_CHECK(kvdb_batch_commit(batch) == -2);
+    set_file_size_limit(previous_limit);
+    
+    // None of the changes of the batch is visible.
+    check_values(db, 0);
+    char * found_value;
+    size_t found_value_size;
+    KVTEST_CHECK(kvdb_get(db, "large-0", strlen("large-0"), &found_value, &found_value_size) == -1);
+    
+    // The blocks taken by the failed batch can be used again.
+    for(unsigned int idx = 0 ; idx < KEY_COUNT ; idx ++) {
+        kvdb_batch_put(batch, key, kvtest_make_key(key, idx), value, make_value(value, idx, 2, 0));
+    }
+    KVTEST_CHECK(kvdb_batch_commit(batch) == 0);
+    check_values(db, 2);
+    kvdb_close(db);
+    KVTEST_CHECK(kvdb_open(db) == 0);
+    check_values(db, 2);
+    
+    kvdb_batch_free(batch);
+    kvtest_close(db);
+    unlink(filename);
+    free(filename);
+}
+
+int main(int argc, char ** argv)
+{
+    // The writes beyond the limit fail instead of stopping the process.
+    signal(SIGXFSZ, SIG_IGN);
+    run(argc, argv, KVDB_STORAGE_TYPE_TABLES, 0);
+    run(argc, argv, KVDB_STORAGE_TYPE_TABLES, 1);
+    run(argc, argv, KVDB_STORAGE_TYPE_LINEAR_HASHING, 0);
+    run(argc, argv, KVDB_STORAGE_TYPE_LINEAR_HASHING, 1);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,201 @@
+//
+//  kvtest_block_cache.c
+//  kvdb
+//
+
+// checks that the blocks kept in the cache of kvdb_set_block_cache_size() save the reads of the lookups, that a
+// value changed by kvdb_set(), kvdb_delete(), a batch or kvdb_vacuum() is never read from a stale block, and that
+// the cache doesn't keep more blocks than its size allows.
+// usage: kvtest-block-cache [directory]
+
+#include <string.h>
+
+#include "kvdb.h"
+#include "kvtest.h"
+
+#define KEY_COUNT 1000
+#define VALUE_SIZE 100
+// large enough for the blocks of all the keys.
+#define LARGE_CACHE_SIZE (1024 * 1024)
+// room for a few blocks per shard of the cache.
+#define SMALL_CACHE_SIZE (16 * 1024)
+
+// the value of a key starts with its version. the versions 0 and 1 have the same size: a new version is written
+// in the same block, the larger versions are written in another block.
+static size_t make_value(char * value, unsigned int idx, unsigned int version)
+{
+    size_t size = VALUE_SIZE * (1 + version / 2);
+    memset(value, 'a' + idx % 26, size);
+    value[0] = (char) ('0' + version);
+    return size;
+}
+
+static kvdb * open_with_cache(const char * filename, size_t cache_size, int options)
+{
+    kvdb * db = kvdb_new(filename);
+    kvdb_set_compression_type(db, KVDB_COMPRESSION_TYPE_RAW);
+    kvdb_set_concurrent_readers(db, (options & KVTEST_OPEN_CONCURRENT) != 0);
+    kvdb_set_block_cache_size(db, cache_size);
+    KVTEST_CHECK(kvdb_open(db) == 0);
+    KVTEST_CHECK(kvdb_get_block_cache_size(db) == cache_size);
+    return db;
+}
+
+static void set_key(kvdb * db, unsigned int idx, unsigned int version)
+{
+    char key[KVTEST_KEY_SIZE];
+    char value[4 * VALUE_SIZE];
+    KVTEST_CHECK(kvdb_set(db, key, kvtest_make_key(key, idx), value, make_value(value, idx, version)) == 0);
+}
+
+static void check_key(kvdb * db, unsigned int idx, unsigned int version)
+{
+    char key[KVTEST_KEY_SIZE];
+    char value[4 * VALUE_SIZE];
+    size_t key_size = kvtest_make_key(key, idx);
+    kvtest_check_value(db, key, key_size, value, make_value(value, idx, version));
+}
+
+static void check_missing_key(kvdb * db, unsigned int idx)
+{
+    char key[KVTEST_KEY_SIZE];
+    char * value;
+    size_t value_size;
+    KVTEST_CHECK(kvdb_get(db, key, kvtest_make_key(key, idx), &value, &value_size) == -1);
+}
+
+static uint64_t cache_hits(kvdb * db)
+{
+    uint64_t hits;
+    uint64_t misses;
+    kvdb_get_block_cache_stats(db, &hits, &misses);
+    return hits;
+}
+
+// a repeated lookup is a hit, the changes of the values are never hidden by the cache.
+static void check_changes(int argc, char ** argv, const char * name, int options)
+{
+    char * filename = kvtest_filename(argc, argv, name);
+    kvdb * db = open_with_cache(filename, LARGE_CACHE_SIZE, options);
+    unsigned int versions[KEY_COUNT];
+    for(unsigned int idx = 0 ; idx < KEY_COUNT ; idx ++) {
+        set_key(db, idx, 0);
+        versions[idx] = 0;
+    }
+    for(unsigned int idx = 0 ; idx < KEY_COUNT ; idx ++) {
+        check_key(db, idx, 0);
+    }
+    uint64_t hits = cache_hits(db);
+    for(unsigned int idx = 0 ; idx < KEY_COUNT ; idx ++) {
+        check_key(db, idx, 0);
+    }
+    KVTEST_CHECK(cache_hits(db) >= hits + KEY_COUNT);
+
+    // Overwritten in place or in another block.
+    for(unsigned int idx = 0 ; idx < KEY_COUNT ; idx += 5) {
+        versions[idx] = 1 + idx % 2;
+        set_key(db, idx, versions[idx]);
+    }
+    // Deleted, then set again: the new block might reuse the block of another deleted key.
+    for(unsigned int idx = 1 ; idx < KEY_COUNT ; idx += 5) {
+        char key[KVTEST_KEY_SIZE];
+        KVTEST_CHECK(kvdb_delete(db, key, kvtest_make_key(key, idx)) == 0);
+        check_missing_key(db, idx);
+    }
+    for(unsigned int idx = 1 ; idx < KEY_COUNT ; idx += 10) {
+        versions[idx] = 1;
+        set_key(db, idx, versions[idx]);
+    }
+    // Changed by a batch.
+    kvdb_batch * batch = kvdb_batch_new(db);
+    KVTEST_CHECK(batch != NULL);
+    for(unsigned int idx = 2 ; idx < KEY_COUNT ; idx += 5) {
+        char key[KVTEST_KEY_SIZE];
+        char value[4 * VALUE_SIZE];
+        versions[idx] = (idx % 2) ? 1 : 4;
+        kvdb_batch_put(batch, key, kvtest_make_key(key, idx), value, make_value(value, idx, versions[idx]));
+    }
+    for(unsigned int idx = 3 ; idx < KEY_COUNT ; idx += 10) {
+        char key[KVTEST_KEY_SIZE];
+        kvdb_batch_delete(batch, key, kvtest_make_key(key, idx));
+    }
+    KVTEST_CHECK(kvdb_batch_commit(batch) == 0);
+    kvdb_batch_free(batch);
+    for(unsigned int idx = 0 ; idx < KEY_COUNT ; idx ++) {
+        if ((idx % 10) == 3 || (idx % 10) == 6) {
+            check_missing_key(db, idx);
+        }
+        else {
+            check_key(db, idx, versions[idx]);
+        }
+    }
+
+    // Moved by the vacuum once the first half is deleted.
+    for(unsigned int idx = 0 ; idx < KEY_COUNT / 2 ; idx ++) {
+        char key[KVTEST_KEY_SIZE];
+        kvdb_delete(db, key, kvtest_make_key(key, idx));
+    }
+    int r;
+    while ((r = kvdb_vacuum(db, 64 * 1024, NULL)) == 1) {
+        for(unsigned int idx = KEY_COUNT / 2 ; idx < KEY_COUNT ; idx += 7) {
+            if ((idx % 10) != 3 && (idx % 10) != 6) {
+                check_key(db, idx, versions[idx]);
+            }
+        }
+    }
+    KVTEST_CHECK(r == 0);
+    for(unsigned int idx = 0 ; idx < KEY_COUNT ; idx ++) {
+        if ((idx < KEY_COUNT / 2) || (idx % 10) == 3 || (idx % 10) == 6) {
+            check_missing_key(db, idx);
+        }
+        else {
+            check_key(db, idx, versions[idx]);
+        }
+    }
+    // The blocks freed by the vacuum are used again.
+    for(unsigned int idx = 0 ; idx < KEY_COUNT / 2 ; idx ++) {
+        set_key(db, idx, 3);
+    }
+    for(unsigned int idx = 0 ; idx < KEY_COUNT / 2 ; idx ++) {
+        check_key(db, idx, 3);
+    }
+
+    kvtest_close(db);
+    unlink(filename);
+    free(filename);
+}
+
+// once the blocks of all the keys have been read, the cache only keeps the blocks that fit in its size.
+static void check_size(int argc, char ** argv, const char * name, int options)
+{
+    char * filename = kvtest_filename(argc, argv, name);
+    kvdb * db = open_with_cache(filename, SMALL_CACHE_SIZE, options);
+    for(unsigned int idx = 0 ; idx < KEY_COUNT ; idx ++) {
+        set_key(db, idx, 0);
+    }
+    for(unsigned int idx = 0 ; idx < KEY_COUNT ; idx ++) {
+        check_key(db, idx, 0);
+    }
+    // The keys read last are looked up first: they are still in the cache.
+    uint64_t hits = cache_hits(db);
+    for(unsigned int idx = KEY_COUNT ; idx > 0 ; idx --) {
+        check_key(db, idx - 1, 0);
+    }
+    uint64_t new_hits = cache_hits(db) - hits;
+    KVTEST_CHECK(new_hits > 0);
+    // A block uses more than VALUE_SIZE bytes of the cache.
+    KVTEST_CHECK(new_hits <= SMALL_CACHE_SIZE / VALUE_SIZE);
+
+    kvtest_close(db);
+    unlink(filename);
+    free(filename);
+}
+
+int main(int argc, char ** argv)
+{
+    check_changes(argc, argv, "block-cache.kvdb", 0);
+    check_changes(argc, argv, "block-cache-concurrent.kvdb", KVTEST_OPEN_CONCURRENT);
+    check_size(argc, argv, "block-cache-size.kvdb", 0);
+    check_size(argc, argv, "block-cache-size-concurrent.kvdb", KVTEST_OPEN_CONCURRENT);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,169 @@
+//
+//  kvtest_compact.c
+//  kvdb
+//
+//  Copyright (c) 2013 etpan. All rights reserved.
+//
+
+// checks that the compaction never replaces the file of the database, whatever the path leading to it, and
+// that the destination file is only replaced by a complete copy.
+// usage: kvtest-compact [directory]
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include "kvdb.h"
+#include "kvtest.h"
+
+#define KEY_COUNT 5000
+
+static size_t make_value(char * value, unsigned int idx)
+{
+    size_t size = (size_t) snprintf(value, 64, "value-%u", idx);
+    size_t pattern_size = size;
+    size += idx % 500;
+    for(size_t i = pattern_size ; i < size ; i ++) {
+        value[i] = value[i % pattern_size];
+    }
+    return size;
+}
+
+// the odd keys have been deleted.
+static void check_database(kvdb * db)
+{
+    char key[KVTEST_KEY_SIZE];
+    char expected[1024];
+    for(unsigned int idx = 0 ; idx < KEY_COUNT ; idx ++) {
+        size_t key_size = kvtest_make_key(key, idx);
+        if (idx % 2 == 1) {
+            char * value;
+            size_t value_size;
+            KVTEST_CHECK(kvdb_get(db, key, key_size, &value, &value_size) == -1);
+            continue;
+        }
+        kvtest_check_value(db, key, key_size, expected, make_value(expected, idx));
+    }
+}
+
+static void check_file(const char * filename)
+{
+    kvdb * db = kvtest_open(filename, KVDB_STORAGE_TYPE_TABLES, 0);
+    check_database(db);
+    kvtest_close(db);
+}
+
+static char * make_path(const char * directory, const char * name)
+{
+    size_t size = strlen(directory) + 1 + strlen(name) + 1;
+    char * path = malloc(size);
+    snprintf(path, size, "%s/%s", directory, name);
+    return path;
+}
+
+// Returns 1 if the directory contains a temporary file of the compaction.
+static int has_temporary_file(const char * directory)
+{
+    DIR * dir = opendir(directory);
+    KVTEST_CHECK(dir != NULL);
+    struct dirent * entry;
+    int found = 0;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strstr(entry->d_name, ".kvdb.compact-") != NULL) {
+            found = 1;
+        }
+    }
+    closedir(dir);
+    return found;
+}
+
+static void write_file(const char * filename, const char * content)
+{
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    KVTEST_CHECK(fd >= 0);
+    KVTEST_CHECK(write(fd, content, strlen(content)) == (ssize_t) strlen(content));
+    close(fd);
+}
+
+static int file_has_content(const char * filename, const char * content)
+{
+    char buffer[64];
+    int fd = open(filename, O_RDONLY);
+    KVTEST_CHECK(fd >= 0);
+    ssize_t count = read(fd, buffer, sizeof(buffer));
+    close(fd);
+    return (count == (ssize_t) strlen(content)) && (memcmp(buffer, content, (size_t) count) == 0);
+}
+
+int main(int argc, char ** argv)
+{
+    const char * directory = argc > 1 ? argv[1] : ".";
+    char * filename = kvtest_filename(argc, argv, "compact.kvdb");
+    char * symlink_filename = kvtest_filename(argc, argv, "compact-symlink.kvdb");
+    char * hardlink_filename = kvtest_filename(argc, argv, "compact-hardlink.kvdb");
+    char * dest_filename = kvtest_filename(argc, argv, "compact-dest.kvdb");
+    
+    kvdb * db = kvtest_open(filename, KVDB_STORAGE_TYPE_TABLES, 0);
+    char key[KVTEST_KEY_SIZE];
+    char value[1024];
+    for(unsigned int idx = 0 ; idx < KEY_COUNT ; idx ++) {
+        KVTEST_CHECK(kvdb_set(db, key, kvtest_make_key(key, idx), value, make_value(value, idx)) == 0);
+    }
+    for(unsigned int idx = 1 ; idx < KEY_COUNT ; idx += 2) {
+        KVTEST_CHECK(kvdb_delete(db, key, kvtest_make_key(key, idx)) == 0);
+    }
+    
+    // The paths that lead to the file of the database are rejected.
+    KVTEST_CHECK(symlink("compact.kvdb", symlink_filename) == 0);
+    KVTEST_CHECK(link(filename, hardlink_filename) == 0);
+    char * dot_filename = make_path(directory, "./compact.kvdb");
+    char * slash_filename = make_path(directory, "/compact.kvdb");
+    const char * alias_filenames[] = {filename, dot_filename, slash_filename, symlink_filename, hardlink_filename};
+    for(unsigned int i = 0 ; i < sizeof(alias_filenames) / sizeof(alias_filenames[0]) ; i ++) {
+        KVTEST_CHECK(kvdb_compact_to(db, alias_filenames[i]) == -1);
+    }
+    check_database(db);
+    check_file(hardlink_filename);
+    KVTEST_CHECK(!has_temporary_file(directory));
+    
+    // An existing file is replaced by the compacted database.
+    write_file(dest_filename, "not a database");
+    KVTEST_CHECK(kvdb_compact_to(db, dest_filename) == 0);
+    check_file(dest_filename);
+    check_database(db);
+    
+    // When the copy fails, the destination file is left untouched and the temporary file is removed.
+    write_file(dest_filename, "not a database");
+    signal(SIGXFSZ, SIG_IGN);
+    struct rlimit rl;
+    KVTEST_CHECK(getrlimit(RLIMIT_FSIZE, &rl) == 0);
+    rlim_t previous_limit = rl.rlim_cur;
+    rl.rlim_cur = 64 * 1024;
+    KVTEST_CHECK(setrlimit(RLIMIT_FSIZE, &rl) == 0);
+    KVTEST_CHECK(kvdb_compact_to(db, dest_filename) == -2);
+    rl.rlim_cur = previous_limit;
+    KVTEST_CHECK(setrlimit(RLIMIT_FSIZE, &rl) == 0);
+    KVTEST_CHECK(file_has_content(dest_filename, "not a database"));
+    KVTEST_CHECK(!has_temporary_file(directory));
+    
+    // The database is replaced by its compacted copy.
+    KVTEST_CHECK(kvdb_compact(db) == 0);
+    check_database(db);
+    KVTEST_CHECK(!has_temporary_file(directory));
+    kvtest_close(db);
+    check_file(filename);
+    
+    unlink(filename);
+    unlink(symlink_filename);
+    unlink(hardlink_filename);
+    unlink(dest_filename);
+    free(dot_filename);
+    free(slash_filename);
+    free(filename);
+    free(symlink_filename);
+    free(hardlink_filename);
+    free(dest_filename);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,107 @@
+//
+//  kvtest_compression.c
+//  kvdb
+//
+
+// checks that with the default compression, the values that compression doesn't make smaller are stored
+// uncompressed and that the others are compressed. it also checks that the values decompressed by kvdb_get_ref()
+// stay valid until kvdb_release_refs().
+// usage: kvtest-compression [directory]
+
+#include <fcntl.h>
+#include <string.h>
+
+#include "kvdb.h"
+#include "kvtest.h"
+
+#define VALUE_SIZE 4000
+
+// Returns the offset of the data in the file, -1 if it's not found.
+static off_t find_in_file(const char * filename, const char * data, size_t size)
+{
+    off_t file_size = kvtest_file_size(filename);
+    char * content = malloc((size_t) file_size);
+    int fd = open(filename, O_RDONLY);
+    KVTEST_CHECK(fd >= 0);
+    KVTEST_CHECK(read(fd, content, (size_t) file_size) == file_size);
+    close(fd);
+    off_t result = -1;
+    for(off_t offset = 0 ; offset + (off_t) size <= file_size ; offset ++) {
+        if (memcmp(content + offset, data, size) == 0) {
+            result = offset;
+            break;
+        }
+    }
+    free(content);
+    return result;
+}
+
+static void check_value(kvdb * db, const char * key, const char * expected, size_t expected_size)
+{
+    kvtest_check_value(db, key, strlen(key), expected, expected_size);
+}
+
+// the second decompressed value doesn't replace the first one.
+static void check_refs(kvdb * db, const char * compressible, size_t size)
+{
+    char other[VALUE_SIZE];
+    for(size_t i = 0 ; i < size ; i ++) {
+        other[i] = "other value "[i % 12];
+    }
+    KVTEST_CHECK(kvdb_set(db, "other", strlen("other"), other, size) == 0);
+    
+    const char * value;
+    size_t value_size;
+    const char * other_value;
+    size_t other_value_size;
+    KVTEST_CHECK(kvdb_get_ref(db, "compressible", strlen("compressible"), &value, &value_size) == 0);
+    KVTEST_CHECK(kvdb_get_ref(db, "other", strlen("other"), &other_value, &other_value_size) == 0);
+    KVTEST_CHECK((value_size == size) && (memcmp(value, compressible, size) == 0));
+    KVTEST_CHECK((other_value_size == size) && (memcmp(other_value, other, size) == 0));
+    kvdb_release_refs(db);
+}
+
+int main(int argc, char ** argv)
+{
+    char * filename = kvtest_filename(argc, argv, "compression.kvdb");
+    
+    // The random bytes are the content of an already compressed file.
+    char incompressible[VALUE_SIZE];
+    unsigned int seed = 1;
+    for(size_t i = 0 ; i < sizeof(incompressible) ; i ++) {
+        incompressible[i] = (char) rand_r(&seed);
+    }
+    char compressible[VALUE_SIZE];
+    for(size_t i = 0 ; i < sizeof(compressible) ; i ++) {
+        compressible[i] = "compressible value "[i % 19];
+    }
+    
+    kvdb * db = kvdb_new(filename);
+    KVTEST_CHECK(kvdb_get_compression_type(db) == KVDB_COMPRESSION_TYPE_LZ4);
+    KVTEST_CHECK(kvdb_open(db) == 0);
+    KVTEST_CHECK(kvdb_set(db, "incompressible", strlen("incompressible"), incompressible, sizeof(incompressible)) == 0);
+    KVTEST_CHECK(kvdb_set(db, "compressible", strlen("compressible"), compressible, sizeof(compressible)) == 0);
+    check_value(db, "incompressible", incompressible, sizeof(incompressible));
+    check_value(db, "compressible", compressible, sizeof(compressible));
+    kvdb_close(db);
+    
+    // The value stored uncompressed has the tag of the dictionary 0 followed by its size as a variable length
+    // integer.
+    char stored_value[3 + VALUE_SIZE];
+    stored_value[0] = (char) 0x80;
+    stored_value[1] = (char) (0x80 | (VALUE_SIZE & 0x7f));
+    stored_value[2] = (char) (VALUE_SIZE >> 7);
+    memcpy(stored_value + 3, incompressible, VALUE_SIZE);
+    KVTEST_CHECK(find_in_file(filename, stored_value, sizeof(stored_value)) >= 0);
+    KVTEST_CHECK(find_in_file(filename, compressible, sizeof(compressible)) == -1);
+    
+    KVTEST_CHECK(kvdb_open(db) == 0);
+    check_value(db, "incompressible", incompressible, sizeof(incompressible));
+    check_value(db, "compressible", compressible, sizeof(compressible));
+    check_refs(db, compressible, sizeof(compressible));
+    kvdb_close(db);
+    kvdb_free(db);
+    unlink(filename);
+    free(filename);
+    return EXIT_SUCCESS;
+}
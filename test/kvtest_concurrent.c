@@ -0,0 +1,346 @@
+//
+//  kvtest_concurrent.c
+//  kvdb
+//
+//  Copyright (c) 2013 etpan. All rights reserved.
+//
+
+// checks that the readers always find a complete value and that the enumerations find each key once while
+// other threads change the database, and that the blocks recycled by the writers are reused.
+// usage: kvtest-concurrent [directory]
+
+#include <pthread.h>
+#include <string.h>
+
+#include "kvdb.h"
+#include "kvtest.h"
+
+#define KEY_COUNT 20000
+#define WRITER_COUNT 2
+#define READER_COUNT 4
+#define ENUMERATOR_COUNT 1
+#define THREAD_COUNT (WRITER_COUNT + READER_COUNT + ENUMERATOR_COUNT)
+#define RUN_SECONDS 2
+#define MAX_VALUE_SIZE 1024
+
+struct test_state {
+    kvdb * db;
+    volatile int stop;
+    // number of lookups that returned a bad result.
+    unsigned int errors;
+};
+
+struct thread_state {
+    struct test_state * test;
+    unsigned int index;
+    pthread_t thread;
+};
+
+// the even keys never change: they're always found with their first value.
+// the odd keys are changed and deleted by the writers, a reader finds one of their complete values or none.
+// the value repeats the key and the version, its size depends on both so that some values stay in the cells
+// of the buckets and the others are in blocks of different sizes.
+static size_t make_value(char * value, unsigned int idx, unsigned int version)
+{
+    char pattern[32];
+    size_t pattern_size = (size_t) snprintf(pattern, sizeof(pattern), "%u:%u;", idx, version);
+    size_t size = 8 + (idx * 7 + version * 13) % (MAX_VALUE_SIZE - 8);
+    if (size < pattern_size) {
+        size = pattern_size;
+    }
+    for(size_t i = 0 ; i < size ; i ++) {
+        value[i] = pattern[i % pattern_size];
+    }
+    return size;
+}
+
+// Returns 1 if the value is a complete value of the key.
+static int value_is_valid(const char * value, size_t value_size, unsigned int idx, int stable)
+{
+    char header[32];
+    size_t header_size = value_size < sizeof(header) - 1 ? value_size : sizeof(header) - 1;
+    memcpy(header, value, header_size);
+    header[header_size] = 0;
+    unsigned int value_idx;
+    unsigned int version;
+    if (sscanf(header, "%u:%u;", &value_idx, &version) != 2) {
+        return 0;
+    }
+    if ((value_idx != idx) || (stable && (version != 0))) {
+        return 0;
+    }
+    char expected[MAX_VALUE_SIZE];
+    size_t expected_size = make_value(expected, idx, version);
+    return (expected_size == value_size) && (memcmp(expected, value, value_size) == 0);
+}
+
+static void report_error(struct test_state * test, const char * message, unsigned int idx, int r)
+{
+    if (__sync_fetch_and_add(&test->errors, 1) < 10) {
+        fprintf(stderr, "%s: key %u, result %i\n", message, idx, r);
+    }
+}
+
+static void * writer_main(void * data)
+{
+    struct thread_state * state = data;
+    struct test_state * test = state->test;
+    unsigned int seed = state->index + 1;
+    unsigned int version = 0;
+    char key[KVTEST_KEY_SIZE];
+    char value[MAX_VALUE_SIZE];
+    while (!test->stop) {
+        version ++;
+        if (version % 100 == 0) {
+            // The batches change several buckets at once.
+            kvdb_batch * batch = kvdb_batch_new(test->db);
+            for(unsigned int i = 0 ; i < 20 ; i ++) {
+                unsigned int idx = (rand_r(&seed) % (KEY_COUNT / 2)) * 2 + 1;
+                kvdb_batch_put(batch, key, kvtest_make_key(key, idx), value, make_value(value, idx, version));
+            }
+            if (kvdb_batch_commit(batch) < 0) {
+                report_error(test, "batch failed", 0, -2);
+            }
+            kvdb_batch_free(batch);
+            continue;
+        }
+        
+        if (version % 4 == 0) {
+            // The new keys make the tables grow: the buckets are split or new tables are added.
+            char extra_key[32];
+            size_t extra_key_size = (size_t) snprintf(extra_key, sizeof(extra_key), "extra-%u-%u", state->index, version);
+            if (kvdb_set(test->db, extra_key, extra_key_size, "x", 1) < 0) {
+                report_error(test, "set failed", 0, -2);
+            }
+            if ((state->index == 0) && (version % 20000 == 0)) {
+                // The consolidation moves the keys between the tables.
+                while (kvdb_consolidate(test->db, 1000) == 1) {
+                }
+            }
+            continue;
+        }
+        
+        unsigned int idx = (rand_r(&seed) % (KEY_COUNT / 2)) * 2 + 1;
+        size_t key_size = kvtest_make_key(key, idx);
+        if (rand_r(&seed) % 5 == 0) {
+            kvdb_delete(test->db, key, key_size);
+        }
+        else if (kvdb_set(test->db, key, key_size, value, make_value(value, idx, version)) < 0) {
+            report_error(test, "set failed", idx, -2);
+        }
+    }
+    return NULL;
+}
+
+static void * reader_main(void * data)
+{
+    struct thread_state * state = data;
+    struct test_state * test = state->test;
+    unsigned int seed = state->index + 100;
+    char key[KVTEST_KEY_SIZE];
+    char buffer[MAX_VALUE_SIZE];
+    while (!test->stop) {
+        unsigned int idx = rand_r(&seed) % KEY_COUNT;
+        size_t key_size = kvtest_make_key(key, idx);
+        int stable = (idx % 2 == 0);
+        int r;
+        if (rand_r(&seed) % 2 == 0) {
+            char * value;
+            size_t value_size;
+            r = kvdb_get(test->db, key, key_size, &value, &value_size);
+            if (r == 0) {
+                if (!value_is_valid(value, value_size, idx, stable)) {
+                    report_error(test, "bad value", idx, r);
+                }
+                free(value);
+            }
+        }
+        else {
+            size_t value_size;
+            r = kvdb_get_into(test->db, key, key_size, buffer, sizeof(buffer), &value_size);
+            if ((r == 0) && !value_is_valid(buffer, value_size, idx, stable)) {
+                report_error(test, "bad value", idx, r);
+            }
+        }
+        if ((r < 0) && (stable || (r != -1))) {
+            report_error(test, "lookup failed", idx, r);
+        }
+    }
+    return NULL;
+}
+
+static void enumerate_callback(kvdb * db, struct kvdb_enumerate_cb_params * params, void * data, int * stop)
+{
+    (void) db;
+    (void) stop;
+    unsigned char * seen = data;
+    char key[KVTEST_KEY_SIZE];
+    if ((params->key_size < 4) || (params->key_size >= sizeof(key)) || (memcmp(params->key, "key-", 4) != 0)) {
+        return;
+    }
+    memcpy(key, params->key, params->key_size);
+    key[params->key_size] = 0;
+    unsigned int idx = (unsigned int) strtoul(key + 4, NULL, 10);
+    if ((idx < KEY_COUNT) && (seen[idx] < 255)) {
+        seen[idx] ++;
+    }
+}
+
+// the enumeration finds each key at most once and the keys that don't change exactly once.
+static void * enumerator_main(void * data)
+{
+    struct thread_state * state = data;
+    struct test_state * test = state->test;
+    unsigned char * seen = malloc(KEY_COUNT);
+    while (!test->stop) {
+        memset(seen, 0, KEY_COUNT);
+        if (kvdb_enumerate_keys(test->db, enumerate_callback, seen) < 0) {
+            report_error(test, "enumeration failed", 0, -2);
+            continue;
+        }
+        for(unsigned int idx = 0 ; idx < KEY_COUNT ; idx ++) {
+            if ((seen[idx] > 1) || ((idx % 2 == 0) && (seen[idx] != 1))) {
+                report_error(test, "bad enumeration", idx, seen[idx]);
+                break;
+            }
+        }
+    }
+    free(seen);
+    return NULL;
+}
+
+static void run(int argc, char ** argv, int storage_type)
+{
+    char * filename = kvtest_filename(argc, argv, "concurrent.kvdb");
+    struct test_state test;
+    test.db = kvtest_open(filename, storage_type, KVTEST_OPEN_CONCURRENT);
+    test.stop = 0;
+    test.errors = 0;
+    
+    char key[KVTEST_KEY_SIZE];
+    char value[MAX_VALUE_SIZE];
+    for(unsigned int idx = 0 ; idx < KEY_COUNT ; idx ++) {
+        KVTEST_CHECK(kvdb_set(test.db, key, kvtest_make_key(key, idx), value, make_value(value, idx, 0)) == 0);
+    }
+    
+    struct thread_state threads[THREAD_COUNT];
+    for(unsigned int i = 0 ; i < THREAD_COUNT ; i ++) {
+        threads[i].test = &test;
+        threads[i].index = i;
+        void * (* thread_main)(void *) = reader_main;
+        if (i < WRITER_COUNT) {
+            thread_main = writer_main;
+        }
+        else if (i >= WRITER_COUNT + READER_COUNT) {
+            thread_main = enumerator_main;
+        }
+        pthread_create(&threads[i].thread, NULL, thread_main, &threads[i]);
+    }
+    sleep(RUN_SECONDS);
+    test.stop = 1;
+    for(unsigned int i = 0 ; i < THREAD_COUNT ; i ++) {
+        pthread_join(threads[i].thread, NULL);
+    }
+    KVTEST_CHECK(test.errors == 0);
+    
+    // The changes are all there once the file is opened again.
+    kvdb_close(test.db);
+    KVTEST_CHECK(kvdb_open(test.db) == 0);
+    for(unsigned int idx = 0 ; idx < KEY_COUNT ; idx ++) {
+        char * found_value;
+        size_t found_value_size;
+        size_t key_size = kvtest_make_key(key, idx);
+        int r = kvdb_get(test.db, key, key_size, &found_value, &found_value_size);
+        if (idx % 2 == 0) {
+            KVTEST_CHECK(r == 0);
+        }
+        KVTEST_CHECK((r == 0) || (r == -1));
+        if (r == 0) {
+            KVTEST_CHECK(value_is_valid(found_value, found_value_size, idx, idx % 2 == 0));
+            free(found_value);
+        }
+    }
+    kvtest_close(test.db);
+    unlink(filename);
+    free(filename);
+}
+
+#define REUSE_KEY_COUNT 500
+#define REUSE_ROUND_COUNT 20
+#define REUSE_VALUE_SIZE 1000
+
+struct reuse_state {
+    kvdb * db;
+    unsigned int index;
+    pthread_t thread;
+};
+
+// each writer changes its own keys again and again: the block of the previous value is recycled and used
+// for the next one.
+static void * reuse_writer_main(void * data)
+{
+    struct reuse_state * state = data;
+    char key[KVTEST_KEY_SIZE];
+    char value[REUSE_VALUE_SIZE];
+    for(unsigned int round = 0 ; round < REUSE_ROUND_COUNT ; round ++) {
+        memset(value, 'a' + round % 26, sizeof(value));
+        for(unsigned int i = 0 ; i < REUSE_KEY_COUNT ; i ++) {
+            size_t key_size = kvtest_make_key(key, state->index * REUSE_KEY_COUNT + i);
+            KVTEST_CHECK(kvdb_set(state->db, key, key_size, value, sizeof(value)) == 0);
+        }
+    }
+    return NULL;
+}
+
+static void run_reuse_writers(kvdb * db)
+{
+    struct reuse_state states[WRITER_COUNT * 2];
+    for(unsigned int i = 0 ; i < WRITER_COUNT * 2 ; i ++) {
+        states[i].db = db;
+        states[i].index = i;
+        pthread_create(&states[i].thread, NULL, reuse_writer_main, &states[i]);
+    }
+    for(unsigned int i = 0 ; i < WRITER_COUNT * 2 ; i ++) {
+        pthread_join(states[i].thread, NULL);
+    }
+}
+
+// the blocks recycled by the writers are reused by them and, once the file is closed, by the next writers.
+static void check_reuse(int argc, char ** argv)
+{
+    char * filename = kvtest_filename(argc, argv, "concurrent-reuse.kvdb");
+    kvdb * db = kvtest_open(filename, KVDB_STORAGE_TYPE_TABLES, KVTEST_OPEN_RAW | KVTEST_OPEN_CONCURRENT);
+    kvdb_close(db);
+    off_t empty_size = kvtest_file_size(filename);
+    KVTEST_CHECK(kvdb_open(db) == 0);
+    run_reuse_writers(db);
+    kvdb_close(db);
+    // Without reuse, each round would add the size of all the values.
+    off_t values_size = (off_t) WRITER_COUNT * 2 * REUSE_KEY_COUNT * REUSE_VALUE_SIZE;
+    off_t size = kvtest_file_size(filename);
+    KVTEST_CHECK(size - empty_size < values_size * 4);
+    
+    KVTEST_CHECK(kvdb_open(db) == 0);
+    run_reuse_writers(db);
+    kvdb_close(db);
+    KVTEST_CHECK(kvtest_file_size(filename) < size + values_size);
+    
+    KVTEST_CHECK(kvdb_open(db) == 0);
+    char key[KVTEST_KEY_SIZE];
+    char expected[REUSE_VALUE_SIZE];
+    memset(expected, 'a' + (REUSE_ROUND_COUNT - 1) % 26, sizeof(expected));
+    for(unsigned int idx = 0 ; idx < WRITER_COUNT * 2 * REUSE_KEY_COUNT ; idx ++) {
+        kvtest_check_value(db, key, kvtest_make_key(key, idx), expected, sizeof(expected));
+    }
+    kvtest_close(db);
+    unlink(filename);
+    free(filename);
+}
+
+int main(int argc, char ** argv)
+{
+    run(argc, argv, KVDB_STORAGE_TYPE_TABLES);
+    run(argc, argv, KVDB_STORAGE_TYPE_LINEAR_HASHING);
+    check_reuse(argc, argv);
+    return EXIT_SUCCESS;
+}
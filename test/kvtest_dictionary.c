@@ -0,0 +1,134 @@
+//
+//  kvtest_dictionary.c
+//  kvdb
+//
+
+// checks that the values written before the first dictionary, with the first dictionary and with the second one
+// are all read by kvdb_get() and kvdb_get_ref(), after the file is opened again and in the file written by
+// kvdb_compact_to(). it also checks the values compressed with LZ4 high compression.
+// usage: kvtest-dictionary [directory]
+
+#include <string.h>
+
+#include "kvdb.h"
+#include "kvtest.h"
+
+#define KEY_COUNT 500
+#define VALUE_MAX_SIZE 512
+#define DICTIONARY_SIZE 4096
+// the keys written before the first dictionary, with the first one and with the second one.
+#define GENERATION_COUNT 3
+
+// the small values share most of their structure.
+static size_t make_value(char * value, unsigned int idx)
+{
+    int size = snprintf(value, VALUE_MAX_SIZE,
+                        "{\"id\": %u, \"name\": \"user %u\", \"email\": \"user%u@example.com\", "
+                        "\"status\": \"active\", \"roles\": [\"reader\", \"writer\"], \"group\": %u, "
+                        "\"settings\": {\"theme\": \"dark\", \"language\": \"en\", \"notifications\": true}}",
+                        idx, idx, idx, idx % 7);
+    return (size_t) size;
+}
+
+static void set_keys(kvdb * db, unsigned int generation)
+{
+    char key[KVTEST_KEY_SIZE];
+    char value[VALUE_MAX_SIZE];
+    for(unsigned int idx = generation * KEY_COUNT ; idx < (generation + 1) * KEY_COUNT ; idx ++) {
+        KVTEST_CHECK(kvdb_set(db, key, kvtest_make_key(key, idx), value, make_value(value, idx)) == 0);
+    }
+}
+
+static void check_keys(kvdb * db, unsigned int generation_count)
+{
+    char key[KVTEST_KEY_SIZE];
+    char expected[VALUE_MAX_SIZE];
+    for(unsigned int idx = 0 ; idx < generation_count * KEY_COUNT ; idx ++) {
+        size_t key_size = kvtest_make_key(key, idx);
+        size_t expected_size = make_value(expected, idx);
+        kvtest_check_value(db, key, key_size, expected, expected_size);
+
+        const char * value;
+        size_t value_size;
+        KVTEST_CHECK(kvdb_get_ref(db, key, key_size, &value, &value_size) == 0);
+        KVTEST_CHECK((value_size == expected_size) && (memcmp(value, expected, value_size) == 0));
+    }
+    kvdb_release_refs(db);
+}
+
+// the database is checked, then opened again and checked, then compacted and the compacted file is checked.
+static void check_database(const char * filename, const char * compacted_filename, int compression_type,
+                           unsigned int generation_count)
+{
+    kvdb * db = kvdb_new(filename);
+    kvdb_set_compression_type(db, compression_type);
+    KVTEST_CHECK(kvdb_open(db) == 0);
+    check_keys(db, generation_count);
+    KVTEST_CHECK(kvdb_compact_to(db, compacted_filename) == 0);
+    kvtest_close(db);
+
+    db = kvdb_new(compacted_filename);
+    kvdb_set_compression_type(db, compression_type);
+    KVTEST_CHECK(kvdb_open(db) == 0);
+    check_keys(db, generation_count);
+    kvtest_close(db);
+}
+
+static void check_dictionaries(int argc, char ** argv)
+{
+    char * filename = kvtest_filename(argc, argv, "dictionary.kvdb");
+    char * compacted_filename = kvtest_filename(argc, argv, "dictionary-compacted.kvdb");
+    kvdb * db = kvdb_new(filename);
+    kvdb_set_compression_type(db, KVDB_COMPRESSION_TYPE_LZ4_DICTIONARY);
+    KVTEST_CHECK(kvdb_open(db) == 0);
+    // There's no value to sample yet.
+    KVTEST_CHECK(kvdb_train_dictionary(db, DICTIONARY_SIZE) == -1);
+    off_t size = kvtest_file_size(filename);
+    set_keys(db, 0);
+    off_t growth_without_dictionary = kvtest_file_size(filename) - size;
+    KVTEST_CHECK(kvdb_train_dictionary(db, DICTIONARY_SIZE) == 0);
+    size = kvtest_file_size(filename);
+    set_keys(db, 1);
+    off_t growth_with_dictionary = kvtest_file_size(filename) - size;
+    // The values compressed with the dictionary are much smaller.
+    KVTEST_CHECK(growth_with_dictionary < growth_without_dictionary / 2);
+    KVTEST_CHECK(kvdb_train_dictionary(db, DICTIONARY_SIZE) == 0);
+    set_keys(db, 2);
+    check_keys(db, GENERATION_COUNT);
+    kvtest_close(db);
+
+    check_database(filename, compacted_filename, KVDB_COMPRESSION_TYPE_LZ4_DICTIONARY, GENERATION_COUNT);
+
+    unlink(filename);
+    unlink(compacted_filename);
+    free(filename);
+    free(compacted_filename);
+}
+
+static void check_high_compression(int argc, char ** argv)
+{
+    char * filename = kvtest_filename(argc, argv, "lz4hc.kvdb");
+    char * compacted_filename = kvtest_filename(argc, argv, "lz4hc-compacted.kvdb");
+    kvdb * db = kvdb_new(filename);
+    kvdb_set_compression_type(db, KVDB_COMPRESSION_TYPE_LZ4HC);
+    KVTEST_CHECK(kvdb_open(db) == 0);
+    // There's no dictionary with LZ4 high compression.
+    KVTEST_CHECK(kvdb_train_dictionary(db, DICTIONARY_SIZE) == -1);
+    set_keys(db, 0);
+    check_keys(db, 1);
+    kvtest_close(db);
+
+    check_database(filename, compacted_filename, KVDB_COMPRESSION_TYPE_LZ4HC, 1);
+
+    unlink(filename);
+    unlink(compacted_filename);
+    free(filename);
+    free(compacted_filename);
+}
+
+int main(int argc, char ** argv)
+{
+    check_dictionaries(argc, argv);
+    check_high_compression(argc, argv);
+    return EXIT_SUCCESS;
+}
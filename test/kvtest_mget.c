@@ -0,0 +1,158 @@
+//
+//  kvtest_mget.c
+//  kvdb
+//
+
+// checks that kvdb_mget() returns the same values as kvdb_get(): found and missing keys, values stored in the
+// cells of the buckets, keys longer than the first read of a block and keys spread over several tables.
+// the lookups also run while another thread changes the database.
+// usage: kvtest-mget [directory]
+
+#include <pthread.h>
+#include <string.h>
+
+#include "kvdb.h"
+#include "kvtest.h"
+
+#define KEY_COUNT 1000
+#define MISSING_KEY_COUNT 200
+#define LONG_KEY_SIZE 200
+#define MAX_VALUE_SIZE 300
+// the first table is full after a few keys: the keys are spread over several tables.
+#define EXPECTED_COUNT 30
+#define WRITER_KEY_COUNT 2000
+
+// a third of the keys are longer than the first read of a block.
+static size_t make_test_key(char * key, unsigned int idx)
+{
+    size_t key_size = kvtest_make_key(key, idx);
+    if (idx % 3 != 2) {
+        return key_size;
+    }
+    memset(key + key_size, 'k', LONG_KEY_SIZE - key_size);
+    return LONG_KEY_SIZE;
+}
+
+// a third of the values are small enough to be stored in the cells of the buckets.
+static size_t make_value(char * value, unsigned int idx)
+{
+    size_t value_size = (idx % 3 == 0) ? 8 : MAX_VALUE_SIZE;
+    for(size_t i = 0 ; i < value_size ; i ++) {
+        value[i] = (char) ('a' + (idx + i) % 26);
+    }
+    return value_size;
+}
+
+static void set_keys(kvdb * db)
+{
+    char key[LONG_KEY_SIZE];
+    char value[MAX_VALUE_SIZE];
+    for(unsigned int idx = 0 ; idx < KEY_COUNT ; idx ++) {
+        KVTEST_CHECK(kvdb_set(db, key, make_test_key(key, idx), value, make_value(value, idx)) == 0);
+    }
+    // The deleted keys are looked up as missing keys.
+    for(unsigned int idx = 0 ; idx < KEY_COUNT ; idx += 10) {
+        KVTEST_CHECK(kvdb_delete(db, key, make_test_key(key, idx)) == 0);
+    }
+}
+
+// the keys are looked up in a different order than they were added, followed by keys that were never added.
+static void check_mget(kvdb * db)
+{
+    unsigned int count = KEY_COUNT + MISSING_KEY_COUNT;
+    char (* key_buffers)[LONG_KEY_SIZE] = malloc(count * LONG_KEY_SIZE);
+    const char ** keys = malloc(count * sizeof(* keys));
+    size_t * key_sizes = malloc(count * sizeof(* key_sizes));
+    unsigned int * indexes = malloc(count * sizeof(* indexes));
+    char ** values = malloc(count * sizeof(* values));
+    size_t * value_sizes = malloc(count * sizeof(* value_sizes));
+    int * results = malloc(count * sizeof(* results));
+    for(unsigned int i = 0 ; i < count ; i ++) {
+        indexes[i] = (i < KEY_COUNT) ? (i * 7) % KEY_COUNT : i;
+        keys[i] = key_buffers[i];
+        key_sizes[i] = make_test_key(key_buffers[i], indexes[i]);
+    }
+
+    KVTEST_CHECK(kvdb_mget(db, keys, key_sizes, count, values, value_sizes, results) == 0);
+    char expected[MAX_VALUE_SIZE];
+    for(unsigned int i = 0 ; i < count ; i ++) {
+        unsigned int idx = indexes[i];
+        if ((idx >= KEY_COUNT) || (idx % 10 == 0)) {
+            KVTEST_CHECK(results[i] == -1);
+            continue;
+        }
+        KVTEST_CHECK(results[i] == 0);
+        size_t expected_size = make_value(expected, idx);
+        KVTEST_CHECK((value_sizes[i] == expected_size) && (memcmp(values[i], expected, expected_size) == 0));
+        free(values[i]);
+    }
+
+    free(results);
+    free(value_sizes);
+    free(values);
+    free(indexes);
+    free(key_sizes);
+    free(keys);
+    free(key_buffers);
+}
+
+static void run(int argc, char ** argv, const char * name, int options)
+{
+    char * filename = kvtest_filename(argc, argv, name);
+    kvdb * db = kvdb_new(filename);
+    kvdb_set_expected_count(db, EXPECTED_COUNT);
+    kvdb_set_inline_values(db, 1);
+    KVTEST_CHECK(kvdb_open(db) == 0);
+    set_keys(db);
+    check_mget(db);
+    kvdb_close(db);
+    kvdb_free(db);
+
+    db = kvtest_open(filename, KVDB_STORAGE_TYPE_TABLES, options);
+    check_mget(db);
+    kvtest_close(db);
+    unlink(filename);
+    free(filename);
+}
+
+// adds other keys: the tables grow and the buckets of the looked up keys change.
+static void * writer_main(void * data)
+{
+    kvdb * db = data;
+    char key[KVTEST_KEY_SIZE];
+    char value[MAX_VALUE_SIZE];
+    memset(value, 'w', sizeof(value));
+    for(unsigned int idx = 0 ; idx < WRITER_KEY_COUNT ; idx ++) {
+        size_t key_size = (size_t) snprintf(key, sizeof(key), "writer-%u", idx);
+        KVTEST_CHECK(kvdb_set(db, key, key_size, value, sizeof(value)) == 0);
+    }
+    return NULL;
+}
+
+static void run_concurrent(int argc, char ** argv)
+{
+    char * filename = kvtest_filename(argc, argv, "mget-concurrent.kvdb");
+    kvdb * db = kvdb_new(filename);
+    kvdb_set_expected_count(db, EXPECTED_COUNT);
+    kvdb_set_inline_values(db, 1);
+    kvdb_set_concurrent_readers(db, 1);
+    KVTEST_CHECK(kvdb_open(db) == 0);
+    set_keys(db);
+    pthread_t writer;
+    KVTEST_CHECK(pthread_create(&writer, NULL, writer_main, db) == 0);
+    for(unsigned int i = 0 ; i < 20 ; i ++) {
+        check_mget(db);
+    }
+    KVTEST_CHECK(pthread_join(writer, NULL) == 0);
+    kvtest_close(db);
+    unlink(filename);
+    free(filename);
+}
+
+int main(int argc, char ** argv)
+{
+    run(argc, argv, "mget.kvdb", 0);
+    run(argc, argv, "mget-uring.kvdb", KVTEST_OPEN_IO_URING);
+    run_concurrent(argc, argv);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,159 @@
+//
+//  kvtest_multi_process.c
+//  kvdb
+//
+//  Copyright (c) 2013 etpan. All rights reserved.
+//
+
+// checks that several processes can change the same file: each process changes its own keys and reads the keys
+// of the others, the file contains the last value of every key at the end.
+// usage: kvtest-multi-process [directory]
+
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "kvdb.h"
+#include "kvtest.h"
+
+#define PROCESS_COUNT 4
+#define KEY_COUNT 8000
+#define CHANGE_COUNT 6000
+#define MAX_VALUE_SIZE 1024
+
+// version of the last value written for each key, -1 if it has been deleted. shared by the processes.
+static int * s_versions;
+
+// some values are small enough to stay in the cells of the buckets.
+static size_t make_value(char * value, unsigned int idx, int version)
+{
+    char pattern[32];
+    size_t pattern_size = (size_t) snprintf(pattern, sizeof(pattern), "%u:%i;", idx, version);
+    size_t size = idx % 3 == 0 ? pattern_size : 40 + (idx * 7 + (unsigned int) version * 13) % (MAX_VALUE_SIZE - 40);
+    for(size_t i = 0 ; i < size ; i ++) {
+        value[i] = pattern[i % pattern_size];
+    }
+    return size;
+}
+
+// Returns the version of the value, -1 if it's not a complete value of the key.
+static int value_version(const char * value, size_t value_size, unsigned int idx)
+{
+    char header[32];
+    size_t header_size = value_size < sizeof(header) - 1 ? value_size : sizeof(header) - 1;
+    memcpy(header, value, header_size);
+    header[header_size] = 0;
+    unsigned int value_idx;
+    int version;
+    if ((sscanf(header, "%u:%i;", &value_idx, &version) != 2) || (value_idx != idx) || (version < 0)) {
+        return -1;
+    }
+    char expected[MAX_VALUE_SIZE];
+    size_t expected_size = make_value(expected, idx, version);
+    if ((expected_size != value_size) || (memcmp(expected, value, value_size) != 0)) {
+        return -1;
+    }
+    return version;
+}
+
+// the process changes the keys idx where idx % PROCESS_COUNT == process_idx.
+static void child_main(const char * filename, int storage_type, unsigned int process_idx)
+{
+    kvdb * db = kvtest_open(filename, storage_type, KVTEST_OPEN_MULTI_PROCESS);
+    unsigned int seed = process_idx + 1;
+    char key[KVTEST_KEY_SIZE];
+    char value[MAX_VALUE_SIZE];
+    for(int version = 1 ; version <= CHANGE_COUNT ; version ++) {
+        unsigned int idx = (rand_r(&seed) % (KEY_COUNT / PROCESS_COUNT)) * PROCESS_COUNT + process_idx;
+        size_t key_size = kvtest_make_key(key, idx);
+        if ((idx % 4 == 0) && (rand_r(&seed) % 3 == 0)) {
+            kvdb_delete(db, key, key_size);
+            s_versions[idx] = -1;
+        }
+        else {
+            KVTEST_CHECK(kvdb_set(db, key, key_size, value, make_value(value, idx, version)) == 0);
+            s_versions[idx] = version;
+        }
+        
+        // The keys of the other processes are always found with a complete value, except the ones that
+        // can be deleted.
+        unsigned int other_idx = rand_r(&seed) % KEY_COUNT;
+        char * found_value;
+        size_t found_value_size;
+        key_size = kvtest_make_key(key, other_idx);
+        int r = kvdb_get(db, key, key_size, &found_value, &found_value_size);
+        if (r == 0) {
+            KVTEST_CHECK(value_version(found_value, found_value_size, other_idx) >= 0);
+            free(found_value);
+        }
+        else {
+            KVTEST_CHECK((r == -1) && (other_idx % 4 == 0));
+        }
+        
+        if ((process_idx == 0) && (version % 2000 == 0)) {
+            // These changes are done while the other processes keep using the file.
+            while (kvdb_consolidate(db, 1000) == 1) {
+            }
+            KVTEST_CHECK(kvdb_release_free_space(db, NULL) == 0);
+        }
+    }
+    kvtest_close(db);
+}
+
+static void run(int argc, char ** argv, int storage_type)
+{
+    char * filename = kvtest_filename(argc, argv, "multi-process.kvdb");
+    
+    kvdb * db = kvtest_open(filename, storage_type, KVTEST_OPEN_MULTI_PROCESS);
+    char key[KVTEST_KEY_SIZE];
+    char value[MAX_VALUE_SIZE];
+    for(unsigned int idx = 0 ; idx < KEY_COUNT ; idx ++) {
+        KVTEST_CHECK(kvdb_set(db, key, kvtest_make_key(key, idx), value, make_value(value, idx, 0)) == 0);
+        s_versions[idx] = 0;
+    }
+    kvtest_close(db);
+    
+    pid_t pids[PROCESS_COUNT];
+    for(unsigned int i = 0 ; i < PROCESS_COUNT ; i ++) {
+        pids[i] = fork();
+        KVTEST_CHECK(pids[i] >= 0);
+        if (pids[i] == 0) {
+            child_main(filename, storage_type, i);
+            _exit(EXIT_SUCCESS);
+        }
+    }
+    for(unsigned int i = 0 ; i < PROCESS_COUNT ; i ++) {
+        int status;
+        KVTEST_CHECK(waitpid(pids[i], &status, 0) == pids[i]);
+        KVTEST_CHECK(WIFEXITED(status) && (WEXITSTATUS(status) == EXIT_SUCCESS));
+    }
+    
+    // The file contains the last change of every key.
+    db = kvtest_open(filename, storage_type, KVTEST_OPEN_MULTI_PROCESS);
+    for(unsigned int idx = 0 ; idx < KEY_COUNT ; idx ++) {
+        char * found_value;
+        size_t found_value_size;
+        int r = kvdb_get(db, key, kvtest_make_key(key, idx), &found_value, &found_value_size);
+        if (s_versions[idx] < 0) {
+            KVTEST_CHECK(r == -1);
+        }
+        else {
+            KVTEST_CHECK(r == 0);
+            KVTEST_CHECK(value_version(found_value, found_value_size, idx) == s_versions[idx]);
+            free(found_value);
+        }
+    }
+    kvtest_close(db);
+    unlink(filename);
+    free(filename);
+}
+
+int main(int argc, char ** argv)
+{
+    s_versions = mmap(NULL, KEY_COUNT * sizeof(* s_versions), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    KVTEST_CHECK(s_versions != MAP_FAILED);
+    run(argc, argv, KVDB_STORAGE_TYPE_TABLES);
+    run(argc, argv, KVDB_STORAGE_TYPE_LINEAR_HASHING);
+    munmap(s_versions, KEY_COUNT * sizeof(* s_versions));
+    return EXIT_SUCCESS;
+}
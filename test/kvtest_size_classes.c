@@ -0,0 +1,172 @@
+//
+//  kvtest_size_classes.c
+//  kvdb
+//
+
+// checks that a record slightly larger than a power of 2 uses a block between two powers of 2, that a recycled
+// block is split to be reused by smaller size classes, and that the recycled blocks are reused by the other
+// processes and after the process that recycled them stopped without closing the file.
+// usage: kvtest-size-classes [directory]
+
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/wait.h>
+
+#include "kvdb.h"
+#include "kvendian.h"
+#include "kvtest.h"
+#include "kvtypes.h"
+
+#define KEY_COUNT 200
+#define VALUE_SIZE 1000
+// size of the key and the value of the records of check_size_classes().
+#define SMALL_RECORD_SIZE 1025
+#define LARGE_RECORD_SIZE 2560
+#define MAX_RECORD_SIZE 4096
+
+// opens the database with uncompressed values.
+static kvdb * open_database(const char * filename, int multi_process)
+{
+    return kvtest_open(filename, KVDB_STORAGE_TYPE_TABLES, KVTEST_OPEN_RAW | (multi_process ? KVTEST_OPEN_MULTI_PROCESS : 0));
+}
+
+static void set_keys(kvdb * db, char fill)
+{
+    char key[KVTEST_KEY_SIZE];
+    char value[VALUE_SIZE];
+    memset(value, fill, sizeof(value));
+    for(unsigned int idx = 0 ; idx < KEY_COUNT ; idx ++) {
+        KVTEST_CHECK(kvdb_set(db, key, kvtest_make_key(key, idx), value, sizeof(value)) == 0);
+    }
+}
+
+static void check_keys(kvdb * db, char fill)
+{
+    char key[KVTEST_KEY_SIZE];
+    char expected[VALUE_SIZE];
+    memset(expected, fill, sizeof(expected));
+    for(unsigned int idx = 0 ; idx < KEY_COUNT ; idx ++) {
+        kvtest_check_value(db, key, kvtest_make_key(key, idx), expected, sizeof(expected));
+    }
+}
+
+static void delete_keys(kvdb * db)
+{
+    char key[KVTEST_KEY_SIZE];
+    for(unsigned int idx = 0 ; idx < KEY_COUNT ; idx ++) {
+        KVTEST_CHECK(kvdb_delete(db, key, kvtest_make_key(key, idx)) == 0);
+    }
+}
+
+// returns the size of the file used by the blocks, the file itself grows by larger steps.
+static uint64_t used_size(const char * filename)
+{
+    int fd = open(filename, O_RDONLY);
+    KVTEST_CHECK(fd >= 0);
+    uint64_t size;
+    KVTEST_CHECK(pread(fd, &size, sizeof(size), KV_HEADER_FILESIZE_OFFSET) == sizeof(size));
+    close(fd);
+    return ntoh64(size);
+}
+
+// sets a key whose key and value use record_size bytes.
+// Returns the number of bytes added to the file.
+static uint64_t set_record(kvdb * db, const char * filename, const char * key, size_t record_size)
+{
+    char value[MAX_RECORD_SIZE];
+    size_t key_size = strlen(key);
+    memset(value, 'r', sizeof(value));
+    uint64_t size = used_size(filename);
+    KVTEST_CHECK(kvdb_set(db, key, key_size, value, record_size - key_size) == 0);
+    kvtest_check_value(db, key, key_size, value, record_size - key_size);
+    return used_size(filename) - size;
+}
+
+// a record of 1025 bytes doesn't use a block of 2048 bytes, and the block of a larger record is reused by two
+// smaller records once it's recycled.
+static void check_size_classes(int argc, char ** argv)
+{
+    char * filename = kvtest_filename(argc, argv, "size-classes.kvdb");
+    kvdb * db = open_database(filename, 0);
+    uint64_t added_size = set_record(db, filename, "small", SMALL_RECORD_SIZE);
+    KVTEST_CHECK((added_size > SMALL_RECORD_SIZE) && (added_size < 2048));
+    
+    KVTEST_CHECK(set_record(db, filename, "large", LARGE_RECORD_SIZE) > LARGE_RECORD_SIZE);
+    KVTEST_CHECK(kvdb_delete(db, "large", strlen("large")) == 0);
+    KVTEST_CHECK(set_record(db, filename, "split-1", SMALL_RECORD_SIZE) == 0);
+    KVTEST_CHECK(set_record(db, filename, "split-2", VALUE_SIZE) == 0);
+    kvtest_close(db);
+    unlink(filename);
+    free(filename);
+}
+
+// a process deletes the keys and keeps the file open while another one sets them again, then it's killed
+// and the keys are deleted and set again.
+static void check_recycled_blocks_reuse(int argc, char ** argv)
+{
+    char * filename = kvtest_filename(argc, argv, "size-classes-reuse.kvdb");
+    kvdb * db = open_database(filename, 0);
+    set_keys(db, 'a');
+    kvtest_close(db);
+    off_t size = kvtest_file_size(filename);
+    
+    int deleted_pipe[2];
+    int done_pipe[2];
+    KVTEST_CHECK(pipe(deleted_pipe) == 0);
+    KVTEST_CHECK(pipe(done_pipe) == 0);
+    pid_t pid = fork();
+    KVTEST_CHECK(pid >= 0);
+    if (pid == 0) {
+        db = open_database(filename, 1);
+        delete_keys(db);
+        char c = 0;
+        // Stop if the other process stops.
+        close(done_pipe[1]);
+        KVTEST_CHECK(write(deleted_pipe[1], &c, 1) == 1);
+        // Wait until the process is killed.
+        read(done_pipe[0], &c, 1);
+        _exit(EXIT_FAILURE);
+    }
+    char c;
+    KVTEST_CHECK(read(deleted_pipe[0], &c, 1) == 1);
+    
+    // The blocks recycled by the other process are used while it has the file open.
+    db = open_database(filename, 1);
+    set_keys(db, 'b');
+    KVTEST_CHECK(kvtest_file_size(filename) == size);
+    kvtest_close(db);
+    kill(pid, SIGKILL);
+    int status;
+    KVTEST_CHECK(waitpid(pid, &status, 0) == pid);
+    
+    // The blocks recycled by a process that has been killed are not lost.
+    pid = fork();
+    KVTEST_CHECK(pid >= 0);
+    if (pid == 0) {
+        db = open_database(filename, 0);
+        delete_keys(db);
+        kill(getpid(), SIGKILL);
+    }
+    KVTEST_CHECK(waitpid(pid, &status, 0) == pid);
+    KVTEST_CHECK(WIFSIGNALED(status));
+    db = open_database(filename, 0);
+    set_keys(db, 'c');
+    check_keys(db, 'c');
+    KVTEST_CHECK(kvtest_file_size(filename) == size);
+    kvtest_close(db);
+    
+    close(deleted_pipe[0]);
+    close(deleted_pipe[1]);
+    close(done_pipe[0]);
+    close(done_pipe[1]);
+    unlink(filename);
+    free(filename);
+}
+
+int main(int argc, char ** argv)
+{
+    check_size_classes(argc, argv);
+    check_recycled_blocks_reuse(argc, argv);
+    return EXIT_SUCCESS;
+}
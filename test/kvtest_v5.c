@@ -0,0 +1,341 @@
+//
+//  kvtest_v5.c
+//  kvdb
+//
+//  Copyright (c) 2013 etpan. All rights reserved.
+//
+
+// checks that the files of version 5 can still be read and changed, and that they can still be read
+// the way version 5 did once they've been changed.
+// the file is built by the test with the layout of version 5: the header, a single table with a prime number
+// of buckets and the chains of blocks sized by powers of 2, with values compressed with LZ4.
+// usage: kvtest-v5 [directory]
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <lz4.h>
+
+#include "kvdb.h"
+#include "kvmurmurhash.h"
+#include "kvtest.h"
+
+#define V5_HEADER_SIZE (4 + 4 + 8 + 1 + 8 + 64 * 8)
+#define V5_VERSION 5
+#define V5_COMPRESSION_TYPE_LZ4 1
+#define V5_MAX_COUNT 31
+#define V5_BLOOM_SIZE 256
+#define V5_TABLE_HEADER_SIZE (8 + 8 + 8 + 8)
+#define V5_BLOCK_HEADER_SIZE (8 + 4 + 1 + 8)
+// the blocks are after the table.
+#define V5_FIRST_BLOCK_OFFSET 4096
+
+#define OLD_KEY_COUNT 60
+#define NEW_KEY_COUNT 300
+#define MAX_VALUE_SIZE 4096
+
+static void write_be32(char * data, uint32_t value)
+{
+    for(unsigned int i = 0 ; i < 4 ; i ++) {
+        data[i] = (char) (value >> (24 - 8 * i));
+    }
+}
+
+static void write_be64(char * data, uint64_t value)
+{
+    for(unsigned int i = 0 ; i < 8 ; i ++) {
+        data[i] = (char) (value >> (56 - 8 * i));
+    }
+}
+
+static uint32_t read_be32(const char * data)
+{
+    uint32_t value = 0;
+    for(unsigned int i = 0 ; i < 4 ; i ++) {
+        value = (value << 8) | (unsigned char) data[i];
+    }
+    return value;
+}
+
+static uint64_t read_be64(const char * data)
+{
+    uint64_t value = 0;
+    for(unsigned int i = 0 ; i < 8 ; i ++) {
+        value = (value << 8) | (unsigned char) data[i];
+    }
+    return value;
+}
+
+static size_t make_key(char * key, const char * prefix, unsigned int idx)
+{
+    return (size_t) snprintf(key, 32, "%s-%u", prefix, idx);
+}
+
+// the values of the keys written in the version 5 file compress well, one of them is empty.
+static size_t make_old_value(char * value, unsigned int idx, unsigned int version)
+{
+    if (idx == 0) {
+        return 0;
+    }
+    size_t size = (size_t) snprintf(value, MAX_VALUE_SIZE, "value %u of version %u", idx, version);
+    size_t pattern_size = size;
+    size += 10 * idx;
+    for(size_t i = pattern_size ; i < size ; i ++) {
+        value[i] = value[i % pattern_size];
+    }
+    return size;
+}
+
+// the values added later don't compress: they're stored with their legacy header anyway.
+static size_t make_new_value(char * value, unsigned int idx)
+{
+    uint64_t state = idx * 0x9e3779b97f4a7c15ULL + 1;
+    size_t size = 100 + (idx * 37) % 2000;
+    for(size_t i = 0 ; i < size ; i ++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        value[i] = (char) state;
+    }
+    return size;
+}
+
+// returns the log2 of the smallest power of 2 that can hold size bytes.
+static uint8_t block_size_log2(size_t size)
+{
+    uint8_t log2_size = 0;
+    while ((((size_t) 1) << log2_size) < size) {
+        log2_size ++;
+    }
+    return log2_size;
+}
+
+// the stored value is the size of the value on 4 bytes followed by the value compressed with LZ4.
+static size_t legacy_stored_value(char * stored_value, const char * value, size_t value_size)
+{
+    if (value_size == 0) {
+        return 0;
+    }
+    write_be32(stored_value, (uint32_t) value_size);
+    int compressed_size = LZ4_compress_default(value, stored_value + 4, (int) value_size,
+                                               LZ4_compressBound((int) value_size));
+    KVTEST_CHECK(compressed_size > 0);
+    return 4 + (size_t) compressed_size;
+}
+
+static void create_v5_file(const char * filename)
+{
+    size_t table_size = V5_TABLE_HEADER_SIZE + V5_BLOOM_SIZE / 8 + V5_MAX_COUNT * 8;
+    KVTEST_CHECK(V5_HEADER_SIZE + table_size <= V5_FIRST_BLOCK_OFFSET);
+    char * data = calloc(1, V5_FIRST_BLOCK_OFFSET);
+    char * table = data + V5_HEADER_SIZE;
+    char * items = table + V5_TABLE_HEADER_SIZE + V5_BLOOM_SIZE / 8;
+    memcpy(data, "KVDB", 4);
+    write_be32(data + 4, V5_VERSION);
+    write_be64(data + 8, V5_MAX_COUNT);
+    data[16] = V5_COMPRESSION_TYPE_LZ4;
+    write_be64(table + 8, OLD_KEY_COUNT);
+    write_be64(table + 16, V5_BLOOM_SIZE);
+    write_be64(table + 24, V5_MAX_COUNT);
+    // All the bits of the bloom filter are set: a lookup always visits the bucket.
+    memset(table + V5_TABLE_HEADER_SIZE, 0xff, V5_BLOOM_SIZE / 8);
+    
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    KVTEST_CHECK(fd >= 0);
+    uint64_t offset = V5_FIRST_BLOCK_OFFSET;
+    for(unsigned int idx = 0 ; idx < OLD_KEY_COUNT ; idx ++) {
+        char key[32];
+        char value[MAX_VALUE_SIZE];
+        size_t key_size = make_key(key, "old", idx);
+        size_t value_size = make_old_value(value, idx, 0);
+        char block[V5_BLOCK_HEADER_SIZE + 32 + 8 + 4 + MAX_VALUE_SIZE * 2];
+        size_t stored_value_size = legacy_stored_value(block + V5_BLOCK_HEADER_SIZE + key_size + 8, value, value_size);
+        uint32_t hash_value = kv_murmur_hash(key, key_size, 0);
+        uint8_t log2_size = block_size_log2(key_size + stored_value_size);
+        // The new block is the first one of the chain of its bucket.
+        char * item = items + (hash_value % V5_MAX_COUNT) * 8;
+        write_be64(block, read_be64(item));
+        write_be32(block + 8, hash_value);
+        block[12] = (char) log2_size;
+        write_be64(block + 13, key_size);
+        memcpy(block + V5_BLOCK_HEADER_SIZE, key, key_size);
+        write_be64(block + V5_BLOCK_HEADER_SIZE + key_size, stored_value_size);
+        size_t block_size = V5_BLOCK_HEADER_SIZE + key_size + 8 + stored_value_size;
+        KVTEST_CHECK(pwrite(fd, block, block_size, (off_t) offset) == (ssize_t) block_size);
+        write_be64(item, offset);
+        offset += V5_BLOCK_HEADER_SIZE + 8 + (((uint64_t) 1) << log2_size);
+    }
+    write_be64(data + 17, offset);
+    KVTEST_CHECK(pwrite(fd, data, V5_FIRST_BLOCK_OFFSET, 0) == V5_FIRST_BLOCK_OFFSET);
+    KVTEST_CHECK(ftruncate(fd, (off_t) offset) == 0);
+    close(fd);
+    free(data);
+}
+
+// looks up a key the way version 5 did: through the chain of tables and the chain of blocks of the bucket
+// selected with a modulo. the value is decompressed after its 4 bytes header.
+// Returns -1 if the key is not found.
+static int legacy_get(const char * file, size_t file_size, const char * key, size_t key_size,
+                      char * value, size_t * p_value_size)
+{
+    uint32_t hash_value = kv_murmur_hash(key, key_size, 0);
+    uint64_t table_offset = V5_HEADER_SIZE;
+    while (table_offset != 0) {
+        KVTEST_CHECK(table_offset + V5_TABLE_HEADER_SIZE <= file_size);
+        const char * table = file + table_offset;
+        uint64_t bloom_size = read_be64(table + 16);
+        uint64_t max_count = read_be64(table + 24);
+        const char * items = table + V5_TABLE_HEADER_SIZE + (bloom_size + 7) / 8;
+        uint64_t offset = read_be64(items + (hash_value % max_count) * 8);
+        while (offset != 0) {
+            KVTEST_CHECK(offset + V5_BLOCK_HEADER_SIZE <= file_size);
+            const char * block = file + offset;
+            uint8_t log2_size = (uint8_t) block[12];
+            // Version 5 only knew the blocks sized by powers of 2.
+            KVTEST_CHECK(log2_size < 64);
+            uint64_t block_key_size = read_be64(block + 13);
+            if ((read_be32(block + 8) == hash_value) && (block_key_size == key_size) &&
+                (memcmp(block + V5_BLOCK_HEADER_SIZE, key, key_size) == 0)) {
+                uint64_t stored_value_size = read_be64(block + V5_BLOCK_HEADER_SIZE + key_size);
+                const char * stored_value = block + V5_BLOCK_HEADER_SIZE + key_size + 8;
+                KVTEST_CHECK(key_size + stored_value_size <= (((uint64_t) 1) << log2_size));
+                KVTEST_CHECK(offset + V5_BLOCK_HEADER_SIZE + key_size + 8 + stored_value_size <= file_size);
+                if (stored_value_size == 0) {
+                    * p_value_size = 0;
+                    return 0;
+                }
+                KVTEST_CHECK(stored_value_size >= 4);
+                uint32_t value_size = read_be32(stored_value);
+                KVTEST_CHECK(value_size <= MAX_VALUE_SIZE);
+                int r = LZ4_decompress_safe(stored_value + 4, value, (int) stored_value_size - 4, (int) value_size);
+                KVTEST_CHECK(r == (int) value_size);
+                * p_value_size = value_size;
+                return 0;
+            }
+            offset = read_be64(block);
+        }
+        table_offset = read_be64(table);
+    }
+    return -1;
+}
+
+static void check_value(kvdb * db, const char * key, size_t key_size, const char * expected, size_t expected_size)
+{
+    kvtest_check_value(db, key, key_size, expected, expected_size);
+    
+    size_t value_size;
+    char buffer[MAX_VALUE_SIZE];
+    KVTEST_CHECK(kvdb_get_into(db, key, key_size, buffer, sizeof(buffer), &value_size) == 0);
+    KVTEST_CHECK((value_size == expected_size) && (memcmp(buffer, expected, value_size) == 0));
+    
+    const char * ref_value;
+    KVTEST_CHECK(kvdb_get_ref(db, key, key_size, &ref_value, &value_size) == 0);
+    KVTEST_CHECK((value_size == expected_size) && (memcmp(ref_value, expected, value_size) == 0));
+}
+
+// the keys idx of the file where idx % 3 == 1 have been changed and where idx % 3 == 2 have been deleted.
+static void check_database(kvdb * db, int changed)
+{
+    char key[32];
+    char value[MAX_VALUE_SIZE];
+    for(unsigned int idx = 0 ; idx < OLD_KEY_COUNT ; idx ++) {
+        size_t key_size = make_key(key, "old", idx);
+        if (changed && (idx % 3 == 2)) {
+            char * found_value;
+            size_t found_value_size;
+            KVTEST_CHECK(kvdb_get(db, key, key_size, &found_value, &found_value_size) == -1);
+            continue;
+        }
+        size_t value_size = make_old_value(value, idx, changed && (idx % 3 == 1) ? 1 : 0);
+        check_value(db, key, key_size, value, value_size);
+    }
+    if (!changed) {
+        return;
+    }
+    for(unsigned int idx = 0 ; idx < NEW_KEY_COUNT ; idx ++) {
+        size_t key_size = make_key(key, "new", idx);
+        size_t value_size = make_new_value(value, idx);
+        check_value(db, key, key_size, value, value_size);
+    }
+}
+
+// reads the whole file the way version 5 did.
+static void check_legacy_file(const char * filename)
+{
+    int fd = open(filename, O_RDONLY);
+    KVTEST_CHECK(fd >= 0);
+    struct stat stat_info;
+    KVTEST_CHECK(fstat(fd, &stat_info) == 0);
+    size_t file_size = (size_t) stat_info.st_size;
+    char * file = malloc(file_size);
+    KVTEST_CHECK(pread(fd, file, file_size, 0) == (ssize_t) file_size);
+    close(fd);
+    
+    // The file keeps its version so that the previous versions of kvdb can open it.
+    KVTEST_CHECK(read_be32(file + 4) == V5_VERSION);
+    KVTEST_CHECK(file[16] == V5_COMPRESSION_TYPE_LZ4);
+    
+    char key[32];
+    char value[MAX_VALUE_SIZE];
+    char expected[MAX_VALUE_SIZE];
+    size_t value_size;
+    for(unsigned int idx = 0 ; idx < OLD_KEY_COUNT ; idx ++) {
+        size_t key_size = make_key(key, "old", idx);
+        int r = legacy_get(file, file_size, key, key_size, value, &value_size);
+        if (idx % 3 == 2) {
+            KVTEST_CHECK(r == -1);
+            continue;
+        }
+        KVTEST_CHECK(r == 0);
+        size_t expected_size = make_old_value(expected, idx, idx % 3 == 1 ? 1 : 0);
+        KVTEST_CHECK((value_size == expected_size) && (memcmp(value, expected, value_size) == 0));
+    }
+    for(unsigned int idx = 0 ; idx < NEW_KEY_COUNT ; idx ++) {
+        size_t key_size = make_key(key, "new", idx);
+        KVTEST_CHECK(legacy_get(file, file_size, key, key_size, value, &value_size) == 0);
+        size_t expected_size = make_new_value(expected, idx);
+        KVTEST_CHECK((value_size == expected_size) && (memcmp(value, expected, value_size) == 0));
+    }
+    free(file);
+}
+
+int main(int argc, char ** argv)
+{
+    char * filename = kvtest_filename(argc, argv, "v5.kvdb");
+    create_v5_file(filename);
+    
+    kvdb * db = kvdb_new(filename);
+    KVTEST_CHECK(kvdb_open(db) == 0);
+    KVTEST_CHECK(kvdb_get_compression_type(db) == KVDB_COMPRESSION_TYPE_LZ4);
+    check_database(db, 0);
+    
+    char key[32];
+    char value[MAX_VALUE_SIZE];
+    for(unsigned int idx = 0 ; idx < OLD_KEY_COUNT ; idx ++) {
+        size_t key_size = make_key(key, "old", idx);
+        if (idx % 3 == 1) {
+            KVTEST_CHECK(kvdb_set(db, key, key_size, value, make_old_value(value, idx, 1)) == 0);
+        }
+        else if (idx % 3 == 2) {
+            KVTEST_CHECK(kvdb_delete(db, key, key_size) == 0);
+        }
+    }
+    // More keys than the buckets of the table can hold: a table is added.
+    for(unsigned int idx = 0 ; idx < NEW_KEY_COUNT ; idx ++) {
+        KVTEST_CHECK(kvdb_set(db, key, make_key(key, "new", idx), value, make_new_value(value, idx)) == 0);
+    }
+    check_database(db, 1);
+    kvdb_close(db);
+    
+    check_legacy_file(filename);
+    
+    KVTEST_CHECK(kvdb_open(db) == 0);
+    check_database(db, 1);
+    kvdb_close(db);
+    kvdb_free(db);
+    
+    unlink(filename);
+    free(filename);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,155 @@
+//
+//  kvtest_vacuum.c
+//  kvdb
+//
+
+// checks that kvdb_vacuum() keeps the values and shrinks the file, and that the free space it was using is
+// found again when the process stops in the middle of it.
+// usage: kvtest-vacuum [directory]
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "kvdb.h"
+#include "kvtest.h"
+#include "kvtypes.h"
+
+#define KEY_COUNT 2000
+#define VALUE_SIZE 1000
+// the first call stops after a few blocks.
+#define STEP_IO_BUDGET (64 * 1024)
+#define STOP_ATTEMPT_COUNT 10
+
+static size_t make_value(char * value, unsigned int idx)
+{
+    memset(value, 'a' + idx % 26, VALUE_SIZE);
+    return VALUE_SIZE;
+}
+
+// the keys of the first half of the file are deleted: the blocks of the second half can be moved there.
+static void create_database(const char * filename)
+{
+    kvdb * db = kvtest_open(filename, KVDB_STORAGE_TYPE_TABLES, KVTEST_OPEN_RAW);
+    char key[KVTEST_KEY_SIZE];
+    char value[VALUE_SIZE];
+    for(unsigned int idx = 0 ; idx < KEY_COUNT ; idx ++) {
+        KVTEST_CHECK(kvdb_set(db, key, kvtest_make_key(key, idx), value, make_value(value, idx)) == 0);
+    }
+    for(unsigned int idx = 0 ; idx < KEY_COUNT / 2 ; idx ++) {
+        KVTEST_CHECK(kvdb_delete(db, key, kvtest_make_key(key, idx)) == 0);
+    }
+    kvtest_close(db);
+}
+
+static void check_values(kvdb * db)
+{
+    char key[KVTEST_KEY_SIZE];
+    char expected[VALUE_SIZE];
+    for(unsigned int idx = KEY_COUNT / 2 ; idx < KEY_COUNT ; idx ++) {
+        kvtest_check_value(db, key, kvtest_make_key(key, idx), expected, make_value(expected, idx));
+    }
+}
+
+static void vacuum(kvdb * db)
+{
+    int r;
+    do {
+        r = kvdb_vacuum(db, STEP_IO_BUDGET, NULL);
+        KVTEST_CHECK(r >= 0);
+    } while (r == 1);
+}
+
+// Returns the size of the file after the vacuum.
+static off_t check_vacuum(int argc, char ** argv)
+{
+    char * filename = kvtest_filename(argc, argv, "vacuum.kvdb");
+    create_database(filename);
+    off_t size = kvtest_file_size(filename);
+
+    kvdb * db = kvtest_open(filename, KVDB_STORAGE_TYPE_TABLES, KVTEST_OPEN_RAW);
+    vacuum(db);
+    check_values(db);
+    kvtest_close(db);
+    off_t vacuumed_size = kvtest_file_size(filename);
+    // About half of the blocks are removed.
+    KVTEST_CHECK(vacuumed_size < size - (off_t) (KEY_COUNT / 4) * VALUE_SIZE);
+
+    db = kvtest_open(filename, KVDB_STORAGE_TYPE_TABLES, KVTEST_OPEN_RAW);
+    check_values(db);
+    kvtest_close(db);
+    unlink(filename);
+    free(filename);
+    return vacuumed_size;
+}
+
+// kills the process as soon as the vacuum has taken the free space of the file.
+static void * killer_main(void * data)
+{
+    const char * filename = data;
+    int fd = open(filename, O_RDONLY);
+    KVTEST_CHECK(fd >= 0);
+    char * header = mmap(NULL, KV_HEADER_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+    KVTEST_CHECK(header != MAP_FAILED);
+    volatile uint64_t * free_regions_head = (volatile uint64_t *) (header + KV_HEADER_FREE_REGIONS_OFFSET);
+    while (* free_regions_head == 0) {
+    }
+    kill(getpid(), SIGKILL);
+    return NULL;
+}
+
+// runs the vacuum in a child process that is killed in the middle of the first step.
+// Returns 0 if the step ended before the process could be killed.
+static int stop_vacuum(const char * filename)
+{
+    pid_t pid = fork();
+    KVTEST_CHECK(pid >= 0);
+    if (pid == 0) {
+        kvdb * db = kvtest_open(filename, KVDB_STORAGE_TYPE_TABLES, KVTEST_OPEN_RAW);
+        pthread_t killer;
+        KVTEST_CHECK(pthread_create(&killer, NULL, killer_main, (void *) filename) == 0);
+        kvdb_vacuum(db, UINT64_MAX, NULL);
+        _exit(EXIT_SUCCESS);
+    }
+    int status;
+    KVTEST_CHECK(waitpid(pid, &status, 0) == pid);
+    if (WIFEXITED(status) && (WEXITSTATUS(status) == EXIT_SUCCESS)) {
+        return 0;
+    }
+    KVTEST_CHECK(WIFSIGNALED(status) && (WTERMSIG(status) == SIGKILL));
+    return 1;
+}
+
+// the process is killed in the middle of the first step of the vacuum.
+static void check_stopped_vacuum(int argc, char ** argv, off_t vacuumed_size)
+{
+    char * filename = kvtest_filename(argc, argv, "vacuum-stopped.kvdb");
+    // The killer thread might not run before the end of the step on a busy machine.
+    int stopped = 0;
+    for(unsigned int attempt = 0 ; !stopped && (attempt < STOP_ATTEMPT_COUNT) ; attempt ++) {
+        unlink(filename);
+        create_database(filename);
+        stopped = stop_vacuum(filename);
+    }
+    KVTEST_CHECK(stopped);
+
+    kvdb * db = kvtest_open(filename, KVDB_STORAGE_TYPE_TABLES, KVTEST_OPEN_RAW);
+    check_values(db);
+    vacuum(db);
+    check_values(db);
+    kvtest_close(db);
+    // The free space is used as if the vacuum had not been stopped.
+    KVTEST_CHECK(kvtest_file_size(filename) <= vacuumed_size + 64 * 1024);
+    unlink(filename);
+    free(filename);
+}
+
+int main(int argc, char ** argv)
+{
+    off_t vacuumed_size = check_vacuum(argc, argv);
+    check_stopped_vacuum(argc, argv, vacuumed_size);
+    return EXIT_SUCCESS;
+}